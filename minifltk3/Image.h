@@ -49,6 +49,16 @@ class Widget;
 class Label;
 struct MenuItem;
 
+/**
+ The ways fltk3::ImageRGB::copy(int, int) can resample an image.
+ \sa fltk3::ImageRGB::scaling(fltk3::RGBScaling)
+ */
+enum RGBScaling {
+	RGB_SCALING_NEAREST = 0,	///< pick the nearest pixel, fast but aliased
+	RGB_SCALING_BILINEAR,		///< interpolate between the 4 nearest pixels
+	RGB_SCALING_AREA		///< average the pixels covered, best for shrinking
+};
+
 /**
  fltk3::Image is the base class used for caching and
  drawing all kinds of images in FLTK. This class keeps track of
@@ -236,6 +246,7 @@ class FLTK3_EXPORT ImageRGB : public Image
 	friend class GDIGraphicsDriver;
 	friend class XlibGraphicsDriver;
 	static size_t max_size_;
+	static fltk3::RGBScaling scaling_;
 public:
 
 	const uchar *array;
@@ -262,6 +273,7 @@ public:
 	virtual ~ImageRGB();
 	virtual fltk3::Image *copy(int W, int H);
 	fltk3::Image *copy() { return copy(w(), h()); }
+	fltk3::Image *copy(int W, int H, fltk3::RGBScaling method);
 	virtual void color_average(fltk3::Color c, float i);
 	virtual void desaturate();
 	virtual void draw(int X, int Y, int W, int H, int cx=0, int cy=0);
@@ -290,6 +302,24 @@ public:
 	static size_t max_size() {
 		return max_size_;
 	}
+	/** Sets how copy(int W, int H) resamples the image when its size changes.
+
+	 The default fltk3::RGB_SCALING_NEAREST is the fastest. fltk3::RGB_SCALING_BILINEAR
+	 is smoother for enlarging and small changes, fltk3::RGB_SCALING_AREA averages
+	 all the pixels under each new pixel and is the one to use for thumbnails.
+	 Both weigh the colors by their alpha, so that transparent pixels don't
+	 darken the edges.
+	 */
+	static void scaling(fltk3::RGBScaling method) {
+		scaling_ = method;
+	}
+	/** Returns how copy(int W, int H) resamples the image.
+
+	 \sa  void ImageRGB::scaling(fltk3::RGBScaling)
+	 */
+	static fltk3::RGBScaling scaling() {
+		return scaling_;
+	}
 };
 
 } // namespace
@@ -52,6 +52,65 @@ namespace fltk3
  */
 class FLTK3_EXPORT ImagePNG : public fltk3::ImageRGB
 {
+	/*
+	 Decodes to as many channels as the file has, so that opaque images are
+	 not drawn through alpha blending: 1 for grey, 2 for grey and alpha, 3
+	 for RGB and palette, 4 for RGBA. A tRNS chunk adds alpha.
+	 */
+	void load_png_(const unsigned char *buffer, int datasize)
+	{
+		unsigned error;
+		unsigned char* image;
+		unsigned int width, height;
+		LodePNGState state;
+
+		lodepng_state_init(&state);
+		error = lodepng_inspect(&width, &height, &state, buffer, datasize);
+		LodePNGColorType type = state.info_png.color.colortype;
+		lodepng_state_cleanup(&state);
+		if(error) return;
+
+		// tRNS comes after the header and before the first IDAT chunk
+		bool trns = false;
+		const unsigned char *chunk = buffer + 8, *end = buffer + datasize;
+		while (end - chunk >= 12 && lodepng_chunk_length(chunk) <= (unsigned)(end - chunk - 12)) {
+			if (lodepng_chunk_type_equals(chunk, "IDAT")) break;
+			if (lodepng_chunk_type_equals(chunk, "tRNS")) {
+				trns = true;
+				break;
+			}
+			chunk = lodepng_chunk_next_const(chunk);
+		}
+
+		int depth;
+		switch (type) {
+		case LCT_GREY:
+			depth = trns ? 2 : 1;
+			break;
+		case LCT_GREY_ALPHA:
+			depth = 2;
+			break;
+		case LCT_RGB:
+		case LCT_PALETTE:
+			depth = trns ? 4 : 3;
+			break;
+		default:
+			depth = 4;
+		}
+		static const LodePNGColorType types[] = { LCT_GREY, LCT_GREY, LCT_GREY_ALPHA, LCT_RGB, LCT_RGBA };
+		error = lodepng_decode_memory(&image, &width, &height, buffer, datasize, types[depth], 8);
+		if(error) return;
+
+		w(width); h(height); d(depth);
+
+		array = new uchar[w() * h() * d()];
+		alloc_array = 1;
+		unsigned char *ptr = (unsigned char *)array;
+		memcpy(ptr, image, w() * h() * d());
+
+		free(image);
+	}
+
 protected:
 	ImagePNG(const uchar *a, int b, int c, int d=3, int e=0) : ImageRGB(a, b, c, d, e) {}
 
@@ -71,44 +130,13 @@ public:
 		size = (int) fread(buf, 1, size, fp);
 		fclose(fp);
 		
-		unsigned error;
-		unsigned char* image;
-		unsigned int width, height;
-
-		error = lodepng_decode32(&image, &width, &height, buf, size);
-		if(error) {
-			free(buf);
-			return;
-		}
-		
-		w(width); h(height); d(4);
-
-		array = new uchar[w() * h() * d()];
-		alloc_array = 1;
-		unsigned char *ptr = (unsigned char *)array;
-		memcpy(ptr, image, w() * h() * d());
-
-		free(image);
+		load_png_(buf, size);
 		free(buf);
 	}
 
 	ImagePNG(const char *name_png, const unsigned char *buffer, int datasize) : fltk3::ImageRGB(0,0,0) 
 	{
-		unsigned error;
-		unsigned char* image;
-		unsigned int width, height;
-
-		error = lodepng_decode32(&image, &width, &height, buffer, datasize);
-		if(error) return;
-
-		w(width); h(height); d(4);
-
-		array = new uchar[w() * h() * d()];
-		alloc_array = 1;
-		unsigned char *ptr = (unsigned char *)array;
-		memcpy(ptr, image, w() * h() * d());
-
-		free(image);
+		load_png_(buffer, datasize);
 
 		if (w() && h() && name_png) {
 			fltk3::SharedImage *si = new fltk3::SharedImage(name_png, this);
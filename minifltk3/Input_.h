@@ -37,6 +37,8 @@
 namespace fltk3
 {
 
+class InputLineCache;
+
 const uchar NORMAL_INPUT	= 0;
 const uchar FLOAT_INPUT	= 1;
 const uchar INT_INPUT		= 2;
@@ -135,6 +137,15 @@ class FLTK3_EXPORT Input_ : public fltk3::Widget
 	 of the buffer. */
 	int mu_p;
 
+	/** \internal End of the minimal update. Lines that start after it are not
+	 redrawn if the paragraph from \p mu_para to \p mu_q still has \p mu_lines
+	 displayed lines. INT_MAX redraws to the end of the buffer. */
+	int mu_q, mu_para, mu_lines;
+
+	/** \internal Start and end of each displayed line, measured on demand and
+	 invalidated from the edited paragraph by replace(). */
+	fltk3::InputLineCache *lines_;
+
 	/** \internal Maximum size of buffer. \todo Is this really needed? */
 	int maximum_size_;
 
@@ -165,6 +176,18 @@ class FLTK3_EXPORT Input_ : public fltk3::Widget
 	/* Mark a range of characters for update. */
 	void minimal_update(int p);
 
+	/* Mark an edited range of characters for update. */
+	void minimal_update(int p, int q, int para, int nLines);
+
+	/* Return the line cache, cleared if the layout settings changed. */
+	fltk3::InputLineCache *line_cache() const;
+
+	/* Measure displayed lines up to the one containing pos or up to line number n. */
+	void measure_lines(int pos, int n) const;
+
+	/* Find the displayed line containing a given index. */
+	int line_of(int i) const;
+
 	/* Copy the value from a possibly static entry into the internal buffer. */
 	void put_in_buffer(int newsize);
 
@@ -68,12 +68,34 @@
 
 
 #include "Export.h"
+#include <limits.h>
 
 namespace fltk3
 {
 
 #define TEXT_MAX_EXP_CHAR_LEN 20
 
+/**
+ \brief A byte offset or a length in a fltk3::TextBuffer.
+
+ Positions are an \c int by default, which limits a buffer to 2GB. When
+ the library and the application are compiled with FLTK3_TEXT_POSITION_64
+ defined, they are 64 bits wide, so that larger files can be loaded. All
+ positions, lengths and line numbers of fltk3::TextBuffer,
+ fltk3::TextDisplay and their callbacks use this type.
+ */
+#ifdef FLTK3_TEXT_POSITION_64
+typedef long long TextPosition;
+#define TEXT_POSITION_MAX LLONG_MAX
+#else
+typedef int TextPosition;
+#define TEXT_POSITION_MAX INT_MAX
+#endif
+
+class TextLineIndex;
+class TextHistory;
+class TextBatch;
+
 /**
  \class fltk3::TextSelection
  \brief This is an internal class for fltk3::TextBuffer to manage text selections.
@@ -91,7 +113,7 @@ public:
 	 \param start byte offset to first selected character
 	 \param end byte offset pointing after last selected character
 	 */
-	void set(int start, int end);
+	void set(fltk3::TextPosition start, fltk3::TextPosition end);
 
 	/**
 	 \brief Updates a selection afer text was modified.
@@ -100,13 +122,14 @@ public:
 	 \param nDeleted number of bytes deleted from the buffer
 	 \param nInserted number of bytes inserted into the buffer
 	 */
-	void update(int pos, int nDeleted, int nInserted);
+	void update(fltk3::TextPosition pos, fltk3::TextPosition nDeleted,
+	            fltk3::TextPosition nInserted);
 
 	/**
 	 \brief Return the byte offset to the first selected character.
 	 \return byte offset
 	 */
-	int start() const {
+	fltk3::TextPosition start() const {
 		return mStart;
 	}
 
@@ -114,7 +137,7 @@ public:
 	 \brief Return the byte ofsset to the character after the last selected character.
 	 \return byte offset
 	 */
-	int end() const {
+	fltk3::TextPosition end() const {
 		return mEnd;
 	}
 
@@ -139,7 +162,7 @@ public:
 	 Return true if position \p pos with indentation \p dispIndex is in
 	 the fltk3::TextSelection.
 	 */
-	int includes(int pos) const;
+	int includes(fltk3::TextPosition pos) const;
 
 	/**
 	 \brief Return the positions of this selection.
@@ -147,22 +170,109 @@ public:
 	 \param end retrun byte offset pointing after last selected character
 	 \return true if selected
 	 */
-	int position(int* start, int* end) const;
+	int position(fltk3::TextPosition* start, fltk3::TextPosition* end) const;
 
 protected:
 
-	int mStart;         ///< byte offset to the first selected character
-	int mEnd;           ///< byte offset to the character after the last selected character
+	fltk3::TextPosition mStart; ///< byte offset to the first selected character
+	fltk3::TextPosition mEnd;  ///< byte offset to the character after the last selected character
 	bool mSelected;     ///< this flag is set if any text is selected
 };
 
 
-typedef void (*TextModifyCb)(int pos, int nInserted, int nDeleted,
-                             int nRestyled, const char* deletedText,
+typedef void (*TextModifyCb)(fltk3::TextPosition pos, fltk3::TextPosition nInserted,
+                             fltk3::TextPosition nDeleted, fltk3::TextPosition nRestyled,
+                             const char* deletedText,
                              void* cbArg);
 
 
-typedef void (*TextPredeleteCb)(int pos, int nDeleted, void* cbArg);
+typedef void (*TextPredeleteCb)(fltk3::TextPosition pos, fltk3::TextPosition nDeleted, void* cbArg);
+
+
+typedef void (*TextMatchCb)(fltk3::TextPosition start, fltk3::TextPosition end, void* cbArg);
+
+
+/**
+ \class fltk3::TextSearch
+ \brief A search string that is prepared once and can then be searched for
+ many times in one or more fltk3::TextBuffer.
+
+ The buffer is searched for the first and last byte of the string many bytes
+ at a time, and only these candidates are compared in full. When case is
+ ignored and the string only contains ASCII characters, the string is stored
+ folded to lower case and the candidates are folded byte by byte through a
+ table. Other case insensitive strings are compared character by character.
+ */
+class FLTK3_EXPORT TextSearch
+{
+	friend class TextBuffer;
+
+	// Forbid use of copy contructor and assign operator
+	TextSearch(const TextSearch&);
+	TextSearch& operator=(const TextSearch&);
+
+public:
+
+	/**
+	 \brief Prepare a search string.
+	 \param searchString utf8 string that we want to find, may be NULL
+	 \param matchCase if set, match character case
+	 */
+	TextSearch(const char* searchString = 0, int matchCase = 0);
+
+	/**
+	 Frees the search string.
+	 */
+	~TextSearch();
+
+	/**
+	 \brief Change the search string.
+	 \param searchString utf8 string that we want to find, may be NULL
+	 \param matchCase if set, match character case
+	 */
+	void set(const char* searchString, int matchCase = 0);
+
+	/**
+	 \brief Return the search string, never NULL.
+	 */
+	const char* text() const {
+		return mText;
+	}
+
+	/**
+	 \brief Return the length of the search string in bytes.
+	 */
+	int length() const {
+		return mLength;
+	}
+
+	/**
+	 \brief Return non-zero if the search matches character case.
+	 */
+	int match_case() const {
+		return mMatchCase;
+	}
+
+protected:
+
+	/**
+	 Return the first match that starts within the \p n bytes at \p s and
+	 ends at or before \p s + \p n, or NULL. Only used in byte mode.
+	 */
+	const char* find_in(const char* s, int n) const;
+
+	/**
+	 Return the last match that lies within the \p n bytes at \p s, or NULL.
+	 Only used in byte mode.
+	 */
+	const char* find_back_in(const char* s, int n) const;
+
+	char* mText;                    ///< the search string, folded to lower case in byte mode
+	int mLength;                    ///< length of mText in bytes
+	char mMatchCase;                ///< non-zero if case must match
+	char mByteMode;                 ///< matches can be found byte by byte through mFold
+	unsigned char mFold[256];       ///< byte to folded byte
+};
 
 
 /**
@@ -181,6 +291,14 @@ class FLTK3_EXPORT TextBuffer
 {
 public:
 
+	/**
+	 storage modes - used in storage_mode()
+	 */
+	enum {
+		GAP_STORAGE,    /**< all text in one gap buffer (default) */
+		PIECE_STORAGE   /**< piece table over the original text and an append-only add buffer */
+	};
+
 	/**
 	 Create an empty text buffer of a pre-determined size.
 	 \param requestedSize use this to avoid unnecessary re-allocation
@@ -189,18 +307,46 @@ public:
 	 in the buffer where text might be inserted
 	 if the user is typing sequential chars)
 	 */
-	TextBuffer(int requestedSize = 0, int preferredGapSize = 1024);
+	TextBuffer(fltk3::TextPosition requestedSize = 0, int preferredGapSize = 1024);
 
 	/**
 	 Frees a text buffer
 	 */
 	~TextBuffer();
 
+	/**
+	 \brief Select how the text is stored.
+
+	 GAP_STORAGE keeps all text in a single buffer with a gap at the last
+	 edit position. It is fast for local editing, but an edit far away from
+	 the previous one moves all text in between, and growing the buffer
+	 copies all of it.
+
+	 PIECE_STORAGE keeps the text as a table of pieces that point into the
+	 original text and into an append-only add buffer. Inserting or removing
+	 text never moves existing text, so the cost of an edit depends on the
+	 size of the edit and the number of pieces, but not on the size of the
+	 buffer. Text removed in this mode is only released when the buffer is
+	 replaced with text() or switched back to GAP_STORAGE.
+
+	 Switching modes keeps the contents, selections and undo information.
+	 \param mode GAP_STORAGE or PIECE_STORAGE
+	 */
+	void storage_mode(int mode);
+
+	/**
+	 \brief Return the current storage mode.
+	 \return GAP_STORAGE or PIECE_STORAGE
+	 */
+	int storage_mode() const {
+		return mStorageMode;
+	}
+
 	/**
 	 \brief Returns the number of bytes in the buffer.
 	 \return size of text in bytes
 	 */
-	int length() const {
+	fltk3::TextPosition length() const {
 		return mLength;
 	}
 
@@ -228,7 +374,7 @@ public:
 	 \param end byte offset after last character in range
 	 \return newly allocated text buffer - must be free'd, text is utf8
 	 */
-	char* text_range(int start, int end) const;
+	char* text_range(fltk3::TextPosition start, fltk3::TextPosition end) const;
 
 	/**
 	 Returns the character at the specified position pos in the buffer.
@@ -236,7 +382,7 @@ public:
 	 \param pos byte offset into buffer, pos must be at acharacter boundary
 	 \return Unicode UCS-4 encoded character
 	 */
-	unsigned int char_at(int pos) const;
+	unsigned int char_at(fltk3::TextPosition pos) const;
 
 	/**
 	 Returns the raw byte at the specified position pos in the buffer.
@@ -244,14 +390,16 @@ public:
 	 \param pos byte offset into buffer
 	 \return unencoded raw byte
 	 */
-	char byte_at(int pos) const;
+	char byte_at(fltk3::TextPosition pos) const;
 
 	/**
 	 Convert a byte offset in buffer into a memory address.
 	 \param pos byte offset into buffer
 	 \return byte offset converted to a memory address
 	 */
-	const char *address(int pos) const {
+	const char *address(fltk3::TextPosition pos) const {
+		if (mStorageMode == PIECE_STORAGE)
+			return piece_address(pos);
 		return (pos < mGapStart) ? mBuf+pos : mBuf+pos+mGapEnd-mGapStart;
 	}
 
@@ -260,7 +408,9 @@ public:
 	 \param pos byte offset into buffer
 	 \return byte offset converted to a memory address
 	 */
-	char *address(int pos) {
+	char *address(fltk3::TextPosition pos) {
+		if (mStorageMode == PIECE_STORAGE)
+			return piece_address(pos);
 		return (pos < mGapStart) ? mBuf+pos : mBuf+pos+mGapEnd-mGapStart;
 	}
 
@@ -269,22 +419,94 @@ public:
 	 \param pos insertion position as byte offset (must be utf-8 character aligned)
 	 \param text utf-8 encoded and nul terminated text
 	 */
-	void insert(int pos, const char* text);
+	void insert(fltk3::TextPosition pos, const char* text);
+
+	/**
+	 Inserts the first \p insertedLength bytes of \p text at position \p pos.
+	 The text need not be nul terminated, and is inserted in one step with
+	 a single modify callback.
+	 \param pos insertion position as byte offset (must be utf-8 character aligned)
+	 \param text utf-8 encoded text without nul bytes
+	 \param insertedLength number of bytes to insert
+	 */
+	void insert(fltk3::TextPosition pos, const char* text, fltk3::TextPosition insertedLength);
 
 	/**
 	 Appends the text string to the end of the buffer.
 	 \param t utf-8 encoded and nul terminated text
+	 \see tail_mode()
 	 */
 	void append(const char* t) {
 		insert(length(), t);
 	}
 
+	/**
+	 \brief Turn tail mode on or off.
+
+	 Tail mode is meant for log viewers that append text at a high rate.
+	 Text that is appended to the end of the buffer goes into the buffer
+	 right away, but the modify callbacks for all text appended within
+	 1/60 of a second are combined into one, which is delivered from a
+	 timeout. Any other change to the buffer delivers them first. When the
+	 buffer grows beyond its capacity, whole lines are dropped from the
+	 start. fltk3::TextDisplay keeps following the end of the text while
+	 it is scrolled to the bottom.
+
+	 As appends trigger a timeout, threads must hold fltk3::lock() while
+	 appending; the main thread is woken with fltk3::awake() to deliver the
+	 callbacks. Tail mode turns off undo, leaving it turns undo back on if
+	 it was on before.
+	 \param capacity maximum length of the text in bytes, 0 to leave tail mode
+	 */
+	void tail_mode(fltk3::TextPosition capacity);
+
+	/**
+	 \brief Return the capacity in tail mode, or 0 if the buffer is not in tail mode.
+	 */
+	fltk3::TextPosition tail_mode() const {
+		return mTailCapacity;
+	}
+
+	/**
+	 \brief Deliver the pending modify callbacks for appended text now.
+	 Only needed in tail mode, and only if the callbacks can not wait for
+	 the next timeout.
+	 */
+	void flush_appends();
+
+	/**
+	 \brief Start a batch of changes.
+
+	 Until the matching end_batch(), changes are applied to the text right
+	 away, but the predelete and modify callbacks are not called. Instead,
+	 end_batch() calls them once for a single range that covers all changes
+	 of the batch, so that a display is only laid out once for any number
+	 of edits, for example when replacing all matches of a search. The
+	 batch also becomes a single step in the undo history.
+
+	 Batches can be nested; only the outermost end_batch() calls the
+	 callbacks.
+	 */
+	void begin_batch();
+
+	/**
+	 \brief End a batch of changes that was started with begin_batch().
+	 */
+	void end_batch();
+
+	/**
+	 \brief Return non-zero between begin_batch() and end_batch().
+	 */
+	int in_batch() const {
+		return mBatch != 0;
+	}
+
 	/**
 	 Deletes a range of characters in the buffer.
 	 \param start byte offset to first character to be removed
 	 \param end byte offset to charcatre after last character to be removed
 	 */
-	void remove(int start, int end);
+	void remove(fltk3::TextPosition start, fltk3::TextPosition end);
 
 	/**
 	 Deletes the characters between \p start and \p end, and inserts the null-terminated string \p text in their place in the buffer.
@@ -292,7 +514,7 @@ public:
 	 \param end byte offset to charcatre after last character to be removed
 	 \param text utf-8 encoded and nul terminated text
 	 */
-	void replace(int start, int end, const char *text);
+	void replace(fltk3::TextPosition start, fltk3::TextPosition end, const char *text);
 
 	/**
 	 Copies text from one buffer to this one.
@@ -301,19 +523,61 @@ public:
 	 \param fromEnd byte offset into buffer
 	 \param toPos destination byte offset into buffer
 	 */
-	void copy(fltk3::TextBuffer* fromBuf, int fromStart, int fromEnd, int toPos);
+	void copy(fltk3::TextBuffer* fromBuf, fltk3::TextPosition fromStart,
+	          fltk3::TextPosition fromEnd, fltk3::TextPosition toPos);
+
+	/**
+	 \brief Undo the most recent modification.
+
+	 Every buffer keeps its own history of modifications. Consecutive typing
+	 and deleting of single characters at the same place is merged into one
+	 step, and so is replacing a text with a new one. Undoing a step takes
+	 time proportional to the size of the modification.
+	 \param cp if not NULL, receives the position of the cursor after the undo
+	 \return 1 if a step was undone, 0 if there was nothing to undo
+	 */
+	int undo(fltk3::TextPosition *cp=0);
+
+	/**
+	 \brief Redo the most recently undone modification.
+	 Any new modification of the buffer clears the steps that can be redone.
+	 \param cp if not NULL, receives the position of the cursor after the redo
+	 \return 1 if a step was redone, 0 if there was nothing to redo
+	 */
+	int redo(fltk3::TextPosition *cp=0);
 
 	/**
-	 Undo text modification according to the undo variables or insert text
-	 from the undo buffer
+	 \brief Return non-zero if undo() would change the buffer.
 	 */
-	int undo(int *cp=0);
+	int can_undo() const;
 
 	/**
-	 Lets the undo system know if we can undo changes
+	 \brief Return non-zero if redo() would change the buffer.
+	 */
+	int can_redo() const;
+
+	/**
+	 Lets the undo system know if we can undo changes. Disabling undo
+	 also clears the history.
 	 */
 	void canUndo(char flag=1);
 
+	/**
+	 \brief Limit the memory used by the undo history.
+	 The history stores the text removed by each step. When it grows beyond
+	 the limit, the oldest steps are forgotten. A single modification that
+	 removes more text than the limit clears the history.
+	 \param bytes the limit in bytes, 0 for no limit; the default is 64MB
+	 */
+	void undo_limit(fltk3::TextPosition bytes);
+
+	/**
+	 \brief Return the memory limit of the undo history in bytes.
+	 */
+	fltk3::TextPosition undo_limit() const {
+		return mUndoLimit;
+	}
+
 	/**
 	 Inserts a file at the specified position. Returns 0 on success,
 	 non-zero on error (strerror() contains reason).  1 indicates open
@@ -323,9 +587,13 @@ public:
 	 If the input file is not UTF-8-encoded, the fltk3::TextBuffer widget will contain
 	 UTF-8-transcoded data. By default, the message fltk3::TextBuffer::file_encoding_warning_message
 	 will warn the user about this.
+
+	 Regular files are mapped into memory where the system allows it. If
+	 they are valid UTF-8, they are inserted in a single step, and \p buflen
+	 is not used.
 	 \see input_file_was_transcoded and transcoding_warning_action.
 	 */
-	int insertfile(const char *file, int pos, int buflen = 128*1024);
+	int insertfile(const char *file, fltk3::TextPosition pos, int buflen = 128*1024);
 
 	/**
 	 Appends the named file to the end of the buffer. See also insertfile().
@@ -348,8 +616,11 @@ public:
 	 on error (strerror() contains reason).  1 indicates open for write failed
 	 (no data saved). 2 indicates error occurred while writing data
 	 (data was partially saved).
+	 The text is written straight from the buffer. \p buflen is the most
+	 bytes handed to the system in one write.
 	 */
-	int outputfile(const char *file, int start, int end, int buflen = 128*1024);
+	int outputfile(const char *file, fltk3::TextPosition start, fltk3::TextPosition end,
+	               int buflen = 128*1024);
 
 	/**
 	 Saves a text file from the current buffer
@@ -374,7 +645,7 @@ public:
 	/**
 	 Selects a range of characters in the buffer.
 	 */
-	void select(int start, int end);
+	void select(fltk3::TextPosition start, fltk3::TextPosition end);
 
 	/**
 	 Returns a non 0 value if text has been selected, 0 otherwise
@@ -391,7 +662,7 @@ public:
 	/**
 	 Gets the selection position
 	 */
-	int selection_position(int* start, int* end);
+	int selection_position(fltk3::TextPosition* start, fltk3::TextPosition* end);
 
 	/**
 	 Returns the currently selected text. When you are done with
@@ -412,7 +683,7 @@ public:
 	/**
 	 Selects a range of characters in the secondary selection.
 	 */
-	void secondary_select(int start, int end);
+	void secondary_select(fltk3::TextPosition start, fltk3::TextPosition end);
 
 	/**
 	 Returns a non 0 value if text has been selected in the secondary
@@ -430,7 +701,7 @@ public:
 	/**
 	 Returns the current selection in the secondary text selection object.
 	 */
-	int secondary_selection_position(int* start, int* end);
+	int secondary_selection_position(fltk3::TextPosition* start, fltk3::TextPosition* end);
 
 	/**
 	 Returns the text in the secondary selection. When you are
@@ -452,7 +723,7 @@ public:
 	/**
 	 Highlights the specified text within the buffer.
 	 */
-	void highlight(int start, int end);
+	void highlight(fltk3::TextPosition start, fltk3::TextPosition end);
 
 	/**
 	 Returns the highlighted text. When you are done with the
@@ -470,7 +741,7 @@ public:
 	/**
 	 Highlights the specified text between \p start and \p end within the buffer.
 	 */
-	int highlight_position(int* start, int* end);
+	int highlight_position(fltk3::TextPosition* start, fltk3::TextPosition* end);
 
 	/**
 	 Returns the highlighted text. When you are done with the
@@ -483,8 +754,9 @@ public:
 	 modified. The callback function is declared as follows:
 
 	 \code
-	 typedef void (*fltk3::TextModifyCb)(int pos, int nInserted, int nDeleted,
-	 int nRestyled, const char* deletedText,
+	 typedef void (*fltk3::TextModifyCb)(fltk3::TextPosition pos,
+	 fltk3::TextPosition nInserted, fltk3::TextPosition nDeleted,
+	 fltk3::TextPosition nRestyled, const char* deletedText,
 	 void* cbArg);
 	 \endcode
 	 */
@@ -530,14 +802,14 @@ public:
 	 \param pos byte index into buffer
 	 \return copy of utf8 text, must be free'd
 	 */
-	char* line_text(int pos) const;
+	char* line_text(fltk3::TextPosition pos) const;
 
 	/**
 	 Returns the position of the start of the line containing position \p pos.
 	 \param pos byte index into buffer
 	 \return byte offset to line start
 	 */
-	int line_start(int pos) const;
+	fltk3::TextPosition line_start(fltk3::TextPosition pos) const;
 
 	/**
 	 Finds and returns the position of the end of the line containing position \p pos
@@ -546,21 +818,21 @@ public:
 	 \param pos byte index into buffer
 	 \return byte offset to line end
 	 */
-	int line_end(int pos) const;
+	fltk3::TextPosition line_end(fltk3::TextPosition pos) const;
 
 	/**
 	 Returns the position corresponding to the start of the word
 	 \param pos byte index into buffer
 	 \return byte offset to word start
 	 */
-	int word_start(int pos) const;
+	fltk3::TextPosition word_start(fltk3::TextPosition pos) const;
 
 	/**
 	 Returns the position corresponding to the end of the word.
 	 \param pos byte index into buffer
 	 \return byte offset to word end
 	 */
-	int word_end(int pos) const;
+	fltk3::TextPosition word_end(fltk3::TextPosition pos) const;
 
 	/**
 	 Count the number of displayed characters between buffer position
@@ -568,7 +840,7 @@ public:
 	 shown on the screen to represent characters in the buffer, where tabs and
 	 control characters are expanded)
 	 */
-	int count_displayed_characters(int lineStartPos, int targetPos) const;
+	fltk3::TextPosition count_displayed_characters(fltk3::TextPosition lineStartPos, fltk3::TextPosition targetPos) const;
 
 	/**
 	 Count forward from buffer position \p startPos in displayed characters
@@ -578,26 +850,46 @@ public:
 	 \param nChars number of bytes that are sent to the display
 	 \return byte offset in input after all output bytes are sent
 	 */
-	int skip_displayed_characters(int lineStartPos, int nChars);
+	fltk3::TextPosition skip_displayed_characters(fltk3::TextPosition lineStartPos, int nChars);
 
 	/**
 	 Counts the number of newlines between \p startPos and \p endPos in buffer.
 	 The character at position \p endPos is not counted.
 	 */
-	int count_lines(int startPos, int endPos) const;
+	fltk3::TextPosition count_lines(fltk3::TextPosition startPos, fltk3::TextPosition endPos) const;
 
 	/**
 	 Finds the first character of the line \p nLines forward from \p startPos
 	 in the buffer and returns its position
 	 */
-	int skip_lines(int startPos, int nLines);
+	fltk3::TextPosition skip_lines(fltk3::TextPosition startPos, fltk3::TextPosition nLines);
 
 	/**
 	 Finds and returns the position of the first character of the line \p nLines backwards
 	 from \p startPos (not counting the character pointed to by \p startpos if
 	 that is a newline) in the buffer.  \p nLines == 0 means find the beginning of the line
 	 */
-	int rewind_lines(int startPos, int nLines);
+	fltk3::TextPosition rewind_lines(fltk3::TextPosition startPos, fltk3::TextPosition nLines);
+
+	/**
+	 \brief Return the number of the line that contains \p pos.
+	 Lines are counted from 0, so this is the number of newlines before \p pos.
+	 The first call builds an index of the newlines in the buffer, which is
+	 then kept up to date by all modifications. Later calls take logarithmic
+	 time plus a short scan, independent of the size of the buffer.
+	 \param pos byte offset into buffer
+	 \return line number, starting at 0
+	 */
+	fltk3::TextPosition position_to_line(fltk3::TextPosition pos) const;
+
+	/**
+	 \brief Return the position of the first character of a line.
+	 This is the inverse of position_to_line() and uses the same index.
+	 \param lineNum line number, starting at 0
+	 \return byte offset of the start of the line, 0 if \p lineNum is
+	   negative, or length() if the buffer has fewer lines
+	 */
+	fltk3::TextPosition line_to_position(fltk3::TextPosition lineNum) const;
 
 	/**
 	 Finds the next occurrence of the specified character.
@@ -612,7 +904,8 @@ public:
 	 \param foundPos byte offset where the character was found
 	 \return 1 if found, 0 if not
 	 */
-	int findchar_forward(int startPos, unsigned searchChar, int* foundPos) const;
+	int findchar_forward(fltk3::TextPosition startPos, unsigned searchChar,
+	                     fltk3::TextPosition* foundPos) const;
 
 	/**
 	 Search backwards in buffer \p buf for character \p searchChar, starting
@@ -626,7 +919,8 @@ public:
 	 \param foundPos byte offset where the character was found
 	 \return 1 if found, 0 if not
 	 */
-	int findchar_backward(int startPos, unsigned int searchChar, int* foundPos) const;
+	int findchar_backward(fltk3::TextPosition startPos, unsigned int searchChar,
+	                      fltk3::TextPosition* foundPos) const;
 
 	/**
 	 Search forwards in buffer for string \p searchString, starting with the
@@ -638,8 +932,8 @@ public:
 	 \param matchCase if set, match character case
 	 \return 1 if found, 0 if not
 	 */
-	int search_forward(int startPos, const char* searchString, int* foundPos,
-	                   int matchCase = 0) const;
+	int search_forward(fltk3::TextPosition startPos, const char* searchString,
+	                   fltk3::TextPosition* foundPos, int matchCase = 0) const;
 
 	/**
 	 Search backwards in buffer for string <i>searchCharssearchString</i>, starting with the
@@ -651,8 +945,58 @@ public:
 	 \param matchCase if set, match character case
 	 \return 1 if found, 0 if not
 	 */
-	int search_backward(int startPos, const char* searchString, int* foundPos,
-	                    int matchCase = 0) const;
+	int search_backward(fltk3::TextPosition startPos, const char* searchString,
+	                    fltk3::TextPosition* foundPos, int matchCase = 0) const;
+
+	/**
+	 Search forwards in buffer for a prepared search string, starting with the
+	 character \p startPos.
+	 \param startPos byte offset to start position
+	 \param search the prepared search string
+	 \param foundPos byte offset where the string was found
+	 \param foundEnd if not NULL, byte offset after the end of the match, which
+	   may differ from \p foundPos plus the length of the string if case is ignored
+	 \return 1 if found, 0 if not
+	 */
+	int search_forward(fltk3::TextPosition startPos, const fltk3::TextSearch& search,
+	                   fltk3::TextPosition* foundPos, fltk3::TextPosition* foundEnd = 0) const;
+
+	/**
+	 Search backwards in buffer for a prepared search string. The match
+	 starts at or before \p startPos.
+	 \param startPos byte offset to start position
+	 \param search the prepared search string
+	 \param foundPos byte offset where the string was found
+	 \param foundEnd if not NULL, byte offset after the end of the match
+	 \return 1 if found, 0 if not
+	 */
+	int search_backward(fltk3::TextPosition startPos, const fltk3::TextSearch& search,
+	                    fltk3::TextPosition* foundPos, fltk3::TextPosition* foundEnd = 0) const;
+
+	/**
+	 \brief Find all matches of a search string between two positions.
+
+	 \p matchCb is called with the start and end of every match, in order.
+	 Matches do not overlap. If \p maxBytes is larger than zero, only
+	 matches starting within \p maxBytes bytes of \p startPos are reported,
+	 and the position at which the search must continue is returned. This
+	 way, a very large buffer can be searched in slices from an idle
+	 callback (see fltk3::add_idle()) without blocking the user interface:
+	 call search_all() again with the returned position as \p startPos
+	 until it returns \p endPos.
+
+	 The buffer must not be modified between slices.
+	 \param search the prepared search string
+	 \param startPos byte offset to start position
+	 \param endPos byte offset to end position, matches end at or before it
+	 \param matchCb function called for every match
+	 \param cbArg argument passed to \p matchCb
+	 \param maxBytes limit the amount of text searched in this call, 0 for no limit
+	 \return byte offset where the next slice starts, \p endPos when done
+	 */
+	fltk3::TextPosition search_all(const fltk3::TextSearch& search, fltk3::TextPosition startPos,
+	                        fltk3::TextPosition endPos, fltk3::TextMatchCb matchCb,
+	                        void* cbArg, fltk3::TextPosition maxBytes = 0) const;
 
 	/**
 	 Returns the primary selection.
@@ -686,20 +1030,20 @@ public:
 	 Returns the index of the previous character.
 	 \param ix index to the current char
 	 */
-	int prev_char(int ix) const;
-	int prev_char_clipped(int ix) const;
+	fltk3::TextPosition prev_char(fltk3::TextPosition ix) const;
+	fltk3::TextPosition prev_char_clipped(fltk3::TextPosition ix) const;
 
 	/**
 	 Returns the index of the next character.
 	 \param ix index to the current char
 	 */
-	int next_char(int ix) const;
-	int next_char_clipped(int ix) const;
+	fltk3::TextPosition next_char(fltk3::TextPosition ix) const;
+	fltk3::TextPosition next_char_clipped(fltk3::TextPosition ix) const;
 
 	/**
 	 Align an index into the buffer to the current or previous utf8 boundary.
 	 */
-	int utf8_align(int) const;
+	fltk3::TextPosition utf8_align(fltk3::TextPosition) const;
 
 	/**
 	 \brief true iff the loaded file has been transcoded to UTF-8
@@ -728,14 +1072,15 @@ protected:
 	 Calls the stored modify callback procedure(s) for this buffer to update the
 	 changed area(s) on the screen and any other listeners.
 	 */
-	void call_modify_callbacks(int pos, int nDeleted, int nInserted,
-	                           int nRestyled, const char* deletedText) const;
+	void call_modify_callbacks(fltk3::TextPosition pos, fltk3::TextPosition nDeleted,
+	                           fltk3::TextPosition nInserted, fltk3::TextPosition nRestyled,
+	                           const char* deletedText) const;
 
 	/**
 	 Calls the stored pre-delete callback procedure(s) for this buffer to update
 	 the changed area(s) on the screen and any other listeners.
 	 */
-	void call_predelete_callbacks(int pos, int nDeleted) const;
+	void call_predelete_callbacks(fltk3::TextPosition pos, fltk3::TextPosition nDeleted) const;
 
 	/**
 	 Internal (non-redisplaying) version of BufInsert. Returns the length of
@@ -745,14 +1090,20 @@ protected:
 	 the buffer (i.e. not past the end).
 	 \return the number of bytes inserted
 	 */
-	int insert_(int pos, const char* text);
+	fltk3::TextPosition insert_(fltk3::TextPosition pos, const char* text);
+
+	/**
+	 Same as insert_(int, const char*), but inserts the first
+	 \p insertedLength bytes of \p text, which need not be nul terminated.
+	 */
+	fltk3::TextPosition insert_(fltk3::TextPosition pos, const char* text, fltk3::TextPosition insertedLength);
 
 	/**
 	 Internal (non-redisplaying) version of BufRemove.  Removes the contents
 	 of the buffer between start and end (and moves the gap to the site of
 	 the delete).
 	 */
-	void remove_(int start, int end);
+	void remove_(fltk3::TextPosition start, fltk3::TextPosition end);
 
 	/**
 	 Calls the stored redisplay procedure(s) for this buffer to update the
@@ -764,13 +1115,84 @@ protected:
 	/**
 	 Move the gap to start at a new position.
 	 */
-	void move_gap(int pos);
+	void move_gap(fltk3::TextPosition pos);
 
 	/**
 	 Reallocates the text storage in the buffer to have a gap starting at \p newGapStart
 	 and a gap size of \p newGapLen, preserving the buffer's current contents.
 	 */
-	void reallocate_with_gap(int newGapStart, int newGapLen);
+	void reallocate_with_gap(fltk3::TextPosition newGapStart, fltk3::TextPosition newGapLen);
+
+	/**
+	 Return the longest run of contiguous bytes starting at \p pos, but
+	 no more than INT_MAX bytes, so that it can be passed to functions
+	 that take an \c int length.
+	 \param pos byte offset into buffer
+	 \param[out] len number of bytes that can be read at the returned address,
+	   0 if \p pos is at or after the end of the buffer
+	 \return address of the byte at \p pos
+	 */
+	const char *segment(fltk3::TextPosition pos, int *len) const;
+
+	/**
+	 Return the longest run of contiguous bytes ending right before \p pos,
+	 but no more than INT_MAX bytes.
+	 \param pos byte offset into buffer
+	 \param[out] len number of bytes in the run, 0 if \p pos is 0
+	 \return address of the first byte of the run
+	 */
+	const char *segment_before(fltk3::TextPosition pos, int *len) const;
+
+	/**
+	 Copy the bytes between \p start and \p end into \p to, which must have
+	 room for at least \p end - \p start bytes. No terminating nul is added.
+	 */
+	void copy_text_(char *to, fltk3::TextPosition start, fltk3::TextPosition end) const;
+
+	/**
+	 Return the address of the byte at \p pos in PIECE_STORAGE mode.
+	 */
+	char *piece_address(fltk3::TextPosition pos) const;
+
+	/**
+	 Return the index of the piece that contains the byte at \p pos.
+	 \p pos must be a valid offset smaller than length().
+	 */
+	int piece_index(fltk3::TextPosition pos) const;
+
+	/**
+	 Make sure that a piece starts at \p pos, splitting the piece that
+	 contains \p pos if needed.
+	 \return index of the piece starting at \p pos, or the number of pieces
+	   if \p pos is at the end of the buffer
+	 */
+	int split_piece(fltk3::TextPosition pos);
+
+	/**
+	 Reserve \p len bytes in the add buffer and link them into the piece table
+	 at \p pos. Consecutive inserts at the end of the previous one extend
+	 the same piece. The caller must fill in the returned memory and update
+	 mLength.
+	 \return address of the reserved bytes
+	 */
+	char *piece_insert_(fltk3::TextPosition pos, fltk3::TextPosition len);
+
+	/**
+	 Link \p len bytes at \p text into the piece table at \p pos, in a
+	 piece of their own. The caller must update mLength.
+	 */
+	void piece_link_(fltk3::TextPosition pos, char *text, fltk3::TextPosition len);
+
+	/**
+	 Unlink the text between \p start and \p end from the piece table.
+	 The caller must update mLength.
+	 */
+	void piece_remove_(fltk3::TextPosition start, fltk3::TextPosition end);
+
+	/**
+	 Release the piece table and the add buffer.
+	 */
+	void free_pieces();
 
 	char* selection_text_(fltk3::TextSelection* sel) const;
 
@@ -787,17 +1209,95 @@ protected:
 	/**
 	 Updates all of the selections in the buffer for changes in the buffer's text
 	 */
-	void update_selections(int pos, int nDeleted, int nInserted);
+	void update_selections(fltk3::TextPosition pos, fltk3::TextPosition nDeleted,
+	                       fltk3::TextPosition nInserted);
+
+	/**
+	 Find the first match of \p search that starts at or after \p startPos
+	 and before \p startLimit, and ends at or before \p endPos.
+	 */
+	int find_(const fltk3::TextSearch& search, fltk3::TextPosition startPos,
+	          fltk3::TextPosition startLimit, fltk3::TextPosition endPos,
+	          fltk3::TextPosition* matchStart, fltk3::TextPosition* matchEnd) const;
+
+	/**
+	 Find the last match of \p search that starts at or before \p startPos.
+	 */
+	int find_back_(const fltk3::TextSearch& search, fltk3::TextPosition startPos,
+	               fltk3::TextPosition* matchStart, fltk3::TextPosition* matchEnd) const;
+
+	/**
+	 Append text in tail mode, and combine the modify callbacks.
+	 */
+	void tail_append_(const char* text, fltk3::TextPosition len);
+
+	/**
+	 In tail mode, drop lines from the start if the buffer is too long.
+	 */
+	void trim_head_();
+
+	/**
+	 In a batch, grow the changed range to include the text between
+	 \p start and \p end, and save the original text of the new parts.
+	 */
+	void batch_cover_(fltk3::TextPosition start, fltk3::TextPosition end) const;
+
+	/**
+	 Replace the undo steps of a batch by one step for the whole batch.
+	 */
+	void batch_undo_(fltk3::TextBatch *batch);
+
+	/**
+	 Call the predelete callbacks of a batch that replaced its original
+	 text by the \p nInserted bytes now in the buffer. The original text is
+	 shown in its place while they run, without copying the new text.
+	 */
+	void batch_predelete_(fltk3::TextBatch *batch, fltk3::TextPosition nInserted);
+
+	/**
+	 Add an insertion of \p nInserted bytes at \p pos to the undo history.
+	 */
+	void record_insert(fltk3::TextPosition pos, fltk3::TextPosition nInserted);
+
+	/**
+	 Add the removal of the text between \p start and \p end to the undo
+	 history. Must be called while the text is still in the buffer.
+	 */
+	void record_remove(fltk3::TextPosition start, fltk3::TextPosition end);
+
+	/**
+	 Delete the undo history.
+	 */
+	void free_history();
+
+	/**
+	 Count the newlines between \p startPos and \p endPos by scanning the text,
+	 without using the line index.
+	 */
+	fltk3::TextPosition scan_lines(fltk3::TextPosition startPos, fltk3::TextPosition endPos) const;
+
+	/**
+	 Return the line index, building it first if needed.
+	 */
+	fltk3::TextLineIndex *line_index() const;
+
+	/**
+	 Drop the line index. It will be rebuilt by the next call that needs it.
+	 */
+	void free_line_index();
+
+	friend class TextLineIndex;
+	friend class TextSpanIterator;
 
 	fltk3::TextSelection mPrimary;     /**< highlighted areas */
 	fltk3::TextSelection mSecondary;   /**< highlighted areas */
 	fltk3::TextSelection mHighlight;   /**< highlighted areas */
-	int mLength;                    /**< length of the text in the buffer (the length
+	fltk3::TextPosition mLength;           /**< length of the text in the buffer (the length
                                      of the buffer itself must be calculated:
                                      gapEnd - gapStart + length) */
 	char* mBuf;                     /**< allocated memory where the text is stored */
-	int mGapStart;                  /**< points to the first character of the gap */
-	int mGapEnd;                    /**< points to the first char after the gap */
+	fltk3::TextPosition mGapStart;         /**< points to the first character of the gap */
+	fltk3::TextPosition mGapEnd;           /**< points to the first char after the gap */
 	// The hardware tab distance used by all displays for this buffer,
 	// and used in computing offsets for rectangular selection operations.
 	int mTabDist;                   /**< equiv. number of characters in a tab */
@@ -809,13 +1309,114 @@ protected:
 	fltk3::TextPredeleteCb *mPredeleteProcs; /**< procedure to call before text is deleted
                                             from the buffer; at most one is supported. */
 	void **mPredeleteCbArgs;        /**< caller argument for pre-delete proc above */
-	int mCursorPosHint;             /**< hint for reasonable cursor position after
+	fltk3::TextPosition mCursorPosHint;    /**< hint for reasonable cursor position after
                                      a buffer modification operation */
 	char mCanUndo;                  /**< if this buffer is used for attributes, it must
                                      not do any undo calls */
-	int mPreferredGapSize;          /**< the default allocation for the text gap is 1024
+	fltk3::TextPosition mPreferredGapSize; /**< the default allocation for the text gap is 1024
                                      bytes and should only be increased if frequent
                                      and large changes in buffer size are expected */
+
+	/**
+	 A contiguous run of text in PIECE_STORAGE mode.
+	 */
+	struct Piece {
+		char *text;                   ///< first byte of the run, in mBuf or in an add block
+		fltk3::TextPosition start;           ///< byte offset of the run in the buffer
+		fltk3::TextPosition length;          ///< number of bytes in the run
+	};
+
+	char mStorageMode;              /**< GAP_STORAGE or PIECE_STORAGE; in piece mode,
+                                     mBuf holds the original text */
+	Piece *mPieces;                 /**< piece table, sorted by position */
+	int mNPieces;                   /**< number of pieces in use */
+	int mNPiecesAllocated;          /**< number of pieces allocated */
+	mutable int mPieceHint;         /**< piece found by the last lookup */
+	char **mAddBlocks;              /**< append-only blocks holding inserted text */
+	int mNAddBlocks;                /**< number of add blocks */
+	fltk3::TextPosition mAddUsed;          /**< bytes used in the newest add block */
+	fltk3::TextPosition mAddSize;          /**< size of the newest add block */
+	mutable fltk3::TextLineIndex *mLineIndex; /**< newline count per block of text,
+                                     NULL until a line lookup needs it */
+	fltk3::TextHistory *mHistory;   /**< undo and redo steps, NULL until the first
+                                     modification is recorded */
+	fltk3::TextPosition mUndoLimit;        /**< memory limit of mHistory in bytes, 0 for none */
+	fltk3::TextPosition mTailCapacity;     /**< maximum length in tail mode, 0 if not in tail mode */
+	fltk3::TextPosition mTailStart;        /**< start of the appended text whose modify
+                                     callbacks are pending */
+	fltk3::TextPosition mTailPending;      /**< length of that text, 0 if none is pending */
+	char mTailCanUndo;              /**< canUndo() before tail mode was turned on */
+	fltk3::TextBatch *mBatch;       /**< changes since begin_batch(), NULL outside
+                                     of a batch */
+};
+
+
+/**
+ \class fltk3::TextSpanIterator
+ \brief Reads a range of an fltk3::TextBuffer in place, without copying it.
+
+ The range is returned as a sequence of spans of contiguous bytes. In gap
+ storage there are at most two, one on each side of the gap. In piece
+ storage there is one for every piece the range touches. The spans point
+ into the buffer, so they are only valid until the buffer is modified, and
+ they are not nul terminated.
+
+ \code
+ for (fltk3::TextSpanIterator i(buf, start, end); !i.done(); i.next())
+   fwrite(i.text(), 1, i.length(), fp);
+ \endcode
+ */
+class FLTK3_EXPORT TextSpanIterator
+{
+public:
+
+	/**
+	 \brief Start reading the text between \p start and \p end.
+	 The positions are clipped to the buffer.
+	 */
+	TextSpanIterator(const fltk3::TextBuffer* buf, fltk3::TextPosition start, fltk3::TextPosition end);
+
+	/**
+	 \brief Advance to the next span.
+	 */
+	void next();
+
+	/**
+	 \brief Return non-zero when all spans have been read.
+	 */
+	int done() const {
+		return mLength == 0;
+	}
+
+	/**
+	 \brief Return the address of the current span.
+	 */
+	const char* text() const {
+		return mText;
+	}
+
+	/**
+	 \brief Return the length of the current span in bytes.
+	 */
+	int length() const {
+		return mLength;
+	}
+
+	/**
+	 \brief Return the buffer position of the first byte of the current span.
+	 */
+	fltk3::TextPosition position() const {
+		return mPos;
+	}
+
+protected:
+	void fetch();
+
+	const fltk3::TextBuffer* mBuffer; ///< buffer being read
+	fltk3::TextPosition mPos;              ///< position of the current span
+	fltk3::TextPosition mEnd;              ///< end of the range
+	const char* mText;              ///< address of the current span
+	int mLength;                    ///< length of the current span, 0 at the end
 };
 
 }
@@ -43,6 +43,146 @@
 namespace fltk3
 {
 
+class TextLayoutCache;
+struct TextLineLayout;
+class TextWrapIndex;
+
+
+/**
+ \class fltk3::TextStyleRuns
+ \brief Run-length encoded styles of the text of an fltk3::TextDisplay.
+
+ This is an alternative to the style buffer of
+ fltk3::TextDisplay::highlight_data(). Instead of one style byte for every
+ byte of text, it keeps a sorted list of runs of text in the same style,
+ so a large document with few style changes needs little memory. A style
+ is found with a binary search over the starts of the runs.
+
+ The text starts out "unfinished", and the display asks an
+ fltk3::TextHighlighter to style it when it is about to be shown. When the
+ text is modified, the styles from the start of the modified line to the
+ end of the text are dropped and become unfinished again, so they are
+ only redone when they are shown.
+
+ A TextStyleRuns can be used by one fltk3::TextDisplay at a time, which
+ keeps it in step with the modifications of its buffer.
+ */
+class FLTK3_EXPORT TextStyleRuns
+{
+public:
+
+	/**
+	 \brief Create an empty style store.
+	 \param unfinishedStyle style of text that was not styled yet. It
+	   must be a style that the highlighter never sets, or the display
+	   would ask the highlighter again for every character drawn in it.
+	   Use a spare entry past the styles of the highlighter, e.g. 'A' +
+	   the number of styles it sets.
+	 */
+	explicit TextStyleRuns(char unfinishedStyle);
+
+	~TextStyleRuns();
+
+	/**
+	 \brief Return the length of the styled text.
+	 */
+	fltk3::TextPosition length() const {
+		return mLength;
+	}
+
+	/**
+	 \brief Return the style of text that was not styled yet.
+	 */
+	char unfinished_style() const {
+		return mUnfinishedStyle;
+	}
+
+	/**
+	 \brief Return the number of runs.
+	 */
+	int runs() const {
+		return mNRuns;
+	}
+
+	char style_at(fltk3::TextPosition pos) const;
+	fltk3::TextPosition run_start(fltk3::TextPosition pos) const;
+	fltk3::TextPosition run_end(fltk3::TextPosition pos) const;
+	void set(fltk3::TextPosition start, fltk3::TextPosition end, char style);
+	void clear(fltk3::TextPosition length);
+	void modified(fltk3::TextPosition pos, fltk3::TextPosition length);
+
+protected:
+	int find(fltk3::TextPosition pos) const;
+	fltk3::TextPosition start_of(int i) const {
+		return mStart[i < mGapStart ? i : i + mGapEnd - mGapStart];
+	}
+	char style_of(int i) const {
+		return mStyle[i < mGapStart ? i : i + mGapEnd - mGapStart];
+	}
+	void move_gap(int i);
+	void insert_run(int i, fltk3::TextPosition start, char style);
+	void remove_run(int i);
+
+	fltk3::TextPosition *mStart;    ///< first position of each run
+	char *mStyle;                   ///< style of each run
+	int mNRuns;                     ///< number of runs, at least 1
+	int mAllocated;                 ///< size of the arrays
+	int mGapStart, mGapEnd;         ///< unused part of the arrays
+	fltk3::TextPosition mLength;    ///< length of the text
+	char mUnfinishedStyle;
+	mutable int mLast;              ///< run found last, for sequential access
+
+private:
+	// Forbid use of copy contructor and assign operator
+	TextStyleRuns(const TextStyleRuns&);
+	TextStyleRuns &operator=(const TextStyleRuns&);
+};
+
+
+/**
+ \class fltk3::TextHighlighter
+ \brief Interface of the syntax highlighters for fltk3::TextStyleRuns.
+
+ fltk3::TextDisplay calls highlight() when it finds unfinished text
+ in the lines it shows. Only that text and about one screen more is
+ highlighted, so the cost does not depend on the size of the document.
+ */
+class FLTK3_EXPORT TextHighlighter
+{
+public:
+	virtual ~TextHighlighter() {}
+
+	/**
+	 \brief Return where highlighting has to begin to style \p pos.
+
+	 \p start is the first unfinished position before \p pos. The styles
+	 before it are valid, so a highlighter can find its state there. The
+	 default returns \p start. A highlighter whose state does not carry
+	 from one line to the next can return the start of the line of \p pos
+	 instead, which skips the text in between.
+	 */
+	virtual fltk3::TextPosition restart(const fltk3::TextBuffer * /*buf*/,
+	                                    const fltk3::TextStyleRuns * /*runs*/,
+	                                    fltk3::TextPosition start,
+	                                    fltk3::TextPosition /*pos*/) {
+		return start;
+	}
+
+	/**
+	 \brief Style the text from \p start to at least \p end.
+	 Use fltk3::TextStyleRuns::set() to store the styles; \p end is always
+	 at a line start or at the end of the text.
+
+	 Never set fltk3::TextStyleRuns::unfinished_style(). Text in that style
+	 is taken to be not styled yet, so the display would call highlight()
+	 again for each of its characters.
+	 */
+	virtual void highlight(const fltk3::TextBuffer *buf,
+	                       fltk3::TextStyleRuns *runs,
+	                       fltk3::TextPosition start, fltk3::TextPosition end) = 0;
+};
+
+
 /**
  \brief Rich text display widget.
 
@@ -140,9 +280,9 @@ public:
 		WRAP_AT_BOUNDS  /**< wrap text so that it fits into the widget width */
 	};
 
-	friend void text_drag_me(int pos, fltk3::TextDisplay* d);
+	friend void text_drag_me(fltk3::TextPosition pos, fltk3::TextDisplay* d);
 
-	typedef void (*UnfinishedStyleCb)(int, void *);
+	typedef void (*UnfinishedStyleCb)(fltk3::TextPosition, void *);
 
 	/**
 	 This structure associates the color, font, andsize of a string to draw
@@ -186,20 +326,20 @@ public:
 		return mBuffer;
 	}
 
-	void redisplay_range(int start, int end);
-	void scroll(int topLineNum, int horizOffset);
+	void redisplay_range(fltk3::TextPosition start, fltk3::TextPosition end);
+	void scroll(fltk3::TextPosition topLineNum, int horizOffset);
 	void insert(const char* text);
 	void overstrike(const char* text);
-	void insert_position(int newPos);
+	void insert_position(fltk3::TextPosition newPos);
 
 	/**
 	 Gets the position of the text insertion cursor for text display.
 	 \return insert position index into text buffer
 	 */
-	int insert_position() const {
+	fltk3::TextPosition insert_position() const {
 		return mCursorPos;
 	}
-	int position_to_xy(int pos, int* x, int* y) const;
+	int position_to_xy(fltk3::TextPosition pos, int* x, int* y) const;
 
 	int in_selection(int x, int y) const;
 	void show_insert_position();
@@ -208,11 +348,13 @@ public:
 	int move_left();
 	int move_up();
 	int move_down();
-	int count_lines(int start, int end, bool start_pos_is_line_start) const;
-	int line_start(int pos) const;
-	int line_end(int startPos, bool startPosIsLineStart) const;
-	int skip_lines(int startPos, int nLines, bool startPosIsLineStart);
-	int rewind_lines(int startPos, int nLines);
+	fltk3::TextPosition count_lines(fltk3::TextPosition start, fltk3::TextPosition end,
+	                                bool start_pos_is_line_start) const;
+	fltk3::TextPosition line_start(fltk3::TextPosition pos) const;
+	fltk3::TextPosition line_end(fltk3::TextPosition startPos, bool startPosIsLineStart) const;
+	fltk3::TextPosition skip_lines(fltk3::TextPosition startPos, fltk3::TextPosition nLines,
+	                               bool startPosIsLineStart);
+	fltk3::TextPosition rewind_lines(fltk3::TextPosition startPos, fltk3::TextPosition nLines);
 	void next_word(void);
 	void previous_word(void);
 
@@ -280,7 +422,7 @@ public:
 	 \param pos start calculation at this index
 	 \return beginning of the words
 	 */
-	int word_start(int pos) const {
+	fltk3::TextPosition word_start(fltk3::TextPosition pos) const {
 		return buffer()->word_start(pos);
 	}
 
@@ -289,7 +431,7 @@ public:
 	 \param pos start calculation at this index
 	 \return index of first character after the end of the word
 	 */
-	int word_end(int pos) const {
+	fltk3::TextPosition word_end(fltk3::TextPosition pos) const {
 		return buffer()->word_end(pos);
 	}
 
@@ -300,7 +442,12 @@ public:
 	                    UnfinishedStyleCb unfinishedHighlightCB,
 	                    void *cbArg);
 
-	int position_style(int lineStartPos, int lineLen, int lineIndex) const;
+	void highlight_data(fltk3::TextStyleRuns *styleRuns,
+	                    const StyleTableEntry *styleTable, int nStyles,
+	                    fltk3::TextHighlighter *highlighter);
+
+	int position_style(fltk3::TextPosition lineStartPos, int lineLen,
+	                   int lineIndex) const;
 
 	/**
 	 \todo FIXME : get set methods pointing on shortcut_
@@ -328,6 +475,7 @@ public:
 	void textfont(fltk3::Font s) {
 		Widget::textfont(s);
 		mColumnScale = 0;
+		if (mContinuousWrap && mBuffer) reset_wrap_index();
 	}
 
 	/**
@@ -338,6 +486,7 @@ public:
 	void textsize(fltk3::Fontsize s) {
 		Widget::textsize(s);
 		mColumnScale = 0;
+		if (mContinuousWrap && mBuffer) reset_wrap_index();
 	}
 	fltk3::Font textfont() const {
 		return Widget::textfont();
@@ -390,7 +539,8 @@ protected:
 
 	virtual void draw();
 	void draw_text(int X, int Y, int W, int H);
-	void draw_range(int start, int end);
+	static void draw_text_cb(void *d, int X, int Y, int W, int H);
+	void draw_range(fltk3::TextPosition start, fltk3::TextPosition end);
 	void draw_cursor(int, int);
 
 	void draw_string(int style, int x, int y, int toX, const char *string,
@@ -408,34 +558,55 @@ protected:
 		GET_WIDTH
 	};
 
-	int handle_vline(int mode,
-	                 int lineStart, int lineLen, int leftChar, int rightChar,
-	                 int topClip, int bottomClip,
-	                 int leftClip, int rightClip) const;
+	fltk3::TextPosition handle_vline(int mode,
+	                                 fltk3::TextPosition lineStart, int lineLen,
+	                                 int leftChar, int rightChar,
+	                                 int topClip, int bottomClip,
+	                                 int leftClip, int rightClip) const;
+
+	const char *contiguous_text(fltk3::TextPosition pos, int len) const;
+
+	const fltk3::TextLineLayout *line_layout(fltk3::TextPosition lineStart, int lineLen,
+	                                         const char *lineStr, int prefix) const;
+	int add_layout_run(fltk3::TextLineLayout *layout, const char *lineStr,
+	                   int start, int end, int style, int tab, int x) const;
 
 	void draw_line_numbers(bool clearAll);
 
 	void clear_rect(int style, int x, int y, int width, int height) const;
 	void display_insert();
 
-	void offset_line_starts(int newTopLineNum);
+	void offset_line_starts(fltk3::TextPosition newTopLineNum);
+
+	void calc_line_starts(fltk3::TextPosition startLine, fltk3::TextPosition endLine);
 
-	void calc_line_starts(int startLine, int endLine);
+	void update_line_starts(fltk3::TextPosition pos, fltk3::TextPosition charsInserted,
+	                        fltk3::TextPosition charsDeleted,
+	                        fltk3::TextPosition linesInserted,
+	                        fltk3::TextPosition linesDeleted, int *scrolled);
 
-	void update_line_starts(int pos, int charsInserted, int charsDeleted,
-	                        int linesInserted, int linesDeleted, int *scrolled);
+	void reset_wrap_index();
+	fltk3::TextPosition index_wrapped_lines(int nBytes);
+	fltk3::TextPosition wrapped_lines_before(fltk3::TextPosition pos) const;
+	void estimate_wrapped_lines();
+	static void wrap_index_cb(void*);
 
 	void calc_last_char();
 
-	int position_to_line( int pos, int* lineNum ) const;
+	int position_to_line( fltk3::TextPosition pos, int* lineNum ) const;
 	double string_width(const char* string, int length, int style) const;
 
 	static void scroll_timer_cb(void*);
+	static void highlight_runs_cb(fltk3::TextPosition pos, void *cbArg);
+	int style_byte(fltk3::TextPosition pos) const;
 
-	static void buffer_predelete_cb(int pos, int nDeleted, void* cbArg);
-	static void buffer_modified_cb(int pos, int nInserted, int nDeleted,
-	                               int nRestyled, const char* deletedText,
-	                               void* cbArg);
+	static void buffer_predelete_cb(fltk3::TextPosition pos,
+	                                fltk3::TextPosition nDeleted, void* cbArg);
+	static void buffer_modified_cb(fltk3::TextPosition pos,
+	                               fltk3::TextPosition nInserted,
+	                               fltk3::TextPosition nDeleted,
+	                               fltk3::TextPosition nRestyled,
+	                               const char* deletedText, void* cbArg);
 
 	static void h_scrollbar_cb(fltk3::Scrollbar* w, fltk3::TextDisplay* d);
 	static void v_scrollbar_cb( fltk3::Scrollbar* w, fltk3::TextDisplay* d);
@@ -445,60 +616,73 @@ protected:
 	int longest_vline() const;
 	int empty_vlines() const;
 	int vline_length(int visLineNum) const;
-	int xy_to_position(int x, int y, int PosType = CHARACTER_POS) const;
+	fltk3::TextPosition xy_to_position(int x, int y, int PosType = CHARACTER_POS) const;
 
 	void xy_to_rowcol(int x, int y, int* row, int* column,
 	                  int PosType = CHARACTER_POS) const;
 	void maintain_absolute_top_line_number(int state);
-	int get_absolute_top_line_number() const;
-	void absolute_top_line_number(int oldFirstChar);
+	fltk3::TextPosition get_absolute_top_line_number() const;
+	void absolute_top_line_number(fltk3::TextPosition oldFirstChar);
 	int maintaining_absolute_top_line_number() const;
 	void reset_absolute_top_line_number();
-	int position_to_linecol(int pos, int* lineNum, int* column) const;
-	int scroll_(int topLineNum, int horizOffset);
-
-	void extend_range_for_styles(int* start, int* end);
-
-	void find_wrap_range(const char *deletedText, int pos, int nInserted,
-	                     int nDeleted, int *modRangeStart, int *modRangeEnd,
-	                     int *linesInserted, int *linesDeleted);
-	void measure_deleted_lines(int pos, int nDeleted);
-	void wrapped_line_counter(fltk3::TextBuffer *buf, int startPos, int maxPos,
-	                          int maxLines, bool startPosIsLineStart,
-	                          int styleBufOffset, int *retPos, int *retLines,
-	                          int *retLineStart, int *retLineEnd,
+	int position_to_linecol(fltk3::TextPosition pos, fltk3::TextPosition* lineNum,
+	                        int* column) const;
+	int scroll_(fltk3::TextPosition topLineNum, int horizOffset);
+
+	void extend_range_for_styles(fltk3::TextPosition* start, fltk3::TextPosition* end);
+
+	void find_wrap_range(const char *deletedText, fltk3::TextPosition pos,
+	                     fltk3::TextPosition nInserted, fltk3::TextPosition nDeleted,
+	                     fltk3::TextPosition *modRangeStart,
+	                     fltk3::TextPosition *modRangeEnd,
+	                     fltk3::TextPosition *linesInserted,
+	                     fltk3::TextPosition *linesDeleted);
+	void measure_deleted_lines(fltk3::TextPosition pos, fltk3::TextPosition nDeleted);
+	void wrapped_line_counter(fltk3::TextBuffer *buf, fltk3::TextPosition startPos,
+	                          fltk3::TextPosition maxPos, fltk3::TextPosition maxLines,
+	                          bool startPosIsLineStart,
+	                          fltk3::TextPosition styleBufOffset,
+	                          fltk3::TextPosition *retPos, fltk3::TextPosition *retLines,
+	                          fltk3::TextPosition *retLineStart,
+	                          fltk3::TextPosition *retLineEnd,
 	                          bool countLastLineMissingNewLine = true) const;
-	void find_line_end(int pos, bool start_pos_is_line_start, int *lineEnd,
-	                   int *nextLineStart) const;
-	double measure_proportional_character(const char *s, int colNum, int pos) const;
-	int wrap_uses_character(int lineEndPos) const;
-
-	int damage_range1_start, damage_range1_end;
-	int damage_range2_start, damage_range2_end;
-	int mCursorPos;
+	void find_line_end(fltk3::TextPosition pos, bool start_pos_is_line_start,
+	                   fltk3::TextPosition *lineEnd,
+	                   fltk3::TextPosition *nextLineStart) const;
+	double measure_proportional_character(const char *s, int colNum, fltk3::TextPosition pos) const;
+	int wrap_uses_character(fltk3::TextPosition lineEndPos) const;
+
+	fltk3::TextPosition damage_range1_start, damage_range1_end;
+	fltk3::TextPosition damage_range2_start, damage_range2_end;
+	fltk3::TextPosition mCursorPos;
 	int mCursorOn;
 	int mCursorOldY;              /* Y pos. of cursor for blanking */
-	int mCursorToHint;            /* Tells the buffer modified callback
+	int mScrollDX, mScrollDY;     /* Pixels the text moved since it was
+                                 last drawn, see fltk3::scroll() */
+	fltk3::TextPosition mCursorToHint; /* Tells the buffer modified callback
                                  where to move the cursor, to reduce
                                  the number of redraw calls */
 	int mCursorStyle;             /* One of enum cursorStyles above */
 	int mCursorPreferredXPos;     /* Pixel position for vert. cursor movement */
 	int mNVisibleLines;           /* # of visible (displayed) lines */
-	int mNBufferLines;            /* # of newlines in the buffer */
+	fltk3::TextPosition mNBufferLines; /* # of newlines in the buffer */
 	fltk3::TextBuffer* mBuffer;      /* Contains text to be displayed */
 	fltk3::TextBuffer* mStyleBuffer; /* Optional parallel buffer containing
                                  color and font information */
-	int mFirstChar, mLastChar;    /* Buffer positions of first and last
+	fltk3::TextStyleRuns* mStyleRuns; /* Optional run-length encoded styles,
+                                 instead of mStyleBuffer */
+	fltk3::TextHighlighter* mHighlighter; /* Styles unfinished mStyleRuns */
+	fltk3::TextPosition mFirstChar, mLastChar; /* Buffer positions of first and last
                                  displayed character (lastChar points
                                  either to a newline or one character
                                  beyond the end of the buffer) */
 	int mContinuousWrap;          /* Wrap long lines when displaying */
 	int mWrapMarginPix; 	    	/* Margin in # of pixels for
                                  wrapping in continuousWrap mode */
-	int* mLineStarts;
-	int mTopLineNum;              /* Line number of top displayed line
+	fltk3::TextPosition* mLineStarts;
+	fltk3::TextPosition mTopLineNum; /* Line number of top displayed line
                                  of file (first line of file is 1) */
-	int mAbsTopLineNum;           /* In continuous wrap mode, the line
+	fltk3::TextPosition mAbsTopLineNum; /* In continuous wrap mode, the line
                                   number of the top line if the text
                                   were not wrapped (note that this is
                                   only maintained as needed). */
@@ -506,7 +690,7 @@ protected:
                                  maintaining absTopLineNum even if
                                  it isn't needed for line # display */
 	int mHorizOffset;             /* Horizontal scroll pos. in pixels */
-	int mTopLineNumHint;          /* Line number of top displayed line
+	fltk3::TextPosition mTopLineNumHint; /* Line number of top displayed line
                                  of file (first line of file is 1) */
 	int mHorizOffsetHint;         /* Horizontal scroll pos. in pixels */
 	int mNStyles;                 /* Number of entries in styleTable */
@@ -522,7 +706,7 @@ protected:
 
 	int mSuppressResync;          /* Suppress resynchronization of line
                                  starts during buffer updates */
-	int mNLinesDeleted;           /* Number of lines deleted during
+	fltk3::TextPosition mNLinesDeleted; /* Number of lines deleted during
                                  buffer modification (only used
                                  when resynchronization is suppressed) */
 	int mModifyingTabDistance;    /* Whether tab distance is being
@@ -533,14 +717,23 @@ protected:
                                  needs to be mutable so that it can be calculated
                                  within a method marked as "const" */
 
+	mutable char *mLineText;      /* Copy of a line that is split in the
+                                 buffer, reused by contiguous_text() */
+	mutable int mLineTextSize;    /* Allocated size of mLineText */
+	fltk3::TextLayoutCache *mLayoutCache; /* Measured style runs of recently
+                                 displayed lines */
+	fltk3::TextWrapIndex *mWrapIndex; /* Wrapped line counts at checkpoints
+                                 in continuous wrap mode */
+
 	fltk3::Color mCursor_color;
 
 	fltk3::Scrollbar* mHScrollBar;
 	fltk3::Scrollbar* mVScrollBar;
 	int scrollbar_width_;
 	fltk3::Align scrollbar_align_;
-	int dragPos, dragType, dragging;
-	int display_insert_position_hint;
+	fltk3::TextPosition dragPos;
+	int dragType, dragging;
+	fltk3::TextPosition display_insert_position_hint;
 	struct {
 		int x, y, w, h;
 	} text_area;
@@ -142,6 +142,7 @@ public:
 	static int kf_paste(int c, fltk3::TextEditor* e);
 	static int kf_select_all(int c, fltk3::TextEditor* e);
 	static int kf_undo(int c, fltk3::TextEditor* e);
+	static int kf_redo(int c, fltk3::TextEditor* e);
 
 protected:
 	int handle_key();
@@ -116,6 +116,22 @@
 
 #define HAVE_XFIXES 0
 
+/*
+ * HAVE_XRENDER:
+ *
+ * Do we have the X render extension?
+ */
+
+#define HAVE_XRENDER 1
+
+/*
+ * HAVE_XSHM:
+ *
+ * Do we have the X shared memory extension?
+ */
+
+#define HAVE_XSHM 1
+
 /*
  * __APPLE_QUARTZ__:
  *
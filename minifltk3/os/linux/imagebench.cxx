@@ -0,0 +1,72 @@
+//
+// fltk3::draw_image() benchmark.
+//
+// Pushes 1080p and 4K RGB frames through fltk3::draw_image() into an
+// offscreen pixmap and reports frames per second, including the time the
+// X server takes to take them. Run it once with MIT-SHM and once without:
+//
+//	make imagebench && ./imagebench [frames] && FLTK_NO_SHM=1 ./imagebench [frames]
+//
+
+#include "run.h"
+#include "x.h"
+#include "draw.h"
+#include "Window.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void run(int W, int H, int frames)
+{
+	// two frames, so that each one differs from the one before it
+	uchar *rgb[2];
+	for (int k = 0; k < 2; k++) {
+		rgb[k] = new uchar[W * H * 3];
+		uchar *p = rgb[k];
+		for (int y = 0; y < H; y++)
+			for (int x = 0; x < W; x++) {
+				*p++ = (uchar)(x + k * 64);
+				*p++ = (uchar)y;
+				*p++ = (uchar)(x ^ y);
+			}
+	}
+
+	fltk3::Offscreen pixmap = fl_create_offscreen(W, H);
+	fl_begin_offscreen(pixmap);
+	fltk3::draw_image(rgb[0], 0, 0, W, H); // allocates the buffers
+	XSync(fl_display, False);
+	double t0 = now();
+	for (int i = 0; i < frames; i++)
+		fltk3::draw_image(rgb[i & 1], 0, 0, W, H);
+	XSync(fl_display, False);
+	double t = now() - t0;
+	fl_end_offscreen();
+	fl_delete_offscreen(pixmap);
+
+	printf("%dx%d: %.2f ms per frame, %.1f frames per second\n", W, H, t * 1e3 / frames, frames / t);
+	delete[] rgb[0];
+	delete[] rgb[1];
+}
+
+int main(int argc, char **argv)
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 100;
+	if (frames < 1) frames = 1;
+
+	fltk3::Window win(100, 100, "imagebench");
+	win.show();
+	while (!win.visible()) fltk3::wait();
+	win.make_current();
+
+	printf("MIT-SHM %s\n", getenv("FLTK_NO_SHM") ? "off" : "on, if the server has it");
+	run(1920, 1080, frames);
+	run(3840, 2160, frames);
+	return 0;
+}
@@ -0,0 +1,68 @@
+//
+// Full-screen TextDisplay repaint benchmark.
+//
+// Opens a window the size of the screen with a TextDisplay full of text
+// and times repainting all of it, including the time the X server takes
+// to draw it. Run it before and after a change to the text drawing path:
+//
+//	make textbench && ./textbench [frames]
+//
+
+#include "run.h"
+#include "x.h"
+#include "DoubleWindow.h"
+#include "TextDisplay.h"
+#include "TextBuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 200;
+	if (frames < 1) frames = 1;
+
+	fltk3::TextBuffer buf;
+	static const char *words[] = {
+		"for", "(int", "i", "=", "0;", "i", "<", "n;", "i++)", "buffer", "display",
+		"return", "static", "const", "char", "*text", "=", "NULL;", "// comment", "\xc3\xa4\xc3\xb6\xc3\xbc"
+	};
+	srand(1);
+	for (int line = 0; line < 5000; line++) {
+		int n = rand() % 16;
+		for (int i = 0; i < n; i++) {
+			buf.append(words[rand() % (sizeof(words) / sizeof(words[0]))]);
+			buf.append(" ");
+		}
+		buf.append("\n");
+	}
+
+	int X, Y, W, H;
+	fltk3::screen_xywh(X, Y, W, H, 0);
+	fltk3::DoubleWindow win(X, Y, W, H, "textbench");
+	fltk3::TextDisplay display(0, 0, W, H);
+	display.buffer(&buf);
+	win.end();
+	win.resizable(&display);
+	win.show();
+	while (!win.visible()) fltk3::wait();
+	for (int i = 0; i < 10; i++) fltk3::check();
+	XSync(fl_display, False);
+
+	double t0 = now();
+	for (int i = 0; i < frames; i++) {
+		display.redraw();
+		fltk3::flush();
+		XSync(fl_display, False);
+	}
+	double t = now() - t0;
+	printf("%dx%d, %d frames: %.2f ms per full repaint\n", W, H, frames, t * 1e3 / frames);
+	return 0;
+}
@@ -0,0 +1,130 @@
+//
+// TextBuffer scanning benchmark.
+//
+// Fills a TextBuffer with about 256 MB of 64-byte lines, with the gap in
+// the middle, and times the functions that scan all of it: line counting,
+// findchar_forward/backward() and search_forward/backward() with and
+// without matching case. The characters and strings looked for are not in
+// the text, so every call reads the whole buffer. Run it once with the
+// vectorized kernels and once with the plain C ones to compare:
+//
+//	make textscanbench && ./textscanbench [MB] && FLTK_SCAN_SCALAR=1 ./textscanbench [MB]
+//
+
+#include "TextBuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static fltk3::TextBuffer *buf;
+static fltk3::TextPosition sink;
+
+// longer ranges are answered by the line index, so count the lines of
+// every 16 KB, which scans all of the text
+static void count_lines()
+{
+	fltk3::TextPosition length = buf->length();
+	for (fltk3::TextPosition pos = 0; pos < length; pos += 16384)
+		sink += buf->count_lines(pos, buf->utf8_align(pos + 16384));
+}
+
+static void findchar_forward()
+{
+	fltk3::TextPosition pos;
+	sink += buf->findchar_forward(0, '#', &pos);
+}
+
+static void findchar_backward()
+{
+	fltk3::TextPosition pos;
+	sink += buf->findchar_backward(buf->length(), '#', &pos);
+}
+
+static void search_forward()
+{
+	fltk3::TextPosition pos;
+	sink += buf->search_forward(0, "needle#", &pos, 1);
+}
+
+static void search_backward()
+{
+	fltk3::TextPosition pos;
+	sink += buf->search_backward(buf->length(), "needle#", &pos, 1);
+}
+
+static void search_forward_nocase()
+{
+	fltk3::TextPosition pos;
+	sink += buf->search_forward(0, "Needle#", &pos, 0);
+}
+
+static void search_backward_nocase()
+{
+	fltk3::TextPosition pos;
+	sink += buf->search_backward(buf->length(), "Needle#", &pos, 0);
+}
+
+// prints the best of a few runs, in GB/s
+static void run(const char *name, void (*scan)())
+{
+	double best = 0;
+	for (int i = 0; i < 3; i++) {
+		double t0 = now();
+		scan();
+		double t = now() - t0;
+		if (i == 0 || t < best) best = t;
+	}
+	printf("  %-26s %6.2f\n", name, buf->length() / best / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	int mb = argc > 1 ? atoi(argv[1]) : 256;
+	if (mb < 1) mb = 1;
+
+	// 1 MB of 64-byte lines of words, appended until the buffer is full
+	static const char *words[] = {
+		"text", "buffer", "display", "line", "gap", "scan", "search", "needle",
+		"count", "char", "style", "wrap", "font", "size", "\xc3\xa4rger", "caf\xc3\xa9"
+	};
+	char *chunk = (char *)malloc(1024 * 1024 + 1);
+	char *p = chunk, *e = chunk + 1024 * 1024;
+	srand(1);
+	while (p + 64 <= e) {
+		char *line = p;
+		while (p - line < 56) {
+			const char *w = words[rand() % 16];
+			memcpy(p, w, strlen(w));
+			p += strlen(w);
+			*p++ = ' ';
+		}
+		while (p - line < 63) *p++ = '.';
+		*p++ = '\n';
+	}
+	*p = 0;
+
+	buf = new fltk3::TextBuffer(mb * 1024 * 1024, 1024 * 1024);
+	for (int i = 0; i < mb; i++) buf->append(chunk);
+	free(chunk);
+	buf->insert(buf->length() / 2, "\n"); // moves the gap to the middle
+
+	printf("%.0f MB, gap in the middle, %s kernels, in GB/s:\n", buf->length() / 1048576.0,
+	       getenv("FLTK_SCAN_SCALAR") ? "plain C" : "vectorized");
+	run("line count", count_lines);
+	run("findchar_forward", findchar_forward);
+	run("findchar_backward", findchar_backward);
+	run("search_forward", search_forward);
+	run("search_backward", search_backward);
+	run("search_forward, no case", search_forward_nocase);
+	run("search_backward, no case", search_backward_nocase);
+	delete buf;
+	return sink == 42; // keeps the calls from being optimized away
+}
@@ -984,6 +984,20 @@ void set_font(fltk3::Font, fltk3::Font);
  The return value is how many faces are in the table after this is done.
  */
 fltk3::Font set_fonts(const char* = 0); // platform dependent
+/**
+ Starts resolving the system fonts that fltk3::font() opens for face
+ \p font at the \p n sizes in \p sizes, on a background thread. Call
+ this early, for instance with the sizes a zoomable view steps through,
+ so that the first fltk3::font() call for each size does not wait for the
+ font to be matched. If a size is asked for before it is resolved,
+ fltk3::font() waits for that size only.
+
+ The fonts resolved here are also kept in a cache file in the user's
+ home directory, so later runs of the program skip matching until fonts
+ are installed or the fontconfig setup is changed.
+ This does nothing on platforms where opening a font is fast.
+ */
+void preload_fonts(fltk3::Font font, const fltk3::Fontsize *sizes, int n);
 
 /**   @} */
 /** \defgroup  fl_drawings  Drawing functions
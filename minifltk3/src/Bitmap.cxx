@@ -431,6 +431,7 @@ int to_display)
 #else // Xlib
 void fltk3::XlibGraphicsDriver::draw(fltk3::Bitmap *bm, int XP, int YP, int WP, int HP, int cx, int cy)
 {
+	fl_flush_text();
 	int X, Y, W, H;
 	if (!bm->array) {
 		bm->draw_empty(XP, YP);
@@ -130,16 +130,48 @@ void fltk3::GraphicsDriver::copy_offscreen(int x, int y, int w, int h, fltk3::Of
 
 #if defined(USE_X11)
 
+#if USE_XFT
+extern void fl_destroy_xft_draw(Window);
+#endif
+#if HAVE_XRENDER
+#include <X11/extensions/Xrender.h>
+#endif
+
 void fltk3::XlibGraphicsDriver::copy_offscreen(int x, int y, int w, int h, fltk3::Offscreen pixmap, int srcx, int srcy)
 {
+	fl_flush_text();
 	XCopyArea(fl_display, pixmap, fl_window, fl_gc, srcx, srcy, w, h, x, y);
 }
 
+/**  Deletion of an offscreen graphics buffer.
+ \param pixmap     the buffer to be deleted.
+ */
+void fl_delete_offscreen(fltk3::Offscreen pixmap)
+{
+#if USE_XFT
+	fl_destroy_xft_draw(pixmap);
+#endif
+	XFreePixmap(fl_display, pixmap);
+}
+
 
-// maybe someone feels inclined to implement alpha blending on X11?
+// images with alpha are composited by the X render extension, if the
+// server has it for the visual
 char fltk3::XlibGraphicsDriver::can_do_alpha_blending()
 {
+#if HAVE_XRENDER
+	static char can_do = -1;
+	if (can_do < 0) {
+		int event_base, error_base;
+		fl_open_display();
+		can_do = XRenderQueryExtension(fl_display, &event_base, &error_base) &&
+		         XRenderFindVisualFormat(fl_display, fl_visual->visual) &&
+		         XRenderFindStandardFormat(fl_display, PictStandardARGB32);
+	}
+	return can_do;
+#else
 	return 0;
+#endif
 }
 #elif defined(WIN32)
 
@@ -443,6 +475,7 @@ void fltk3::DoubleWindow::flush(int eraseoverlay)
 		}
 
 		// Copy contents of back buffer to window...
+		fl_flush_text();
 		XdbeSwapInfo s;
 		s.swap_window = fl_xid(this);
 		s.swap_action = XdbeCopied;
@@ -499,6 +532,9 @@ void fltk3::DoubleWindow::resize(int X,int Y,int W,int H)
 		Fl_X* myi = Fl_X::i(this);
 		if (myi && myi->other_xid && (ow < w() || oh < h())) {
 			// STR #2152: Deallocate the back buffer to force creation of a new one.
+#if USE_XFT
+			fl_destroy_xft_draw(myi->other_xid);
+#endif
 			XdbeDeallocateBackBufferName(fl_display,myi->other_xid);
 			myi->other_xid = 0;
 		}
@@ -517,7 +553,12 @@ void fltk3::DoubleWindow::hide()
 	Fl_X* myi = Fl_X::i(this);
 	if (myi && myi->other_xid) {
 #if USE_XDBE
-		if (!use_xdbe)
+		if (use_xdbe) {
+#  if USE_XFT
+			// the back buffer goes away with the window
+			fl_destroy_xft_draw(myi->other_xid);
+#  endif
+		} else
 #endif
 			fl_delete_offscreen(myi->other_xid);
 	}
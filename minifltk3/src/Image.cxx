@@ -32,6 +32,9 @@
 #include "MenuItem.h"
 #include "Image.h"
 #include "flstring.h"
+#if HAVE_XRENDER
+#include <X11/extensions/Xrender.h>
+#endif
 
 #ifdef WIN32
 void fl_release_dc(HWND, HDC); // from Fl_win32.cxx
@@ -189,6 +192,7 @@ fltk3::Image::measure(const fltk3::Label *lo,		// I - Label
 // RGB image class...
 //
 size_t fltk3::ImageRGB::max_size_ = ~((size_t)0);
+fltk3::RGBScaling fltk3::ImageRGB::scaling_ = fltk3::RGB_SCALING_NEAREST;
 
 /**  The destructor free all memory and server resources that are used by  the image. */
 fltk3::ImageRGB::~ImageRGB()
@@ -206,6 +210,10 @@ void fltk3::ImageRGB::uncache()
 	}
 #else
 	if (id_) {
+#if HAVE_XRENDER
+		if (d() == 2 || d() == 4) XRenderFreePicture(fl_display, id_);
+		else
+#endif
 		fl_delete_offscreen((fltk3::Offscreen)id_);
 		id_ = 0;
 	}
@@ -217,7 +225,276 @@ void fltk3::ImageRGB::uncache()
 #endif
 }
 
+//
+// Filtered resampling for ImageRGB::copy()...
+//
+
+// Lines are resampled across, then the new lines are mixed down. Pixels
+// are kept as 4 floats with the colors multiplied by alpha, so that one
+// SSE2 operation does a whole pixel whatever the depth, and so that
+// transparent pixels don't bleed their color into the edges.
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#  include <emmintrin.h>
+#  define RESAMPLE_SSE2 1
+#endif
+#if HAVE_PTHREAD
+#  include <pthread.h>
+#  include <unistd.h>
+#endif
+#include <math.h>
+
+#define RESAMPLE_THREADS 4		// at most
+#define RESAMPLE_MINIMUM 0x100000	// pixels read and written, smaller images use one thread
+
+// The source pixels making up one column or line of the new image
+struct Fl_Resample_Tap {
+	int first, n;		// source pixels used
+	float *weight;		// n weights adding up to 1
+};
+
+struct Fl_Resample {
+	const uchar *array;
+	int w, h, d, ld;
+	uchar *to;
+	int W, H;
+	Fl_Resample_Tap *xtaps, *ytaps;
+	int ny;			// most source lines used for one new line
+	int y0, y1;		// new lines done by this band
+};
+
+// returns the taps of dst pixels resampling src pixels, and sets max to the
+// most pixels one of them uses; free() them
+static Fl_Resample_Tap *resample_taps(int src, int dst, fltk3::RGBScaling method, int &max)
+{
+	double scale = (double)src / dst;
+	max = method == fltk3::RGB_SCALING_AREA ? (int)ceil(scale) + 1 : 2;
+	Fl_Resample_Tap *taps = (Fl_Resample_Tap*)malloc(dst * (sizeof(Fl_Resample_Tap) + max * sizeof(float)));
+	float *weight = (float*)(taps + dst);
+	int most = 1;
+	for (int i = 0; i < dst; i++, weight += max) {
+		Fl_Resample_Tap &t = taps[i];
+		t.weight = weight;
+		if (method == fltk3::RGB_SCALING_AREA) {
+			// the part of each source pixel that the new pixel covers
+			double x0 = i * scale, x1 = (i + 1) * scale;
+			t.first = (int)x0;
+			t.n = 0;
+			for (int s = t.first; s < x1 && s < src; s++) {
+				double a = s < x0 ? x0 : s, b = s + 1 > x1 ? x1 : s + 1;
+				weight[t.n++] = float((b - a) / scale);
+			}
+		} else {
+			// pixel centers are at .5
+			double x = (i + 0.5) * scale - 0.5;
+			if (x < 0) x = 0;
+			t.first = (int)x;
+			if (t.first >= src - 1) {
+				t.first = src - 1;
+				t.n = 1;
+				weight[0] = 1;
+			} else {
+				t.n = 2;
+				weight[1] = float(x - t.first);
+				weight[0] = 1 - weight[1];
+			}
+		}
+		if (t.n > most) most = t.n;
+	}
+	max = most;
+	return taps;
+}
+
+static void resample_load(const uchar *p, int w, int d, float *f)
+{
+	switch (d) {
+	case 1:
+		for (; w--; p += 1, f += 4) {
+			f[0] = p[0];
+			f[1] = f[2] = f[3] = 0;
+		}
+		break;
+	case 2:
+		for (; w--; p += 2, f += 4) {
+			float a = p[1] / 255.0f;
+			f[0] = p[0] * a;
+			f[1] = p[1];
+			f[2] = f[3] = 0;
+		}
+		break;
+	case 3:
+		for (; w--; p += 3, f += 4) {
+			f[0] = p[0];
+			f[1] = p[1];
+			f[2] = p[2];
+			f[3] = 0;
+		}
+		break;
+	default:
+		for (; w--; p += 4, f += 4) {
+			float a = p[3] / 255.0f;
+			f[0] = p[0] * a;
+			f[1] = p[1] * a;
+			f[2] = p[2] * a;
+			f[3] = p[3];
+		}
+		break;
+	}
+}
+
+static void resample_store(const float *f, int W, int d, uchar *p)
+{
+	int alpha = d & 1 ? d : d - 1;	// d for no alpha channel
+#if RESAMPLE_SSE2
+	const __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+	const __m128 is_alpha = _mm_castsi128_ps(_mm_cmpeq_epi32(lane, _mm_set1_epi32(alpha)));
+	const __m128 one = _mm_set1_ps(1);
+	for (; W--; f += 4, p += d) {
+		__m128 v = _mm_loadu_ps(f);
+		if (alpha < d) {
+			float s = f[alpha] > 0 ? 255 / f[alpha] : 0;
+			v = _mm_mul_ps(v, _mm_or_ps(_mm_and_ps(is_alpha, one), _mm_andnot_ps(is_alpha, _mm_set1_ps(s))));
+		}
+		__m128i i = _mm_cvtps_epi32(v);
+		i = _mm_packus_epi16(_mm_packs_epi32(i, i), i);
+		unsigned pixel = (unsigned)_mm_cvtsi128_si32(i);
+		for (int c = 0; c < d; c++, pixel >>= 8) p[c] = uchar(pixel);
+	}
+#else
+	for (; W--; f += 4, p += d) {
+		float s = 1;	// undoes the multiplication by alpha
+		if (alpha < d) s = f[alpha] > 0 ? 255 / f[alpha] : 0;
+		for (int c = 0; c < d; c++) {
+			float v = c == alpha ? f[c] : f[c] * s;
+			p[c] = v <= 0 ? 0 : v >= 255 ? 255 : uchar(v + 0.5f);
+		}
+	}
+#endif
+}
+
+// resamples a line across
+static void resample_line(const float *from, const Fl_Resample_Tap *taps, int W, float *to)
+{
+	for (int x = 0; x < W; x++, to += 4) {
+		const Fl_Resample_Tap &t = taps[x];
+		const float *f = from + 4 * t.first;
+#if RESAMPLE_SSE2
+		__m128 sum = _mm_setzero_ps();
+		for (int k = 0; k < t.n; k++, f += 4)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(f), _mm_set1_ps(t.weight[k])));
+		_mm_storeu_ps(to, sum);
+#else
+		to[0] = to[1] = to[2] = to[3] = 0;
+		for (int k = 0; k < t.n; k++, f += 4)
+			for (int c = 0; c < 4; c++) to[c] += f[c] * t.weight[k];
+#endif
+	}
+}
+
+// mixes the resampled source lines of one new line
+static void resample_lines(const float * const *lines, const Fl_Resample_Tap &t, int n, float *to)
+{
+#if RESAMPLE_SSE2
+	const __m128 w0 = _mm_set1_ps(t.weight[0]);
+	for (int i = 0; i < n; i += 4)
+		_mm_storeu_ps(to + i, _mm_mul_ps(_mm_loadu_ps(lines[0] + i), w0));
+	for (int k = 1; k < t.n; k++) {
+		const __m128 wk = _mm_set1_ps(t.weight[k]);
+		const float *f = lines[k];
+		for (int i = 0; i < n; i += 4)
+			_mm_storeu_ps(to + i, _mm_add_ps(_mm_loadu_ps(to + i), _mm_mul_ps(_mm_loadu_ps(f + i), wk)));
+	}
+#else
+	for (int i = 0; i < n; i++) to[i] = lines[0][i] * t.weight[0];
+	for (int k = 1; k < t.n; k++)
+		for (int i = 0; i < n; i++) to[i] += lines[k][i] * t.weight[k];
+#endif
+}
+
+static void *resample_band(void *arg)
+{
+	Fl_Resample *r = (Fl_Resample*)arg;
+	int n = 4 * r->W;
+	// the last ny resampled source lines, line y is at y % ny
+	float *ring = (float*)malloc((size_t)r->ny * n * sizeof(float));
+	const float **lines = (const float**)malloc(r->ny * sizeof(float*));
+	float *line = (float*)malloc(4 * r->w * sizeof(float));
+	float *mixed = (float*)malloc(n * sizeof(float));
+	int next = 0;	// next source line to resample
+	for (int y = r->y0; y < r->y1; y++) {
+		const Fl_Resample_Tap &t = r->ytaps[y];
+		if (next < t.first) next = t.first;
+		for (; next < t.first + t.n; next++) {
+			resample_load(r->array + (size_t)next * r->ld, r->w, r->d, line);
+			resample_line(line, r->xtaps, r->W, ring + (size_t)(next % r->ny) * n);
+		}
+		for (int k = 0; k < t.n; k++) lines[k] = ring + (size_t)((t.first + k) % r->ny) * n;
+		resample_lines(lines, t, n, mixed);
+		resample_store(mixed, r->W, r->d, r->to + (size_t)y * r->W * r->d);
+	}
+	free(mixed);
+	free(line);
+	free(lines);
+	free(ring);
+	return NULL;
+}
+
+static void resample(const uchar *array, int w, int h, int d, int ld,
+                     uchar *to, int W, int H, fltk3::RGBScaling method)
+{
+	Fl_Resample r;
+	int nx;
+	r.array = array;
+	r.w = w;
+	r.h = h;
+	r.d = d;
+	r.ld = ld;
+	r.to = to;
+	r.W = W;
+	r.H = H;
+	r.xtaps = resample_taps(w, W, method, nx);
+	r.ytaps = resample_taps(h, H, method, r.ny);
+	r.y0 = 0;
+	r.y1 = H;
+#if HAVE_PTHREAD
+	// split large images into bands of new lines
+	long threads = 1;
+	if ((double)w * h + (double)W * H >= RESAMPLE_MINIMUM) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads > RESAMPLE_THREADS) threads = RESAMPLE_THREADS;
+		if (threads > H) threads = H;
+	}
+	if (threads > 1) {
+		Fl_Resample band[RESAMPLE_THREADS];
+		pthread_t thread[RESAMPLE_THREADS];
+		bool started[RESAMPLE_THREADS];
+		for (int i = 0; i < threads; i++) {
+			band[i] = r;
+			band[i].y0 = (int)(H * i / threads);
+			band[i].y1 = (int)(H * (i + 1) / threads);
+			started[i] = i && !pthread_create(thread + i, NULL, resample_band, band + i);
+		}
+		resample_band(band);
+		for (int i = 1; i < threads; i++) {
+			if (started[i]) pthread_join(thread[i], NULL);
+			else resample_band(band + i);
+		}
+	} else
+#endif // HAVE_PTHREAD
+		resample_band(&r);
+	free(r.ytaps);
+	free(r.xtaps);
+}
+
 fltk3::Image *fltk3::ImageRGB::copy(int W, int H)
+{
+	return copy(W, H, scaling_);
+}
+
+/**
+ Creates a copy of the image resized to W by H pixels, resampled with the
+ given method rather than the one set with scaling(fltk3::RGBScaling).
+ */
+fltk3::Image *fltk3::ImageRGB::copy(int W, int H, fltk3::RGBScaling method)
 {
 	fltk3::ImageRGB	*new_image;	// New RGB image
 	uchar		*new_array;	// New array for image data
@@ -249,6 +526,15 @@ fltk3::Image *fltk3::ImageRGB::copy(int W, int H)
 	}
 	if (W <= 0 || H <= 0) return 0;
 
+	if (method != fltk3::RGB_SCALING_NEAREST) {
+		new_array = new uchar [W * H * d()];
+		resample(array, w(), h(), d(), ld() ? ld() : w() * d(), new_array, W, H, method);
+		new_image = new fltk3::ImageRGB(new_array, W, H, d());
+		new_image->alloc_array = 1;
+
+		return new_image;
+	}
+
 	// OK, need to resize the image data; allocate memory and
 	uchar		*new_ptr;	// Pointer into new array
 	const uchar	*old_ptr;	// Pointer into old array
@@ -456,6 +742,45 @@ static void alpha_blend(fltk3::ImageRGB *img, int X, int Y, int W, int H, int cx
 
 	delete[] dst;
 }
+
+#if HAVE_XRENDER
+// Uploads an image with alpha once as a premultiplied ARGB picture, which
+// the server then composites without reading the window back.
+static Picture create_alpha_picture(fltk3::ImageRGB *img)
+{
+	int w = img->w(), h = img->h(), d = img->d();
+	int ld = img->ld();
+	if (ld == 0) ld = w * d;
+	XRenderPictFormat *format = XRenderFindStandardFormat(fl_display, PictStandardARGB32);
+	Pixmap pixmap = XCreatePixmap(fl_display, RootWindow(fl_display, fl_screen), w, h, 32);
+	Picture picture = XRenderCreatePicture(fl_display, pixmap, format, 0, 0);
+
+	unsigned *data = (unsigned*)malloc(w * h * 4);
+	unsigned *dstptr = data;
+	for (int y = 0; y < h; y++) {
+		const uchar *srcptr = img->array + y * ld;
+		for (int x = w; x > 0; x--, srcptr += d) {
+			unsigned r = srcptr[0], g = r, b = r, a = srcptr[d - 1];
+			if (d == 4) {
+				g = srcptr[1];
+				b = srcptr[2];
+			}
+			*dstptr++ = (a << 24) | (((r * a + 127) / 255) << 16) |
+			            (((g * a + 127) / 255) << 8) | ((b * a + 127) / 255);
+		}
+	}
+	// the pixels are in the byte order of the client, XPutImage() swaps them if needed
+	XImage *xi = XCreateImage(fl_display, NULL, 32, ZPixmap, 0, (char*)data, w, h, 32, 0);
+	static const int one = 1;
+	xi->byte_order = *(const char*)&one ? LSBFirst : MSBFirst;
+	GC gc = XCreateGC(fl_display, pixmap, 0, 0);
+	XPutImage(fl_display, pixmap, gc, xi, 0, 0, 0, 0, w, h);
+	XFreeGC(fl_display, gc);
+	XDestroyImage(xi); // frees data
+	XFreePixmap(fl_display, pixmap); // the picture keeps it
+	return picture;
+}
+#endif // HAVE_XRENDER
 #endif // !WIN32 && !__APPLE_QUARTZ__
 
 void fltk3::ImageRGB::draw(int XP, int YP, int WP, int HP, int cx, int cy)
@@ -588,6 +913,7 @@ void fltk3::GDIGraphicsDriver::draw(fltk3::ImageRGB *img, int XP, int YP, int WP
 #else
 void fltk3::XlibGraphicsDriver::draw(fltk3::ImageRGB *img, int XP, int YP, int WP, int HP, int cx, int cy)
 {
+	fl_flush_text();
 	int X, Y, W, H;
 	// Don't draw an empty image...
 	if (!img->d() || !img->array) {
@@ -607,7 +933,24 @@ void fltk3::XlibGraphicsDriver::draw(fltk3::ImageRGB *img, int XP, int YP, int W
 			fltk3::pop_origin();
 			fl_end_offscreen();
 		}
+#if HAVE_XRENDER
+		else if (can_do_alpha_blending()) {
+			img->id_ = create_alpha_picture(img);
+		}
+#endif
+	}
+#if HAVE_XRENDER
+	if (img->id_ && (img->d() == 2 || img->d() == 4)) {
+		Picture dst = XRenderCreatePicture(fl_display, fl_window,
+		                                   XRenderFindVisualFormat(fl_display, fl_visual->visual), 0, 0);
+		fltk3::Region r = fltk3::clip_region();
+		if (r) XRenderSetPictureClipRegion(fl_display, dst, r);
+		XRenderComposite(fl_display, PictOpOver, img->id_, None, dst, cx, cy, 0, 0,
+		                 X+origin_x(), Y+origin_y(), W, H);
+		XRenderFreePicture(fl_display, dst);
+		return;
 	}
+#endif
 	if (img->id_) {
 		if (img->mask_) {
 			// I can't figure out how to combine a mask with existing region,
@@ -31,10 +31,12 @@
 #include "MenuItem.h"
 #include "draw.h"
 #include "ask.h"
+#include "Device.h"
 #include <math.h>
 #include "utf8.h"
 #include "flstring.h"
 #include <stdlib.h>
+#include <limits.h>
 #include <ctype.h>
 
 #define MAXBUF 1024
@@ -170,6 +172,84 @@ double fltk3::Input_::expandpos(
 
 ////////////////////////////////////////////////////////////////
 
+/*
+ The start and end index of each displayed line, as returned by expand().
+ Lines are measured from the start of the text on demand, so only the lines
+ up to the one that is needed cost any fltk3::width() calls. The cache is
+ cleared when the font, size, wrap width, type or drawing surface change.
+ */
+class fltk3::InputLineCache
+{
+public:
+	int *mStart, *mEnd;	/* start and end index of each measured line */
+	int mN, mAllocated;	/* number of measured lines, size of the arrays */
+	int mComplete;		/* the last measured line ends the text */
+	fltk3::Font mFont;	/* layout settings the lines were measured with */
+	fltk3::Fontsize mSize;
+	int mWrap, mType;
+	fltk3::SurfaceDevice *mSurface;
+
+	InputLineCache() : mStart(0), mEnd(0), mN(0), mAllocated(0), mComplete(0),
+		mFont(0), mSize(0), mWrap(0), mType(-1), mSurface(0) {}
+	~InputLineCache() {
+		free(mStart);
+		free(mEnd);
+	}
+
+	void clear() {
+		mN = 0;
+		mComplete = 0;
+	}
+
+	/* Clear the cache if it was measured with other settings. */
+	void check(fltk3::Font font, fltk3::Fontsize size, int wrap, int type) {
+		fltk3::SurfaceDevice *surface = fltk3::SurfaceDevice::surface();
+		if (font == mFont && size == mSize && wrap == mWrap && type == mType
+		    && surface == mSurface) return;
+		mFont = font;
+		mSize = size;
+		mWrap = wrap;
+		mType = type;
+		mSurface = surface;
+		clear();
+	}
+
+	void add(int start, int end) {
+		if (mN == mAllocated) {
+			mAllocated = mAllocated ? 2*mAllocated : 64;
+			mStart = (int*)realloc(mStart, mAllocated*sizeof(int));
+			mEnd = (int*)realloc(mEnd, mAllocated*sizeof(int));
+		}
+		mStart[mN] = start;
+		mEnd[mN] = end;
+		mN++;
+	}
+
+	/* Return the first measured line that ends at or after pos, or the last one. */
+	int find(int pos) const {
+		int lo = 0, hi = mN-1;
+		while (lo < hi) {
+			int mid = (lo+hi)/2;
+			if (mEnd[mid] < pos) lo = mid+1;
+			else hi = mid;
+		}
+		return lo;
+	}
+
+	/* Return the number of lines starting in [start, end], or -1 if they
+	 are not all measured yet. */
+	int count(int start, int end) const {
+		if (!mN || (mEnd[mN-1] < end && !mComplete)) return -1;
+		return find(end)-find(start)+1;
+	}
+
+	/* Drop all lines that do not end before pos. */
+	void invalidate(int pos) {
+		if (mN && mEnd[mN-1] >= pos) mN = find(pos);
+		mComplete = 0;
+	}
+};
+
 /** \internal
   Marks a range of characters for update.
 
@@ -186,15 +266,7 @@ double fltk3::Input_::expandpos(
 */
 void fltk3::Input_::minimal_update(int p)
 {
-	if (damage() & fltk3::DAMAGE_ALL) return; // don't waste time if it won't be done
-	if (damage() & fltk3::DAMAGE_EXPOSE) {
-		if (p < mu_p) mu_p = p;
-	} else {
-		mu_p = p;
-	}
-
-	damage(fltk3::DAMAGE_EXPOSE);
-	erase_cursor_only = 0;
+	minimal_update(p, INT_MAX, 0, -1);
 }
 
 /** \internal
@@ -208,8 +280,45 @@ void fltk3::Input_::minimal_update(int p)
 */
 void fltk3::Input_::minimal_update(int p, int q)
 {
-	if (q < p) p = q;
-	minimal_update(p);
+	if (q < p) {
+		int t = p;
+		p = q;
+		q = t;
+	}
+	minimal_update(p, q, 0, -1);
+}
+
+/** \internal
+  Marks an edited range of characters for update.
+
+  Characters from \p p to \p q are redrawn. If the paragraph that
+  starts at \p para and ends at \p q had \p nLines displayed lines
+  before the edit and still has as many when it is drawn, the lines
+  after it did not move and are not redrawn either. A negative
+  \p nLines means that the edit did not change the line layout.
+
+  \param [in] p start of update range
+  \param [in] q end of update range, INT_MAX for the end of the buffer
+  \param [in] para start of the edited paragraph
+  \param [in] nLines number of lines of the paragraph before the edit
+*/
+void fltk3::Input_::minimal_update(int p, int q, int para, int nLines)
+{
+	if (damage() & fltk3::DAMAGE_ALL) return; // don't waste time if it won't be done
+	if (damage() & fltk3::DAMAGE_EXPOSE) {
+		if (p < mu_p) mu_p = p;
+		// two edits can't be checked against one paragraph:
+		if (nLines >= 0 || mu_lines >= 0) mu_q = INT_MAX;
+		else if (q > mu_q) mu_q = q;
+	} else {
+		mu_p = p;
+		mu_q = q;
+		mu_para = para;
+		mu_lines = nLines;
+	}
+
+	damage(fltk3::DAMAGE_EXPOSE);
+	erase_cursor_only = 0;
 }
 
 ////////////////////////////////////////////////////////////////
@@ -228,6 +337,59 @@ void fltk3::Input_::setfont() const
 	fltk3::font(textfont(), textsize());
 }
 
+/** \internal
+  Returns the line cache.
+
+  The cache is cleared first if the lines were measured with a different
+  font, size, wrap width, input type or drawing surface.
+*/
+fltk3::InputLineCache *fltk3::Input_::line_cache() const
+{
+	lines_->check(textfont(), textsize(),
+	              wrap() ? w() - fltk3::box_dw(box()) - 2 : 0, type());
+	return lines_;
+}
+
+/** \internal
+  Measures the displayed lines.
+
+  Lines are measured with expand() after the last cached one until the line
+  that contains index \p pos or line number \p n is known, or the text ends.
+  A line that ends at a newline or a wrapping space is followed by a line
+  that starts after it, otherwise the next line starts where it ends.
+  The current font must be set with setfont().
+
+  \param [in] pos index that must be covered by the measured lines
+  \param [in] n line number that must be measured
+*/
+void fltk3::Input_::measure_lines(int pos, int n) const
+{
+	fltk3::InputLineCache *c = line_cache();
+	char buf[MAXBUF];
+	while (!c->mComplete && c->mN <= n && (!c->mN || c->mEnd[c->mN-1] < pos)) {
+		int i = 0;
+		if (c->mN) {
+			i = c->mEnd[c->mN-1];
+			if (value_[i] == '\n' || value_[i] == ' ') i++;
+		}
+		const char *e = expand(value_+i, buf);
+		c->add(i, (int)(e-value_));
+		if (e >= value_+size_) c->mComplete = 1;
+	}
+}
+
+/** \internal
+  Finds the displayed line containing a given index.
+  The current font must be set with setfont().
+  \param [in] i index into the text
+  \return line number, the last line if \p i is past the end of the text
+*/
+int fltk3::Input_::line_of(int i) const
+{
+	measure_lines(i, INT_MAX);
+	return lines_->find(i);
+}
+
 /**
   Draws the text in the passed bounding box.
 
@@ -264,39 +426,33 @@ void fltk3::Input_::drawtext(int X, int Y, int W, int H)
 	const char *p, *e;
 	char buf[MAXBUF];
 
-	// count how many lines and put the last one into the buffer:
-	// And figure out where the cursor is:
+	// figure out where the cursor is:
 	int height = fltk3::height();
 	int threshold = height/2;
-	int lines;
 	int curx, cury;
-	for (p=value(), curx=cury=lines=0; ;) {
-		e = expand(p, buf);
-		if (position() >= p-value() && position() <= e-value()) {
-			curx = int(expandpos(p, value()+position(), buf, 0)+.5);
-			if (fltk3::focus()==this && !was_up_down) up_down_pos = curx;
-			cury = lines*height;
-			int newscroll = xscroll_;
-			if (curx > newscroll+W-threshold) {
-				// figure out scrolling so there is space after the cursor:
-				newscroll = curx+threshold-W;
-				// figure out the furthest left we ever want to scroll:
-				int ex = int(expandpos(p, e, buf, 0))+4-W;
-				// use minimum of both amounts:
-				if (ex < newscroll) newscroll = ex;
-			} else if (curx < newscroll+threshold) {
-				newscroll = curx-threshold;
-			}
-			if (newscroll < 0) newscroll = 0;
-			if (newscroll != xscroll_) {
-				xscroll_ = newscroll;
-				mu_p = 0;
-				erase_cursor_only = 0;
-			}
-		}
-		lines++;
-		if (e >= value_+size_) break;
-		p = e+1;
+	int curline = line_of(position());
+	p = value() + lines_->mStart[curline];
+	e = expand(p, buf);
+	curx = int(expandpos(p, value()+position(), buf, 0)+.5);
+	if (fltk3::focus()==this && !was_up_down) up_down_pos = curx;
+	cury = curline*height;
+	int newscroll = xscroll_;
+	if (curx > newscroll+W-threshold) {
+		// figure out scrolling so there is space after the cursor:
+		newscroll = curx+threshold-W;
+		// figure out the furthest left we ever want to scroll:
+		int ex = int(expandpos(p, e, buf, 0))+4-W;
+		// use minimum of both amounts:
+		if (ex < newscroll) newscroll = ex;
+	} else if (curx < newscroll+threshold) {
+		newscroll = curx-threshold;
+	}
+	if (newscroll < 0) newscroll = 0;
+	if (newscroll != xscroll_) {
+		xscroll_ = newscroll;
+		mu_p = 0;
+		mu_q = INT_MAX;
+		erase_cursor_only = 0;
 	}
 
 	// adjust the scrolling:
@@ -308,6 +464,7 @@ void fltk3::Input_::drawtext(int X, int Y, int W, int H)
 		if (newy != yscroll_) {
 			yscroll_ = newy;
 			mu_p = 0;
+			mu_q = INT_MAX;
 			erase_cursor_only = 0;
 		}
 	} else {
@@ -317,21 +474,31 @@ void fltk3::Input_::drawtext(int X, int Y, int W, int H)
 	fltk3::push_clip(X, Y, W, H);
 	fltk3::Color tc = active_r() ? textcolor() : fltk3::inactive(textcolor());
 
-	p = value();
-	// visit each line and draw it:
+	// visit each visible line and draw it:
 	int desc = height-fltk3::descent();
 	float xpos = (float)(X - xscroll_ + 1);
-	int ypos = -yscroll_;
-	for (; ypos < H;) {
-
-		// re-expand line unless it is the last one calculated above:
-		if (lines>1) e = expand(p, buf);
-
-		if (ypos <= -height) goto CONTINUE; // clipped off top
+	int line = yscroll_ > 0 ? yscroll_/height : 0;
+	int ypos = line*height - yscroll_;
+	int mu_clean = -1; // lines after mu_q need no redraw, -1 if not known yet
+	for (; ypos < H; line++) {
+
+		measure_lines(INT_MAX, line);
+		if (line >= lines_->mN) { // scrolled past the last line
+			p = value() + lines_->mStart[lines_->mN-1];
+			ypos = lines_->mN*height - yscroll_;
+			break;
+		}
+		p = value() + lines_->mStart[line];
+		e = expand(p, buf);
 
 		if (do_mu) {	// for minimal update:
 			const char* pp = value()+mu_p; // pointer to where minimal update starts
 			if (e < pp) goto CONTINUE2; // this line is before the changes
+			if (p-value() > mu_q) { // this line is after the changes
+				if (mu_clean < 0)
+					mu_clean = mu_lines < 0 || lines_->count(mu_para, mu_q) == mu_lines;
+				if (mu_clean) goto CONTINUE2;
+			}
 			if (readonly()) erase_cursor_only = 0; // this isn't the most efficient way
 			if (erase_cursor_only && p > pp) goto CONTINUE2; // this line is after
 			// calculate area to erase:
@@ -423,15 +590,12 @@ CONTINUE2:
 #endif
 		}
 
-CONTINUE:
 		ypos += height;
 		if (e >= value_+size_) break;
-		if (*e == '\n' || *e == ' ') e++;
-		p = e;
 	}
 
 	// for minimal update, erase all lines below last one if necessary:
-	if (input_type()==fltk3::MULTILINE_INPUT && do_mu && ypos<H
+	if (input_type()==fltk3::MULTILINE_INPUT && do_mu && ypos<H && mu_clean <= 0
 	    && (!erase_cursor_only || p <= value()+mu_p)) {
 		if (ypos < 0) ypos = 0;
 		fltk3::push_clip(X, Y+ypos, W, H-ypos);
@@ -509,18 +673,10 @@ int fltk3::Input_::line_end(int i) const
 	if (input_type() != fltk3::MULTILINE_INPUT) return size();
 
 	if (wrap()) {
-		// go to the start of the paragraph:
-		int j = i;
-		while (j > 0 && index(j-1) != '\n') j--;
-		// now measure lines until we get past i, end of that line is real eol:
+		// the end of the displayed line is the real eol:
 		setfont();
-		for (const char* p=value()+j; ;) {
-			char buf[MAXBUF];
-			p = expand(p, buf);
-			int k = (int)(p - value());
-			if (k >= i) return k;
-			p++;
-		}
+		int line = line_of(i);
+		return lines_->mEnd[line];
 	} else {
 		while (i < size() && index(i) != '\n') i++;
 		return i;
@@ -539,18 +695,15 @@ int fltk3::Input_::line_end(int i) const
 int fltk3::Input_::line_start(int i) const
 {
 	if (input_type() != fltk3::MULTILINE_INPUT) return 0;
-	int j = i;
-	while (j > 0 && index(j-1) != '\n') j--;
 	if (wrap()) {
-		// now measure lines until we get past i, start of that line is real eol:
+		// the start of the displayed line is the real bol:
 		setfont();
-		for (const char* p=value()+j; ;) {
-			char buf[MAXBUF];
-			const char* e = expand(p, buf);
-			if ( (int)(e-value()) >= i) return (int)(p-value());
-			p = e+1;
-		}
-	} else return j;
+		int line = line_of(i);
+		return lines_->mStart[line];
+	}
+	int j = i;
+	while (j > 0 && index(j-1) != '\n') j--;
+	return j;
 }
 
 
@@ -635,13 +788,11 @@ void fltk3::Input_::handle_mouse(int X, int Y, int /*W*/, int /*H*/, int drag)
 	              (fltk3::event_y()-Y+yscroll_)/fltk3::height() : 0;
 
 	int newpos = 0;
-	for (p=value();; ) {
-		e = expand(p, buf);
-		theline--;
-		if (theline < 0) break;
-		if (e >= value_+size_) break;
-		p = e+1;
-	}
+	if (theline < 0) theline = 0;
+	measure_lines(INT_MAX, theline);
+	if (theline >= lines_->mN) theline = lines_->mN-1;
+	p = value() + lines_->mStart[theline];
+	e = expand(p, buf);
 	const char *l, *r, *t;
 	double f0 = fltk3::event_x()-X+xscroll_;
 	for (l = p, r = e; l<r; ) {
@@ -917,6 +1068,18 @@ int fltk3::Input_::replace(int b, int e, const char* text, int ilen)
 		if (ilen < 0) ilen = 0;
 	}
 
+	// count the lines of the edited paragraphs, see minimal_update():
+	int para = 0, paraEnd = size_;
+	if (input_type() == fltk3::MULTILINE_INPUT) {
+		para = b;
+		paraEnd = e;
+		while (para > 0 && value_[para-1] != '\n') para--;
+		while (paraEnd < size_ && value_[paraEnd] != '\n') paraEnd++;
+	}
+	int nLines = line_cache()->count(para, paraEnd);
+	if (mark_ > paraEnd || position_ > paraEnd) nLines = -1;
+	paraEnd += ilen-(e-b);
+
 	put_in_buffer(size_+ilen);
 
 	if (e>b) {
@@ -957,6 +1120,7 @@ int fltk3::Input_::replace(int b, int e, const char* text, int ilen)
 		size_ += ilen;
 	}
 	undowidget = this;
+	lines_->invalidate(para);
 	om = mark_;
 	op = position_;
 	mark_ = position_ = undoat = b+ilen;
@@ -981,7 +1145,9 @@ int fltk3::Input_::replace(int b, int e, const char* text, int ilen)
 	if (om < b) b = om;
 	if (op < b) b = op;
 
-	minimal_update(b);
+	// lines after the edited paragraphs only move if their line count changed:
+	if (nLines < 0) minimal_update(b);
+	else minimal_update(b, paraEnd, para, nLines);
 
 	mark_ = position_ = undoat;
 
@@ -1030,6 +1196,11 @@ int fltk3::Input_::undo()
 	mark_ = b /* -ilen */;
 	position_ = b;
 
+	if (input_type() == fltk3::MULTILINE_INPUT) {
+		int para = b1;
+		while (para > 0 && value_[para-1] != '\n') para--;
+		lines_->invalidate(para);
+	} else lines_->clear();
 	if (wrap())
 		while (b1 > 0 && index(b1)!='\n') b1--;
 	minimal_update(b1);
@@ -1219,6 +1390,11 @@ fltk3::Input_::Input_(int X, int Y, int W, int H, const char* l)
 	buffer  = 0;
 	value_ = "";
 	xscroll_ = yscroll_ = 0;
+	mu_p = 0;
+	mu_q = INT_MAX;
+	mu_para = 0;
+	mu_lines = -1;
+	lines_ = new fltk3::InputLineCache;
 	maximum_size_ = 32767;
 	shortcut_ = 0;
 	set_flag(SHORTCUT_LABEL);
@@ -1296,6 +1472,7 @@ int fltk3::Input_::static_value(const char* str, int len)
 	if (len) { // non-empty new value:
 		if (xscroll_ || yscroll_) {
 			xscroll_ = yscroll_ = 0;
+			lines_->clear();
 			minimal_update(0);
 		} else {
 			int i = 0;
@@ -1304,6 +1481,10 @@ int fltk3::Input_::static_value(const char* str, int len)
 				for (; i<size_ && i<len && str[i]==value_[i]; i++);
 				if (i==size_ && i==len) return 0;
 			}
+			int para = 0;
+			if (input_type() == fltk3::MULTILINE_INPUT)
+				for (para = i; para > 0 && str[para-1] != '\n'; para--);
+			lines_->invalidate(para);
 			minimal_update(i);
 		}
 		value_ = str;
@@ -1313,6 +1494,7 @@ int fltk3::Input_::static_value(const char* str, int len)
 		size_ = 0;
 		value_ = "";
 		xscroll_ = yscroll_ = 0;
+		lines_->clear();
 		minimal_update(0);
 	}
 	position(readonly() ? 0 : size());
@@ -1399,6 +1581,7 @@ fltk3::Input_::~Input_()
 {
 	if (undowidget == this) undowidget = 0;
 	if (bufsize) free((void*)buffer);
+	delete lines_;
 }
 
 /** \internal
@@ -277,6 +277,8 @@ static Fl_Font_Descriptor* find(int fnum, int size)
 // Public interface:
 
 void *fl_xftfont = 0;
+int fl_text_batch = 0; // core fonts are drawn right away
+void fl_draw_text_batch() {}
 static GC font_gc;
 
 XFontStruct* Fl_XFont_On_Demand::value()
@@ -66,43 +66,51 @@
 #include <X11/Xft/Xft.h>
 
 #include <math.h>
+#include <sys/stat.h>
+#if HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+#include "text_scan.h"
+#include "filename.h"
+#include "utf8.h"
 
-// The predefined fonts that FLTK has:
+// The predefined fonts that FLTK has; the other members are filled in when
+// a font is first used:
 static Fl_Fontdesc built_in_table[] = {
 #if 1
-	{" sans"},
-	{"Bsans"},
-	{"Isans"},
-	{"Psans"},
-	{" mono"},
-	{"Bmono"},
-	{"Imono"},
-	{"Pmono"},
-	{" serif"},
-	{"Bserif"},
-	{"Iserif"},
-	{"Pserif"},
-	{" symbol"},
-	{" screen"},
-	{"Bscreen"},
-	{" zapf dingbats"},
+	{" sans", "", 0, 0, 0, 0, 0},
+	{"Bsans", "", 0, 0, 0, 0, 0},
+	{"Isans", "", 0, 0, 0, 0, 0},
+	{"Psans", "", 0, 0, 0, 0, 0},
+	{" mono", "", 0, 0, 0, 0, 0},
+	{"Bmono", "", 0, 0, 0, 0, 0},
+	{"Imono", "", 0, 0, 0, 0, 0},
+	{"Pmono", "", 0, 0, 0, 0, 0},
+	{" serif", "", 0, 0, 0, 0, 0},
+	{"Bserif", "", 0, 0, 0, 0, 0},
+	{"Iserif", "", 0, 0, 0, 0, 0},
+	{"Pserif", "", 0, 0, 0, 0, 0},
+	{" symbol", "", 0, 0, 0, 0, 0},
+	{" screen", "", 0, 0, 0, 0, 0},
+	{"Bscreen", "", 0, 0, 0, 0, 0},
+	{" zapf dingbats", "", 0, 0, 0, 0, 0},
 #else
-	{" helvetica"},
-	{"Bhelvetica"},
-	{"Ihelvetica"},
-	{"Phelvetica"},
-	{" courier"},
-	{"Bcourier"},
-	{"Icourier"},
-	{"Pcourier"},
-	{" times"},
-	{"Btimes"},
-	{"Itimes"},
-	{"Ptimes"},
-	{" symbol"},
-	{" lucidatypewriter"},
-	{"Blucidatypewriter"},
-	{" zapf dingbats"},
+	{" helvetica", "", 0, 0, 0, 0, 0},
+	{"Bhelvetica", "", 0, 0, 0, 0, 0},
+	{"Ihelvetica", "", 0, 0, 0, 0, 0},
+	{"Phelvetica", "", 0, 0, 0, 0, 0},
+	{" courier", "", 0, 0, 0, 0, 0},
+	{"Bcourier", "", 0, 0, 0, 0, 0},
+	{"Icourier", "", 0, 0, 0, 0, 0},
+	{"Pcourier", "", 0, 0, 0, 0, 0},
+	{" times", "", 0, 0, 0, 0, 0},
+	{"Btimes", "", 0, 0, 0, 0, 0},
+	{"Itimes", "", 0, 0, 0, 0, 0},
+	{"Ptimes", "", 0, 0, 0, 0, 0},
+	{" symbol", "", 0, 0, 0, 0, 0},
+	{" lucidatypewriter", "", 0, 0, 0, 0, 0},
+	{"Blucidatypewriter", "", 0, 0, 0, 0, 0},
+	{" zapf dingbats", "", 0, 0, 0, 0, 0},
 #endif
 };
 
@@ -113,6 +121,57 @@ void *fl_xftfont = 0;
 //const char* fl_encoding_ = "iso8859-1";
 const char* fl_encoding_ = "iso10646-1";
 
+// All font descriptors by (font, size, angle). The lists of the fltk3::fonts
+// entries are only walked to delete them.
+static Fl_Font_Descriptor **desc_table;
+static int desc_table_size, desc_count;
+
+static unsigned desc_hash(fltk3::Font fnum, fltk3::Fontsize size, int angle)
+{
+	return ((unsigned)fnum * 0x9e3779b1u) ^ ((unsigned)size * 0x85ebca6bu) ^ (unsigned)angle;
+}
+
+static Fl_Font_Descriptor *fl_xft_find(fltk3::Font fnum, fltk3::Fontsize size, int angle)
+{
+	if (!desc_table) return NULL;
+	Fl_Font_Descriptor *f = desc_table[desc_hash(fnum, size, angle) & (desc_table_size - 1)];
+	while (f && (f->fnum != fnum || f->size != size || f->angle != angle)) f = f->hash_next;
+	return f;
+}
+
+static void fl_xft_insert(Fl_Font_Descriptor *f)
+{
+	if (desc_count >= desc_table_size) {
+		int size = desc_table_size ? 2 * desc_table_size : 64;
+		Fl_Font_Descriptor **t = (Fl_Font_Descriptor**)calloc(size, sizeof(Fl_Font_Descriptor*));
+		for (int i = 0; i < desc_table_size; i++) {
+			for (Fl_Font_Descriptor *g = desc_table[i], *n; g; g = n) {
+				n = g->hash_next;
+				Fl_Font_Descriptor *&slot = t[desc_hash(g->fnum, g->size, g->angle) & (size - 1)];
+				g->hash_next = slot;
+				slot = g;
+			}
+		}
+		free(desc_table);
+		desc_table = t;
+		desc_table_size = size;
+	}
+	Fl_Font_Descriptor *&slot = desc_table[desc_hash(f->fnum, f->size, f->angle) & (desc_table_size - 1)];
+	f->hash_next = slot;
+	slot = f;
+	desc_count++;
+}
+
+static void fl_xft_remove(Fl_Font_Descriptor *f)
+{
+	if (!desc_table) return;
+	Fl_Font_Descriptor **p = desc_table + (desc_hash(f->fnum, f->size, f->angle) & (desc_table_size - 1));
+	while (*p && *p != f) p = &(*p)->hash_next;
+	if (!*p) return;
+	*p = f->hash_next;
+	desc_count--;
+}
+
 static void fl_xft_font(fltk3::XlibGraphicsDriver *driver, fltk3::Font fnum, fltk3::Fontsize size, int angle)
 {
 	if (fnum==-1) { // special case to stop font caching
@@ -125,14 +184,13 @@ static void fl_xft_font(fltk3::XlibGraphicsDriver *driver, fltk3::Font fnum, flt
 	driver->fltk3::GraphicsDriver::font(fnum, size);
 	Fl_Fontdesc *font = fltk3::fonts + fnum;
 	// search the fontsizes we have generated already
-	for (f = font->first; f; f = f->next) {
-		if (f->size == size && f->angle == angle)// && !strcasecmp(f->encoding, fl_encoding_))
-			break;
-	}
+	f = fl_xft_find(fnum, size, angle);
 	if (!f) {
 		f = new Fl_Font_Descriptor(font->name, size, angle);
+		f->fnum = fnum;
 		f->next = font->first;
 		font->first = f;
+		fl_xft_insert(f);
 	}
 	driver->font_descriptor(f);
 #if XFT_MAJOR < 2
@@ -148,10 +206,12 @@ void fltk3::XlibGraphicsDriver::font(fltk3::Font fnum, fltk3::Fontsize size)
 	fl_xft_font(this,fnum,size,0);
 }
 
-static XftFont* fontopen(const char* name, fltk3::Fontsize size, bool core, int angle)
+/* Builds the pattern fontopen() matches for an FLTK font name, or returns
+ NULL if the name looks like an old-school XLFD font name.
+ */
+static XftPattern* fontpattern(const char* name, fltk3::Fontsize size, bool core, int angle)
 {
 	// Check: does it look like we have been passed an old-school XLFD fontname?
-	bool is_xlfd = false;
 	int hyphen_count = 0;
 	int comma_count = 0;
 	unsigned len = strlen(name);
@@ -160,131 +220,400 @@ static XftFont* fontopen(const char* name, fltk3::Fontsize size, bool core, int
 		if(name[idx] == '-') hyphen_count++; // check for XLFD hyphens
 		if(name[idx] == ',') comma_count++;  // are there multiple names?
 	}
-	if(hyphen_count >= 14) is_xlfd = true; // Not a robust check, but good enough?
+	if(hyphen_count >= 14) return NULL; // Not a robust check, but good enough?
+
+	XftPattern *fnt_pat = XftPatternCreate(); // the pattern we will use for matching
+
+	int slant = XFT_SLANT_ROMAN;
+	int weight = XFT_WEIGHT_MEDIUM;
+
+	/* This "converts" FLTK-style font names back into "regular" names, extracting
+	 * the BOLD and ITALIC codes as it does so - all FLTK font names are prefixed
+	 * by 'I' (italic) 'B' (bold) 'P' (bold italic) or ' ' (regular) modifiers.
+	 * This gives a fairly limited font selection ability, but is retained for
+	 * compatibility reasons. If you really need a more complex choice, you are best
+	 * calling fltk3::set_fonts(*) then selecting the font by font-index rather than by
+	 * name anyway. Probably.
+	 * If you want to load a font who's name does actually begin with I, B or P, you
+	 * MUST use a leading space OR simply use lowercase for the name...
+	 */
+	/* This may be efficient, but it is non-obvious. */
+	switch (*name++) {
+	case 'I':
+		slant = XFT_SLANT_ITALIC;
+		break; // italic
+	case 'P':
+		slant = XFT_SLANT_ITALIC;        // bold-italic (falls-through)
+	case 'B':
+		weight = XFT_WEIGHT_BOLD;
+		break; // bold
+	case ' ':
+		break;                           // regular
+	default:
+		name--;                           // no prefix, restore name
+	}
 
-	fl_open_display();
+	if(comma_count) { // multiple comma-separated names were passed
+		char *local_name = strdup(name); // duplicate the full name so we can edit the copy
+		char *curr = local_name; // points to first name in string
+		char *nxt; // next name in string
+		do {
+			nxt = strchr(curr, ','); // find comma separator
+			if (nxt) {
+				*nxt = 0; // terminate first name
+				nxt++; // first char of next name
+			}
 
-	if(!is_xlfd) { // Not an XLFD - open as a XFT style name
-		XftFont *the_font; // the font we will return;
-		XftPattern *fnt_pat = XftPatternCreate(); // the pattern we will use for matching
-		int slant = XFT_SLANT_ROMAN;
-		int weight = XFT_WEIGHT_MEDIUM;
-
-		/* This "converts" FLTK-style font names back into "regular" names, extracting
-		 * the BOLD and ITALIC codes as it does so - all FLTK font names are prefixed
-		 * by 'I' (italic) 'B' (bold) 'P' (bold italic) or ' ' (regular) modifiers.
-		 * This gives a fairly limited font selection ability, but is retained for
-		 * compatibility reasons. If you really need a more complex choice, you are best
-		 * calling fltk3::set_fonts(*) then selecting the font by font-index rather than by
-		 * name anyway. Probably.
-		 * If you want to load a font who's name does actually begin with I, B or P, you
-		 * MUST use a leading space OR simply use lowercase for the name...
-		 */
-		/* This may be efficient, but it is non-obvious. */
-		switch (*name++) {
-		case 'I':
-			slant = XFT_SLANT_ITALIC;
-			break; // italic
-		case 'P':
-			slant = XFT_SLANT_ITALIC;        // bold-italic (falls-through)
-		case 'B':
-			weight = XFT_WEIGHT_BOLD;
-			break; // bold
-		case ' ':
-			break;                           // regular
-		default:
-			name--;                           // no prefix, restore name
-		}
+			// Add the current name to the match pattern
+			XftPatternAddString(fnt_pat, XFT_FAMILY, curr);
+
+			if(nxt) curr = nxt; // move onto next name (if it exists)
+			// Now do a cut-down version of the FLTK name conversion.
+			// NOTE: we only use the slant and weight of the first name,
+			// subsequent names we ignore this for... But we still need to do the check.
+			switch (*curr++) {
+			case 'I':
+				break; // italic
+			case 'P':        // bold-italic (falls-through)
+			case 'B':
+				break; // bold
+			case ' ':
+				break; // regular
+			default:
+				curr--; // no prefix, restore name
+			}
 
-		if(comma_count) { // multiple comma-separated names were passed
-			char *local_name = strdup(name); // duplicate the full name so we can edit the copy
-			char *curr = local_name; // points to first name in string
-			char *nxt; // next name in string
-			do {
-				nxt = strchr(curr, ','); // find comma separator
-				if (nxt) {
-					*nxt = 0; // terminate first name
-					nxt++; // first char of next name
-				}
-
-				// Add the current name to the match pattern
-				XftPatternAddString(fnt_pat, XFT_FAMILY, curr);
-
-				if(nxt) curr = nxt; // move onto next name (if it exists)
-				// Now do a cut-down version of the FLTK name conversion.
-				// NOTE: we only use the slant and weight of the first name,
-				// subsequent names we ignore this for... But we still need to do the check.
-				switch (*curr++) {
-				case 'I':
-					break; // italic
-				case 'P':        // bold-italic (falls-through)
-				case 'B':
-					break; // bold
-				case ' ':
-					break; // regular
-				default:
-					curr--; // no prefix, restore name
-				}
-
-				comma_count--; // decrement name sections count
-			} while (comma_count >= 0);
-			free(local_name); // release our local copy of font names
-		} else { // single name was passed - add it directly
-			XftPatternAddString(fnt_pat, XFT_FAMILY, name);
-		}
+			comma_count--; // decrement name sections count
+		} while (comma_count >= 0);
+		free(local_name); // release our local copy of font names
+	} else { // single name was passed - add it directly
+		XftPatternAddString(fnt_pat, XFT_FAMILY, name);
+	}
 
-		// Construct a match pattern for the font we want...
-		XftPatternAddInteger(fnt_pat, XFT_WEIGHT, weight);
-		XftPatternAddInteger(fnt_pat, XFT_SLANT, slant);
-		XftPatternAddDouble (fnt_pat, XFT_PIXEL_SIZE, (double)size);
-		XftPatternAddString (fnt_pat, XFT_ENCODING, fl_encoding_);
-
-		// rotate font if angle!=0
-		if (angle !=0) {
-			XftMatrix m;
-			XftMatrixInit(&m);
-			XftMatrixRotate(&m,cos(M_PI*angle/180.),sin(M_PI*angle/180.));
-			XftPatternAddMatrix (fnt_pat, XFT_MATRIX,&m);
-		}
+	// Construct a match pattern for the font we want...
+	XftPatternAddInteger(fnt_pat, XFT_WEIGHT, weight);
+	XftPatternAddInteger(fnt_pat, XFT_SLANT, slant);
+	XftPatternAddDouble (fnt_pat, XFT_PIXEL_SIZE, (double)size);
+	XftPatternAddString (fnt_pat, XFT_ENCODING, fl_encoding_);
+
+	// rotate font if angle!=0
+	if (angle !=0) {
+		XftMatrix m;
+		XftMatrixInit(&m);
+		XftMatrixRotate(&m,cos(M_PI*angle/180.),sin(M_PI*angle/180.));
+		XftPatternAddMatrix (fnt_pat, XFT_MATRIX,&m);
+	}
 
-		if (core) {
-			XftPatternAddBool(fnt_pat, XFT_CORE, FcTrue);
-			XftPatternAddBool(fnt_pat, XFT_RENDER, FcFalse);
-		}
+	if (core) {
+		XftPatternAddBool(fnt_pat, XFT_CORE, FcTrue);
+		XftPatternAddBool(fnt_pat, XFT_RENDER, FcFalse);
+	}
+	return fnt_pat;
+}
 
-		XftPattern *match_pat;  // the best available match on the system
-		XftResult match_result; // the result of our matching attempt
+/* Resolved font patterns. Each pattern fontopen() asks for is only matched
+ once, by the preload_fonts() thread or by fontopen() itself. The matches of
+ the preload thread are also appended to a cache file that later runs read
+ back, so that they need not wait for it. The file starts with a stamp of
+ the fontconfig setup and is dropped when the configuration files or font
+ directories change; a cached match is also dropped when its font file is
+ modified.
+ */
+struct Fl_Font_Match {
+	Fl_Font_Match *next;	// next match in the same slot of match_table
+	Fl_Font_Match *queued;	// next match waiting for the preload thread
+	char *key;		// FcNameUnparse() of the pattern asked for
+	FcPattern *pattern;	// the pattern to resolve while it is queued
+	FcPattern *match;	// the resolved pattern, or NULL
+	char *cached;		// the resolved pattern as read from the cache file
+	long mtime;		// modification time of the font file of cached
+};
 
-		// query the system to find a match for this font
-		match_pat = XftFontMatch(fl_display, fl_screen, fnt_pat, &match_result);
+static Fl_Font_Match *match_table[256];
+static Fl_Font_Match *match_queue, **match_queue_end = &match_queue;
+static bool match_cache_read;
+static unsigned match_cache_stamp;
+// what XftDefaultSubstitute() adds to a pattern, read once by the main thread
+static FcPattern *xft_defaults;
+#if HAVE_PTHREAD
+// fontconfig is thread safe, this only guards the table and the cache file
+static pthread_mutex_t match_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t match_done = PTHREAD_COND_INITIALIZER;
+static bool match_thread;
+static void match_lock() { pthread_mutex_lock(&match_mutex); }
+static void match_unlock() { pthread_mutex_unlock(&match_mutex); }
+#else
+static void match_lock() {}
+static void match_unlock() {}
+#endif
+
+static Fl_Font_Match *&match_slot(const char *key)
+{
+	unsigned h = 2166136261u;
+	for (const uchar *p = (const uchar*)key; *p; p++) h = (h ^ *p) * 16777619u;
+	return match_table[h & 255];
+}
+
+static Fl_Font_Match *fl_find_match(const char *key)
+{
+	Fl_Font_Match *m = match_slot(key);
+	while (m && strcmp(m->key, key)) m = m->next;
+	return m;
+}
+
+static Fl_Font_Match *fl_add_match(const char *key)
+{
+	Fl_Font_Match *m = (Fl_Font_Match*)calloc(1, sizeof(Fl_Font_Match));
+	m->key = strdup(key);
+	Fl_Font_Match *&slot = match_slot(key);
+	m->next = slot;
+	slot = m;
+	return m;
+}
 
-#if 0 // the XftResult never seems to get set to anything... abandon this code?
-		switch(match_result) { // how good a match is this font for our request?
-		case XftResultMatch:
-			puts("Object exists with the specified ID");
-			break;
+// adds the Xft rendering defaults that pat has no value for
+static void fl_xft_defaults(FcPattern *pat)
+{
+	static const char *objects[] = {
+		XFT_RENDER, FC_EMBOLDEN, FC_ANTIALIAS, FC_AUTOHINT, FC_HINT_STYLE, FC_HINTING,
+		FC_RGBA, FC_LCD_FILTER, FC_MINSPACE, FC_DPI, FC_SCALE, XFT_MAX_GLYPH_MEMORY
+	};
+	for (unsigned i = 0; i < sizeof(objects) / sizeof(objects[0]); i++) {
+		FcValue v;
+		if (FcPatternGet(pat, objects[i], 0, &v) == FcResultNoMatch &&
+		    FcPatternGet(xft_defaults, objects[i], 0, &v) == FcResultMatch)
+			FcPatternAdd(pat, objects[i], v, FcTrue);
+	}
+}
 
-		case XftResultTypeMismatch:
-			puts("Object exists, but the type does not match");
-			break;
+/* Returns the key of pat in match_table. It includes the Xft defaults, so
+ that changing the resolution or the antialiasing of the display does not
+ reuse matches of previous runs.
+ */
+static char *fl_match_key(XftPattern *pat)
+{
+	if (!xft_defaults) {
+		xft_defaults = FcPatternCreate();
+		XftDefaultSubstitute(fl_display, fl_screen, xft_defaults);
+	}
+	FcPattern *p = FcPatternDuplicate(pat);
+	fl_xft_defaults(p);
+	FcChar8 *key = FcNameUnparse(p);
+	FcPatternDestroy(p);
+	return (char*)key;
+}
 
-		case XftResultNoId:
-			puts("Object exists, but has fewer values than specified");
-			break;
+// does what XftFontMatch() does without using the display
+static FcPattern *fl_xft_resolve(FcPattern *pat)
+{
+	FcConfigSubstitute(NULL, pat, FcMatchPattern);
+	fl_xft_defaults(pat);
+	FcDefaultSubstitute(pat);
+	FcResult result;
+	return FcFontMatch(NULL, pat, &result);
+}
 
-		case FcResultOutOfMemory:
-			puts("FcResult: Malloc failed");
-			break;
+static const char *fl_font_cache_file()
+{
+	static char path[FLTK3_PATH_MAX];
+	if (!path[0]) {
+		const char *home = fltk3::getenv("HOME");
+		if (!home) return NULL;
+		snprintf(path, sizeof(path), "%s/.fltk/fontcache", home);
+	}
+	return path;
+}
 
-		case XftResultNoMatch:
-			puts("Object does not exist at all");
-			break;
+static unsigned fl_stamp_add(unsigned h, const void *data, size_t n)
+{
+	for (const uchar *p = (const uchar*)data; n--; p++) h = (h ^ *p) * 16777619u;
+	return h;
+}
 
-		default:
-			printf("Invalid XftResult status %d \n", match_result);
-			break;
+/* Returns a hash of the fontconfig version and of the names and
+ modification times of its configuration files and font directories.
+ Installing or removing fonts, or editing the configuration, changes it.
+ */
+static unsigned fl_fontconfig_stamp()
+{
+	FcInit();
+	FcConfig *config = FcConfigGetCurrent();
+	int version = FcGetVersion();
+	unsigned h = fl_stamp_add(2166136261u, &version, sizeof(version));
+	FcStrList *lists[3] = {
+		FcConfigGetConfigFiles(config), FcConfigGetConfigDirs(config), FcConfigGetFontDirs(config)
+	};
+	for (int i = 0; i < 3; i++) {
+		if (!lists[i]) continue;
+		FcChar8 *name;
+		while ((name = FcStrListNext(lists[i]))) {
+			struct stat st;
+			long mtime = stat((const char*)name, &st) ? 0 : (long)st.st_mtime;
+			h = fl_stamp_add(h, name, strlen((const char*)name) + 1);
+			h = fl_stamp_add(h, &mtime, sizeof(mtime));
 		}
+		FcStrListDone(lists[i]);
+	}
+	return h;
+}
+
+/* Reads the matches of previous runs. The first line holds the stamp of
+ the fontconfig setup, the others the modification time of the font file,
+ the key and the resolved pattern separated by tabs; later lines replace
+ earlier ones. A file with another stamp is emptied, and a file with
+ replaced lines is written again without them, so it does not grow.
+ */
+static void fl_read_font_cache()
+{
+	match_cache_read = true;
+	match_cache_stamp = fl_fontconfig_stamp();
+	const char *path = fl_font_cache_file();
+	FILE *f = path ? fltk3::fopen(path, "rb") : NULL;
+	if (!f) return;
+	fseek(f, 0, SEEK_END);
+	long n = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *buf = n > 0 ? (char*)malloc(n) : NULL;
+	if (buf) n = fread(buf, 1, n, f);
+	fclose(f);
+	if (!buf) return;
+	char *end = (char*)memchr(buf, '\n', n);
+	bool compact = !end || strtoul(buf, NULL, 16) != match_cache_stamp;
+	int lines = 0, matches = 0;
+	if (!compact) for (char *line = end + 1; (end = (char*)memchr(line, '\n', buf + n - line)); line = end + 1) {
+		*end = 0;
+		lines++;
+		char *key = strchr(line, '\t');
+		char *value = key ? strchr(key + 1, '\t') : NULL;
+		if (!value) continue;
+		*key++ = 0;
+		*value++ = 0;
+		Fl_Font_Match *m = fl_find_match(key);
+		if (!m) m = fl_add_match(key);
+		if (!m->cached) matches++;
+		free(m->cached);
+		m->cached = strdup(value);
+		m->mtime = atol(line);
+	}
+	free(buf);
+	if (!compact && lines == matches) return;
+	f = fltk3::fopen(path, "wb");
+	if (!f) return;
+	fprintf(f, "%08x\n", match_cache_stamp);
+	for (int i = 0; i < 256; i++)
+		for (Fl_Font_Match *m = match_table[i]; m; m = m->next)
+			if (m->cached) fprintf(f, "%ld\t%s\t%s\n", m->mtime, m->key, m->cached);
+	fclose(f);
+}
+
+static void fl_write_font_cache(Fl_Font_Match *m)
+{
+	const char *path = fl_font_cache_file();
+	FcChar8 *file;
+	struct stat st;
+	if (!path || FcPatternGetString(m->match, FC_FILE, 0, &file) != FcResultMatch ||
+	    stat((const char*)file, &st)) return;
+	FcChar8 *value = FcNameUnparse(m->match);
+	if (!value) return;
+	fltk3::make_path_for_file(path);
+	FILE *f = fltk3::fopen(path, "ab");
+	if (f) {
+		fseek(f, 0, SEEK_END);
+		if (ftell(f) == 0) fprintf(f, "%08x\n", match_cache_stamp);
+		fprintf(f, "%ld\t%s\t%s\n", (long)st.st_mtime, m->key, (char*)value);
+		fclose(f);
+	}
+	free(value);
+}
+
+/* Returns the resolved pattern for pat, as XftFontMatch() does, taking it
+ from match_table if it is there or waiting for the preload thread if it
+ resolves it now. The caller owns a reference to it.
+ */
+static XftPattern *fl_xft_match(XftPattern *pat)
+{
+	XftResult result;
+	char *key = fl_match_key(pat);
+	if (!key) return XftFontMatch(fl_display, fl_screen, pat, &result);
+	match_lock();
+	if (!match_cache_read) fl_read_font_cache();
+	Fl_Font_Match *m = fl_find_match(key);
+#if HAVE_PTHREAD
+	while (m && m->pattern) pthread_cond_wait(&match_done, &match_mutex);
 #endif
+	bool stale = false;
+	if (m && !m->match && m->cached) {
+		FcPattern *p = FcNameParse((const FcChar8*)m->cached);
+		FcChar8 *file;
+		struct stat st;
+		if (p && (FcPatternGetString(p, FC_FILE, 0, &file) != FcResultMatch ||
+		          stat((const char*)file, &st) || (long)st.st_mtime != m->mtime)) {
+			FcPatternDestroy(p); // the font file was changed or removed since
+			p = NULL;
+		}
+		stale = !p;
+		m->match = p;
+		free(m->cached);
+		m->cached = NULL;
+	}
+	XftPattern *match = m ? m->match : NULL;
+	if (match) FcPatternReference(match);
+	match_unlock();
+	if (!match) {
+		match = XftFontMatch(fl_display, fl_screen, pat, &result);
+		if (match) {
+			match_lock();
+			if (!m) m = fl_add_match(key);
+			if (!m->match) {
+				m->match = match;
+				FcPatternReference(match);
+				// only replace a stale line, the next run drops the old one
+				if (stale) fl_write_font_cache(m);
+			}
+			match_unlock();
+		}
+	}
+	free(key);
+	return match;
+}
+
+// resolves the queued patterns, on the preload thread if there is one
+static void *fl_preload_fonts(void *)
+{
+	match_lock();
+	while (match_queue) {
+		Fl_Font_Match *m = match_queue;
+		match_queue = m->queued;
+		if (!match_queue) match_queue_end = &match_queue;
+		match_unlock();
+		FcPattern *match = fl_xft_resolve(m->pattern);
+		match_lock();
+		FcPatternDestroy(m->pattern);
+		m->pattern = NULL;
+		m->match = match;
+		if (match) fl_write_font_cache(m);
+#if HAVE_PTHREAD
+		pthread_cond_broadcast(&match_done);
+#endif
+	}
+#if HAVE_PTHREAD
+	match_thread = false;
+#endif
+	match_unlock();
+	return NULL;
+}
+
+static XftFont* fontopen(const char* name, fltk3::Fontsize size, bool core, int angle)
+{
+	fl_open_display();
+
+	XftPattern *fnt_pat = fontpattern(name, size, core, angle);
+	if(fnt_pat) { // Not an XLFD - open as a XFT style name
+		XftFont *the_font; // the font we will return;
+		XftPattern *match_pat;  // the best available match on the system
+
+		// query the system to find a match for this font
+		match_pat = fl_xft_match(fnt_pat);
 
 #if 0 // diagnostic to print the "full name" of the font we matched. This works.
 		FcChar8 *picked_name =  FcNameUnparse(match_pat);
@@ -329,8 +658,8 @@ static XftFont* fontopen(const char* name, fltk3::Fontsize size, bool core, int
 		 * XLFD's and use that to perform a XftFontMatch(). Maybe...
 		 */
 		char *local_name = strdup(name);
-		if(comma_count) { // This means we were passed multiple XLFD's
-			char *pc = strchr(local_name, ',');
+		char *pc = strchr(local_name, ',');
+		if(pc) { // This means we were passed multiple XLFD's
 			*pc = 0; // terminate the XLFD at the first comma
 		}
 		XftFont *the_font = XftFontOpenXlfd(fl_display, fl_screen, local_name);
@@ -347,6 +676,50 @@ static XftFont* fontopen(const char* name, fltk3::Fontsize size, bool core, int
 	}
 } // end of fontopen
 
+void fltk3::preload_fonts(fltk3::Font fnum, const fltk3::Fontsize *sizes, int n)
+{
+	fl_open_display();
+	match_lock();
+	if (!match_cache_read) fl_read_font_cache();
+	for (int i = 0; i < n; i++) {
+		if (fl_xft_find(fnum, sizes[i], 0)) continue; // already open
+		XftPattern *pat = fontpattern(fltk3::fonts[fnum].name, sizes[i], false, 0);
+		if (!pat) continue; // XLFD names are not matched
+		char *key = fl_match_key(pat);
+		if (key && !fl_find_match(key)) {
+			Fl_Font_Match *m = fl_add_match(key);
+			m->pattern = pat;
+			pat = NULL;
+			*match_queue_end = m;
+			match_queue_end = &m->queued;
+		}
+		if (pat) XftPatternDestroy(pat);
+		free(key);
+	}
+#if HAVE_PTHREAD
+	bool started = match_thread;
+	if (match_queue && !started) {
+		pthread_t t;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		started = match_thread = !pthread_create(&t, &attr, fl_preload_fonts, NULL);
+		pthread_attr_destroy(&attr);
+	}
+	match_unlock();
+	if (!started) fl_preload_fonts(NULL); // no thread, at least fill the cache file
+#else
+	match_unlock();
+	fl_preload_fonts(NULL);
+#endif
+}
+
+// marks an advance in Fl_Font_Descriptor::latin and width that is not measured yet
+static const short no_advance = -32768;
+// marks a character in Fl_Font_Descriptor::face whose font is not looked up yet,
+// this also limits the length of the fallback chain
+static const unsigned char no_face = 0xff;
+
 Fl_Font_Descriptor::Fl_Font_Descriptor(const char* name, fltk3::Fontsize fsize, int fangle)
 {
 //  encoding = fl_encoding_;
@@ -355,47 +728,182 @@ Fl_Font_Descriptor::Fl_Font_Descriptor(const char* name, fltk3::Fontsize fsize,
 #if HAVE_GL
 	listbase = 0;
 #endif // HAVE_GL
+	for (int i = 0; i < 256; i++) {
+		latin[i] = no_advance;
+		width[i] = NULL;
+		face[i] = NULL;
+	}
+	ucs = NULL;
+	ucs_size = 0;
+	fnum = -1;
+	fallback = NULL;
+	hash_next = NULL;
 	font = fontopen(name, fsize, false, angle);
 }
 
 Fl_Font_Descriptor::~Fl_Font_Descriptor()
 {
+	fl_flush_text(); // the batch may hold glyphs of its fonts
 	if (this == fltk3::graphics_driver->font_descriptor()) fltk3::graphics_driver->font_descriptor(NULL);
+	fl_xft_remove(this);
+	for (int i = 0; i < 256; i++) {
+		free(width[i]);
+		free(face[i]);
+	}
+	free(ucs);
+	if (fallback) {
+		Fl_Fontdesc *s = fltk3::fonts + fnum;
+		for (int i = 0; i < s->fallback->nfont && i < no_face - 1; i++)
+			if (fallback[i]) XftFontClose(fl_display, fallback[i]);
+		free(fallback);
+	}
 //  XftFontClose(fl_display, font);
 }
 
-/* decodes the input UTF-8 string into a series of wchar_t characters.
+/* Sorts the fonts fontconfig would use for the characters missing from
+ the first size of this face that is opened, and keeps the coverage of each
+ of them. This is done once per face; finding the font of a character
+ afterwards only looks at these bitmaps and never matches fonts again.
+ */
+static void fl_xft_sort_fallback(Fl_Fontdesc *s, XftFont *font)
+{
+	FcPattern *pat = FcPatternCreate();
+	FcChar8 *family;
+	int i;
+	for (i = 0; FcPatternGetString(font->pattern, FC_FAMILY, i, &family) == FcResultMatch; i++)
+		FcPatternAddString(pat, FC_FAMILY, family);
+	if (FcPatternGetInteger(font->pattern, FC_WEIGHT, 0, &i) == FcResultMatch)
+		FcPatternAddInteger(pat, FC_WEIGHT, i);
+	if (FcPatternGetInteger(font->pattern, FC_SLANT, 0, &i) == FcResultMatch)
+		FcPatternAddInteger(pat, FC_SLANT, i);
+	FcConfigSubstitute(NULL, pat, FcMatchPattern);
+	FcDefaultSubstitute(pat);
+	FcResult result;
+	// trimmed, so that every font adds characters the ones before it lack
+	s->fallback = FcFontSort(NULL, pat, FcTrue, NULL, &result);
+	FcPatternDestroy(pat);
+	int n = s->fallback ? s->fallback->nfont : 0;
+	s->coverage = (FcCharSet**)malloc((n + 1) * sizeof(FcCharSet*));
+	for (i = 0; i < n; i++)
+		if (FcPatternGetCharSet(s->fallback->fonts[i], FC_CHARSET, 0, s->coverage + i) != FcResultMatch)
+			s->coverage[i] = NULL;
+}
+
+void fl_xft_forget_fallback(Fl_Fontdesc *s)
+{
+	if (s->fallback) FcFontSetDestroy(s->fallback);
+	free(s->coverage);
+	s->fallback = NULL;
+	s->coverage = NULL;
+}
+
+/* Returns 0 if the font of the descriptor has character c, otherwise
+ 1 + the index of the first font of the fallback chain that has it, opening
+ that font at the size of the descriptor if needed. Characters that no font
+ has are left to the font of the descriptor.
+ */
+static int fl_xft_cover(Fl_Font_Descriptor *desc, FcChar32 c)
+{
+	if (FcCharSetHasChar(desc->font->charset, c)) return 0;
+	Fl_Fontdesc *s = fltk3::fonts + desc->fnum;
+	if (!s->coverage) fl_xft_sort_fallback(s, desc->font);
+	int n = s->fallback ? s->fallback->nfont : 0;
+	if (n > no_face - 1) n = no_face - 1;
+	for (int i = 0; i < n; i++) {
+		if (!s->coverage[i] || !FcCharSetHasChar(s->coverage[i], c)) continue;
+		if (!desc->fallback) desc->fallback = (XftFont**)calloc(n, sizeof(XftFont*));
+		if (!desc->fallback[i]) {
+			// same size, angle and rendering options as the font of the descriptor
+			FcPattern *pat = FcFontRenderPrepare(NULL, desc->font->pattern, s->fallback->fonts[i]);
+			if (!pat) continue;
+			desc->fallback[i] = XftFontOpenPattern(fl_display, pat);
+			if (!desc->fallback[i]) {
+				FcPatternDestroy(pat);
+				continue;
+			}
+		}
+		return i + 1;
+	}
+	return 0;
+}
+
+/* Returns the font of the descriptor or of its fallback chain that draws
+ character c. ASCII is always drawn with the font of the descriptor, so that
+ symbol fonts keep working.
+ */
+static XftFont *fl_xft_face(Fl_Font_Descriptor *desc, FcChar32 c)
+{
+	if (c < 0x80) return desc->font;
+	int f;
+	if (c < 0x10000) {
+		unsigned char *&block = desc->face[c >> 8];
+		if (!block) {
+			block = (unsigned char*)malloc(256);
+			memset(block, no_face, 256);
+		}
+		unsigned char &cached = block[c & 0xff];
+		if (cached == no_face) cached = fl_xft_cover(desc, c);
+		f = cached;
+	} else { // rarely used, look it up every time
+		f = fl_xft_cover(desc, c);
+	}
+	return f ? desc->fallback[f - 1] : desc->font;
+}
+
+/* decodes the input UTF-8 string into UCS-4 characters in the scratch
+ buffer of the font descriptor.
  n is set upon return to the number of characters.
  Don't deallocate the returned memory.
  */
-static const wchar_t *utf8reformat(const char *str, int& n)
+static const FcChar32 *utf8reformat(Fl_Font_Descriptor *desc, const char *str, int& n)
 {
-	static const wchar_t empty[] = {0};
-	static wchar_t *buffer;
-	static int lbuf = 0;
-	int newn;
-	if (n == 0) return empty;
-	newn = fltk3::utf8towc(str, n, (wchar_t*)buffer, lbuf);
-	if (newn >= lbuf) {
-		lbuf = newn + 100;
-		if (buffer) free(buffer);
-		buffer = (wchar_t*)malloc(lbuf * sizeof(wchar_t));
-		n = fltk3::utf8towc(str, n, (wchar_t*)buffer, lbuf);
-	} else {
-		n = newn;
+	if (n > desc->ucs_size) {
+		desc->ucs_size = n + 100;
+		free(desc->ucs);
+		desc->ucs = (unsigned*)malloc(desc->ucs_size * sizeof(unsigned));
 	}
-	return buffer;
+	n = fl_utf8_to_ucs4(str, n, desc->ucs);
+	return desc->ucs;
 }
 
 static void utf8extents(Fl_Font_Descriptor *desc, const char *str, int n, XGlyphInfo *extents)
 {
 	memset(extents, 0, sizeof(XGlyphInfo));
-	const wchar_t *buffer = utf8reformat(str, n);
-#ifdef __CYGWIN__
-	XftTextExtents16(fl_display, desc->font, (XftChar16 *)buffer, n, extents);
-#else
-	XftTextExtents32(fl_display, desc->font, (XftChar32 *)buffer, n, extents);
-#endif
+	if (fl_ascii_prefix(str, n) == n) { // ASCII is the same in Latin-1
+		XftTextExtents8(fl_display, desc->font, (const FcChar8 *)str, n, extents);
+		return;
+	}
+	const FcChar32 *buffer = utf8reformat(desc, str, n);
+	// union of the ink of the runs drawn with the same font
+	int x = 0, y = 0, l = 0, t = 0, r = 0, b = 0;
+	while (n > 0) {
+		XftFont *face = fl_xft_face(desc, buffer[0]);
+		int i = 1;
+		while (i < n && fl_xft_face(desc, buffer[i]) == face) i++;
+		XGlyphInfo gi;
+		XftTextExtents32(fl_display, face, buffer, i, &gi);
+		if (gi.width && gi.height) {
+			int gl = x - gi.x, gt = y - gi.y;
+			if (l == r) {
+				l = gl; t = gt; r = gl + gi.width; b = gt + gi.height;
+			} else {
+				if (gl < l) l = gl;
+				if (gt < t) t = gt;
+				if (gl + gi.width > r) r = gl + gi.width;
+				if (gt + gi.height > b) b = gt + gi.height;
+			}
+		}
+		x += gi.xOff;
+		y += gi.yOff;
+		buffer += i;
+		n -= i;
+	}
+	extents->x = -l;
+	extents->y = -t;
+	extents->width = r - l;
+	extents->height = b - t;
+	extents->xOff = x;
+	extents->yOff = y;
 }
 
 int fltk3::XlibGraphicsDriver::height()
@@ -410,12 +918,54 @@ int fltk3::XlibGraphicsDriver::descent()
 	else return -1;
 }
 
+/* Returns the advance of character c. The advances of the BMP are only
+ measured once per font descriptor; Xft adds them up the same way to get
+ the advance of a string.
+ */
+static int fl_xft_advance(Fl_Font_Descriptor *desc, FcChar32 c)
+{
+	short *a;
+	if (c < 0x100) {
+		a = desc->latin + c;
+	} else if (c < 0x10000) {
+		short *&block = desc->width[c >> 8];
+		if (!block) {
+			block = (short*)malloc(256 * sizeof(short));
+			for (int i = 0; i < 256; i++) block[i] = no_advance;
+		}
+		a = block + (c & 0xff);
+	} else { // rarely used, measure it every time
+		XGlyphInfo i;
+		XftTextExtents32(fl_display, fl_xft_face(desc, c), &c, 1, &i);
+		return i.xOff;
+	}
+	if (*a == no_advance) {
+		XGlyphInfo i;
+		XftTextExtents32(fl_display, fl_xft_face(desc, c), &c, 1, &i);
+		*a = i.xOff;
+	}
+	return *a;
+}
+
 double fltk3::XlibGraphicsDriver::width(const char* str, int n)
 {
-	if (!font_descriptor()) return -1.0;
-	XGlyphInfo i;
-	utf8extents(font_descriptor(), str, n, &i);
-	return i.xOff;
+	Fl_Font_Descriptor *desc = font_descriptor();
+	if (!desc) return -1.0;
+	const char *e = str + n;
+	int w = 0;
+	while (str < e) {
+		FcChar32 c = *(const uchar*)str;
+		if (c < 0x80) { // ascii
+			w += fl_xft_advance(desc, c);
+			str++;
+		} else {
+			int len;
+			c = fltk3::utf8decode(str, e, &len);
+			w += fl_xft_advance(desc, c);
+			str += len;
+		}
+	}
+	return w;
 }
 
 /*double fltk3::width(uchar c) {
@@ -425,9 +975,9 @@ double fltk3::XlibGraphicsDriver::width(const char* str, int n)
 static double fl_xft_width(Fl_Font_Descriptor *desc, FcChar32 *str, int n)
 {
 	if (!desc) return -1.0;
-	XGlyphInfo i;
-	XftTextExtents32(fl_display, desc->font, str, n, &i);
-	return i.xOff;
+	int w = 0;
+	for (int i = 0; i < n; i++) w += fl_xft_advance(desc, str[i]);
+	return w;
 }
 
 double fltk3::XlibGraphicsDriver::width(unsigned int c)
@@ -594,6 +1144,19 @@ extern XVisualInfo* fl_overlay_visual;
 // For some reason Xft produces errors if you destroy a window whose id
 // still exists in an XftDraw structure. It would be nice if this is not
 // true, a lot of junk is needed to try to stop this:
+//
+// XftDrawChange() throws away the Picture and clip that Xft made for the
+// old drawable, so it is only called when fl_window changes. Windows and
+// offscreens are taken out of the XftDraw by fl_destroy_xft_draw() before
+// they are destroyed, so a new drawable that reuses the id is not drawn
+// through a stale Picture.
+//
+// Text is not drawn right away. Its glyphs are collected with their font
+// and position, and a batch of them is drawn with one XftDrawGlyphFontSpec().
+// A batch has one XftDraw, clip and color, and is drawn when one of them
+// changes or it is full. Xlib drawing calls fl_flush_text() first, and so
+// does restore_clip(), which runs whenever the clip or fl_window changes,
+// so the text is drawn before anything that is drawn after it.
 
 static XftDraw* draw_;
 static Window draw_window;
@@ -602,8 +1165,46 @@ static XftDraw* draw_overlay;
 static Window draw_overlay_window;
 #endif
 
+#define TEXT_BATCH_SIZE 1024
+
+int fl_text_batch;	// number of glyphs in the batch
+static XftGlyphFontSpec text_batch[TEXT_BATCH_SIZE];
+static XftDraw *text_batch_draw;
+static XftColor text_batch_color;
+
+void fl_draw_text_batch()
+{
+	if (fl_text_batch)
+		XftDrawGlyphFontSpec(text_batch_draw, &text_batch_color, text_batch, fl_text_batch);
+	fl_text_batch = 0;
+}
+
+// starts a batch for draw and color unless the current one can be continued
+static void fl_xft_batch(XftDraw *draw, const XftColor *color)
+{
+	if (fl_text_batch && draw == text_batch_draw &&
+	    color->pixel == text_batch_color.pixel &&
+	    color->color.red == text_batch_color.color.red &&
+	    color->color.green == text_batch_color.color.green &&
+	    color->color.blue == text_batch_color.color.blue) return;
+	fl_draw_text_batch();
+	text_batch_draw = draw;
+	text_batch_color = *color;
+}
+
+static void fl_xft_glyph(XftFont *face, FcChar32 c, int x, int y)
+{
+	if (fl_text_batch == TEXT_BATCH_SIZE) fl_draw_text_batch();
+	XftGlyphFontSpec &g = text_batch[fl_text_batch++];
+	g.font = face;
+	g.glyph = XftCharIndex(fl_display, face, c);
+	g.x = x;
+	g.y = y;
+}
+
 void fl_destroy_xft_draw(Window id)
 {
+	fl_flush_text();
 	if (id == draw_window)
 		XftDrawChange(draw_, draw_window = fltk3::message_window);
 #if USE_OVERLAY
@@ -612,6 +1213,39 @@ void fl_destroy_xft_draw(Window id)
 #endif
 }
 
+/* Draws UCS-4 text in runs of characters that have the same font of the
+ fallback chain. Horizontal text goes into the batch.
+ */
+static void fl_xft_draw32(XftDraw *draw, XftColor *color, Fl_Font_Descriptor *desc, int x, int y, const FcChar32 *str, int n)
+{
+	if (!desc->angle) {
+		fl_xft_batch(draw, color);
+		for (int i = 0; i < n; i++) {
+			fl_xft_glyph(fl_xft_face(desc, str[i]), str[i], x, y);
+			x += fl_xft_advance(desc, str[i]);
+		}
+		return;
+	}
+	fl_flush_text();
+	while (n > 0) {
+		XftFont *face = fl_xft_face(desc, str[0]);
+		int i = 1;
+		while (i < n && fl_xft_face(desc, str[i]) == face) i++;
+		XftDrawString32(draw, color, face, x, y, str, i);
+		if (i == n) break;
+		if (desc->angle) { // the advance of a rotated run is not horizontal
+			XGlyphInfo gi;
+			XftTextExtents32(fl_display, face, str, i, &gi);
+			x += gi.xOff;
+			y += gi.yOff;
+		} else {
+			for (int k = 0; k < i; k++) x += fl_xft_advance(desc, str[k]);
+		}
+		str += i;
+		n -= i;
+	}
+}
+
 void fltk3::XlibGraphicsDriver::draw(const char *str, int n, int x, int y)
 {
 	if ( !this->font_descriptor() ) {
@@ -623,15 +1257,19 @@ void fltk3::XlibGraphicsDriver::draw(const char *str, int n, int x, int y)
 		if (!draw_)
 			draw_ = XftDrawCreate(fl_display, draw_overlay_window = fl_window,
 			                      fl_overlay_visual->visual, fl_overlay_colormap);
-		else //if (draw_overlay_window != fl_window)
+		else if (draw_overlay_window != fl_window) {
+			fl_flush_text();
 			XftDrawChange(draw_, draw_overlay_window = fl_window);
+		}
 	} else
 #endif
 		if (!draw_)
 			draw_ = XftDrawCreate(fl_display, draw_window = fl_window,
 			                      fl_visual->visual, fl_colormap);
-		else //if (draw_window != fl_window)
+		else if (draw_window != fl_window) {
+			fl_flush_text();
 			XftDrawChange(draw_, draw_window = fl_window);
+		}
 
 	Region region = fltk3::clip_region();
 	if (region && XEmptyRegion(region)) return;
@@ -648,14 +1286,19 @@ void fltk3::XlibGraphicsDriver::draw(const char *str, int n, int x, int y)
 	color.color.blue  = ((int)b)*0x101;
 	color.color.alpha = 0xffff;
 
-	const wchar_t *buffer = utf8reformat(str, n);
 	x += origin_x();
 	y += origin_y();
-#ifdef __CYGWIN__
-	XftDrawString16(draw_, &color, font_descriptor()->font, x, y, (XftChar16 *)buffer, n);
-#else
-	XftDrawString32(draw_, &color, font_descriptor()->font, x, y, (XftChar32 *)buffer, n);
-#endif
+	Fl_Font_Descriptor *desc = font_descriptor();
+	if (!desc->angle && fl_ascii_prefix(str, n) == n) { // drawn with the font of desc
+		fl_xft_batch(draw_, &color);
+		for (int i = 0; i < n; i++) {
+			fl_xft_glyph(desc->font, (uchar)str[i], x, y);
+			x += fl_xft_advance(desc, (uchar)str[i]);
+		}
+		return;
+	}
+	const FcChar32 *buffer = utf8reformat(font_descriptor(), str, n);
+	fl_xft_draw32(draw_, &color, font_descriptor(), x, y, buffer, n);
 }
 
 void fltk3::XlibGraphicsDriver::draw(int angle, const char *str, int n, int x, int y)
@@ -673,15 +1316,19 @@ static void fl_drawUCS4(fltk3::GraphicsDriver *driver, const FcChar32 *str, int
 		if (!draw_)
 			draw_ = XftDrawCreate(fl_display, draw_overlay_window = fl_window,
 			                      fl_overlay_visual->visual, fl_overlay_colormap);
-		else //if (draw_overlay_window != fl_window)
+		else if (draw_overlay_window != fl_window) {
+			fl_flush_text();
 			XftDrawChange(draw_, draw_overlay_window = fl_window);
+		}
 	} else
 #endif
 		if (!draw_)
 			draw_ = XftDrawCreate(fl_display, draw_window = fl_window,
 			                      fl_visual->visual, fl_colormap);
-		else //if (draw_window != fl_window)
+		else if (draw_window != fl_window) {
+			fl_flush_text();
 			XftDrawChange(draw_, draw_window = fl_window);
+		}
 
 	Region region = fltk3::clip_region();
 	if (region && XEmptyRegion(region)) return;
@@ -698,7 +1345,7 @@ static void fl_drawUCS4(fltk3::GraphicsDriver *driver, const FcChar32 *str, int
 	color.color.blue  = ((int)b)*0x101;
 	color.color.alpha = 0xffff;
 
-	XftDrawString32(draw_, &color, driver->font_descriptor()->font, x, y, (FcChar32 *)str, n);
+	fl_xft_draw32(draw_, &color, driver->font_descriptor(), x, y, str, n);
 }
 
 
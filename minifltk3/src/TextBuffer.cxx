@@ -18,12 +18,24 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include "utf8.h"
 #include "flstring.h"
 #include <ctype.h>
 #include "run.h"
 #include "TextBuffer.h"
 #include "ask.h"
+#include "text_scan.h"
+
+#ifndef WIN32
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#  include <sys/uio.h>
+#  include <unistd.h>
+#  include <errno.h>
+#  define TEXT_MMAP 1
+#endif
 
 
 /*
@@ -55,12 +67,12 @@
 
 #ifndef min
 
-static int max(int i1, int i2)
+static fltk3::TextPosition max(fltk3::TextPosition i1, fltk3::TextPosition i2)
 {
 	return i1 >= i2 ? i1 : i2;
 }
 
-static int min(int i1, int i2)
+static fltk3::TextPosition min(fltk3::TextPosition i1, fltk3::TextPosition i2)
 {
 	return i1 <= i2 ? i1 : i2;
 }
@@ -68,41 +80,641 @@ static int min(int i1, int i2)
 #endif
 
 
-static char *undobuffer;
-static int undobufferlength;
-static fltk3::TextBuffer *undowidget;
-static int undoat;		// points after insertion
-static int undocut;		// number of characters deleted there
-static int undoinsert;		// number of characters inserted
-static int undoyankcut;		// length of valid contents of buffer, even if undocut=0
+/* Minimum size of a block in the add buffer of the piece table. Larger
+ inserts get a block of their own. */
+#define PIECE_BLOCK_SIZE (64*1024)
+
+/* Size of a block in the line index. Lookups scan up to one block. */
+#define LINE_INDEX_BLOCK_SIZE (16*1024)
+
+/* Line functions scan this many bytes before they fall back to the index. */
+#define LINE_INDEX_SCAN_LIMIT (2*LINE_INDEX_BLOCK_SIZE)
+
+/* Default memory limit of the undo history. */
+#define UNDO_DEFAULT_LIMIT (64*1024*1024)
+
+/* Insertions and deletions up to this size count as typing. Consecutive
+ typing at the same place is merged into one undo step. */
+#define UNDO_TYPING_SIZE 16
+
+/* In tail mode, the modify callbacks of appended text are delivered at
+ this interval. */
+#define TAIL_FLUSH_INTERVAL (1.0/60)
+
+/* A merged deletion stops growing at this size, because every backspace
+ prepends to its saved text. */
+#define UNDO_MERGE_LIMIT 4096
+
+static void def_transcoding_warning_action(fltk3::TextBuffer *text)
+{
+	fltk3::alert("%s", text->file_encoding_warning_message);
+}
+
+
+/*
+ Newline index of a text buffer.
+
+ The text is divided into consecutive blocks of about LINE_INDEX_BLOCK_SIZE
+ bytes. Two Fenwick trees over the block lengths and over the number of
+ newlines in each block find the block containing a position or a line in
+ logarithmic time, and are updated in logarithmic time when an edit changes
+ the size of a block. Only the edited text and at most one block are ever
+ scanned. Blocks that grow too large are split, and the table is compacted
+ when removals leave too many small blocks behind.
+ */
+class fltk3::TextLineIndex
+{
+public:
+	TextLineIndex(const fltk3::TextBuffer *buf);
+	~TextLineIndex();
+	fltk3::TextPosition lines() const {
+		return mTotalLines;
+	}
+	fltk3::TextPosition position_to_line(fltk3::TextPosition pos) const;
+	fltk3::TextPosition line_to_position(fltk3::TextPosition lineNum) const;
+	void inserted(fltk3::TextPosition pos, fltk3::TextPosition nInserted);
+	void removing(fltk3::TextPosition start, fltk3::TextPosition end);
+private:
+	void reserve(int nBlocks);
+	void build_trees();
+	void add(int block, fltk3::TextPosition dLength, fltk3::TextPosition dLines);
+	int find_position(fltk3::TextPosition pos, fltk3::TextPosition *blockStart,
+	                  fltk3::TextPosition *linesBefore) const;
+	int find_line(fltk3::TextPosition line, fltk3::TextPosition *blockStart,
+	              fltk3::TextPosition *linesBefore) const;
+	void split(int block, fltk3::TextPosition blockStart);
+	void compact();
+
+	const fltk3::TextBuffer *mBuffer;
+	fltk3::TextPosition *mBlockLength; // bytes in each block
+	fltk3::TextPosition *mBlockLines;  // newlines in each block
+	fltk3::TextPosition *mTreeLength;  // Fenwick tree over mBlockLength, 1-based
+	fltk3::TextPosition *mTreeLines;   // Fenwick tree over mBlockLines, 1-based
+	int mNBlocks;
+	int mNAllocated;
+	fltk3::TextPosition mTotalLength;
+	fltk3::TextPosition mTotalLines;
+};
+
+
+/*
+ Build the index by scanning the whole buffer once.
+ */
+fltk3::TextLineIndex::TextLineIndex(const fltk3::TextBuffer *buf)
+{
+	mBuffer = buf;
+	mBlockLength = mBlockLines = mTreeLength = mTreeLines = NULL;
+	mNBlocks = mNAllocated = 0;
+	mTotalLength = buf->length();
+	mTotalLines = 0;
+	reserve((int) (mTotalLength / LINE_INDEX_BLOCK_SIZE) + 1);
+	for (fltk3::TextPosition pos = 0; pos < mTotalLength; pos += LINE_INDEX_BLOCK_SIZE) {
+		fltk3::TextPosition end = min(pos + LINE_INDEX_BLOCK_SIZE, mTotalLength);
+		mBlockLength[mNBlocks] = end - pos;
+		mBlockLines[mNBlocks] = buf->scan_lines(pos, end);
+		mTotalLines += mBlockLines[mNBlocks];
+		mNBlocks++;
+	}
+	build_trees();
+}
+
+
+fltk3::TextLineIndex::~TextLineIndex()
+{
+	free(mBlockLength);
+	free(mBlockLines);
+	free(mTreeLength);
+	free(mTreeLines);
+}
+
+
+/*
+ Make room for at least nBlocks blocks.
+ */
+void fltk3::TextLineIndex::reserve(int nBlocks)
+{
+	if (nBlocks <= mNAllocated)
+		return;
+	mNAllocated = max(nBlocks, 2 * mNAllocated);
+	size_t size = sizeof(fltk3::TextPosition);
+	mBlockLength = (fltk3::TextPosition *) realloc(mBlockLength, mNAllocated * size);
+	mBlockLines = (fltk3::TextPosition *) realloc(mBlockLines, mNAllocated * size);
+	mTreeLength = (fltk3::TextPosition *) realloc(mTreeLength, (mNAllocated + 1) * size);
+	mTreeLines = (fltk3::TextPosition *) realloc(mTreeLines, (mNAllocated + 1) * size);
+}
+
 
 /*
- Resize the undo buffer to match at least the requested size.
+ Rebuild both trees from the block table in linear time.
  */
-static void undobuffersize(int n)
+void fltk3::TextLineIndex::build_trees()
 {
-	if (n > undobufferlength) {
-		if (undobuffer) {
-			do {
-				undobufferlength *= 2;
-			} while (undobufferlength < n);
-			undobuffer = (char *) realloc(undobuffer, undobufferlength);
+	int i;
+	for (i = 1; i <= mNBlocks; i++) {
+		mTreeLength[i] = mBlockLength[i - 1];
+		mTreeLines[i] = mBlockLines[i - 1];
+	}
+	for (i = 1; i <= mNBlocks; i++) {
+		int parent = i + (i & -i);
+		if (parent <= mNBlocks) {
+			mTreeLength[parent] += mTreeLength[i];
+			mTreeLines[parent] += mTreeLines[i];
+		}
+	}
+}
+
+
+/*
+ Change the length and newline count of one block.
+ */
+void fltk3::TextLineIndex::add(int block, fltk3::TextPosition dLength, fltk3::TextPosition dLines)
+{
+	mBlockLength[block] += dLength;
+	mBlockLines[block] += dLines;
+	mTotalLength += dLength;
+	mTotalLines += dLines;
+	for (int i = block + 1; i <= mNBlocks; i += i & -i) {
+		mTreeLength[i] += dLength;
+		mTreeLines[i] += dLines;
+	}
+}
+
+
+/*
+ Return the number of blocks that end at or before pos, which is the index
+ of the block containing pos. Also returns the start of that block and the
+ number of newlines before it.
+ */
+int fltk3::TextLineIndex::find_position(fltk3::TextPosition pos,
+                                        fltk3::TextPosition *blockStart,
+                                        fltk3::TextPosition *linesBefore) const
+{
+	int block = 0;
+	fltk3::TextPosition length = 0, lines = 0;
+	int step = 1;
+	while (2 * step <= mNBlocks)
+		step *= 2;
+	for (; step; step /= 2) {
+		int next = block + step;
+		if (next <= mNBlocks && length + mTreeLength[next] <= pos) {
+			block = next;
+			length += mTreeLength[next];
+			lines += mTreeLines[next];
+		}
+	}
+	*blockStart = length;
+	*linesBefore = lines;
+	return block;
+}
+
+
+/*
+ Return the index of the block containing newline number line (counting
+ from 0), the start of that block and the number of newlines before it.
+ */
+int fltk3::TextLineIndex::find_line(fltk3::TextPosition line,
+                                    fltk3::TextPosition *blockStart,
+                                    fltk3::TextPosition *linesBefore) const
+{
+	int block = 0;
+	fltk3::TextPosition length = 0, lines = 0;
+	int step = 1;
+	while (2 * step <= mNBlocks)
+		step *= 2;
+	for (; step; step /= 2) {
+		int next = block + step;
+		if (next <= mNBlocks && lines + mTreeLines[next] <= line) {
+			block = next;
+			length += mTreeLength[next];
+			lines += mTreeLines[next];
+		}
+	}
+	*blockStart = length;
+	*linesBefore = lines;
+	return block;
+}
+
+
+/*
+ Return the number of newlines before pos.
+ */
+fltk3::TextPosition fltk3::TextLineIndex::position_to_line(fltk3::TextPosition pos) const
+{
+	if (pos >= mTotalLength)
+		return mTotalLines;
+	fltk3::TextPosition blockStart, linesBefore;
+	find_position(pos, &blockStart, &linesBefore);
+	return linesBefore + mBuffer->scan_lines(blockStart, pos);
+}
+
+
+/*
+ Return the position after newline number lineNum-1, or the length of the
+ buffer if there are not that many newlines.
+ */
+fltk3::TextPosition fltk3::TextLineIndex::line_to_position(fltk3::TextPosition lineNum) const
+{
+	if (lineNum <= 0)
+		return 0;
+	if (lineNum > mTotalLines)
+		return mTotalLength;
+	fltk3::TextPosition blockStart, linesBefore;
+	find_line(lineNum - 1, &blockStart, &linesBefore);
+
+	/* the newline we are looking for is in this block */
+	int nLines = (int) (lineNum - linesBefore);
+	fltk3::TextPosition pos = blockStart;
+	for (;;) {
+		int n;
+		const char *s = mBuffer->segment(pos, &n);
+		const char *nl = fl_find_nth_byte(s, n, '\n', &nLines);
+		if (nl)
+			return pos + (int) (nl - s) + 1;
+		pos += n;
+	}
+}
+
+
+/*
+ Account for nInserted bytes that were just inserted at pos.
+ */
+void fltk3::TextLineIndex::inserted(fltk3::TextPosition pos, fltk3::TextPosition nInserted)
+{
+	fltk3::TextPosition nLines = mBuffer->scan_lines(pos, pos + nInserted);
+	if (mNBlocks == 0) {
+		reserve(1);
+		mBlockLength[0] = mBlockLines[0] = 0;
+		mNBlocks = 1;
+		build_trees();
+	}
+	fltk3::TextPosition blockStart, linesBefore;
+	int block = find_position(pos, &blockStart, &linesBefore);
+	if (block == mNBlocks) {
+		/* appending to the end of the text */
+		block = mNBlocks - 1;
+		blockStart = mTotalLength - mBlockLength[block];
+	}
+	add(block, nInserted, nLines);
+	if (mBlockLength[block] > 2 * LINE_INDEX_BLOCK_SIZE)
+		split(block, blockStart);
+}
+
+
+/*
+ Account for the text between start and end, which is about to be removed.
+ Must be called while the text is still in the buffer.
+ */
+void fltk3::TextLineIndex::removing(fltk3::TextPosition start, fltk3::TextPosition end)
+{
+	fltk3::TextPosition blockStart, linesBefore;
+	int block = find_position(start, &blockStart, &linesBefore);
+	fltk3::TextPosition pos = start;
+	while (pos < end && block < mNBlocks) {
+		fltk3::TextPosition blockEnd = blockStart + mBlockLength[block];
+		fltk3::TextPosition e = min(end, blockEnd);
+		if (e > pos)
+			add(block, pos - e, -mBuffer->scan_lines(pos, e));
+		pos = e;
+		blockStart = blockEnd;
+		block++;
+	}
+	if (mNBlocks > 2 * (mTotalLength / LINE_INDEX_BLOCK_SIZE) + 16)
+		compact();
+}
+
+
+/*
+ Replace an oversized block with blocks of LINE_INDEX_BLOCK_SIZE bytes.
+ */
+void fltk3::TextLineIndex::split(int block, fltk3::TextPosition blockStart)
+{
+	fltk3::TextPosition length = mBlockLength[block];
+	int nNew = (int) ((length + LINE_INDEX_BLOCK_SIZE - 1) / LINE_INDEX_BLOCK_SIZE);
+	reserve(mNBlocks + nNew - 1);
+	memmove(mBlockLength + block + nNew, mBlockLength + block + 1,
+	        (mNBlocks - block - 1) * sizeof(fltk3::TextPosition));
+	memmove(mBlockLines + block + nNew, mBlockLines + block + 1,
+	        (mNBlocks - block - 1) * sizeof(fltk3::TextPosition));
+	for (int i = 0; i < nNew; i++) {
+		fltk3::TextPosition pos = blockStart + i * LINE_INDEX_BLOCK_SIZE;
+		fltk3::TextPosition end = min(pos + LINE_INDEX_BLOCK_SIZE, blockStart + length);
+		mBlockLength[block + i] = end - pos;
+		mBlockLines[block + i] = mBuffer->scan_lines(pos, end);
+	}
+	mNBlocks += nNew - 1;
+	build_trees();
+}
+
+
+/*
+ Merge neighbouring small blocks and drop empty ones. The newline counts
+ are known, so no text needs to be scanned.
+ */
+void fltk3::TextLineIndex::compact()
+{
+	int n = 0;
+	for (int i = 0; i < mNBlocks; i++) {
+		if (mBlockLength[i] == 0)
+			continue;
+		if (n > 0 && mBlockLength[n - 1] + mBlockLength[i] <= LINE_INDEX_BLOCK_SIZE) {
+			mBlockLength[n - 1] += mBlockLength[i];
+			mBlockLines[n - 1] += mBlockLines[i];
 		} else {
-			undobufferlength = n + 9;
-			undobuffer = (char *) malloc(undobufferlength);
+			mBlockLength[n] = mBlockLength[i];
+			mBlockLines[n] = mBlockLines[i];
+			n++;
 		}
 	}
+	mNBlocks = n;
+	build_trees();
 }
 
-static void def_transcoding_warning_action(fltk3::TextBuffer *text)
+namespace {
+
+/*
+ One step of the undo history: nDeleted bytes at pos were replaced by
+ nInserted bytes. Only the text that is not in the buffer is saved: the
+ deleted text while the step can be undone, the inserted text once it
+ has been undone and can be redone.
+ */
+struct TextUndoStep {
+	fltk3::TextPosition pos;
+	fltk3::TextPosition nDeleted;
+	fltk3::TextPosition nInserted;
+	fltk3::TextPosition text; // offset of the saved text in the arena of the stack
+};
+
+
+/*
+ A stack of undo steps. The saved text of all steps is kept in one arena,
+ in the same order as the steps, and each text is followed by a nul. The
+ oldest steps can be dropped from the bottom of the stack; the space is
+ reclaimed the next time the stack needs to grow.
+ */
+class TextUndoStack
 {
-	fltk3::alert("%s", text->file_encoding_warning_message);
+public:
+	TextUndoStack();
+	~TextUndoStack();
+	int size() const {
+		return mNSteps - mFirst;
+	}
+	int dropped() const {
+		return mDropped;
+	}
+	fltk3::TextPosition bytes() const {
+		return mArenaUsed - mArenaStart + size() * (fltk3::TextPosition) sizeof(TextUndoStep);
+	}
+	TextUndoStep *top() {
+		return size() ? &mSteps[mNSteps - 1] : NULL;
+	}
+	char *text(const TextUndoStep *step) {
+		return mArena + step->text;
+	}
+	char *push(fltk3::TextPosition pos, fltk3::TextPosition nDeleted, fltk3::TextPosition nInserted, fltk3::TextPosition nSaved);
+	char *grow_top(fltk3::TextPosition n);
+	void pop();
+	void drop_oldest();
+	void clear();
+private:
+	void reserve(int nSteps, fltk3::TextPosition nBytes);
+	TextUndoStep *mSteps;
+	int mFirst, mNSteps, mNAllocated;
+	char *mArena;
+	fltk3::TextPosition mArenaStart, mArenaUsed, mArenaSize;
+	int mDropped;   // number of steps dropped from the bottom so far
+	// Forbid use of copy contructor and assign operator
+	TextUndoStack(const TextUndoStack&);
+	TextUndoStack &operator=(const TextUndoStack&);
+};
+
+
+TextUndoStack::TextUndoStack()
+{
+	mSteps = NULL;
+	mFirst = mNSteps = mNAllocated = 0;
+	mArena = NULL;
+	mArenaStart = mArenaUsed = mArenaSize = 0;
+	mDropped = 0;
+}
+
+
+TextUndoStack::~TextUndoStack()
+{
+	free(mSteps);
+	free(mArena);
+}
+
+
+/*
+ Make room for nSteps more steps and nBytes more bytes of text. Dropped
+ steps and their text are squeezed out first, the arrays only grow if
+ that is not enough.
+ */
+void TextUndoStack::reserve(int nSteps, fltk3::TextPosition nBytes)
+{
+	if (mNSteps + nSteps > mNAllocated) {
+		if (mFirst > 0) {
+			memmove(mSteps, mSteps + mFirst, size() * sizeof(TextUndoStep));
+			mNSteps -= mFirst;
+			mFirst = 0;
+		}
+		if (mNSteps + nSteps > mNAllocated) {
+			mNAllocated = max(2 * mNAllocated, max(mNSteps + nSteps, 64));
+			mSteps = (TextUndoStep *) realloc(mSteps, mNAllocated * sizeof(TextUndoStep));
+		}
+	}
+	if (mArenaUsed + nBytes > mArenaSize) {
+		if (mArenaStart > 0) {
+			memmove(mArena, mArena + mArenaStart, mArenaUsed - mArenaStart);
+			for (int i = mFirst; i < mNSteps; i++)
+				mSteps[i].text -= mArenaStart;
+			mArenaUsed -= mArenaStart;
+			mArenaStart = 0;
+		}
+		if (mArenaUsed + nBytes > mArenaSize) {
+			mArenaSize = max(2 * mArenaSize, max(mArenaUsed + nBytes, 4096));
+			mArena = (char *) realloc(mArena, mArenaSize);
+		}
+	}
 }
 
+
+/*
+ Push a new step and return the space for its nSaved bytes of saved text.
+ The pointer is valid until the stack changes again.
+ */
+char *TextUndoStack::push(fltk3::TextPosition pos, fltk3::TextPosition nDeleted, fltk3::TextPosition nInserted, fltk3::TextPosition nSaved)
+{
+	reserve(1, nSaved + 1);
+	TextUndoStep *step = &mSteps[mNSteps++];
+	step->pos = pos;
+	step->nDeleted = nDeleted;
+	step->nInserted = nInserted;
+	step->text = mArenaUsed;
+	mArenaUsed += nSaved + 1;
+	mArena[mArenaUsed - 1] = 0;
+	return mArena + step->text;
+}
+
+
+/*
+ Add n bytes to the saved text of the top step. The new bytes are at the
+ end of the text, before the nul. Returns the start of the text.
+ */
+char *TextUndoStack::grow_top(fltk3::TextPosition n)
+{
+	reserve(0, n);
+	mArenaUsed += n;
+	mArena[mArenaUsed - 1] = 0;
+	return mArena + top()->text;
+}
+
+
+/*
+ Remove the top step. Its text stays readable until the stack grows again.
+ */
+void TextUndoStack::pop()
+{
+	mArenaUsed = mSteps[--mNSteps].text;
+	if (mNSteps == mFirst)
+		clear();
+}
+
+
+/*
+ Forget the step at the bottom of the stack.
+ */
+void TextUndoStack::drop_oldest()
+{
+	mDropped++;
+	if (++mFirst == mNSteps)
+		clear();
+	else
+		mArenaStart = mSteps[mFirst].text;
+}
+
+
+void TextUndoStack::clear()
+{
+	mDropped += size();
+	mFirst = mNSteps = 0;
+	mArenaStart = mArenaUsed = 0;
+}
+
+} // namespace
+
+
+/*
+ Undo history of a text buffer: the steps that can be undone, and the
+ steps that were undone and can be redone.
+ */
+class fltk3::TextHistory
+{
+public:
+	TextHistory() {
+		mLastEdit = EDIT_NONE;
+		mReplaying = 0;
+	}
+	fltk3::TextPosition bytes() const {
+		return mUndo.bytes() + mRedo.bytes();
+	}
+	void limit(fltk3::TextPosition bytes);
+	void clear() {
+		mUndo.clear();
+		mRedo.clear();
+		mLastEdit = EDIT_NONE;
+	}
+
+	/* The kind of the last recorded edit, which decides if the next edit
+	 is merged into the same step. EDIT_NONE starts a new step. */
+	enum {
+		EDIT_NONE,
+		EDIT_TYPE,      // a short insertion
+		EDIT_ERASE,     // a short deletion
+		EDIT_DELETE     // a long deletion, which an insertion may replace
+	};
+
+	TextUndoStack mUndo;
+	TextUndoStack mRedo;
+	char mLastEdit;
+	char mReplaying;   // undo() or redo() is changing the buffer
+};
+
+
+/*
+ Forget the oldest steps until the history uses at most the given number
+ of bytes. Steps that can be redone lie further in the future, so they are
+ only dropped once the undo stack is empty.
+ */
+void fltk3::TextHistory::limit(fltk3::TextPosition bytes)
+{
+	if (bytes <= 0)
+		return;
+	while (this->bytes() > bytes && mUndo.size())
+		mUndo.drop_oldest();
+	while (this->bytes() > bytes && mRedo.size())
+		mRedo.drop_oldest();
+	if (!mUndo.size())
+		mLastEdit = EDIT_NONE;
+}
+
+
+/*
+ The changes made in a batch. They are tracked as a single range that
+ covers all of them: it starts at mStart and ends mSuffix bytes before the
+ end of the text, and held the text in mDeleted before the batch started.
+ */
+class fltk3::TextBatch
+{
+public:
+	TextBatch() {
+		mLevel = 0;
+		mStart = -1;
+		mSuffix = 0;
+		mDeleted = NULL;
+		mNDeleted = mDeletedSize = 0;
+		mHistory = NULL;
+		mUndoSize = mUndoDropped = 0;
+		mReplayed = 0;
+	}
+	~TextBatch() {
+		free(mDeleted);
+	}
+	/* make room for n bytes of deleted text and a nul */
+	void reserve(fltk3::TextPosition n) {
+		if (n + 1 > mDeletedSize) {
+			mDeletedSize = max(2 * mDeletedSize, max(n + 1, 1024));
+			mDeleted = (char *) realloc(mDeleted, mDeletedSize);
+		}
+	}
+
+	int mLevel;                 // nesting depth of begin_batch()
+	fltk3::TextPosition mStart; // start of the changed range, -1 if nothing changed
+	fltk3::TextPosition mSuffix; // number of unchanged bytes after the range
+	char *mDeleted;             // original text of the range
+	fltk3::TextPosition mNDeleted, mDeletedSize;
+	fltk3::TextHistory *mHistory; // undo history at the start of the batch
+	int mUndoSize, mUndoDropped;  // state of its undo stack at that time
+	char mReplayed;             // undo() or redo() was called in the batch
+};
+
+
+extern int fl_thread_is_main(); // from lock.cxx
+
+/*
+ Deliver the combined modify callbacks of tail mode.
+ */
+static void tail_flush_cb(void *buf)
+{
+	((fltk3::TextBuffer *) buf)->flush_appends();
+}
+
+
 /*
  Initialize all variables.
  */
-fltk3::TextBuffer::TextBuffer(int requestedSize, int preferredGapSize)
+fltk3::TextBuffer::TextBuffer(fltk3::TextPosition requestedSize, int preferredGapSize)
 {
 	mLength = 0;
 	mPreferredGapSize = preferredGapSize;
@@ -124,6 +736,20 @@ fltk3::TextBuffer::TextBuffer(int requestedSize, int preferredGapSize)
 	mPredeleteCbArgs = NULL;
 	mCursorPosHint = 0;
 	mCanUndo = 1;
+	mStorageMode = GAP_STORAGE;
+	mPieces = NULL;
+	mNPieces = mNPiecesAllocated = 0;
+	mPieceHint = 0;
+	mAddBlocks = NULL;
+	mNAddBlocks = 0;
+	mAddUsed = mAddSize = 0;
+	mLineIndex = NULL;
+	mHistory = NULL;
+	mUndoLimit = UNDO_DEFAULT_LIMIT;
+	mTailCapacity = 0;
+	mTailStart = mTailPending = 0;
+	mTailCanUndo = 1;
+	mBatch = NULL;
 	input_file_was_transcoded = 0;
 	transcoding_warning_action = def_transcoding_warning_action;
 }
@@ -134,6 +760,12 @@ fltk3::TextBuffer::TextBuffer(int requestedSize, int preferredGapSize)
  */
 fltk3::TextBuffer::~TextBuffer()
 {
+	if (mTailPending)
+		fltk3::remove_timeout(tail_flush_cb, this);
+	delete mBatch;
+	free_line_index();
+	free_history();
+	free_pieces();
 	free(mBuf);
 	if (mNModifyProcs != 0) {
 		delete[]mModifyProcs;
@@ -146,6 +778,61 @@ fltk3::TextBuffer::~TextBuffer()
 }
 
 
+/*
+ Convert the buffer between gap and piece storage. The text itself does not
+ change, so no callbacks are called.
+ */
+void fltk3::TextBuffer::storage_mode(int mode)
+{
+	if (mode == mStorageMode)
+		return;
+
+	if (mode == PIECE_STORAGE) {
+		/* close the gap; the text becomes the original text of the table */
+		move_gap(mLength);
+		mNPiecesAllocated = 16;
+		mPieces = (Piece *) malloc(mNPiecesAllocated * sizeof(Piece));
+		mNPieces = 0;
+		if (mLength) {
+			mPieces[0].text = mBuf;
+			mPieces[0].start = 0;
+			mPieces[0].length = mLength;
+			mNPieces = 1;
+		}
+		mPieceHint = 0;
+		mStorageMode = PIECE_STORAGE;
+	} else {
+		/* flatten the pieces into a new gap buffer */
+		char *newBuf = (char *) malloc(mLength + mPreferredGapSize);
+		copy_text_(newBuf, 0, mLength);
+		free_pieces();
+		free((void *) mBuf);
+		mBuf = newBuf;
+		mGapStart = mLength;
+		mGapEnd = mLength + mPreferredGapSize;
+		mStorageMode = GAP_STORAGE;
+	}
+}
+
+
+/*
+ Release the piece table and all add blocks.
+ */
+void fltk3::TextBuffer::free_pieces()
+{
+	for (int i = 0; i < mNAddBlocks; i++)
+		free(mAddBlocks[i]);
+	free(mAddBlocks);
+	free(mPieces);
+	mAddBlocks = NULL;
+	mNAddBlocks = 0;
+	mAddUsed = mAddSize = 0;
+	mPieces = NULL;
+	mNPieces = mNPiecesAllocated = 0;
+	mPieceHint = 0;
+}
+
+
 /*
  This function copies verbose whatever is in front and after the gap into a
  single buffer.
@@ -153,8 +840,7 @@ fltk3::TextBuffer::~TextBuffer()
 char *fltk3::TextBuffer::text() const
 {
 	char *t = (char *) malloc(mLength + 1);
-	memcpy(t, mBuf, mGapStart);
-	memcpy(t+mGapStart, mBuf+mGapEnd, mLength - mGapStart);
+	copy_text_(t, 0, mLength);
 	t[mLength] = '\0';
 	return t;
 }
@@ -171,20 +857,30 @@ void fltk3::TextBuffer::text(const char *t)
 	// then don't return so that internal cleanup can happen
 	if (!t) t="";
 
+	flush_appends();
 	call_predelete_callbacks(0, length());
 
 	/* Save information for redisplay, and get rid of the old buffer */
 	const char *deletedText = text();
-	int deletedLength = mLength;
+	fltk3::TextPosition deletedLength = mLength;
+	int pieceStorage = (mStorageMode == PIECE_STORAGE);
+	if (pieceStorage) {
+		free_pieces();
+		mStorageMode = GAP_STORAGE;
+	}
 	free((void *) mBuf);
+	free_line_index();
+	free_history();
 
 	/* Start a new buffer with a gap of mPreferredGapSize at the end */
-	int insertedLength = (int) strlen(t);
+	fltk3::TextPosition insertedLength = (fltk3::TextPosition) strlen(t);
 	mBuf = (char *) malloc(insertedLength + mPreferredGapSize);
 	mLength = insertedLength;
 	mGapStart = insertedLength;
 	mGapEnd = mGapStart + mPreferredGapSize;
 	memcpy(mBuf, t, insertedLength);
+	if (pieceStorage)
+		storage_mode(PIECE_STORAGE);
 
 	/* Zero all of the existing selections */
 	update_selections(0, deletedLength, 0);
@@ -198,7 +894,7 @@ void fltk3::TextBuffer::text(const char *t)
 /*
  Creates a range of text to a new buffer and copies verbose from around the gap.
  */
-char *fltk3::TextBuffer::text_range(int start, int end) const
+char *fltk3::TextBuffer::text_range(fltk3::TextPosition start, fltk3::TextPosition end) const
 {
 	IS_UTF8_ALIGNED2(this, (start))
 	IS_UTF8_ALIGNED2(this, (end))
@@ -213,34 +909,292 @@ char *fltk3::TextBuffer::text_range(int start, int end) const
 		return s;
 	}
 	if (end < start) {
-		int temp = start;
+		fltk3::TextPosition temp = start;
 		start = end;
 		end = temp;
 	}
 	if (end > mLength)
 		end = mLength;
-	int copiedLength = end - start;
+	fltk3::TextPosition copiedLength = end - start;
 	s = (char *) malloc(copiedLength + 1);
 
 	/* Copy the text from the buffer to the returned string */
-	if (end <= mGapStart) {
-		memcpy(s, mBuf + start, copiedLength);
-	} else if (start >= mGapStart) {
-		memcpy(s, mBuf + start + (mGapEnd - mGapStart), copiedLength);
+	copy_text_(s, start, end);
+	s[copiedLength] = '\0';
+	return s;
+}
+
+
+/*
+ Copy a range of text into caller memory, walking across the gap or the
+ pieces.
+ */
+void fltk3::TextBuffer::copy_text_(char *to, fltk3::TextPosition start, fltk3::TextPosition end) const
+{
+	while (start < end) {
+		int n;
+		const char *src = segment(start, &n);
+		if (n <= 0)
+			break;
+		if (n > end - start)
+			n = (int) (end - start);
+		memcpy(to, src, n);
+		to += n;
+		start += n;
+	}
+}
+
+
+/*
+ Return the contiguous run of bytes that starts at pos.
+ */
+const char *fltk3::TextBuffer::segment(fltk3::TextPosition pos, int *len) const
+{
+	if (pos < 0)
+		pos = 0;
+	if (pos >= mLength) {
+		*len = 0;
+		return address(mLength);
+	}
+	fltk3::TextPosition n;
+	const char *s;
+	if (mStorageMode == PIECE_STORAGE) {
+		const Piece &p = mPieces[piece_index(pos)];
+		n = p.start + p.length - pos;
+		s = p.text + (pos - p.start);
+	} else if (pos < mGapStart) {
+		n = mGapStart - pos;
+		s = mBuf + pos;
 	} else {
-		int part1Length = mGapStart - start;
-		memcpy(s, mBuf + start, part1Length);
-		memcpy(s + part1Length, mBuf + mGapEnd, copiedLength - part1Length);
+		n = mLength - pos;
+		s = mBuf + pos + (mGapEnd - mGapStart);
 	}
-	s[copiedLength] = '\0';
+	*len = (int) min(n, INT_MAX);
 	return s;
 }
 
+
+/*
+ Return the contiguous run of bytes that ends right before pos.
+ */
+const char *fltk3::TextBuffer::segment_before(fltk3::TextPosition pos, int *len) const
+{
+	if (pos > mLength)
+		pos = mLength;
+	if (pos <= 0) {
+		*len = 0;
+		return address(0);
+	}
+	fltk3::TextPosition n;
+	const char *e;
+	if (mStorageMode == PIECE_STORAGE) {
+		const Piece &p = mPieces[piece_index(pos - 1)];
+		n = pos - p.start;
+		e = p.text + n;
+	} else if (pos <= mGapStart) {
+		n = pos;
+		e = mBuf + n;
+	} else {
+		n = pos - mGapStart;
+		e = mBuf + mGapEnd + n;
+	}
+	*len = (int) min(n, INT_MAX);
+	return e - *len;
+}
+
+
+fltk3::TextSpanIterator::TextSpanIterator(const fltk3::TextBuffer *buf, fltk3::TextPosition start, fltk3::TextPosition end)
+{
+	mBuffer = buf;
+	mPos = start < 0 ? 0 : start;
+	mEnd = end > buf->length() ? buf->length() : end;
+	mLength = 0;
+	fetch();
+}
+
+
+void fltk3::TextSpanIterator::next()
+{
+	mPos += mLength;
+	fetch();
+}
+
+
+/*
+ Read the span at mPos, clipped to the end of the range.
+ */
+void fltk3::TextSpanIterator::fetch()
+{
+	if (mPos >= mEnd) {
+		mText = NULL;
+		mLength = 0;
+		return;
+	}
+	mText = mBuffer->segment(mPos, &mLength);
+	if (mLength > mEnd - mPos)
+		mLength = (int) (mEnd - mPos);
+}
+
+
+/*
+ Find the piece holding pos. Most lookups are close to the previous one, so
+ the last result and its neighbours are tried before a binary search.
+ */
+int fltk3::TextBuffer::piece_index(fltk3::TextPosition pos) const
+{
+	int i = mPieceHint;
+	if (i < mNPieces) {
+		const Piece &p = mPieces[i];
+		if (pos >= p.start) {
+			if (pos < p.start + p.length)
+				return i;
+			if (i + 1 < mNPieces && pos < mPieces[i+1].start + mPieces[i+1].length)
+				return mPieceHint = i + 1;
+		} else if (i > 0 && pos >= mPieces[i-1].start) {
+			return mPieceHint = i - 1;
+		}
+	}
+
+	int lo = 0, hi = mNPieces - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (mPieces[mid].start <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return mPieceHint = lo;
+}
+
+
+/*
+ Convert a byte offset into a memory address in piece storage.
+ */
+char *fltk3::TextBuffer::piece_address(fltk3::TextPosition pos) const
+{
+	if (mNPieces == 0)
+		return mBuf;
+	if (pos >= mLength) {
+		const Piece &p = mPieces[mNPieces - 1];
+		return p.text + p.length;
+	}
+	if (pos < 0)
+		pos = 0;
+	const Piece &p = mPieces[piece_index(pos)];
+	return p.text + (pos - p.start);
+}
+
+
+/*
+ Split the piece containing pos so that a piece boundary is at pos.
+ */
+int fltk3::TextBuffer::split_piece(fltk3::TextPosition pos)
+{
+	if (pos >= mLength)
+		return mNPieces;
+	int i = piece_index(pos);
+	if (mPieces[i].start == pos)
+		return i;
+
+	if (mNPieces == mNPiecesAllocated) {
+		mNPiecesAllocated *= 2;
+		mPieces = (Piece *) realloc(mPieces, mNPiecesAllocated * sizeof(Piece));
+	}
+	memmove(mPieces + i + 2, mPieces + i + 1, (mNPieces - i - 1) * sizeof(Piece));
+	mNPieces++;
+	fltk3::TextPosition offset = pos - mPieces[i].start;
+	mPieces[i+1].text = mPieces[i].text + offset;
+	mPieces[i+1].start = pos;
+	mPieces[i+1].length = mPieces[i].length - offset;
+	mPieces[i].length = offset;
+	return i + 1;
+}
+
+
+/*
+ Link len new bytes into the piece table at pos. The bytes are reserved at
+ the end of the newest add block, or in a new block if they do not fit.
+ */
+char *fltk3::TextBuffer::piece_insert_(fltk3::TextPosition pos, fltk3::TextPosition len)
+{
+	int i = split_piece(pos);
+	char *tail = mNAddBlocks ? mAddBlocks[mNAddBlocks-1] + mAddUsed : NULL;
+
+	/* typing at the end of the previous insert extends its piece */
+	if (i > 0 && tail && mPieces[i-1].text + mPieces[i-1].length == tail &&
+	    mAddUsed + len <= mAddSize) {
+		mAddUsed += len;
+		mPieces[i-1].length += len;
+		for (; i < mNPieces; i++)
+			mPieces[i].start += len;
+		return tail;
+	}
+
+	if (!tail || mAddUsed + len > mAddSize) {
+		mAddSize = max(len, PIECE_BLOCK_SIZE);
+		mAddBlocks = (char **) realloc(mAddBlocks, (mNAddBlocks + 1) * sizeof(char *));
+		mAddBlocks[mNAddBlocks++] = (char *) malloc(mAddSize);
+		mAddUsed = 0;
+		tail = mAddBlocks[mNAddBlocks-1];
+	}
+	mAddUsed += len;
+	piece_link_(pos, tail, len);
+	return tail;
+}
+
+
+/*
+ Link len bytes of memory that the buffer does not own into the piece
+ table at pos.
+ */
+void fltk3::TextBuffer::piece_link_(fltk3::TextPosition pos, char *text, fltk3::TextPosition len)
+{
+	int i = split_piece(pos);
+	if (mNPieces == mNPiecesAllocated) {
+		mNPiecesAllocated *= 2;
+		mPieces = (Piece *) realloc(mPieces, mNPiecesAllocated * sizeof(Piece));
+	}
+	memmove(mPieces + i + 1, mPieces + i, (mNPieces - i) * sizeof(Piece));
+	mNPieces++;
+	mPieces[i].text = text;
+	mPieces[i].start = pos;
+	mPieces[i].length = len;
+	for (i++; i < mNPieces; i++)
+		mPieces[i].start += len;
+}
+
+
+/*
+ Unlink a range of text from the piece table. Pieces that become adjacent
+ in memory are merged again, so that undoing a delete does not fragment
+ the table.
+ */
+void fltk3::TextBuffer::piece_remove_(fltk3::TextPosition start, fltk3::TextPosition end)
+{
+	int a = split_piece(start);
+	int b = split_piece(end);
+	fltk3::TextPosition len = end - start;
+
+	memmove(mPieces + a, mPieces + b, (mNPieces - b) * sizeof(Piece));
+	mNPieces -= b - a;
+	for (int i = a; i < mNPieces; i++)
+		mPieces[i].start -= len;
+
+	if (a > 0 && a < mNPieces &&
+	    mPieces[a-1].text + mPieces[a-1].length == mPieces[a].text) {
+		mPieces[a-1].length += mPieces[a].length;
+		memmove(mPieces + a, mPieces + a + 1, (mNPieces - a - 1) * sizeof(Piece));
+		mNPieces--;
+	}
+	if (mPieceHint >= mNPieces)
+		mPieceHint = 0;
+}
+
 /*
  Return a UCS-4 character at the given index.
  Pos must be at a character boundary.
  */
-unsigned int fltk3::TextBuffer::char_at(int pos) const
+unsigned int fltk3::TextBuffer::char_at(fltk3::TextPosition pos) const
 {
 	if (pos < 0 || pos >= mLength)
 		return '\0';
@@ -256,7 +1210,7 @@ unsigned int fltk3::TextBuffer::char_at(int pos) const
  Return the raw byte at the given index.
  This function ignores all unicode encoding.
  */
-char fltk3::TextBuffer::byte_at(int pos) const
+char fltk3::TextBuffer::byte_at(fltk3::TextPosition pos) const
 {
 	if (pos < 0 || pos >= mLength)
 		return '\0';
@@ -269,7 +1223,7 @@ char fltk3::TextBuffer::byte_at(int pos) const
  Insert some text at the given index.
  Pos must be at a character boundary.
 */
-void fltk3::TextBuffer::insert(int pos, const char *text)
+void fltk3::TextBuffer::insert(fltk3::TextPosition pos, const char *text)
 {
 	IS_UTF8_ALIGNED2(this, (pos))
 	IS_UTF8_ALIGNED(text)
@@ -278,20 +1232,307 @@ void fltk3::TextBuffer::insert(int pos, const char *text)
 	if (!text || !*text)
 		return;
 
-	/* if pos is not contiguous to existing text, make it */
-	if (pos > mLength)
-		pos = mLength;
-	if (pos < 0)
-		pos = 0;
-
-	/* Even if nothing is deleted, we must call these callbacks */
-	call_predelete_callbacks(pos, 0);
+	/* if pos is not contiguous to existing text, make it */
+	if (pos > mLength)
+		pos = mLength;
+	if (pos < 0)
+		pos = 0;
+
+	if (mTailCapacity && pos == mLength) {
+		tail_append_(text, (fltk3::TextPosition) strlen(text));
+		return;
+	}
+	flush_appends();
+
+	/* Even if nothing is deleted, we must call these callbacks */
+	call_predelete_callbacks(pos, 0);
+
+	/* insert and redisplay */
+	fltk3::TextPosition nInserted = insert_(pos, text);
+	mCursorPosHint = pos + nInserted;
+	IS_UTF8_ALIGNED2(this, (mCursorPosHint))
+	call_modify_callbacks(pos, 0, nInserted, 0, NULL);
+}
+
+
+/*
+ Insert a string of known length.
+ Pos must be at a character boundary. Text must be a correct UTF-8 string.
+ */
+void fltk3::TextBuffer::insert(fltk3::TextPosition pos, const char *text, fltk3::TextPosition insertedLength)
+{
+	IS_UTF8_ALIGNED2(this, (pos))
+	IS_UTF8_ALIGNED(text)
+
+	if (!text || insertedLength <= 0)
+		return;
+
+	if (pos > mLength)
+		pos = mLength;
+	if (pos < 0)
+		pos = 0;
+
+	if (mTailCapacity && pos == mLength) {
+		tail_append_(text, insertedLength);
+		return;
+	}
+	flush_appends();
+
+	call_predelete_callbacks(pos, 0);
+	fltk3::TextPosition nInserted = insert_(pos, text, insertedLength);
+	mCursorPosHint = pos + nInserted;
+	IS_UTF8_ALIGNED2(this, (mCursorPosHint))
+	call_modify_callbacks(pos, 0, nInserted, 0, NULL);
+}
+
+
+/*
+ Turn tail mode on or off.
+ */
+void fltk3::TextBuffer::tail_mode(fltk3::TextPosition capacity)
+{
+	flush_appends();
+	if (capacity < 0)
+		capacity = 0;
+	if (capacity && !mTailCapacity)
+		mTailCanUndo = mCanUndo;
+	else if (!capacity && mTailCapacity)
+		canUndo(mTailCanUndo);
+	mTailCapacity = capacity;
+	if (mTailCapacity) {
+		canUndo(0);
+		trim_head_();
+	}
+}
+
+
+/*
+ Append text in tail mode. The text is inserted right away, but the modify
+ callbacks are only called once for all text appended until the timeout
+ fires or another change flushes them.
+ */
+void fltk3::TextBuffer::tail_append_(const char *text, fltk3::TextPosition len)
+{
+	if (len <= 0)
+		return;
+	if (!mTailPending) {
+		call_predelete_callbacks(mLength, 0);
+		mTailStart = mLength;
+		fltk3::add_timeout(TAIL_FLUSH_INTERVAL, tail_flush_cb, this);
+		// fltk3::wait() does not see a timeout added by another thread
+		if (!fl_thread_is_main())
+			fltk3::awake();
+	}
+	insert_(mLength, text, len);
+	mTailPending += len;
+	mCursorPosHint = mLength;
+	trim_head_();
+}
+
+
+/*
+ Deliver the modify callbacks for the text appended in tail mode.
+ */
+void fltk3::TextBuffer::flush_appends()
+{
+	if (!mTailPending)
+		return;
+	fltk3::TextPosition pos = mTailStart, nInserted = mTailPending;
+	mTailPending = 0;
+	fltk3::remove_timeout(tail_flush_cb, this);
+	call_modify_callbacks(pos, 0, nInserted, 0, NULL);
+}
+
+
+/*
+ Drop whole lines from the start of the buffer when it has grown beyond
+ its capacity in tail mode. The buffer may grow by an eighth of the
+ capacity before lines are dropped, so that the text is only moved once
+ for many appended lines.
+ */
+void fltk3::TextBuffer::trim_head_()
+{
+	if (!mTailCapacity || mLength - mTailCapacity <= mTailCapacity / 8)
+		return;
+	fltk3::TextPosition cut = utf8_align(mLength - mTailCapacity);
+	if (cut < mLength - mTailCapacity)
+		cut = next_char(cut);
+	fltk3::TextPosition newline;
+	if (findchar_forward(cut, '\n', &newline))
+		cut = newline + 1;
+	remove(0, cut);
+}
+
+
+/*
+ Start a batch of changes, or a nested batch inside of one.
+ */
+void fltk3::TextBuffer::begin_batch()
+{
+	if (mBatch) {
+		mBatch->mLevel++;
+		return;
+	}
+	flush_appends();
+	mBatch = new fltk3::TextBatch;
+	mBatch->mLevel = 1;
+	if (mCanUndo) {
+		if (!mHistory)
+			mHistory = new fltk3::TextHistory;
+		/* the first change of the batch must not be merged into an older step */
+		mHistory->mLastEdit = fltk3::TextHistory::EDIT_NONE;
+		mBatch->mHistory = mHistory;
+		mBatch->mUndoSize = mHistory->mUndo.size();
+		mBatch->mUndoDropped = mHistory->mUndo.dropped();
+	}
+}
+
+
+/*
+ End a batch of changes. When the outermost batch ends, the callbacks are
+ called for the range that covers all changes.
+ */
+void fltk3::TextBuffer::end_batch()
+{
+	if (!mBatch || --mBatch->mLevel > 0)
+		return;
+	/* appends in tail mode become part of the batch */
+	flush_appends();
+	fltk3::TextBatch *b = mBatch;
+	mBatch = NULL;
+	if (b->mStart < 0) {
+		delete b;
+		return;
+	}
+
+	fltk3::TextPosition start = b->mStart, nDeleted = b->mNDeleted;
+	fltk3::TextPosition nInserted = mLength - b->mSuffix - start;
+	b->mDeleted[nDeleted] = '\0';
+	batch_undo_(b);
+
+	if (mNPredeleteProcs)
+		batch_predelete_(b, nInserted);
+	call_modify_callbacks(start, nDeleted, nInserted, 0, b->mDeleted);
+	delete b;
+}
+
+
+/*
+ The predelete callbacks expect the old text to still be in the buffer, so
+ it is put in place while they run. In piece storage, the saved text of the
+ batch is linked in as a piece and the piece table is restored after. In
+ gap storage, the new text is moved behind the gap and hidden in it, and
+ the saved text is copied into the gap; restoring the gap brings it back.
+ */
+void fltk3::TextBuffer::batch_predelete_(fltk3::TextBatch *b, fltk3::TextPosition nInserted)
+{
+	fltk3::TextPosition start = b->mStart, nDeleted = b->mNDeleted;
+	fltk3::TextSelection primary = mPrimary, secondary = mSecondary,
+	                     highlight = mHighlight;
+	Piece *pieces = NULL;
+	int nPieces = mNPieces;
+	fltk3::TextPosition gapEnd = 0;
+
+	if (mLineIndex)
+		mLineIndex->removing(start, start + nInserted);
+	if (mStorageMode == PIECE_STORAGE) {
+		pieces = (Piece *) malloc(nPieces * sizeof(Piece));
+		memcpy(pieces, mPieces, nPieces * sizeof(Piece));
+		piece_remove_(start, start + nInserted);
+		if (nDeleted)
+			piece_link_(start, b->mDeleted, nDeleted);
+	} else {
+		move_gap(start);
+		if (mGapEnd - mGapStart < nDeleted)
+			reallocate_with_gap(start, nDeleted + max(mPreferredGapSize, mLength / 8));
+		gapEnd = mGapEnd;
+		memcpy(&mBuf[mGapStart], b->mDeleted, nDeleted);
+		mGapStart += nDeleted;
+		mGapEnd += nInserted;
+	}
+	mLength += nDeleted - nInserted;
+	if (mLineIndex)
+		mLineIndex->inserted(start, nDeleted);
+	update_selections(start, nInserted, nDeleted);
+
+	call_predelete_callbacks(start, nDeleted);
+
+	if (mLineIndex)
+		mLineIndex->removing(start, start + nDeleted);
+	if (mStorageMode == PIECE_STORAGE) {
+		memcpy(mPieces, pieces, nPieces * sizeof(Piece));
+		mNPieces = nPieces;
+		mPieceHint = 0;
+		free(pieces);
+	} else {
+		mGapStart = start;
+		mGapEnd = gapEnd;
+	}
+	mLength += nInserted - nDeleted;
+	if (mLineIndex)
+		mLineIndex->inserted(start, nInserted);
+	mPrimary = primary;
+	mSecondary = secondary;
+	mHighlight = highlight;
+}
+
+
+/*
+ Grow the changed range of the batch so that it includes the text between
+ start and end. Any part of that text that is outside of the range has not
+ changed since the batch started, so it is saved as original text.
+ */
+void fltk3::TextBuffer::batch_cover_(fltk3::TextPosition start, fltk3::TextPosition end) const
+{
+	fltk3::TextBatch *b = mBatch;
+	if (b->mStart < 0) {
+		b->reserve(end - start);
+		copy_text_(b->mDeleted, start, end);
+		b->mNDeleted = end - start;
+		b->mStart = start;
+		b->mSuffix = mLength - end;
+		return;
+	}
+	if (start < b->mStart) {
+		fltk3::TextPosition n = b->mStart - start;
+		b->reserve(b->mNDeleted + n);
+		memmove(b->mDeleted + n, b->mDeleted, b->mNDeleted);
+		copy_text_(b->mDeleted, start, b->mStart);
+		b->mNDeleted += n;
+		b->mStart = start;
+	}
+	fltk3::TextPosition rangeEnd = mLength - b->mSuffix;
+	if (end > rangeEnd) {
+		fltk3::TextPosition n = end - rangeEnd;
+		b->reserve(b->mNDeleted + n);
+		copy_text_(b->mDeleted + b->mNDeleted, rangeEnd, end);
+		b->mNDeleted += n;
+		b->mSuffix = mLength - end;
+	}
+}
+
 
-	/* insert and redisplay */
-	int nInserted = insert_(pos, text);
-	mCursorPosHint = pos + nInserted;
-	IS_UTF8_ALIGNED2(this, (mCursorPosHint))
-	call_modify_callbacks(pos, 0, nInserted, 0, NULL);
+/*
+ Replace the undo steps recorded during a batch by a single step that
+ restores the original text of the changed range. Nothing is combined if
+ the batch replayed the history, or if the history was deleted meanwhile.
+ */
+void fltk3::TextBuffer::batch_undo_(fltk3::TextBatch *b)
+{
+	fltk3::TextHistory *h = mHistory;
+	if (!mCanUndo || !h || h != b->mHistory || b->mReplayed)
+		return;
+	TextUndoStack &u = h->mUndo;
+	int first = max(0, b->mUndoSize - (u.dropped() - b->mUndoDropped));
+	if (u.size() - first < 2)
+		return;
+	while (u.size() > first)
+		u.pop();
+	fltk3::TextPosition nInserted = mLength - b->mSuffix - b->mStart;
+	memcpy(u.push(b->mStart, b->mNDeleted, nInserted, b->mNDeleted),
+	       b->mDeleted, b->mNDeleted);
+	h->mLastEdit = fltk3::TextHistory::EDIT_NONE;
+	h->limit(mUndoLimit);
 }
 
 
@@ -299,7 +1540,7 @@ void fltk3::TextBuffer::insert(int pos, const char *text)
  Replace a range of text with new text.
  Start and end must be at a character boundary.
 */
-void fltk3::TextBuffer::replace(int start, int end, const char *text)
+void fltk3::TextBuffer::replace(fltk3::TextPosition start, fltk3::TextPosition end, const char *text)
 {
 	// Range check...
 	if (!text)
@@ -313,10 +1554,11 @@ void fltk3::TextBuffer::replace(int start, int end, const char *text)
 	IS_UTF8_ALIGNED2(this, (end))
 	IS_UTF8_ALIGNED(text)
 
+	flush_appends();
 	call_predelete_callbacks(start, end - start);
 	const char *deletedText = text_range(start, end);
 	remove_(start, end);
-	int nInserted = insert_(start, text);
+	fltk3::TextPosition nInserted = insert_(start, text);
 	mCursorPosHint = start + nInserted;
 	call_modify_callbacks(start, end - start, nInserted, 0, deletedText);
 	free((void *) deletedText);
@@ -327,11 +1569,11 @@ void fltk3::TextBuffer::replace(int start, int end, const char *text)
  Remove a range of text.
  Start and End must be at a character boundary.
 */
-void fltk3::TextBuffer::remove(int start, int end)
+void fltk3::TextBuffer::remove(fltk3::TextPosition start, fltk3::TextPosition end)
 {
 	/* Make sure the arguments make sense */
 	if (start > end) {
-		int temp = start;
+		fltk3::TextPosition temp = start;
 		start = end;
 		end = temp;
 	}
@@ -350,6 +1592,8 @@ void fltk3::TextBuffer::remove(int start, int end)
 	if (start == end)
 		return;
 
+	flush_appends();
+
 	call_predelete_callbacks(start, end - start);
 	/* Remove and redisplay */
 	const char *deletedText = text_range(start, end);
@@ -364,96 +1608,282 @@ void fltk3::TextBuffer::remove(int start, int end)
  Copy a range of text from another text buffer.
  fromStart, fromEnd, and toPos must be at a character boundary.
  */
-void fltk3::TextBuffer::copy(fltk3::TextBuffer * fromBuf, int fromStart,
-                             int fromEnd, int toPos)
+void fltk3::TextBuffer::copy(fltk3::TextBuffer * fromBuf, fltk3::TextPosition fromStart,
+                             fltk3::TextPosition fromEnd, fltk3::TextPosition toPos)
 {
 	IS_UTF8_ALIGNED2(fromBuf, fromStart)
 	IS_UTF8_ALIGNED2(fromBuf, fromEnd)
 	IS_UTF8_ALIGNED2(this, (toPos))
 
-	int copiedLength = fromEnd - fromStart;
+	fltk3::TextPosition copiedLength = fromEnd - fromStart;
+	if (copiedLength <= 0)
+		return;
+	flush_appends();
+	if (mBatch)
+		batch_cover_(toPos, toPos);
+
+	if (mStorageMode == PIECE_STORAGE) {
+		/* copy through a temporary if source and destination are the same
+		 table, because linking in the new piece may split the source */
+		if (fromBuf == this) {
+			char *tmp = (char *) malloc(copiedLength);
+			copy_text_(tmp, fromStart, fromEnd);
+			memcpy(piece_insert_(toPos, copiedLength), tmp, copiedLength);
+			free(tmp);
+		} else {
+			fromBuf->copy_text_(piece_insert_(toPos, copiedLength), fromStart, fromEnd);
+		}
+		mLength += copiedLength;
+		if (mLineIndex)
+			mLineIndex->inserted(toPos, copiedLength);
+		update_selections(toPos, 0, copiedLength);
+		record_insert(toPos, copiedLength);
+		return;
+	}
 
 	/* Prepare the buffer to receive the new text.  If the new text fits in
 	 the current buffer, just move the gap (if necessary) to where
 	 the text should be inserted.  If the new text is too large, reallocate
 	 the buffer with a gap large enough to accomodate the new text and a
-	 gap of mPreferredGapSize */
+	 gap of mPreferredGapSize, or of an eighth of the text if that is larger,
+	 so that a growing buffer is not copied again for every few kilobytes */
 	if (copiedLength > mGapEnd - mGapStart)
-		reallocate_with_gap(toPos, copiedLength + mPreferredGapSize);
+		reallocate_with_gap(toPos, copiedLength + max(mPreferredGapSize, mLength / 8));
 	else if (toPos != mGapStart)
 		move_gap(toPos);
 
-	/* Insert the new text (toPos now corresponds to the start of the gap) */
-	if (fromEnd <= fromBuf->mGapStart) {
-		memcpy(&mBuf[toPos], &fromBuf->mBuf[fromStart], copiedLength);
-	} else if (fromStart >= fromBuf->mGapStart) {
-		memcpy(&mBuf[toPos],
-		       &fromBuf->mBuf[fromStart + (fromBuf->mGapEnd - fromBuf->mGapStart)],
-		       copiedLength);
-	} else {
-		int part1Length = fromBuf->mGapStart - fromStart;
-		memcpy(&mBuf[toPos], &fromBuf->mBuf[fromStart], part1Length);
-		memcpy(&mBuf[toPos + part1Length],
-		       &fromBuf->mBuf[fromBuf->mGapEnd], copiedLength - part1Length);
-	}
+	/* Insert the new text (toPos now corresponds to the start of the gap).
+	 When copying within the same buffer, the source positions after toPos
+	 have moved behind the gap, which copy_text_() takes care of. */
+	fromBuf->copy_text_(&mBuf[toPos], fromStart, fromEnd);
 	mGapStart += copiedLength;
 	mLength += copiedLength;
+	if (mLineIndex)
+		mLineIndex->inserted(toPos, copiedLength);
 	update_selections(toPos, 0, copiedLength);
+	record_insert(toPos, copiedLength);
 }
 
 
 /*
- Take the previous changes and undo them. Return the previous
- cursor position in cursorPos. Returns 1 if the undo was applied.
- CursorPos will be at a character boundary.
+ Undo the newest step of the history: remove the text it inserted, and put
+ back the text it deleted. The removed text is saved on the redo stack.
+ Returns the cursor position after the undone step in cursorPos.
+ Returns 1 if the undo was applied.
  */
-int fltk3::TextBuffer::undo(int *cursorPos)
+int fltk3::TextBuffer::undo(fltk3::TextPosition *cursorPos)
 {
-	if (undowidget != this || (!undocut && !undoinsert && !mCanUndo))
+	if (!can_undo())
 		return 0;
 
-	int ilen = undocut;
-	int xlen = undoinsert;
-	int b = undoat - xlen;
-
-	if (xlen && undoyankcut && !ilen) {
-		ilen = undoyankcut;
-	}
-
-	if (xlen && ilen) {
-		undobuffersize(ilen + 1);
-		undobuffer[ilen] = 0;
-		char *tmp = strdup(undobuffer);
-		replace(b, undoat, tmp);
-		if (cursorPos)
-			*cursorPos = mCursorPosHint;
-		free(tmp);
-	} else if (xlen) {
-		remove(b, undoat);
-		if (cursorPos)
-			*cursorPos = mCursorPosHint;
-	} else if (ilen) {
-		undobuffersize(ilen + 1);
-		undobuffer[ilen] = 0;
-		insert(undoat, undobuffer);
-		if (cursorPos)
-			*cursorPos = mCursorPosHint;
-		undoyankcut = 0;
-	}
+	flush_appends();
+	if (mBatch)
+		mBatch->mReplayed = 1;
+	fltk3::TextHistory *h = mHistory;
+	TextUndoStep step = *h->mUndo.top();
+	fltk3::TextPosition end = step.pos + step.nInserted;
+	char *removed = h->mRedo.push(step.pos, step.nDeleted, step.nInserted, step.nInserted);
+	copy_text_(removed, step.pos, end);
+
+	call_predelete_callbacks(step.pos, step.nInserted);
+	h->mReplaying = 1;
+	remove_(step.pos, end);
+	insert_(step.pos, h->mUndo.text(h->mUndo.top()), step.nDeleted);
+	h->mReplaying = 0;
+	h->mUndo.pop();
+	h->mLastEdit = fltk3::TextHistory::EDIT_NONE;
+	h->limit(mUndoLimit);
+
+	mCursorPosHint = step.pos + step.nDeleted;
+	if (cursorPos)
+		*cursorPos = mCursorPosHint;
+	call_modify_callbacks(step.pos, step.nInserted, step.nDeleted, 0, removed);
+	return 1;
+}
+
+
+/*
+ Redo the newest undone step: the mirror image of undo().
+ */
+int fltk3::TextBuffer::redo(fltk3::TextPosition *cursorPos)
+{
+	if (!can_redo())
+		return 0;
 
+	flush_appends();
+	if (mBatch)
+		mBatch->mReplayed = 1;
+	fltk3::TextHistory *h = mHistory;
+	TextUndoStep step = *h->mRedo.top();
+	fltk3::TextPosition end = step.pos + step.nDeleted;
+	char *removed = h->mUndo.push(step.pos, step.nDeleted, step.nInserted, step.nDeleted);
+	copy_text_(removed, step.pos, end);
+
+	call_predelete_callbacks(step.pos, step.nDeleted);
+	h->mReplaying = 1;
+	remove_(step.pos, end);
+	insert_(step.pos, h->mRedo.text(h->mRedo.top()), step.nInserted);
+	h->mReplaying = 0;
+	h->mRedo.pop();
+	h->mLastEdit = fltk3::TextHistory::EDIT_NONE;
+	h->limit(mUndoLimit);
+
+	mCursorPosHint = step.pos + step.nInserted;
+	if (cursorPos)
+		*cursorPos = mCursorPosHint;
+	call_modify_callbacks(step.pos, step.nDeleted, step.nInserted, 0, removed);
 	return 1;
 }
 
 
+int fltk3::TextBuffer::can_undo() const
+{
+	return mCanUndo && mHistory && mHistory->mUndo.size();
+}
+
+
+int fltk3::TextBuffer::can_redo() const
+{
+	return mCanUndo && mHistory && mHistory->mRedo.size();
+}
+
+
 /*
  Set a flag if undo function will work.
  */
 void fltk3::TextBuffer::canUndo(char flag)
 {
 	mCanUndo = flag;
-	// disabling undo also clears the last undo operation!
-	if (!mCanUndo && undowidget==this)
-		undowidget = 0;
+	// disabling undo also clears the history!
+	if (!mCanUndo)
+		free_history();
+}
+
+
+/*
+ Set the memory limit of the undo history.
+ */
+void fltk3::TextBuffer::undo_limit(fltk3::TextPosition bytes)
+{
+	mUndoLimit = bytes > 0 ? bytes : 0;
+	if (mHistory)
+		mHistory->limit(mUndoLimit);
+}
+
+
+/*
+ Record an insertion in the undo history. The inserted text is in the
+ buffer, so nothing is copied. Typing right after the previous insertion,
+ and inserting where a deletion just happened, extend the newest step.
+ Typing a newline ends the step.
+ */
+void fltk3::TextBuffer::record_insert(fltk3::TextPosition pos, fltk3::TextPosition nInserted)
+{
+	if (!mCanUndo || (mHistory && mHistory->mReplaying))
+		return;
+	if (!mHistory)
+		mHistory = new fltk3::TextHistory;
+
+	fltk3::TextHistory *h = mHistory;
+	TextUndoStep *top = h->mUndo.top();
+	h->mRedo.clear();
+	if (top && pos == top->pos + top->nInserted
+	    && ((nInserted <= UNDO_TYPING_SIZE
+	         && (h->mLastEdit == fltk3::TextHistory::EDIT_TYPE
+	             || h->mLastEdit == fltk3::TextHistory::EDIT_ERASE))
+	        || (top->nInserted == 0
+	            && (h->mLastEdit == fltk3::TextHistory::EDIT_ERASE
+	                || h->mLastEdit == fltk3::TextHistory::EDIT_DELETE)))) {
+		top->nInserted += nInserted;
+	} else {
+		h->mUndo.push(pos, 0, nInserted, 0);
+		h->limit(mUndoLimit);
+	}
+	h->mLastEdit = fltk3::TextHistory::EDIT_NONE;
+	if (nInserted <= UNDO_TYPING_SIZE) {
+		h->mLastEdit = fltk3::TextHistory::EDIT_TYPE;
+		for (fltk3::TextPosition i = pos; i < pos + nInserted; i++)
+			if (byte_at(i) == '\n')
+				h->mLastEdit = fltk3::TextHistory::EDIT_NONE;
+	}
+}
+
+
+/*
+ Record a deletion in the undo history and save the deleted text. Erasing
+ the end of the text just typed shrinks the newest step, and backspace or
+ delete next to the previous deletion extends its saved text.
+ */
+void fltk3::TextBuffer::record_remove(fltk3::TextPosition start, fltk3::TextPosition end)
+{
+	if (!mCanUndo || (mHistory && mHistory->mReplaying) || start >= end)
+		return;
+	if (!mHistory)
+		mHistory = new fltk3::TextHistory;
+
+	fltk3::TextHistory *h = mHistory;
+	TextUndoStep *top = h->mUndo.top();
+	fltk3::TextPosition n = end - start;
+	h->mRedo.clear();
+
+	/* a deletion larger than the limit could never be undone, and all
+	 older steps would have to be dropped to make room for it */
+	if (mUndoLimit > 0 && n > mUndoLimit - (fltk3::TextPosition) sizeof(TextUndoStep)) {
+		h->clear();
+		return;
+	}
+
+	if (top && n <= UNDO_TYPING_SIZE
+	    && (h->mLastEdit == fltk3::TextHistory::EDIT_TYPE
+	        || h->mLastEdit == fltk3::TextHistory::EDIT_ERASE)) {
+		if (start >= top->pos && end == top->pos + top->nInserted) {
+			/* erasing what was just typed */
+			top->nInserted -= n;
+			h->mLastEdit = fltk3::TextHistory::EDIT_ERASE;
+			if (top->nInserted == 0 && top->nDeleted == 0) {
+				h->mUndo.pop();
+				h->mLastEdit = fltk3::TextHistory::EDIT_NONE;
+			}
+			return;
+		}
+		if (top->nInserted == 0 && top->nDeleted < UNDO_MERGE_LIMIT) {
+			if (end == top->pos) {
+				/* backspace: the text goes in front of the saved text */
+				char *t = h->mUndo.grow_top(n);
+				memmove(t + n, t, top->nDeleted);
+				copy_text_(t, start, end);
+				top->pos = start;
+				top->nDeleted += n;
+				h->mLastEdit = fltk3::TextHistory::EDIT_ERASE;
+				h->limit(mUndoLimit);
+				return;
+			}
+			if (start == top->pos) {
+				/* delete: the text goes after the saved text */
+				char *t = h->mUndo.grow_top(n);
+				copy_text_(t + top->nDeleted, start, end);
+				top->nDeleted += n;
+				h->mLastEdit = fltk3::TextHistory::EDIT_ERASE;
+				h->limit(mUndoLimit);
+				return;
+			}
+		}
+	}
+
+	copy_text_(h->mUndo.push(start, n, 0, n), start, end);
+	h->mLastEdit = n <= UNDO_TYPING_SIZE
+	               ? fltk3::TextHistory::EDIT_ERASE : fltk3::TextHistory::EDIT_DELETE;
+	h->limit(mUndoLimit);
+}
+
+
+/*
+ Delete the undo history.
+ */
+void fltk3::TextBuffer::free_history()
+{
+	delete mHistory;
+	mHistory = NULL;
 }
 
 
@@ -468,6 +1898,7 @@ void fltk3::TextBuffer::tab_distance(int tabDist)
 {
 	/* First call the pre-delete callbacks with the previous tab setting
 	 still active. */
+	flush_appends();
 	call_predelete_callbacks(0, mLength);
 
 	/* Change the tab setting */
@@ -485,7 +1916,7 @@ void fltk3::TextBuffer::tab_distance(int tabDist)
  Select a range of text.
  Start and End must be at a character boundary.
  */
-void fltk3::TextBuffer::select(int start, int end)
+void fltk3::TextBuffer::select(fltk3::TextPosition start, fltk3::TextPosition end)
 {
 	IS_UTF8_ALIGNED2(this, (start))
 	IS_UTF8_ALIGNED2(this, (end))
@@ -512,7 +1943,7 @@ void fltk3::TextBuffer::unselect()
 /*
  Return the primary selection range.
  */
-int fltk3::TextBuffer::selection_position(int *start, int *end)
+int fltk3::TextBuffer::selection_position(fltk3::TextPosition *start, fltk3::TextPosition *end)
 {
 	return mPrimary.position(start, end);
 }
@@ -549,7 +1980,7 @@ void fltk3::TextBuffer::replace_selection(const char *text)
  Select text.
  Start and End must be at a character boundary.
  */
-void fltk3::TextBuffer::secondary_select(int start, int end)
+void fltk3::TextBuffer::secondary_select(fltk3::TextPosition start, fltk3::TextPosition end)
 {
 	fltk3::TextSelection oldSelection = mSecondary;
 
@@ -573,7 +2004,7 @@ void fltk3::TextBuffer::secondary_unselect()
 /*
  Return the selected range.
  */
-int fltk3::TextBuffer::secondary_selection_position(int *start, int *end)
+int fltk3::TextBuffer::secondary_selection_position(fltk3::TextPosition *start, fltk3::TextPosition *end)
 {
 	return mSecondary.position(start, end);
 }
@@ -610,7 +2041,7 @@ void fltk3::TextBuffer::replace_secondary_selection(const char *text)
  Highlight a range of text.
  Start and End must be at a character boundary.
  */
-void fltk3::TextBuffer::highlight(int start, int end)
+void fltk3::TextBuffer::highlight(fltk3::TextPosition start, fltk3::TextPosition end)
 {
 	fltk3::TextSelection oldSelection = mHighlight;
 
@@ -634,7 +2065,7 @@ void fltk3::TextBuffer::unhighlight()
 /*
  Return position of highlight.
  */
-int fltk3::TextBuffer::highlight_position(int *start, int *end)
+int fltk3::TextBuffer::highlight_position(fltk3::TextPosition *start, fltk3::TextPosition *end)
 {
 	return mHighlight.position(start, end);
 }
@@ -655,6 +2086,8 @@ char *fltk3::TextBuffer::highlight_text()
 void fltk3::TextBuffer::add_modify_callback(fltk3::TextModifyCb bufModifiedCB,
                 void *cbArg)
 {
+	/* the new callback must not see appends that happened before it */
+	flush_appends();
 	fltk3::TextModifyCb *newModifyProcs = new fltk3::TextModifyCb[mNModifyProcs + 1];
 	void **newCBArgs = new void *[mNModifyProcs + 1];
 	for (int i = 0; i < mNModifyProcs; i++) {
@@ -681,6 +2114,9 @@ void fltk3::TextBuffer::remove_modify_callback(fltk3::TextModifyCb bufModifiedCB
 {
 	int i, toRemove = -1;
 
+	/* the callback must not miss appends that happened before */
+	flush_appends();
+
 	/* find the matching callback to remove */
 	for (i = 0; i < mNModifyProcs; i++) {
 		if (mModifyProcs[i] == bufModifiedCB && mCbArgs[i] == cbArg) {
@@ -795,208 +2231,605 @@ void fltk3::TextBuffer::remove_predelete_callback(fltk3::TextPredeleteCb bufPreD
 
 
 /*
- Return a copy of the line that contains a given index.
- Pos must be at a character boundary.
+ Return a copy of the line that contains a given index.
+ Pos must be at a character boundary.
+ */
+char *fltk3::TextBuffer::line_text(fltk3::TextPosition pos) const
+{
+	return text_range(line_start(pos), line_end(pos));
+}
+
+
+/*
+ Find the beginning of the line.
+ */
+fltk3::TextPosition fltk3::TextBuffer::line_start(fltk3::TextPosition pos) const
+{
+	if (!findchar_backward(pos, '\n', &pos))
+		return 0;
+	return pos + 1;
+}
+
+
+/*
+ Find the end of the line.
+ */
+fltk3::TextPosition fltk3::TextBuffer::line_end(fltk3::TextPosition pos) const
+{
+	if (!findchar_forward(pos, '\n', &pos))
+		pos = mLength;
+	return pos;
+}
+
+
+/*
+ Find the beginning of a word.
+ NOT UNICODE SAFE.
+ */
+fltk3::TextPosition fltk3::TextBuffer::word_start(fltk3::TextPosition pos) const
+{
+	// FIXME: character is ucs-4
+	while (pos>0 && (isalnum(char_at(pos)) || char_at(pos) == '_')) {
+		pos = prev_char(pos);
+	}
+	// FIXME: character is ucs-4
+	if (!(isalnum(char_at(pos)) || char_at(pos) == '_'))
+		pos = next_char(pos);
+	return pos;
+}
+
+
+/*
+ Find the end of a word.
+ NOT UNICODE SAFE.
+ */
+fltk3::TextPosition fltk3::TextBuffer::word_end(fltk3::TextPosition pos) const
+{
+	// FIXME: character is ucs-4
+	while (pos < length() && (isalnum(char_at(pos)) || char_at(pos) == '_')) {
+		pos = next_char(pos);
+	}
+	return pos;
+}
+
+
+/*
+ Count the number of characters between two positions.
+ */
+fltk3::TextPosition fltk3::TextBuffer::count_displayed_characters(fltk3::TextPosition lineStartPos,
+                fltk3::TextPosition targetPos) const
+{
+	IS_UTF8_ALIGNED2(this, (lineStartPos))
+	IS_UTF8_ALIGNED2(this, (targetPos))
+
+	fltk3::TextPosition charCount = 0;
+
+	fltk3::TextPosition pos = lineStartPos;
+	while (pos < targetPos) {
+		pos = next_char(pos);
+		charCount++;
+	}
+	return charCount;
+}
+
+
+/*
+ Skip ahead a number of characters from a given index.
+ This function breaks early if it encounters a newline character.
+ */
+fltk3::TextPosition fltk3::TextBuffer::skip_displayed_characters(fltk3::TextPosition lineStartPos, int nChars)
+{
+	IS_UTF8_ALIGNED2(this, (lineStartPos))
+
+	fltk3::TextPosition pos = lineStartPos;
+
+	for (int charCount = 0; charCount < nChars && pos < mLength; charCount++) {
+		unsigned int c = char_at(pos);
+		if (c == '\n')
+			return pos;
+		pos = next_char(pos);
+	}
+	return pos;
+}
+
+
+/*
+ Count the number of newline characters between start and end.
+ startPos and endPos must be at a character boundary.
+ Long ranges are looked up in the line index.
+ */
+fltk3::TextPosition fltk3::TextBuffer::count_lines(fltk3::TextPosition startPos, fltk3::TextPosition endPos) const
+{
+	IS_UTF8_ALIGNED2(this, (startPos))
+	IS_UTF8_ALIGNED2(this, (endPos))
+
+	if (endPos > mLength)
+		endPos = mLength;
+	if (endPos - startPos <= LINE_INDEX_SCAN_LIMIT)
+		return scan_lines(startPos, endPos);
+	fltk3::TextLineIndex *index = line_index();
+	return index->position_to_line(endPos) - index->position_to_line(startPos);
+}
+
+
+/*
+ Count the number of newline characters between start and end by looking
+ at every byte. This function is optimized for speed by not using UTF-8 calls
+ and by counting a whole segment at a time.
+ */
+fltk3::TextPosition fltk3::TextBuffer::scan_lines(fltk3::TextPosition startPos, fltk3::TextPosition endPos) const
+{
+	fltk3::TextPosition lineCount = 0;
+
+	if (endPos > mLength)
+		endPos = mLength;
+	fltk3::TextPosition pos = startPos;
+	while (pos < endPos) {
+		int n;
+		const char *s = segment(pos, &n);
+		if (n > endPos - pos)
+			n = (int) (endPos - pos);
+		lineCount += fl_count_byte(s, n, '\n');
+		pos += n;
+	}
+	return lineCount;
+}
+
+
+/*
+ Skip to the first character, n lines ahead.
+ StartPos must be at a character boundary.
+ Nearby lines are found by scanning, distant ones through the line index.
+ */
+fltk3::TextPosition fltk3::TextBuffer::skip_lines(fltk3::TextPosition startPos, fltk3::TextPosition nLines)
+{
+	IS_UTF8_ALIGNED2(this, (startPos))
+
+	if (nLines == 0)
+		return startPos;
+	if (nLines < 0)
+		nLines = 1;
+
+	fltk3::TextPosition pos = startPos;
+	fltk3::TextPosition lineCount = 0;
+	while (pos < mLength) {
+		if (pos - startPos >= LINE_INDEX_SCAN_LIMIT) {
+			fltk3::TextLineIndex *index = line_index();
+			if (nLines > index->lines())
+				return mLength;
+			return index->line_to_position(index->position_to_line(startPos) + nLines);
+		}
+		int n;
+		const char *s = segment(pos, &n);
+		if (n > LINE_INDEX_SCAN_LIMIT)
+			n = LINE_INDEX_SCAN_LIMIT;
+		int count = (int) min(nLines - lineCount, INT_MAX), wanted = count;
+		const char *nl = fl_find_nth_byte(s, n, '\n', &count);
+		if (nl) {
+			IS_UTF8_ALIGNED2(this, (pos+(nl-s)+1))
+			return pos + (int) (nl - s) + 1;
+		}
+		lineCount += wanted - count;
+		pos += n;
+	}
+	IS_UTF8_ALIGNED2(this, (pos))
+	return pos;
+}
+
+
+/*
+ Skip to the first character, n lines back.
+ StartPos must be at a character boundary.
+ Nearby lines are found by scanning, distant ones through the line index.
+ */
+fltk3::TextPosition fltk3::TextBuffer::rewind_lines(fltk3::TextPosition startPos, fltk3::TextPosition nLines)
+{
+	IS_UTF8_ALIGNED2(this, (startPos))
+
+	fltk3::TextPosition pos = startPos - 1;
+	if (pos <= 0)
+		return 0;
+	if (nLines < 0)
+		nLines = 0;
+
+	fltk3::TextPosition lineCount = -1;
+	while (pos >= 0) {
+		if (startPos - pos > LINE_INDEX_SCAN_LIMIT) {
+			fltk3::TextLineIndex *index = line_index();
+			return index->line_to_position(index->position_to_line(startPos) - nLines);
+		}
+		int n;
+		const char *s = segment_before(pos + 1, &n);
+		if (n > LINE_INDEX_SCAN_LIMIT) {
+			s += n - LINE_INDEX_SCAN_LIMIT;
+			n = LINE_INDEX_SCAN_LIMIT;
+		}
+		fltk3::TextPosition segStart = pos + 1 - n;
+		int count = (int) min(nLines - lineCount, INT_MAX), wanted = count;
+		const char *nl = fl_find_nth_byte_back(s, n, '\n', &count);
+		if (nl) {
+			IS_UTF8_ALIGNED2(this, (segStart+(nl-s)+1))
+			return segStart + (int) (nl - s) + 1;
+		}
+		lineCount += wanted - count;
+		pos = segStart - 1;
+	}
+	return 0;
+}
+
+
+/*
+ Return the line number of a position.
+ Short distances from the start of the buffer are scanned.
+ */
+fltk3::TextPosition fltk3::TextBuffer::position_to_line(fltk3::TextPosition pos) const
+{
+	if (pos <= LINE_INDEX_SCAN_LIMIT)
+		return scan_lines(0, pos);
+	return line_index()->position_to_line(pos);
+}
+
+
+/*
+ Return the start position of a line.
+ */
+fltk3::TextPosition fltk3::TextBuffer::line_to_position(fltk3::TextPosition lineNum) const
+{
+	if (lineNum <= 0)
+		return 0;
+	return line_index()->line_to_position(lineNum);
+}
+
+
+/*
+ Create the line index on first use.
+ */
+fltk3::TextLineIndex *fltk3::TextBuffer::line_index() const
+{
+	if (!mLineIndex)
+		mLineIndex = new fltk3::TextLineIndex(this);
+	return mLineIndex;
+}
+
+
+/*
+ Delete the line index.
  */
-char *fltk3::TextBuffer::line_text(int pos) const
+void fltk3::TextBuffer::free_line_index()
 {
-	return text_range(line_start(pos), line_end(pos));
+	delete mLineIndex;
+	mLineIndex = NULL;
 }
 
 
 /*
- Find the beginning of the line.
+ Return 1 if only ASCII characters have the same lower case as the ASCII
+ character c. A case insensitive match of c is then one of at most two
+ known bytes.
  */
-int fltk3::TextBuffer::line_start(int pos) const
+static int ascii_case_is_closed(unsigned int c)
 {
-	if (!findchar_backward(pos, '\n', &pos))
-		return 0;
-	return pos + 1;
+	static char closed[128];
+	static int initialized = 0;
+	if (!initialized) {
+		memset(closed, 1, sizeof(closed));
+		for (unsigned int ucs = 0x80; ucs < 0x10000; ucs++) {
+			int lower = fltk3::tolower(ucs);
+			if (lower >= 0 && lower < 0x80)
+				closed[lower] = 0;
+		}
+		initialized = 1;
+	}
+	return closed[fltk3::tolower(c) & 0x7f];
 }
 
 
 /*
- Find the end of the line.
+ Return the upper case of an ASCII letter, leave other bytes alone.
  */
-int fltk3::TextBuffer::line_end(int pos) const
+static char ascii_upper(char c)
 {
-	if (!findchar_forward(pos, '\n', &pos))
-		pos = mLength;
-	return pos;
+	return (c >= 'a' && c <= 'z') ? (char) (c - 'a' + 'A') : c;
 }
 
 
 /*
- Find the beginning of a word.
- NOT UNICODE SAFE.
+ Compare the buffer at pos with a string, ignoring case. Returns the end of
+ the match, or -1.
  */
-int fltk3::TextBuffer::word_start(int pos) const
+static fltk3::TextPosition match_nocase(const fltk3::TextBuffer *buf,
+                                        fltk3::TextPosition pos, const char *sp)
 {
-	// FIXME: character is ucs-4
-	while (pos>0 && (isalnum(char_at(pos)) || char_at(pos) == '_')) {
-		pos = prev_char(pos);
+	for (;;) {
+		if (!*sp)
+			return pos;
+		if (pos >= buf->length())
+			return -1;
+		int l;
+		unsigned int b = buf->char_at(pos);
+		unsigned int s = fltk3::utf8decode(sp, 0, &l);
+		if (fltk3::tolower(b) != fltk3::tolower(s))
+			return -1;
+		sp += l;
+		pos = buf->next_char(pos);
 	}
-	// FIXME: character is ucs-4
-	if (!(isalnum(char_at(pos)) || char_at(pos) == '_'))
-		pos = next_char(pos);
-	return pos;
 }
 
 
 /*
- Find the end of a word.
- NOT UNICODE SAFE.
+ Prepare a search string.
  */
-int fltk3::TextBuffer::word_end(int pos) const
+fltk3::TextSearch::TextSearch(const char *searchString, int matchCase)
 {
-	// FIXME: character is ucs-4
-	while (pos < length() && (isalnum(char_at(pos)) || char_at(pos) == '_')) {
-		pos = next_char(pos);
-	}
-	return pos;
+	mText = NULL;
+	set(searchString, matchCase);
 }
 
 
 /*
- Count the number of characters between two positions.
+ Free the search string.
  */
-int fltk3::TextBuffer::count_displayed_characters(int lineStartPos,
-                int targetPos) const
+fltk3::TextSearch::~TextSearch()
 {
-	IS_UTF8_ALIGNED2(this, (lineStartPos))
-	IS_UTF8_ALIGNED2(this, (targetPos))
+	free(mText);
+}
 
-	int charCount = 0;
 
-	int pos = lineStartPos;
-	while (pos < targetPos) {
-		pos = next_char(pos);
-		charCount++;
+/*
+ Copy the search string and build the fold table.
+ */
+void fltk3::TextSearch::set(const char *searchString, int matchCase)
+{
+	if (!searchString)
+		searchString = "";
+	free(mText);
+	mText = strdup(searchString);
+	mLength = (int) strlen(mText);
+	mMatchCase = matchCase ? 1 : 0;
+
+	int i;
+	for (i = 0; i < 256; i++)
+		mFold[i] = (unsigned char) i;
+	mByteMode = 1;
+	if (!mMatchCase) {
+		/* folding bytes is only exact if every character of the string is
+		 ASCII and shares its lower case with ASCII characters only */
+		for (i = 0; i < mLength; i++) {
+			unsigned char c = (unsigned char) mText[i];
+			if (c >= 0x80 || !ascii_case_is_closed(c)) {
+				mByteMode = 0;
+				break;
+			}
+		}
+		if (mByteMode) {
+			for (i = 'A'; i <= 'Z'; i++)
+				mFold[i] = (unsigned char) (i - 'A' + 'a');
+			for (i = 0; i < mLength; i++)
+				mText[i] = (char) mFold[(unsigned char) mText[i]];
+		}
 	}
-	return charCount;
 }
 
 
 /*
- Skip ahead a number of characters from a given index.
- This function breaks early if it encounters a newline character.
+ Find the first match in a contiguous run of bytes. The candidates are the
+ positions where the first and last bytes match in either case, which are
+ found many bytes at a time, and only these are compared in full.
  */
-int fltk3::TextBuffer::skip_displayed_characters(int lineStartPos, int nChars)
+const char *fltk3::TextSearch::find_in(const char *s, int n) const
 {
-	IS_UTF8_ALIGNED2(this, (lineStartPos))
-
-	int pos = lineStartPos;
-
-	for (int charCount = 0; charCount < nChars && pos < mLength; charCount++) {
-		unsigned int c = char_at(pos);
-		if (c == '\n')
-			return pos;
-		pos = next_char(pos);
+	int m = mLength;
+	const unsigned char *pat = (const unsigned char *) mText;
+	char first = mText[0], last = mText[m - 1];
+	char first2 = mMatchCase ? first : ascii_upper(first);
+	char last2 = mMatchCase ? last : ascii_upper(last);
+	for (const char *p = s; ; p++) {
+		p = fl_find_byte_pair(p, (int) (s + n - p), first, first2, last, last2, m - 1);
+		if (!p)
+			return NULL;
+		const unsigned char *q = (const unsigned char *) p;
+		int j = 1;
+		while (j < m - 1 && mFold[q[j]] == pat[j])
+			j++;
+		if (j >= m - 1)
+			return p;
 	}
-	return pos;
 }
 
 
 /*
- Count the number of newline characters between start and end.
- startPos and endPos must be at a character boundary.
- This function is optimized for speed by not using UTF-8 calls.
+ Find the last match in a contiguous run of bytes.
  */
-int fltk3::TextBuffer::count_lines(int startPos, int endPos) const
+const char *fltk3::TextSearch::find_back_in(const char *s, int n) const
 {
-	IS_UTF8_ALIGNED2(this, (startPos))
-	IS_UTF8_ALIGNED2(this, (endPos))
-
-	int gapLen = mGapEnd - mGapStart;
-	int lineCount = 0;
-
-	int pos = startPos;
-	while (pos < mGapStart) {
-		if (pos == endPos)
-			return lineCount;
-		if (mBuf[pos++] == '\n')
-			lineCount++;
-	}
-	while (pos < mLength) {
-		if (pos == endPos)
-			return lineCount;
-		if (mBuf[pos++ + gapLen] == '\n')
-			lineCount++;
+	int m = mLength;
+	const unsigned char *pat = (const unsigned char *) mText;
+	char first = mText[0], last = mText[m - 1];
+	char first2 = mMatchCase ? first : ascii_upper(first);
+	char last2 = mMatchCase ? last : ascii_upper(last);
+	const char *e = s + n;
+	for (;;) {
+		const char *p = fl_find_byte_pair_back(s, (int) (e - s), first, first2, last, last2, m - 1);
+		if (!p)
+			return NULL;
+		const unsigned char *q = (const unsigned char *) p;
+		int j = 1;
+		while (j < m - 1 && mFold[q[j]] == pat[j])
+			j++;
+		if (j >= m - 1)
+			return p;
+		e = p + m - 1;
 	}
-	return lineCount;
 }
 
 
 /*
- Skip to the first character, n lines ahead.
- StartPos must be at a character boundary.
- This function is optimized for speed by not using UTF-8 calls.
+ Find the first match that starts in [startPos, startLimit) and ends at or
+ before endPos. In byte mode, every segment is searched on its own, and
+ matches that cross from one segment into the next are checked separately.
  */
-int fltk3::TextBuffer::skip_lines(int startPos, int nLines)
+int fltk3::TextBuffer::find_(const fltk3::TextSearch &search, fltk3::TextPosition startPos,
+                             fltk3::TextPosition startLimit, fltk3::TextPosition endPos,
+                             fltk3::TextPosition *matchStart, fltk3::TextPosition *matchEnd) const
 {
-	IS_UTF8_ALIGNED2(this, (startPos))
-
-	if (nLines == 0)
-		return startPos;
+	int m = search.mLength;
+	if (endPos > mLength)
+		endPos = mLength;
+	if (startLimit > endPos)
+		startLimit = endPos;
+	if (startPos < 0)
+		startPos = 0;
+	if (m == 0 || startPos >= startLimit)
+		return 0;
 
-	int gapLen = mGapEnd - mGapStart;
-	int pos = startPos;
-	int lineCount = 0;
-	while (pos < mGapStart) {
-		if (mBuf[pos++] == '\n') {
-			lineCount++;
-			if (lineCount == nLines) {
-				IS_UTF8_ALIGNED2(this, (pos))
-				return pos;
+	if (search.mByteMode) {
+		fltk3::TextPosition last = min(startLimit - 1, endPos - m);
+		fltk3::TextPosition pos = startPos;
+		while (pos <= last) {
+			int n;
+			const char *s = segment(pos, &n);
+			/* matches inside this segment */
+			const char *p = search.find_in(s, (int) min(n, last + m - pos));
+			if (p) {
+				*matchStart = pos + (int) (p - s);
+				*matchEnd = *matchStart + m;
+				return 1;
+			}
+			/* matches that continue in the next segment */
+			fltk3::TextPosition segEnd = pos + n;
+			for (fltk3::TextPosition i = max(pos, segEnd - m + 1); i < segEnd && i <= last; i++) {
+				int j = 0;
+				while (j < m && search.mFold[(unsigned char) byte_at(i + j)] == (unsigned char) search.mText[j])
+					j++;
+				if (j == m) {
+					*matchStart = i;
+					*matchEnd = i + m;
+					return 1;
+				}
 			}
+			pos = segEnd;
 		}
+		return 0;
 	}
-	while (pos < mLength) {
-		if (mBuf[pos++ + gapLen] == '\n') {
-			lineCount++;
-			if (lineCount >= nLines) {
-				IS_UTF8_ALIGNED2(this, (pos))
-				return pos;
+
+	/* case insensitive search for a string with non-ASCII characters */
+	int l;
+	unsigned int first = fltk3::utf8decode(search.mText, 0, &l);
+	if (first < 0x80 && ascii_case_is_closed(first)) {
+		/* a match can only start with the upper or lower case first byte */
+		char lower = (char) fltk3::tolower(first);
+		char upper = ascii_upper(lower);
+		fltk3::TextPosition pos = startPos;
+		while (pos < startLimit) {
+			int n;
+			const char *s = segment(pos, &n);
+			n = (int) min(n, startLimit - pos);
+			for (const char *p = s; ; p++) {
+				p = fl_find_byte_pair(p, (int) (s + n - p), lower, upper, lower, upper, 0);
+				if (!p)
+					break;
+				fltk3::TextPosition end = match_nocase(this, pos + (int) (p - s), search.mText);
+				if (end >= 0 && end <= endPos) {
+					*matchStart = pos + (int) (p - s);
+					*matchEnd = end;
+					return 1;
+				}
 			}
+			pos += n;
 		}
+		return 0;
 	}
-	IS_UTF8_ALIGNED2(this, (pos))
-	return pos;
+	for (fltk3::TextPosition pos = startPos; pos < startLimit; pos = next_char(pos)) {
+		fltk3::TextPosition end = match_nocase(this, pos, search.mText);
+		if (end >= 0 && end <= endPos) {
+			*matchStart = pos;
+			*matchEnd = end;
+			return 1;
+		}
+	}
+	return 0;
 }
 
 
 /*
- Skip to the first character, n lines back.
- StartPos must be at a character boundary.
- This function is optimized for speed by not using UTF-8 calls.
+ Find the last match that starts at or before startPos.
+ This is the mirror image of find_().
  */
-int fltk3::TextBuffer::rewind_lines(int startPos, int nLines)
+int fltk3::TextBuffer::find_back_(const fltk3::TextSearch &search, fltk3::TextPosition startPos,
+                                  fltk3::TextPosition *matchStart, fltk3::TextPosition *matchEnd) const
 {
-	IS_UTF8_ALIGNED2(this, (startPos))
-
-	int pos = startPos - 1;
-	if (pos <= 0)
+	int m = search.mLength;
+	if (m == 0 || startPos < 0 || mLength == 0)
 		return 0;
 
-	int gapLen = mGapEnd - mGapStart;
-	int lineCount = -1;
-	while (pos >= mGapStart) {
-		if (mBuf[pos + gapLen] == '\n') {
-			if (++lineCount >= nLines) {
-				IS_UTF8_ALIGNED2(this, (pos+1))
-				return pos + 1;
+	if (search.mByteMode) {
+		/* a match must start at or before limit, and end at or before pos */
+		fltk3::TextPosition limit = min(startPos, mLength - m);
+		fltk3::TextPosition pos = limit + m;
+		while (pos >= m) {
+			int n;
+			const char *s = segment_before(pos, &n);
+			fltk3::TextPosition segStart = pos - n;
+			/* matches inside this segment */
+			const char *p = search.find_back_in(s, n);
+			if (p) {
+				*matchStart = segStart + (int) (p - s);
+				*matchEnd = *matchStart + m;
+				return 1;
 			}
+			/* matches that continue from the previous segment */
+			for (fltk3::TextPosition i = min(segStart - 1, limit); i >= 0 && i > segStart - m; i--) {
+				int j = 0;
+				while (j < m && search.mFold[(unsigned char) byte_at(i + j)] == (unsigned char) search.mText[j])
+					j++;
+				if (j == m) {
+					*matchStart = i;
+					*matchEnd = i + m;
+					return 1;
+				}
+			}
+			pos = segStart;
 		}
-		pos--;
+		return 0;
 	}
-	while (pos >= 0) {
-		if (mBuf[pos] == '\n') {
-			if (++lineCount >= nLines) {
-				IS_UTF8_ALIGNED2(this, (pos+1))
-				return pos + 1;
+
+	if (startPos >= mLength)
+		startPos = prev_char(mLength);
+	int l;
+	unsigned int first = fltk3::utf8decode(search.mText, 0, &l);
+	if (first < 0x80 && ascii_case_is_closed(first)) {
+		/* a match can only start with the upper or lower case first byte */
+		char lower = (char) fltk3::tolower(first);
+		char upper = ascii_upper(lower);
+		fltk3::TextPosition pos = startPos + 1;
+		while (pos > 0) {
+			int n;
+			const char *s = segment_before(pos, &n);
+			fltk3::TextPosition segStart = pos - n;
+			const char *e = s + n;
+			for (;;) {
+				const char *p = fl_find_byte_pair_back(s, (int) (e - s), lower, upper, lower, upper, 0);
+				if (!p)
+					break;
+				fltk3::TextPosition end = match_nocase(this, segStart + (int) (p - s), search.mText);
+				if (end >= 0) {
+					*matchStart = segStart + (int) (p - s);
+					*matchEnd = end;
+					return 1;
+				}
+				e = p;
 			}
+			pos = segStart;
+		}
+		return 0;
+	}
+	for ( ; startPos >= 0; startPos = prev_char(startPos)) {
+		fltk3::TextPosition end = match_nocase(this, startPos, search.mText);
+		if (end >= 0) {
+			*matchStart = startPos;
+			*matchEnd = end;
+			return 1;
 		}
-		pos--;
 	}
 	return 0;
 }
@@ -1005,110 +2838,106 @@ int fltk3::TextBuffer::rewind_lines(int startPos, int nLines)
 /*
  Find a matching string in the buffer.
  */
-int fltk3::TextBuffer::search_forward(int startPos, const char *searchString,
-                                      int *foundPos, int matchCase) const
+int fltk3::TextBuffer::search_forward(fltk3::TextPosition startPos, const char *searchString,
+                                      fltk3::TextPosition *foundPos, int matchCase) const
 {
 	IS_UTF8_ALIGNED2(this, (startPos))
 	IS_UTF8_ALIGNED(searchString)
 
 	if (!searchString)
 		return 0;
-	int bp;
-	const char *sp;
-	if (matchCase) {
-		while (startPos < length()) {
-			bp = startPos;
-			sp = searchString;
-			for (;;) {
-				char c = *sp;
-				// we reached the end of the "needle", so we found the string!
-				if (!c) {
-					*foundPos = startPos;
-					return 1;
-				}
-				int l = fltk3::utf8len1(c);
-				if (memcmp(sp, address(bp), l))
-					break;
-				sp += l;
-				bp += l;
-			}
-			startPos = next_char(startPos);
-		}
-	} else {
-		while (startPos < length()) {
-			bp = startPos;
-			sp = searchString;
-			for (;;) {
-				// we reached the end of the "needle", so we found the string!
-				if (!*sp) {
-					*foundPos = startPos;
-					return 1;
-				}
-				int l;
-				unsigned int b = char_at(bp);
-				unsigned int s = fltk3::utf8decode(sp, 0, &l);
-				if (fltk3::tolower(b)!=fltk3::tolower(s))
-					break;
-				sp += l;
-				bp = next_char(bp);
-			}
-			startPos = next_char(startPos);
-		}
-	}
-	return 0;
+	fltk3::TextSearch search(searchString, matchCase);
+	return search_forward(startPos, search, foundPos);
 }
 
-int fltk3::TextBuffer::search_backward(int startPos, const char *searchString,
-                                       int *foundPos, int matchCase) const
+
+/*
+ Find a matching string in the buffer, searching backwards.
+ */
+int fltk3::TextBuffer::search_backward(fltk3::TextPosition startPos, const char *searchString,
+                                       fltk3::TextPosition *foundPos, int matchCase) const
 {
 	IS_UTF8_ALIGNED2(this, (startPos))
 	IS_UTF8_ALIGNED(searchString)
 
 	if (!searchString)
 		return 0;
-	int bp;
-	const char *sp;
-	if (matchCase) {
-		while (startPos >= 0) {
-			bp = startPos;
-			sp = searchString;
-			for (;;) {
-				char c = *sp;
-				// we reached the end of the "needle", so we found the string!
-				if (!c) {
-					*foundPos = startPos;
-					return 1;
-				}
-				int l = fltk3::utf8len1(c);
-				if (memcmp(sp, address(bp), l))
-					break;
-				sp += l;
-				bp += l;
-			}
-			startPos = prev_char(startPos);
-		}
-	} else {
-		while (startPos >= 0) {
-			bp = startPos;
-			sp = searchString;
-			for (;;) {
-				// we reached the end of the "needle", so we found the string!
-				if (!*sp) {
-					*foundPos = startPos;
-					return 1;
-				}
-				int l;
-				unsigned int b = char_at(bp);
-				unsigned int s = fltk3::utf8decode(sp, 0, &l);
-				if (fltk3::tolower(b)!=fltk3::tolower(s))
-					break;
-				sp += l;
-				bp = next_char(bp);
-			}
-			startPos = prev_char(startPos);
-		}
+	fltk3::TextSearch search(searchString, matchCase);
+	return search_backward(startPos, search, foundPos);
+}
+
+
+/*
+ Find a prepared string in the buffer.
+ An empty string matches at startPos.
+ */
+int fltk3::TextBuffer::search_forward(fltk3::TextPosition startPos, const fltk3::TextSearch &search,
+                                      fltk3::TextPosition *foundPos, fltk3::TextPosition *foundEnd) const
+{
+	if (startPos < 0)
+		startPos = 0;
+	fltk3::TextPosition start, end;
+	if (search.length() == 0) {
+		if (startPos >= mLength)
+			return 0;
+		start = end = startPos;
+	} else if (!find_(search, startPos, mLength, mLength, &start, &end)) {
+		return 0;
 	}
-	return 0;
+	*foundPos = start;
+	if (foundEnd)
+		*foundEnd = end;
+	return 1;
+}
+
+
+/*
+ Find a prepared string in the buffer, searching backwards.
+ An empty string matches at startPos.
+ */
+int fltk3::TextBuffer::search_backward(fltk3::TextPosition startPos, const fltk3::TextSearch &search,
+                                       fltk3::TextPosition *foundPos, fltk3::TextPosition *foundEnd) const
+{
+	if (startPos < 0)
+		return 0;
+	fltk3::TextPosition start, end;
+	if (search.length() == 0) {
+		start = end = startPos;
+	} else if (!find_back_(search, startPos, &start, &end)) {
+		return 0;
+	}
+	*foundPos = start;
+	if (foundEnd)
+		*foundEnd = end;
+	return 1;
+}
+
+
+/*
+ Report all matches between startPos and endPos, or those that start
+ within maxBytes of startPos.
+ */
+fltk3::TextPosition fltk3::TextBuffer::search_all(const fltk3::TextSearch &search, fltk3::TextPosition startPos,
+                                  fltk3::TextPosition endPos, fltk3::TextMatchCb matchCb,
+                                  void *cbArg, fltk3::TextPosition maxBytes) const
+{
+	if (endPos > mLength)
+		endPos = mLength;
+	if (startPos < 0)
+		startPos = 0;
+	if (search.length() == 0 || startPos >= endPos)
+		return endPos;
+
+	fltk3::TextPosition stop = endPos;
+	if (maxBytes > 0 && maxBytes < endPos - startPos)
+		stop = startPos + maxBytes;
+
+	fltk3::TextPosition pos = startPos, start, end;
+	while (pos < stop && find_(search, pos, stop, endPos, &start, &end)) {
+		matchCb(start, end, cbArg);
+		pos = end;
+	}
+	return max(pos, stop);
 }
 
 
@@ -1117,40 +2946,46 @@ int fltk3::TextBuffer::search_backward(int startPos, const char *searchString,
  Insert a string into the buffer.
  Pos must be at a character boundary. Text must be a correct UTF-8 string.
  */
-int fltk3::TextBuffer::insert_(int pos, const char *text)
+fltk3::TextPosition fltk3::TextBuffer::insert_(fltk3::TextPosition pos, const char *text)
 {
 	if (!text || !*text)
 		return 0;
+	return insert_(pos, text, (fltk3::TextPosition) strlen(text));
+}
 
-	int insertedLength = (int) strlen(text);
 
-	/* Prepare the buffer to receive the new text.  If the new text fits in
-	 the current buffer, just move the gap (if necessary) to where
-	 the text should be inserted.  If the new text is too large, reallocate
-	 the buffer with a gap large enough to accomodate the new text and a
-	 gap of mPreferredGapSize */
-	if (insertedLength > mGapEnd - mGapStart)
-		reallocate_with_gap(pos, insertedLength + mPreferredGapSize);
-	else if (pos != mGapStart)
-		move_gap(pos);
-
-	/* Insert the new text (pos now corresponds to the start of the gap) */
-	memcpy(&mBuf[pos], text, insertedLength);
-	mGapStart += insertedLength;
-	mLength += insertedLength;
-	update_selections(pos, 0, insertedLength);
+/*
+ Insert insertedLength bytes of text into the buffer.
+ */
+fltk3::TextPosition fltk3::TextBuffer::insert_(fltk3::TextPosition pos, const char *text, fltk3::TextPosition insertedLength)
+{
+	if (insertedLength <= 0)
+		return 0;
 
-	if (mCanUndo) {
-		if (undowidget == this && undoat == pos && undoinsert) {
-			undoinsert += insertedLength;
-		} else {
-			undoinsert = insertedLength;
-			undoyankcut = (undoat == pos) ? undocut : 0;
-		}
-		undoat = pos + insertedLength;
-		undocut = 0;
-		undowidget = this;
+	if (mStorageMode == PIECE_STORAGE) {
+		/* Append the text to the add buffer and link it into the table */
+		memcpy(piece_insert_(pos, insertedLength), text, insertedLength);
+	} else {
+		/* Prepare the buffer to receive the new text.  If the new text fits in
+		 the current buffer, just move the gap (if necessary) to where
+		 the text should be inserted.  If the new text is too large, reallocate
+		 the buffer with a gap large enough to accomodate the new text and a
+		 gap of mPreferredGapSize, or of an eighth of the text if that is larger,
+		 so that a growing buffer is not copied again for every few kilobytes */
+		if (insertedLength > mGapEnd - mGapStart)
+			reallocate_with_gap(pos, insertedLength + max(mPreferredGapSize, mLength / 8));
+		else if (pos != mGapStart)
+			move_gap(pos);
+
+		/* Insert the new text (pos now corresponds to the start of the gap) */
+		memcpy(&mBuf[pos], text, insertedLength);
+		mGapStart += insertedLength;
 	}
+	mLength += insertedLength;
+	if (mLineIndex)
+		mLineIndex->inserted(pos, insertedLength);
+	update_selections(pos, 0, insertedLength);
+	record_insert(pos, insertedLength);
 
 	return insertedLength;
 }
@@ -1160,46 +2995,28 @@ int fltk3::TextBuffer::insert_(int pos, const char *text)
  Remove a string from the buffer.
  Unicode safe. Start and end must be at a character boundary.
  */
-void fltk3::TextBuffer::remove_(int start, int end)
+void fltk3::TextBuffer::remove_(fltk3::TextPosition start, fltk3::TextPosition end)
 {
-	/* if the gap is not contiguous to the area to remove, move it there */
+	record_remove(start, end);
 
-	if (mCanUndo) {
-		if (undowidget == this && undoat == end && undocut) {
-			undobuffersize(undocut + end - start + 1);
-			memmove(undobuffer + end - start, undobuffer, undocut);
-			undocut += end - start;
-		} else {
-			undocut = end - start;
-			undobuffersize(undocut);
-		}
-		undoat = start;
-		undoinsert = 0;
-		undoyankcut = 0;
-		undowidget = this;
-	}
+	if (mLineIndex)
+		mLineIndex->removing(start, end);
 
-	if (start > mGapStart) {
-		if (mCanUndo)
-			memcpy(undobuffer, mBuf + (mGapEnd - mGapStart) + start,
-			       end - start);
-		move_gap(start);
-	} else if (end < mGapStart) {
-		if (mCanUndo)
-			memcpy(undobuffer, mBuf + start, end - start);
-		move_gap(end);
+	if (mStorageMode == PIECE_STORAGE) {
+		/* the removed text stays in its block, only the pieces change */
+		piece_remove_(start, end);
 	} else {
-		int prelen = mGapStart - start;
-		if (mCanUndo) {
-			memcpy(undobuffer, mBuf + start, prelen);
-			memcpy(undobuffer + prelen, mBuf + mGapEnd, end - start - prelen);
-		}
+		/* if the gap is not contiguous to the area to remove, move it there */
+		if (start > mGapStart)
+			move_gap(start);
+		else if (end < mGapStart)
+			move_gap(end);
+
+		/* expand the gap to encompass the deleted characters */
+		mGapEnd += end - mGapStart;
+		mGapStart -= mGapStart - start;
 	}
 
-	/* expand the gap to encompass the deleted characters */
-	mGapEnd += end - mGapStart;
-	mGapStart -= mGapStart - start;
-
 	/* update the length */
 	mLength -= end - start;
 
@@ -1212,7 +3029,7 @@ void fltk3::TextBuffer::remove_(int start, int end)
  simple setter.
  Unicode safe. Start and end must be at a character boundary.
  */
-void fltk3::TextSelection::set(int startpos, int endpos)
+void fltk3::TextSelection::set(fltk3::TextPosition startpos, fltk3::TextPosition endpos)
 {
 	mSelected = startpos != endpos;
 	mStart = min(startpos, endpos);
@@ -1224,7 +3041,7 @@ void fltk3::TextSelection::set(int startpos, int endpos)
  simple getter.
  Unicode safe. Start and end will be at a character boundary.
  */
-int fltk3::TextSelection::position(int *startpos, int *endpos) const
+int fltk3::TextSelection::position(fltk3::TextPosition *startpos, fltk3::TextPosition *endpos) const
 {
 	if (!mSelected)
 		return 0;
@@ -1239,7 +3056,7 @@ int fltk3::TextSelection::position(int *startpos, int *endpos) const
  Return if a position is inside the selected area.
  Unicode safe. Pos must be at a character boundary.
  */
-int fltk3::TextSelection::includes(int pos) const
+int fltk3::TextSelection::includes(fltk3::TextPosition pos) const
 {
 	return (selected() && pos >= start() && pos < end() );
 }
@@ -1251,7 +3068,7 @@ int fltk3::TextSelection::includes(int pos) const
  */
 char *fltk3::TextBuffer::selection_text_(fltk3::TextSelection * sel) const
 {
-	int start, end;
+	fltk3::TextPosition start, end;
 
 	/* If there's no selection, return an allocated empty string */
 	if (!sel->position(&start, &end)) {
@@ -1271,12 +3088,11 @@ char *fltk3::TextBuffer::selection_text_(fltk3::TextSelection * sel) const
  */
 void fltk3::TextBuffer::remove_selection_(fltk3::TextSelection * sel)
 {
-	int start, end;
+	fltk3::TextPosition start, end;
 
 	if (!sel->position(&start, &end))
 		return;
 	remove(start, end);
-	//undoyankcut = undocut;
 }
 
 
@@ -1290,7 +3106,7 @@ void fltk3::TextBuffer::replace_selection_(fltk3::TextSelection * sel,
 	fltk3::TextSelection oldSelection = *sel;
 
 	/* If there's no selection, return */
-	int start, end;
+	fltk3::TextPosition start, end;
 	if (!sel->position(&start, &end))
 		return;
 
@@ -1308,11 +3124,17 @@ void fltk3::TextBuffer::replace_selection_(fltk3::TextSelection * sel,
  Call all callbacks.
  Unicode safe.
  */
-void fltk3::TextBuffer::call_modify_callbacks(int pos, int nDeleted,
-                int nInserted, int nRestyled,
+void fltk3::TextBuffer::call_modify_callbacks(fltk3::TextPosition pos, fltk3::TextPosition nDeleted,
+                fltk3::TextPosition nInserted, fltk3::TextPosition nRestyled,
                 const char *deletedText) const
 {
 	IS_UTF8_ALIGNED2(this, pos)
+	if (mBatch) {
+		/* a restyled range must be redisplayed as well */
+		if (nRestyled)
+			batch_cover_(pos, pos + nRestyled);
+		return;
+	}
 	for (int i = 0; i < mNModifyProcs; i++)
 		(*mModifyProcs[i]) (pos, nInserted, nDeleted, nRestyled,
 		                    deletedText, mCbArgs[i]);
@@ -1323,8 +3145,12 @@ void fltk3::TextBuffer::call_modify_callbacks(int pos, int nDeleted,
  Call all callbacks.
  Unicode safe.
  */
-void fltk3::TextBuffer::call_predelete_callbacks(int pos, int nDeleted) const
+void fltk3::TextBuffer::call_predelete_callbacks(fltk3::TextPosition pos, fltk3::TextPosition nDeleted) const
 {
+	if (mBatch) {
+		batch_cover_(pos, pos + nDeleted);
+		return;
+	}
 	for (int i = 0; i < mNPredeleteProcs; i++)
 		(*mPredeleteProcs[i]) (pos, nDeleted, mPredeleteCbArgs[i]);
 }
@@ -1339,7 +3165,7 @@ void fltk3::TextBuffer::redisplay_selection(fltk3::TextSelection *
                 fltk3::TextSelection *
                 newSelection) const
 {
-	int oldStart, oldEnd, newStart, newEnd, ch1Start, ch1End, ch2Start,
+	fltk3::TextPosition oldStart, oldEnd, newStart, newEnd, ch1Start, ch1End, ch2Start,
 	    ch2End;
 
 	/* If either selection is rectangular, add an additional character to
@@ -1389,9 +3215,9 @@ void fltk3::TextBuffer::redisplay_selection(fltk3::TextSelection *
  Move the gap around without changing buffer content.
  Unicode safe. Pos must be at a character boundary.
  */
-void fltk3::TextBuffer::move_gap(int pos)
+void fltk3::TextBuffer::move_gap(fltk3::TextPosition pos)
 {
-	int gapLen = mGapEnd - mGapStart;
+	fltk3::TextPosition gapLen = mGapEnd - mGapStart;
 
 	if (pos > mGapStart)
 		memmove(&mBuf[mGapStart], &mBuf[mGapEnd], pos - mGapStart);
@@ -1406,10 +3232,10 @@ void fltk3::TextBuffer::move_gap(int pos)
  Create a larger gap.
  Unicode safe. Start must be at a character boundary.
  */
-void fltk3::TextBuffer::reallocate_with_gap(int newGapStart, int newGapLen)
+void fltk3::TextBuffer::reallocate_with_gap(fltk3::TextPosition newGapStart, fltk3::TextPosition newGapLen)
 {
 	char *newBuf = (char *) malloc(mLength + newGapLen);
-	int newGapEnd = newGapStart + newGapLen;
+	fltk3::TextPosition newGapEnd = newGapStart + newGapLen;
 
 	if (newGapStart <= mGapStart) {
 		memcpy(newBuf, mBuf, newGapStart);
@@ -1435,8 +3261,8 @@ void fltk3::TextBuffer::reallocate_with_gap(int newGapStart, int newGapLen)
  Update selection range if characters were inserted.
  Unicode safe. Pos must be at a character boundary.
  */
-void fltk3::TextBuffer::update_selections(int pos, int nDeleted,
-                int nInserted)
+void fltk3::TextBuffer::update_selections(fltk3::TextPosition pos, fltk3::TextPosition nDeleted,
+                fltk3::TextPosition nInserted)
 {
 	mPrimary.update(pos, nDeleted, nInserted);
 	mSecondary.update(pos, nDeleted, nInserted);
@@ -1445,7 +3271,7 @@ void fltk3::TextBuffer::update_selections(int pos, int nDeleted,
 
 
 // unicode safe, assuming the arguments are on character boundaries
-void fltk3::TextSelection::update(int pos, int nDeleted, int nInserted)
+void fltk3::TextSelection::update(fltk3::TextPosition pos, fltk3::TextPosition nDeleted, fltk3::TextPosition nInserted)
 {
 	if (!mSelected || pos > mEnd)
 		return;
@@ -1470,9 +3296,11 @@ void fltk3::TextSelection::update(int pos, int nDeleted, int nInserted)
 /*
  Find a UCS-4 character.
  StartPos must be at a character boundary, searchChar is UCS-4 encoded.
+ The first byte of the UTF-8 encoding is searched for, which in valid UTF-8
+ can only appear at the start of a character.
  */
-int fltk3::TextBuffer::findchar_forward(int startPos, unsigned searchChar,
-                                        int *foundPos) const
+int fltk3::TextBuffer::findchar_forward(fltk3::TextPosition startPos, unsigned searchChar,
+                                        fltk3::TextPosition *foundPos) const
 {
 	if (startPos >= mLength) {
 		*foundPos = mLength;
@@ -1482,11 +3310,29 @@ int fltk3::TextBuffer::findchar_forward(int startPos, unsigned searchChar,
 	if (startPos<0)
 		startPos = 0;
 
-	for ( ; startPos<mLength; startPos = next_char(startPos)) {
-		if (searchChar == char_at(startPos)) {
-			*foundPos = startPos;
-			return 1;
+	char lead = (char) searchChar;
+	if (searchChar >= 0x80) {
+		char buf[8];
+		fltk3::utf8encode(searchChar, buf);
+		lead = buf[0];
+	}
+
+	for (fltk3::TextPosition pos = startPos; pos < mLength; ) {
+		int n;
+		const char *s = segment(pos, &n);
+		const char *e = s + n;
+		for (const char *p = s; ; p++) {
+			int count = 1;
+			p = fl_find_nth_byte(p, (int) (e - p), lead, &count);
+			if (!p)
+				break;
+			fltk3::TextPosition found = pos + (int) (p - s);
+			if (searchChar < 0x80 || char_at(found) == searchChar) {
+				*foundPos = found;
+				return 1;
+			}
 		}
+		pos += n;
 	}
 
 	*foundPos = mLength;
@@ -1498,8 +3344,8 @@ int fltk3::TextBuffer::findchar_forward(int startPos, unsigned searchChar,
  Find a UCS-4 character.
  StartPos must be at a character boundary, searchChar is UCS-4 encoded.
  */
-int fltk3::TextBuffer::findchar_backward(int startPos, unsigned int searchChar,
-                int *foundPos) const
+int fltk3::TextBuffer::findchar_backward(fltk3::TextPosition startPos, unsigned int searchChar,
+                fltk3::TextPosition *foundPos) const
 {
 	if (startPos <= 0) {
 		*foundPos = 0;
@@ -1509,11 +3355,31 @@ int fltk3::TextBuffer::findchar_backward(int startPos, unsigned int searchChar,
 	if (startPos > mLength)
 		startPos = mLength;
 
-	for (startPos = prev_char(startPos); startPos>=0; startPos = prev_char(startPos)) {
-		if (searchChar == char_at(startPos)) {
-			*foundPos = startPos;
-			return 1;
+	char lead = (char) searchChar;
+	if (searchChar >= 0x80) {
+		char buf[8];
+		fltk3::utf8encode(searchChar, buf);
+		lead = buf[0];
+	}
+
+	for (fltk3::TextPosition pos = startPos; pos > 0; ) {
+		int n;
+		const char *s = segment_before(pos, &n);
+		fltk3::TextPosition segStart = pos - n;
+		const char *e = s + n;
+		for (;;) {
+			int count = 1;
+			const char *p = fl_find_nth_byte_back(s, (int) (e - s), lead, &count);
+			if (!p)
+				break;
+			fltk3::TextPosition found = segStart + (int) (p - s);
+			if (searchChar < 0x80 || char_at(found) == searchChar) {
+				*foundPos = found;
+				return 1;
+			}
+			e = p;
 		}
+		pos = segStart;
 	}
 
 	*foundPos = 0;
@@ -1673,21 +3539,79 @@ const char *fltk3::TextBuffer::file_encoding_warning_message =
         "of the input file which was not UTF-8 encoded.\n"
         "Some changes may have occurred.";
 
+#if defined(TEXT_MMAP) && !defined(EXAMPLE_ENCODING)
+/*
+ Map a regular file into memory. Returns NULL if the file is empty, not a
+ regular file, or too large for the buffer.
+ */
+static const char *map_file(FILE *fp, fltk3::TextPosition maxSize, fltk3::TextPosition *size)
+{
+	struct stat st;
+	int fd = fileno(fp);
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > maxSize)
+		return NULL;
+	void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+	*size = (fltk3::TextPosition) st.st_size;
+	return (const char *) map;
+}
+
+
+/*
+ Return non-zero if the n bytes at s are valid UTF-8 without nul bytes.
+ The text is checked in slices that fit in an int.
+ */
+static int utf8_valid(const char *s, fltk3::TextPosition n)
+{
+	while (n > 0) {
+		int slice = (int) min(n, INT_MAX);
+		int valid = fl_utf8_valid_prefix(s, slice);
+		/* a character may continue in the next slice */
+		if (valid == 0 || (slice == n && valid < slice))
+			return 0;
+		s += valid;
+		n -= valid;
+	}
+	return 1;
+}
+#endif
+
 /*
  Insert text from a file.
  Input file can be of various encodings according to what input fiter is used.
  utf8_input_filter accepts UTF-8 or CP1252 as input encoding.
  Output is always UTF-8.
  */
-int fltk3::TextBuffer::insertfile(const char *file, int pos, int buflen)
+int fltk3::TextBuffer::insertfile(const char *file, fltk3::TextPosition pos, int buflen)
 {
 	FILE *fp;
 	if (!(fp = fltk3::fopen(file, "r")))
 		return 1;
+	input_file_was_transcoded = false;
+#if defined(TEXT_MMAP) && !defined(EXAMPLE_ENCODING)
+	/* A file that is valid UTF-8 needs no filtering: validate it in one
+	 pass and insert it in one piece. Otherwise, fall back to transcoding
+	 it from the start. */
+	fltk3::TextPosition size;
+	const char *map = map_file(fp, TEXT_POSITION_MAX - mLength, &size);
+	if (map) {
+		int valid = utf8_valid(map, size);
+		if (valid)
+			insert(pos, map, size);
+		munmap((void *) map, (size_t) size);
+		if (valid) {
+			fclose(fp);
+			return 0;
+		}
+	}
+#endif
 	char *buffer = new char[buflen + 1];
 	char *endline, line[100];
 	int l;
-	input_file_was_transcoded = false;
 	endline = line;
 	while (true) {
 #ifdef EXAMPLE_ENCODING
@@ -1716,27 +3640,94 @@ int fltk3::TextBuffer::insertfile(const char *file, int pos, int buflen)
 }
 
 
+#ifdef TEXT_MMAP
+/*
+ Write all bytes described by iov, continuing after partial writes.
+ Returns 0 on success, -1 on error.
+ */
+static int writev_all(int fd, struct iovec *iov, int n)
+{
+	while (n > 0) {
+		ssize_t r = writev(fd, iov, n);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (n > 0 && (size_t) r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return 0;
+}
+#endif
+
 /*
  Write text to file.
+ The text is written straight from the buffer, without copying it. With
+ writev(), up to 16 spans of the range (the two sides of the gap, or the
+ pieces) go out in a single call of at most buflen bytes.
  Unicode safe.
  */
 int fltk3::TextBuffer::outputfile(const char *file,
-                                  int start, int end,
+                                  fltk3::TextPosition start, fltk3::TextPosition end,
                                   int buflen)
 {
 	FILE *fp;
+	if (buflen < 1)
+		buflen = 1;
 	if (!(fp = fltk3::fopen(file, "w")))
 		return 1;
-	for (int n; (n = min(end - start, buflen)); start += n) {
-		const char *p = text_range(start, start + n);
-		int r = (int) fwrite(p, 1, n, fp);
-		free((void *) p);
-		if (r != n)
+	int e = 0;
+#ifdef TEXT_MMAP
+	struct iovec iov[16];
+	int n = 0, queued = 0; // spans and bytes in iov
+	for (fltk3::TextSpanIterator i(this, start, end); !e; i.next()) {
+		const char *text = i.done() ? 0 : i.text();
+		int left = i.done() ? 0 : i.length();
+		do {
+			/* spans longer than what is left of buflen go out in pieces */
+			if (left) {
+				int k = min(left, buflen - queued);
+				iov[n].iov_base = (void *) text;
+				iov[n].iov_len = k;
+				n++;
+				queued += k;
+				text += k;
+				left -= k;
+			}
+			if (n == 16 || queued == buflen || (i.done() && n)) {
+				if (writev_all(fileno(fp), iov, n)) {
+					e = 2;
+					break;
+				}
+				n = queued = 0;
+			}
+		} while (left);
+		if (i.done())
 			break;
 	}
-
-	int e = ferror(fp) ? 2 : 0;
-	fclose(fp);
+#else
+	for (fltk3::TextSpanIterator i(this, start, end); !i.done(); i.next()) {
+		/* write large spans in pieces of buflen bytes */
+		for (int done = 0, n; done < i.length(); done += n) {
+			n = min(i.length() - done, buflen);
+			if ((int) fwrite(i.text() + done, 1, n, fp) != n)
+				break;
+		}
+		if (ferror(fp))
+			break;
+	}
+	e = ferror(fp) ? 2 : 0;
+#endif
+	if (fclose(fp) && !e)
+		e = 2;
 	return e;
 }
 
@@ -1745,7 +3736,7 @@ int fltk3::TextBuffer::outputfile(const char *file,
  Return the previous character position.
  Unicode safe.
  */
-int fltk3::TextBuffer::prev_char_clipped(int pos) const
+fltk3::TextPosition fltk3::TextBuffer::prev_char_clipped(fltk3::TextPosition pos) const
 {
 	if (pos<=0)
 		return 0;
@@ -1769,7 +3760,7 @@ int fltk3::TextBuffer::prev_char_clipped(int pos) const
  Return the previous character position.
  Returns -1 if the beginning of the buffer is reached.
  */
-int fltk3::TextBuffer::prev_char(int pos) const
+fltk3::TextPosition fltk3::TextBuffer::prev_char(fltk3::TextPosition pos) const
 {
 	if (pos==0) return -1;
 	return prev_char_clipped(pos);
@@ -1780,7 +3771,7 @@ int fltk3::TextBuffer::prev_char(int pos) const
  Return the next character position.
  Returns length() if the end of the buffer is reached.
  */
-int fltk3::TextBuffer::next_char(int pos) const
+fltk3::TextPosition fltk3::TextBuffer::next_char(fltk3::TextPosition pos) const
 {
 	IS_UTF8_ALIGNED2(this, (pos))
 	int n = fltk3::utf8len1(byte_at(pos));
@@ -1796,7 +3787,7 @@ int fltk3::TextBuffer::next_char(int pos) const
  Return the next character position.
  If the end of the buffer is reached, it returns the current position.
  */
-int fltk3::TextBuffer::next_char_clipped(int pos) const
+fltk3::TextPosition fltk3::TextBuffer::next_char_clipped(fltk3::TextPosition pos) const
 {
 	return next_char(pos);
 }
@@ -1804,7 +3795,7 @@ int fltk3::TextBuffer::next_char_clipped(int pos) const
 /*
  Align an index to the current UTF-8 boundary.
  */
-int fltk3::TextBuffer::utf8_align(int pos) const
+fltk3::TextPosition fltk3::TextBuffer::utf8_align(fltk3::TextPosition pos) const
 {
 	char c = byte_at(pos);
 	while ( (c&0xc0) == 0x80) {
@@ -59,8 +59,8 @@
  stack in the draw_vline() method for drawing strings */
 #define MAX_DISP_LINE_LEN 1000
 
-static int max( int i1, int i2 );
-static int min( int i1, int i2 );
+static fltk3::TextPosition max( fltk3::TextPosition i1, fltk3::TextPosition i2 );
+static fltk3::TextPosition min( fltk3::TextPosition i1, fltk3::TextPosition i2 );
 static int countlines( const char *string );
 
 /* The variables below are used in a timer event to allow smooth
@@ -73,6 +73,328 @@ static int scroll_x = 0;
 // CET - FIXME
 #define TMPFONTWIDTH 6
 
+/* Number of slots that are probed for a line in the layout cache */
+#define LAYOUT_PROBES 4
+
+/* Bytes of text between checkpoints of the wrap index, and bytes of text
+ the wrap index counts each time the application is idle */
+#define WRAP_INDEX_STEP 16384
+#define WRAP_INDEX_SLICE 65536
+
+
+/*
+ A part of a displayed line that is drawn in one go: a run of characters
+ in the same style, or a single tab. x is the offset from the start of
+ the line in pixels.
+ */
+struct TextLayoutRun {
+	int start, end;     // byte offsets in the line
+	int style;
+	int x, w;
+	char tab;
+};
+
+
+/*
+ The measured runs of a line, as handle_vline() walks them.
+ */
+struct fltk3::TextLineLayout {
+	fltk3::TextPosition start;          // buffer position of the line, -1 if the slot is unused
+	int len;            // length of the line in bytes
+	unsigned generation;
+	int endStyle;       // style of the area right of the text
+	int nRuns, nAllocated;
+	TextLayoutRun *runs;
+	// bytes of the style buffer from start to the end of the line and one
+	// more, as they were when the line was measured
+	char *styles;
+	int nStyles, nStylesAllocated;
+};
+
+
+/*
+ Layouts of recently displayed lines, keyed by the position of the line.
+ A layout is valid as long as its generation matches; any change of the
+ text starts a new generation. Changes of styles and selections only drop
+ the lines in the changed range.
+ */
+class fltk3::TextLayoutCache
+{
+public:
+	TextLayoutCache() {
+		mLines = NULL;
+		mNLines = 0;
+		mGeneration = 0;
+		mEpoch = 0;
+		mLongest = -1;
+		mFont = 0;
+		mSize = 0;
+		mTabDist = 0;
+		memset(&mScratch, 0, sizeof(mScratch));
+		mScratch.start = -1;
+	}
+	~TextLayoutCache() {
+		for (int i = 0; i < mNLines; i++) {
+			free(mLines[i].runs);
+			free(mLines[i].styles);
+		}
+		free(mLines);
+		free(mScratch.runs);
+		free(mScratch.styles);
+	}
+	void clear() {
+		mGeneration++;
+		mEpoch++;
+	}
+	void check(fltk3::Font font, fltk3::Fontsize size, int tabDist) {
+		if (font != mFont || size != mSize || tabDist != mTabDist) {
+			mFont = font;
+			mSize = size;
+			mTabDist = tabDist;
+			clear();
+		}
+	}
+	fltk3::TextLineLayout *find(fltk3::TextPosition start, int len, int prefix);
+	fltk3::TextLineLayout *slot(fltk3::TextPosition start, int nVisibleLines);
+	void invalidate(fltk3::TextPosition start, fltk3::TextPosition end);
+
+	fltk3::TextLineLayout mScratch; // layout that is not kept, for printing
+	unsigned mGeneration;
+	unsigned mEpoch;                // changes whenever any layout may change
+	// last result of longest_vline() and the view it was measured for
+	int mLongest;
+	unsigned mLongestEpoch;
+	fltk3::TextPosition mLongestFirst, mLongestLast;
+	int mLongestLines, mLongestWidth;
+private:
+	unsigned hash(fltk3::TextPosition start) const {
+		return ((unsigned) start * 2654435761U) >> 16;
+	}
+	fltk3::TextLineLayout *mLines;
+	int mNLines;                    // a power of two
+	fltk3::Font mFont;
+	fltk3::Fontsize mSize;
+	int mTabDist;
+	// Forbid use of copy contructor and assign operator
+	TextLayoutCache(const TextLayoutCache&);
+	TextLayoutCache &operator=(const TextLayoutCache&);
+};
+
+
+/*
+ Return the valid layout of the line at start. If prefix is set, a layout
+ of a longer line at the same position will do as well.
+ */
+fltk3::TextLineLayout *fltk3::TextLayoutCache::find(fltk3::TextPosition start, int len, int prefix)
+{
+	unsigned h = hash(start);
+	for (int i = 0; i < LAYOUT_PROBES && i < mNLines; i++) {
+		fltk3::TextLineLayout *l = &mLines[(h + i) & (mNLines - 1)];
+		if (l->start == start && l->generation == mGeneration
+		    && (l->len == len || (prefix && l->len > len)))
+			return l;
+	}
+	return NULL;
+}
+
+
+/*
+ Return the slot to store a new layout of the line at start in. The table
+ holds about four times the number of visible lines, so that the lines of
+ the display rarely push each other out.
+ */
+fltk3::TextLineLayout *fltk3::TextLayoutCache::slot(fltk3::TextPosition start, int nVisibleLines)
+{
+	if (mNLines < 4 * nVisibleLines) {
+		int n = mNLines ? mNLines : 64;
+		while (n < 4 * nVisibleLines)
+			n *= 2;
+		mLines = (fltk3::TextLineLayout *) realloc(mLines, n * sizeof(fltk3::TextLineLayout));
+		memset(mLines + mNLines, 0, (n - mNLines) * sizeof(fltk3::TextLineLayout));
+		for (int i = 0; i < n; i++)
+			mLines[i].start = -1;
+		mNLines = n;
+	}
+	unsigned h = hash(start);
+	fltk3::TextLineLayout *l = NULL;
+	for (int i = 0; i < LAYOUT_PROBES; i++) {
+		fltk3::TextLineLayout *p = &mLines[(h + i) & (mNLines - 1)];
+		if (p->start == start)
+			return p;
+		if (!l && (p->start == -1 || p->generation != mGeneration))
+			l = p;
+	}
+	return l ? l : &mLines[h & (mNLines - 1)];
+}
+
+
+/*
+ Checkpoints of the number of wrapped lines in continuous wrap mode. Each
+ checkpoint is the start of a displayed line and the number of displayed
+ lines before it. The text is counted from the start in slices while the
+ application is idle, so that changing the wrap width does not have to
+ measure all of the text at once. The lines of the text beyond the last
+ checkpoint are estimated until it is complete.
+ */
+class fltk3::TextWrapIndex
+{
+public:
+	TextWrapIndex() {
+		mPos = mLines = NULL;
+		mAllocated = 0;
+		reset(0, 0, 0);
+	}
+	~TextWrapIndex() {
+		free(mPos);
+		free(mLines);
+	}
+	void reset(int wrapWidth, fltk3::Font font, fltk3::Fontsize size) {
+		mN = 0;
+		add(0, 0);
+		mComplete = 0;
+		mTotal = 0;
+		mWrapWidth = wrapWidth;
+		mFont = font;
+		mSize = size;
+	}
+	int counted_for(int wrapWidth, fltk3::Font font, fltk3::Fontsize size) const {
+		return wrapWidth == mWrapWidth && font == mFont && size == mSize;
+	}
+	void add(fltk3::TextPosition pos, fltk3::TextPosition lines) {
+		if (mN >= mAllocated) {
+			mAllocated = mAllocated ? 2 * mAllocated : 64;
+			mPos = (fltk3::TextPosition *) realloc(mPos, mAllocated * sizeof(fltk3::TextPosition));
+			mLines = (fltk3::TextPosition *) realloc(mLines, mAllocated * sizeof(fltk3::TextPosition));
+		}
+		mPos[mN] = pos;
+		mLines[mN] = lines;
+		mN++;
+	}
+	int find(fltk3::TextPosition pos) const;
+	int find_line(fltk3::TextPosition nLines) const;
+	void modified(fltk3::TextPosition start, fltk3::TextPosition end, fltk3::TextPosition charDelta, fltk3::TextPosition lineDelta);
+
+	fltk3::TextPosition *mPos;   // start of a displayed line
+	fltk3::TextPosition *mLines; // displayed lines before mPos
+	int mN, mAllocated;
+	int mComplete;          // all of the text is counted
+	fltk3::TextPosition mTotal;  // number of lines, if complete
+	int mWrapWidth;         // wrap margin the lines were counted for
+	fltk3::Font mFont;      // and the text font and size
+	fltk3::Fontsize mSize;
+private:
+	// Forbid use of copy contructor and assign operator
+	TextWrapIndex(const TextWrapIndex&);
+	TextWrapIndex &operator=(const TextWrapIndex&);
+};
+
+
+/*
+ Return the last checkpoint at or before pos.
+ */
+int fltk3::TextWrapIndex::find(fltk3::TextPosition pos) const
+{
+	int lo = 0, hi = mN - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (mPos[mid] <= pos) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+
+/*
+ Return the last checkpoint with at most nLines lines before it.
+ */
+int fltk3::TextWrapIndex::find_line(fltk3::TextPosition nLines) const
+{
+	int lo = 0, hi = mN - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (mLines[mid] <= nLines) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+
+/*
+ Adjust the checkpoints to a change of the text that was rewrapped from
+ start to end (in the new text). The checkpoints after the change move by
+ charDelta and lineDelta, those inside of it are dropped.
+ */
+void fltk3::TextWrapIndex::modified(fltk3::TextPosition start, fltk3::TextPosition end, fltk3::TextPosition charDelta, fltk3::TextPosition lineDelta)
+{
+	int i = find(start) + 1, j;
+	for (j = i; j < mN; j++) {
+		fltk3::TextPosition pos = mPos[j] + charDelta;
+		if (pos >= end && pos > start) {
+			mPos[i] = pos;
+			mLines[i] = mLines[j] + lineDelta;
+			i++;
+		}
+	}
+	mN = i;
+	mTotal += lineDelta;
+}
+
+
+/*
+ Keep the style bytes a layout was measured with, so that a change of the
+ style buffer that the display was not told about is noticed.
+ */
+static void save_layout_styles(fltk3::TextLineLayout *l, fltk3::TextBuffer *styleBuf,
+                               fltk3::TextPosition start, int len)
+{
+	int n = (int) min(len + 1, max(styleBuf->length() - start, 0));
+	if (n > l->nStylesAllocated) {
+		l->nStylesAllocated = n + 64;
+		free(l->styles);
+		l->styles = (char *) malloc(l->nStylesAllocated);
+	}
+	char *p = l->styles;
+	for (fltk3::TextSpanIterator span(styleBuf, start, start + n); !span.done(); span.next()) {
+		memcpy(p, span.text(), span.length());
+		p += span.length();
+	}
+	l->nStyles = n;
+}
+
+
+/*
+ Check if the style bytes of the first len bytes of a line are still the
+ ones its layout was measured with.
+ */
+static int same_layout_styles(const fltk3::TextLineLayout *l, fltk3::TextBuffer *styleBuf,
+                              fltk3::TextPosition start, int len)
+{
+	int n = (int) min(len + 1, max(styleBuf->length() - start, 0));
+	if (n > l->nStyles)
+		return 0;
+	const char *p = l->styles;
+	for (fltk3::TextSpanIterator span(styleBuf, start, start + n); !span.done(); span.next()) {
+		if (memcmp(p, span.text(), span.length()))
+			return 0;
+		p += span.length();
+	}
+	return 1;
+}
+
+
+/*
+ Drop the layouts of all lines that touch the text between start and end.
+ */
+void fltk3::TextLayoutCache::invalidate(fltk3::TextPosition start, fltk3::TextPosition end)
+{
+	mEpoch++;
+	for (int i = 0; i < mNLines; i++) {
+		fltk3::TextLineLayout *l = &mLines[i];
+		if (l->start != -1 && l->start <= end && l->start + l->len >= start)
+			l->start = -1;
+	}
+}
+
 
 
 /**
@@ -119,6 +441,7 @@ fltk3::TextDisplay::TextDisplay(int X, int Y, int W, int H, const char* l) : flt
 	mCursorOn = 0;
 	mCursorPos = 0;
 	mCursorOldY = -100;
+	mScrollDX = mScrollDY = 0;
 	mCursorToHint = NO_HINT;
 	mCursorStyle = SIMPLE_CURSOR; // NORMAL_CURSOR;
 	mCursorPreferredXPos = -1;
@@ -134,10 +457,12 @@ fltk3::TextDisplay::TextDisplay(int X, int Y, int W, int H, const char* l) : flt
 	mCursor_color = fltk3::FOREGROUND_COLOR;
 
 	mStyleBuffer = 0;
+	mStyleRuns = 0;
+	mHighlighter = 0;
 	mStyleTable = 0;
 	mNStyles = 0;
 	mNVisibleLines = 1;
-	mLineStarts = new int[mNVisibleLines];
+	mLineStarts = new fltk3::TextPosition[mNVisibleLines];
 	mLineStarts[0] = 0;
 	for (i=1; i<mNVisibleLines; i++)
 		mLineStarts[i] = -1;
@@ -149,6 +474,11 @@ fltk3::TextDisplay::TextDisplay(int X, int Y, int W, int H, const char* l) : flt
 	mUnfinishedHighlightCB = 0;
 	mHighlightCBArg = 0;
 
+	mLineText = 0;
+	mLineTextSize = 0;
+	mLayoutCache = new fltk3::TextLayoutCache;
+	mWrapIndex = new fltk3::TextWrapIndex;
+
 	mLineNumLeft = mLineNumWidth = 0;
 	mContinuousWrap = 0;
 	mWrapMarginPix = 0;
@@ -182,6 +512,10 @@ fltk3::TextDisplay::~TextDisplay()
 		mBuffer->remove_predelete_callback(buffer_predelete_cb, this);
 	}
 	if (mLineStarts) delete[] mLineStarts;
+	free(mLineText);
+	delete mLayoutCache;
+	fltk3::remove_idle(wrap_index_cb, this);
+	delete mWrapIndex;
 }
 
 
@@ -387,12 +721,18 @@ void fltk3::TextDisplay::buffer( fltk3::TextBuffer *buf )
 	/* Add the buffer to the display, and attach a callback to the buffer for
 	 receiving modification information when the buffer contents change */
 	mBuffer = buf;
+	fltk3::remove_idle(wrap_index_cb, this);
+	mWrapIndex->reset(0, 0, 0);
 	if (mBuffer) {
 		mBuffer->add_modify_callback( buffer_modified_cb, this );
 		mBuffer->add_predelete_callback( buffer_predelete_cb, this );
 
 		/* Update the display */
 		buffer_modified_cb( 0, buf->length(), 0, 0, 0, this );
+
+		/* count the wrapped lines of the new text */
+		if (mContinuousWrap)
+			reset_wrap_index();
 	}
 
 	/* Resize the widget to update the screen... */
@@ -414,6 +754,10 @@ void fltk3::TextDisplay::buffer( fltk3::TextBuffer *buf )
  (see extendRangeForStyleMods for more information on this protocol).
 
  Style buffers, tables and their associated memory are managed by the caller.
+ The display keeps the measured layout of recently displayed lines together
+ with their style bytes, and measures a line again when they changed, so
+ the style buffer may be changed at any time; the change shows when the
+ line is drawn next, or right away with redisplay_range().
 
  Styles are ranged from 65 ('A') to 126.
 
@@ -435,12 +779,15 @@ void fltk3::TextDisplay::highlight_data(fltk3::TextBuffer *styleBuffer,
                                         void *cbArg )
 {
 	mStyleBuffer = styleBuffer;
+	mStyleRuns = 0;
+	mHighlighter = 0;
 	mStyleTable = styleTable;
 	mNStyles = nStyles;
 	mUnfinishedStyle = unfinishedStyle;
 	mUnfinishedHighlightCB = unfinishedHighlightCB;
 	mHighlightCBArg = cbArg;
 	mColumnScale = 0;
+	mLayoutCache->clear();
 
 	mStyleBuffer->canUndo(0);
 	damage(fltk3::DAMAGE_EXPOSE);
@@ -448,15 +795,320 @@ void fltk3::TextDisplay::highlight_data(fltk3::TextBuffer *styleBuffer,
 
 
 
+/**
+ \brief Attach run-length encoded highlight information to the display.
+
+ This works like the style buffer version of highlight_data(), but the
+ styles are kept in \p styleRuns, and \p highlighter is asked to style
+ the unfinished text when it is shown. The display keeps \p styleRuns in
+ step with the modifications of its buffer; modified text becomes
+ unfinished again from the start of its line to the end of the text.
+
+ The style runs, table and highlighter are managed by the caller.
+
+ \param styleRuns styles of the text, or NULL to remove the highlighting
+ \param styleTable a list of styles indexed by style - 'A'
+ \param nStyles number of styles in the style table
+ \param highlighter styles unfinished text, may be NULL
+ */
+void fltk3::TextDisplay::highlight_data(fltk3::TextStyleRuns *styleRuns,
+                                        const StyleTableEntry *styleTable, int nStyles,
+                                        fltk3::TextHighlighter *highlighter)
+{
+	mStyleBuffer = 0;
+	mStyleRuns = styleRuns;
+	mHighlighter = highlighter;
+	mStyleTable = styleTable;
+	mNStyles = nStyles;
+	mUnfinishedStyle = styleRuns ? styleRuns->unfinished_style() : 0;
+	mUnfinishedHighlightCB = styleRuns && highlighter ? highlight_runs_cb : 0;
+	mHighlightCBArg = this;
+	mColumnScale = 0;
+	mLayoutCache->clear();
+
+	if (styleRuns && mBuffer && styleRuns->length() != mBuffer->length())
+		styleRuns->clear(mBuffer->length());
+	damage(fltk3::DAMAGE_EXPOSE);
+}
+
+
+
+/**
+ \brief Highlight the unfinished text at pos and the rest of the display.
+
+ Called by position_style() for text in the unfinished style of the style
+ runs. The highlighter styles from where it can restart up to one screen
+ of text below the display, or to the end of the unfinished run.
+ */
+void fltk3::TextDisplay::highlight_runs_cb(fltk3::TextPosition pos, void *cbArg)
+{
+	fltk3::TextDisplay *textD = (fltk3::TextDisplay *)cbArg;
+	fltk3::TextBuffer *buf = textD->mBuffer;
+	fltk3::TextStyleRuns *runs = textD->mStyleRuns;
+
+	fltk3::TextPosition start = runs->run_start(pos);
+	fltk3::TextPosition restart = textD->mHighlighter->restart(buf, runs, start, pos);
+	if (restart > start && restart <= pos)
+		start = restart;
+
+	fltk3::TextPosition limit = max(pos, textD->mLastChar) + (textD->mLastChar - textD->mFirstChar);
+	fltk3::TextPosition end = limit < buf->length() ? buf->line_end(limit) + 1 : buf->length();
+	end = min(end, runs->run_end(pos));
+	if (end < buf->length() && buf->char_at(buf->prev_char(end)) != '\n')
+		end = min(buf->line_end(end) + 1, buf->length());
+
+	textD->mHighlighter->highlight(buf, runs, start, end);
+}
+
+
+
+/**
+ \brief Return the style byte of the character at pos, 0 if there is none.
+ */
+int fltk3::TextDisplay::style_byte(fltk3::TextPosition pos) const
+{
+	if (mStyleBuffer)
+		return (unsigned char) mStyleBuffer->byte_at(pos);
+	if (mStyleRuns)
+		return (unsigned char) mStyleRuns->style_at(pos);
+	return 0;
+}
+
+
+
+/**
+ \brief Create an empty style store.
+ */
+fltk3::TextStyleRuns::TextStyleRuns(char unfinishedStyle)
+{
+	mAllocated = 64;
+	mStart = (fltk3::TextPosition *) malloc(mAllocated * sizeof(fltk3::TextPosition));
+	mStyle = (char *) malloc(mAllocated);
+	mUnfinishedStyle = unfinishedStyle;
+	clear(0);
+}
+
+
+fltk3::TextStyleRuns::~TextStyleRuns()
+{
+	free(mStart);
+	free(mStyle);
+}
+
+
+/**
+ \brief Mark all of the text as unfinished.
+ \param length new length of the text
+ */
+void fltk3::TextStyleRuns::clear(fltk3::TextPosition length)
+{
+	mNRuns = 1;
+	mGapStart = 1;
+	mGapEnd = mAllocated;
+	mStart[0] = 0;
+	mStyle[0] = mUnfinishedStyle;
+	mLength = length;
+	mLast = 0;
+}
+
+
+/*
+ Return the index of the run that contains pos. Runs near the last one that
+ was found are checked first, as the text is mostly read in order.
+ */
+int fltk3::TextStyleRuns::find(fltk3::TextPosition pos) const
+{
+	int i = mLast;
+	if (i < mNRuns && start_of(i) <= pos) {
+		if (i + 1 == mNRuns || pos < start_of(i + 1))
+			return i;
+		if (i + 2 == mNRuns || pos < start_of(i + 2))
+			return mLast = i + 1;
+	}
+	int lo = 0, hi = mNRuns - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (start_of(mid) <= pos) lo = mid;
+		else hi = mid - 1;
+	}
+	return mLast = lo;
+}
+
+
+/**
+ \brief Return the style of the character at \p pos.
+ */
+char fltk3::TextStyleRuns::style_at(fltk3::TextPosition pos) const
+{
+	return style_of(find(pos));
+}
+
+
+/**
+ \brief Return the start of the run that contains \p pos.
+ */
+fltk3::TextPosition fltk3::TextStyleRuns::run_start(fltk3::TextPosition pos) const
+{
+	return start_of(find(pos));
+}
+
+
+/**
+ \brief Return the end of the run that contains \p pos.
+ */
+fltk3::TextPosition fltk3::TextStyleRuns::run_end(fltk3::TextPosition pos) const
+{
+	int i = find(pos);
+	return i + 1 < mNRuns ? start_of(i + 1) : mLength;
+}
+
+
+/*
+ Move the unused part of the arrays in front of run i. The runs are kept
+ like the text of a gap buffer, so that styling a range moves only the runs
+ between it and the previous range.
+ */
+void fltk3::TextStyleRuns::move_gap(int i)
+{
+	int gap = mGapEnd - mGapStart;
+	if (i < mGapStart) {
+		memmove(mStart + i + gap, mStart + i, (mGapStart - i) * sizeof(fltk3::TextPosition));
+		memmove(mStyle + i + gap, mStyle + i, mGapStart - i);
+	} else if (i > mGapStart) {
+		memmove(mStart + mGapStart, mStart + mGapEnd, (i - mGapStart) * sizeof(fltk3::TextPosition));
+		memmove(mStyle + mGapStart, mStyle + mGapEnd, i - mGapStart);
+	}
+	mGapStart = i;
+	mGapEnd = i + gap;
+}
+
+
+/*
+ Insert a run before run i.
+ */
+void fltk3::TextStyleRuns::insert_run(int i, fltk3::TextPosition start, char style)
+{
+	if (mGapStart == mGapEnd) {
+		move_gap(mNRuns);
+		mAllocated *= 2;
+		mStart = (fltk3::TextPosition *) realloc(mStart, mAllocated * sizeof(fltk3::TextPosition));
+		mStyle = (char *) realloc(mStyle, mAllocated);
+		mGapEnd = mAllocated;
+	}
+	move_gap(i);
+	mStart[mGapStart] = start;
+	mStyle[mGapStart] = style;
+	mGapStart++;
+	mNRuns++;
+}
+
+
+/*
+ Remove run i.
+ */
+void fltk3::TextStyleRuns::remove_run(int i)
+{
+	move_gap(i);
+	mGapEnd++;
+	mNRuns--;
+}
+
+
+/**
+ \brief Set the style of the text from \p start to \p end.
+ */
+void fltk3::TextStyleRuns::set(fltk3::TextPosition start, fltk3::TextPosition end, char style)
+{
+	if (start < 0) start = 0;
+	if (end > mLength) end = mLength;
+	if (start >= end) return;
+
+	int i = find(start), j = find(end - 1);
+	fltk3::TextPosition endJ = j + 1 < mNRuns ? start_of(j + 1) : mLength;
+	char styleJ = style_of(j);
+
+	/* drop the runs that start inside of the range, and keep the style
+	 of the text after it */
+	move_gap(i + 1);
+	mGapEnd += j - i;
+	mNRuns -= j - i;
+	if (end < endJ)
+		insert_run(i + 1, end, styleJ);
+
+	/* run i is in front of the gap now */
+	if (mStart[i] == start)
+		mStyle[i] = style;
+	else
+		insert_run(++i, start, style);
+
+	/* join runs of the same style */
+	if (i + 1 < mNRuns && style_of(i + 1) == style)
+		remove_run(i + 1);
+	if (i > 0 && style_of(i - 1) == style)
+		remove_run(i);
+	mLast = 0;
+}
+
+
+/**
+ \brief Drop the styles from \p pos to the end of the text.
+
+ Called by fltk3::TextDisplay when its text is modified; \p pos is the
+ start of the first modified line.
+
+ \param pos the text from here on is unfinished
+ \param length new length of the text
+ */
+void fltk3::TextStyleRuns::modified(fltk3::TextPosition pos, fltk3::TextPosition length)
+{
+	mLength = length;
+	if (pos > length) pos = length;
+	int i = find(pos);
+	move_gap(i + 1);
+	mGapEnd = mAllocated;
+	mNRuns = i + 1;
+	mLast = 0;
+	if (mStart[i] == pos) {
+		mStyle[i] = mUnfinishedStyle;
+		if (i > 0 && (pos == length || style_of(i - 1) == mUnfinishedStyle))
+			remove_run(i);
+	} else if (mStyle[i] != mUnfinishedStyle && pos < length) {
+		insert_run(i + 1, pos, mUnfinishedStyle);
+	}
+}
+
+
+
 /**
  \brief Find the longest line of all visible lines.
  \return the width of the longest visible line in pixels
  */
 int fltk3::TextDisplay::longest_vline() const
 {
+	// The result is kept until the visible lines or any layout change, so
+	// that scrolling sideways and updating the scrollbars don't measure
+	// every line again.
+	fltk3::TextLayoutCache *cache = mLayoutCache;
+	int printing = fltk3::SurfaceDevice::surface() != fltk3::DisplayDevice::display_device();
+	if (mBuffer && !printing) {
+		cache->check(textfont(), textsize(), mBuffer->tab_distance());
+		if (cache->mLongest >= 0 && cache->mLongestEpoch == cache->mEpoch
+		    && cache->mLongestFirst == mFirstChar && cache->mLongestLast == mLastChar
+		    && cache->mLongestLines == mNVisibleLines && cache->mLongestWidth == text_area.w)
+			return cache->mLongest;
+	}
 	int longest = 0;
 	for (int i = 0; i < mNVisibleLines; i++)
 		longest = max(longest, measure_vline(i));
+	if (mBuffer && !printing) {
+		// measuring may have restyled text and dropped layouts
+		cache->mLongest = longest;
+		cache->mLongestEpoch = cache->mEpoch;
+		cache->mLongestFirst = mFirstChar;
+		cache->mLongestLast = mLastChar;
+		cache->mLongestLines = mNVisibleLines;
+		cache->mLongestWidth = text_area.w;
+	}
 	return longest;
 }
 
@@ -509,10 +1161,9 @@ void fltk3::TextDisplay::resize(int X, int Y, int W, int H)
 		 lines in the buffer, and can leave the top line number incorrect, and
 		 the top character no longer pointing at a valid line start */
 		if (mContinuousWrap && !mWrapMarginPix && (W!=oldWidth || text_area.w!=oldTAWidth)) {
-			int oldFirstChar = mFirstChar;
-			mNBufferLines = count_lines(0, buffer()->length(), true);
+			fltk3::TextPosition oldFirstChar = mFirstChar;
 			mFirstChar = line_start(mFirstChar);
-			mTopLineNum = count_lines(0, mFirstChar, true)+1;
+			reset_wrap_index();
 			absolute_top_line_number(oldFirstChar);
 #ifdef DEBUG
 			printf("    mNBufferLines=%d\n", mNBufferLines);
@@ -526,7 +1177,7 @@ void fltk3::TextDisplay::resize(int X, int Y, int W, int H)
 		if (mNVisibleLines != nvlines) {
 			mNVisibleLines = nvlines;
 			if (mLineStarts) delete[] mLineStarts;
-			mLineStarts = new int [mNVisibleLines];
+			mLineStarts = new fltk3::TextPosition[mNVisibleLines];
 		}
 
 		calc_line_starts(0, mNVisibleLines);
@@ -632,6 +1283,10 @@ void fltk3::TextDisplay::resize(int X, int Y, int W, int H)
 	mHorizOffsetHint = mHorizOffset;
 	display_insert_position_hint = 0;
 
+	// the text area may have moved, so scrolled pixels can't be reused
+	if (mScrollDX || mScrollDY)
+		damage(fltk3::DAMAGE_EXPOSE);
+
 	if (mContinuousWrap ||
 	    hscrollbarvisible != mHScrollBar->visible() ||
 	    vscrollbarvisible != mVScrollBar->visible())
@@ -667,6 +1322,17 @@ void fltk3::TextDisplay::draw_text( int left, int top, int width, int height )
 }
 
 
+/**
+ \brief Redraw the text that fltk3::scroll() exposed.
+ \param d the fltk3::TextDisplay that scrolled
+ \param X, Y, W, H the newly exposed area
+ */
+void fltk3::TextDisplay::draw_text_cb(void *d, int X, int Y, int W, int H)
+{
+	((fltk3::TextDisplay*)d)->draw_text(X, Y, W, H);
+}
+
+
 
 /**
  \brief Marks text from start to end as needing a redraw.
@@ -675,11 +1341,14 @@ void fltk3::TextDisplay::draw_text( int left, int top, int width, int height )
  \param startpos index of first character needing redraw
  \param endpos index after last character needing redraw
  */
-void fltk3::TextDisplay::redisplay_range(int startpos, int endpos)
+void fltk3::TextDisplay::redisplay_range(fltk3::TextPosition startpos, fltk3::TextPosition endpos)
 {
 	IS_UTF8_ALIGNED2(buffer(), startpos)
 	IS_UTF8_ALIGNED2(buffer(), endpos)
 
+	/* the styles in the range may have changed */
+	mLayoutCache->invalidate(startpos, endpos);
+
 	if (damage_range1_start == -1 && damage_range1_end == -1) {
 		damage_range1_start = startpos;
 		damage_range1_end = endpos;
@@ -712,7 +1381,7 @@ void fltk3::TextDisplay::redisplay_range(int startpos, int endpos)
  \param startpos index of first character to draw
  \param endpos index after last character to draw
  */
-void fltk3::TextDisplay::draw_range(int startpos, int endpos)
+void fltk3::TextDisplay::draw_range(fltk3::TextPosition startpos, fltk3::TextPosition endpos)
 {
 	startpos = buffer()->utf8_align(startpos);
 	endpos = buffer()->utf8_align(endpos);
@@ -742,10 +1411,10 @@ void fltk3::TextDisplay::draw_range(int startpos, int endpos)
 	}
 
 	/* Get the starting and ending positions within the lines */
-	startIndex = mLineStarts[ startLine ] == -1 ? 0 : startpos - mLineStarts[ startLine ];
+	startIndex = mLineStarts[ startLine ] == -1 ? 0 : (int) min(startpos - mLineStarts[ startLine ], INT_MAX);
 	if ( endpos >= mLastChar ) endIndex = INT_MAX;
 	else if ( mLineStarts[ lastLine ] == -1 ) endIndex = 0;
-	else endIndex = endpos - mLineStarts[ lastLine ];
+	else endIndex = (int) min(endpos - mLineStarts[ lastLine ], INT_MAX);
 
 	/* If the starting and ending lines are the same, redisplay the single
 	 line between "start" and "end" */
@@ -772,7 +1441,7 @@ void fltk3::TextDisplay::draw_range(int startpos, int endpos)
  This function may trigger a redraw.
  \param newPos new caret position
  */
-void fltk3::TextDisplay::insert_position( int newPos )
+void fltk3::TextDisplay::insert_position( fltk3::TextPosition newPos )
 {
 	IS_UTF8_ALIGNED2(buffer(), newPos)
 
@@ -875,14 +1544,19 @@ void fltk3::TextDisplay::wrap_mode(int wrap, int wrapMargin)
 	}
 
 	if (buffer()) {
-		/* wrapping can change the total number of lines, re-count */
-		mNBufferLines = count_lines(0, buffer()->length(), true);
-
 		/* changing wrap margins or changing from wrapped mode to non-wrapped
 		 can leave the character at the top no longer at a line start, and/or
 		 change the line number */
 		mFirstChar = line_start(mFirstChar);
-		mTopLineNum = count_lines(0, mFirstChar, true) + 1;
+
+		/* wrapping can change the total number of lines, re-count */
+		if (mContinuousWrap) {
+			reset_wrap_index();
+		} else {
+			fltk3::remove_idle(wrap_index_cb, this);
+			mNBufferLines = count_lines(0, buffer()->length(), true);
+			mTopLineNum = count_lines(0, mFirstChar, true) + 1;
+		}
 
 		reset_absolute_top_line_number();
 
@@ -902,6 +1576,131 @@ void fltk3::TextDisplay::wrap_mode(int wrap, int wrapMargin)
 
 
 
+/**
+ \brief Start counting the wrapped lines again.
+
+ Called in continuous wrap mode when the wrap margin, the text font or
+ size, or the buffer changes. The first part of the text is counted right
+ away, the rest while the application is idle. Until then, mNBufferLines
+ and mTopLineNum are estimated.
+ */
+void fltk3::TextDisplay::reset_wrap_index()
+{
+	mWrapIndex->reset(mWrapMarginPix ? mWrapMarginPix : text_area.w, textfont(), textsize());
+	if (index_wrapped_lines(WRAP_INDEX_SLICE))
+		fltk3::remove_idle(wrap_index_cb, this);
+	else if (!fltk3::has_idle(wrap_index_cb, this))
+		fltk3::add_idle(wrap_index_cb, this);
+	estimate_wrapped_lines();
+}
+
+
+
+/**
+ \brief Count about nBytes more of the text for the wrap index.
+ \param nBytes amount of text to count
+ \return 1 if all of the text is counted
+ */
+fltk3::TextPosition fltk3::TextDisplay::index_wrapped_lines(int nBytes)
+{
+	fltk3::TextWrapIndex *index = mWrapIndex;
+	fltk3::TextPosition length = mBuffer->length();
+	fltk3::TextPosition retPos, retLines, retLineStart, retLineEnd;
+
+	while (!index->mComplete && nBytes > 0) {
+		fltk3::TextPosition pos = index->mPos[index->mN - 1];
+		fltk3::TextPosition lines = index->mLines[index->mN - 1];
+		fltk3::TextPosition maxPos = pos + WRAP_INDEX_STEP;
+		if (maxPos < length) {
+			/* the checkpoint is the start of the line that maxPos is in */
+			maxPos = mBuffer->utf8_align(maxPos);
+			wrapped_line_counter(mBuffer, pos, maxPos, INT_MAX, true, 0,
+			                     &retPos, &retLines, &retLineStart, &retLineEnd, false);
+			if (retLineStart <= pos) {
+				/* no line break, so continue after the next newline */
+				retLineStart = mBuffer->line_end(maxPos) + 1;
+				if (retLineStart <= length)
+					retLines = count_lines(pos, retLineStart, true);
+			}
+			if (retLineStart < length) {
+				index->add(retLineStart, lines + retLines);
+				nBytes -= (int) min(retLineStart - pos, nBytes);
+				continue;
+			}
+		}
+		index->mTotal = lines + count_lines(pos, length, true);
+		index->mComplete = 1;
+	}
+	return index->mComplete;
+}
+
+
+
+/**
+ \brief Return the number of wrapped lines before pos.
+ This is exact if the wrap index reaches pos, and an estimate otherwise.
+ */
+fltk3::TextPosition fltk3::TextDisplay::wrapped_lines_before(fltk3::TextPosition pos) const
+{
+	fltk3::TextWrapIndex *index = mWrapIndex;
+	int i = index->find(pos);
+	if (i < index->mN - 1 || index->mComplete)
+		return index->mLines[i] + (pos > index->mPos[i] ? count_lines(index->mPos[i], pos, true) : 0);
+
+	/* assume the rest wraps like the text counted so far, but there
+	 are at least as many lines as newlines */
+	fltk3::TextPosition start = index->mPos[i], lines = index->mLines[i];
+	fltk3::TextPosition estimate = start ? (fltk3::TextPosition) ((double) lines * (pos - start) / start) : 0;
+	return lines + max(estimate, mBuffer->count_lines(start, pos));
+}
+
+
+
+/**
+ \brief Update mNBufferLines and mTopLineNum from the wrap index.
+ */
+void fltk3::TextDisplay::estimate_wrapped_lines()
+{
+	if (mWrapIndex->mComplete)
+		mNBufferLines = mWrapIndex->mTotal;
+	else
+		mNBufferLines = wrapped_lines_before(mBuffer->length()) + 1;
+	mTopLineNum = wrapped_lines_before(mFirstChar) + 1;
+}
+
+
+
+/**
+ \brief Idle callback that continues counting the wrapped lines.
+
+ The scrollbar is updated with the refined estimate after each slice.
+ */
+void fltk3::TextDisplay::wrap_index_cb(void *d)
+{
+	fltk3::TextDisplay *textD = (fltk3::TextDisplay *)d;
+	if (!textD->mBuffer || !textD->mContinuousWrap ||
+	    textD->index_wrapped_lines(WRAP_INDEX_SLICE))
+		fltk3::remove_idle(wrap_index_cb, d);
+	if (!textD->mBuffer || !textD->mContinuousWrap)
+		return;
+
+	fltk3::TextPosition oldNBufferLines = textD->mNBufferLines, oldTopLineNum = textD->mTopLineNum;
+	textD->estimate_wrapped_lines();
+	if (textD->mTopLineNumHint == oldTopLineNum)
+		textD->mTopLineNumHint = textD->mTopLineNum;
+	if (textD->mNBufferLines == oldNBufferLines && textD->mTopLineNum == oldTopLineNum)
+		return;
+
+	/* the vertical scrollbar may have to appear or disappear */
+	if ((textD->mNBufferLines >= textD->mNVisibleLines - 1) != (textD->mVScrollBar->visible() != 0)
+	    && textD->scrollbar_width() && textD->scrollbar_align() & (fltk3::ALIGN_LEFT|fltk3::ALIGN_RIGHT))
+		textD->resize(textD->x(), textD->y(), textD->w(), textD->h());
+	else
+		textD->update_v_scrollbar();
+}
+
+
+
 /**
  \brief Inserts "text" at the current cursor location.
 
@@ -916,7 +1715,7 @@ void fltk3::TextDisplay::insert(const char* text)
 	IS_UTF8_ALIGNED2(buffer(), mCursorPos)
 	IS_UTF8_ALIGNED(text)
 
-	int pos = mCursorPos;
+	fltk3::TextPosition pos = mCursorPos;
 
 	mCursorToHint = (int) (pos + strlen( text ));
 	mBuffer->insert( pos, text );
@@ -936,11 +1735,12 @@ void fltk3::TextDisplay::overstrike(const char* text)
 	IS_UTF8_ALIGNED2(buffer(), mCursorPos)
 	IS_UTF8_ALIGNED(text)
 
-	int startPos = mCursorPos;
+	fltk3::TextPosition startPos = mCursorPos;
 	fltk3::TextBuffer *buf = mBuffer;
-	int lineStart = buf->line_start( startPos );
+	fltk3::TextPosition lineStart = buf->line_start( startPos );
 	int textLen = (int) strlen( text );
-	int i, p, endPos, indent, startIndent, endIndent;
+	fltk3::TextPosition p, endPos, indent, startIndent, endIndent;
+	int i;
 	const char *c;
 	unsigned int ch;
 	char *paddedText = NULL;
@@ -1001,12 +1801,12 @@ void fltk3::TextDisplay::overstrike(const char* text)
  \param[out] X, Y pixel position of character on screen
  \return 0 if character vertically out of view, X & Y positions otherwise
  */
-int fltk3::TextDisplay::position_to_xy( int pos, int* X, int* Y ) const
+int fltk3::TextDisplay::position_to_xy( fltk3::TextPosition pos, int* X, int* Y ) const
 {
 	IS_UTF8_ALIGNED2(buffer(), pos)
 
-	int lineStartPos, fontHeight;
-	int visLineNum;
+	fltk3::TextPosition lineStartPos;
+	int fontHeight, visLineNum;
 	/* If position is not displayed, return false */
 	if (pos < mFirstChar || (pos > mLastChar && !empty_vlines())) {
 		return (*X=*Y=0); // make sure X & Y are set when it is out of view
@@ -1028,7 +1828,7 @@ int fltk3::TextDisplay::position_to_xy( int pos, int* X, int* Y ) const
 		*X = text_area.x - mHorizOffset;
 		return 1;
 	}
-	*X = text_area.x + handle_vline(GET_WIDTH, lineStartPos, pos-lineStartPos, 0, 0, 0, 0, 0, 0) - mHorizOffset;
+	*X = text_area.x + (int) handle_vline(GET_WIDTH, lineStartPos, (int) (pos-lineStartPos), 0, 0, 0, 0, 0, 0) - mHorizOffset;
 	return 1;
 }
 
@@ -1051,11 +1851,11 @@ int fltk3::TextDisplay::position_to_xy( int pos, int* X, int* Y ) const
     environment. We will have to further define what exactly we want to return.
     Please check the functions that call this particular function.
  */
-int fltk3::TextDisplay::position_to_linecol( int pos, int* lineNum, int* column ) const
+int fltk3::TextDisplay::position_to_linecol( fltk3::TextPosition pos, fltk3::TextPosition* lineNum, int* column ) const
 {
 	IS_UTF8_ALIGNED2(buffer(), pos)
 
-	int retVal;
+	int retVal, visLineNum;
 
 	/* In continuous wrap mode, the absolute (non-wrapped) line count is
 	 maintained separately, as needed.  Only return it if we're actually
@@ -1064,14 +1864,14 @@ int fltk3::TextDisplay::position_to_linecol( int pos, int* lineNum, int* column
 		if (!maintaining_absolute_top_line_number() || pos < mFirstChar || pos > mLastChar)
 			return 0;
 		*lineNum = mAbsTopLineNum + buffer()->count_lines(mFirstChar, pos);
-		*column = buffer()->count_displayed_characters(buffer()->line_start(pos), pos);
+		*column = (int) buffer()->count_displayed_characters(buffer()->line_start(pos), pos);
 		return 1;
 	}
 
-	retVal = position_to_line( pos, lineNum );
+	retVal = position_to_line( pos, &visLineNum );
 	if ( retVal ) {
-		*column = mBuffer->count_displayed_characters( mLineStarts[ *lineNum ], pos );
-		*lineNum += mTopLineNum;
+		*column = (int) mBuffer->count_displayed_characters( mLineStarts[ visLineNum ], pos );
+		*lineNum = visLineNum + mTopLineNum;
 	}
 	return retVal;
 }
@@ -1085,7 +1885,7 @@ int fltk3::TextDisplay::position_to_linecol( int pos, int* lineNum, int* column
  */
 int fltk3::TextDisplay::in_selection( int X, int Y ) const
 {
-	int pos = xy_to_position( X, Y, CHARACTER_POS );
+	fltk3::TextPosition pos = xy_to_position( X, Y, CHARACTER_POS );
 	IS_UTF8_ALIGNED2(buffer(), pos)
 	fltk3::TextBuffer *buf = mBuffer;
 	return buf->primary_selection()->includes(pos);
@@ -1115,7 +1915,7 @@ int fltk3::TextDisplay::in_selection( int X, int Y ) const
  */
 int fltk3::TextDisplay::wrapped_column(int row, int column) const
 {
-	int lineStart, dispLineStart;
+	fltk3::TextPosition lineStart, dispLineStart;
 
 	if (!mContinuousWrap || row < 0 || row > mNVisibleLines)
 		return column;
@@ -1123,7 +1923,7 @@ int fltk3::TextDisplay::wrapped_column(int row, int column) const
 	if (dispLineStart == -1)
 		return column;
 	lineStart = buffer()->line_start(dispLineStart);
-	return column + buffer()->count_displayed_characters(lineStart, dispLineStart);
+	return column + (int) buffer()->count_displayed_characters(lineStart, dispLineStart);
 }
 
 
@@ -1146,7 +1946,7 @@ int fltk3::TextDisplay::wrapped_row(int row) const
 {
 	if (!mContinuousWrap || row < 0 || row > mNVisibleLines)
 		return row;
-	return buffer()->count_lines(mFirstChar, mLineStarts[row]);
+	return (int) buffer()->count_lines(mFirstChar, mLineStarts[row]);
 }
 
 
@@ -1163,14 +1963,15 @@ int fltk3::TextDisplay::wrapped_row(int row) const
  */
 void fltk3::TextDisplay::display_insert()
 {
-	int hOffset, topLine, X, Y;
+	int hOffset, X, Y;
+	fltk3::TextPosition topLine;
 	hOffset = mHorizOffset;
 	topLine = mTopLineNum;
 
 	if (insert_position() < mFirstChar) {
 		topLine -= count_lines(insert_position(), mFirstChar, false);
 	} else if (mNVisibleLines>=2 && mLineStarts[mNVisibleLines-2] != -1) {
-		int lastChar = line_end(mLineStarts[mNVisibleLines-2],true);
+		fltk3::TextPosition lastChar = line_end(mLineStarts[mNVisibleLines-2],true);
 		if (insert_position() >= lastChar)
 			topLine += count_lines(lastChar - (wrap_uses_character(mLastChar) ? 0 : 1),
 			                       insert_position(), false);
@@ -1225,8 +2026,8 @@ int fltk3::TextDisplay::move_right()
 {
 	if ( mCursorPos >= mBuffer->length() )
 		return 0;
-	int p = insert_position();
-	int q = buffer()->next_char(p);
+	fltk3::TextPosition p = insert_position();
+	fltk3::TextPosition q = buffer()->next_char(p);
 	insert_position(q);
 	return 1;
 }
@@ -1241,8 +2042,8 @@ int fltk3::TextDisplay::move_left()
 {
 	if ( mCursorPos <= 0 )
 		return 0;
-	int p = insert_position();
-	int q = buffer()->prev_char_clipped(p);
+	fltk3::TextPosition p = insert_position();
+	fltk3::TextPosition q = buffer()->prev_char_clipped(p);
 	insert_position(q);
 	return 1;
 }
@@ -1255,7 +2056,8 @@ int fltk3::TextDisplay::move_left()
  */
 int fltk3::TextDisplay::move_up()
 {
-	int lineStartPos, xPos, prevLineStartPos, newPos, visLineNum;
+	fltk3::TextPosition lineStartPos, prevLineStartPos, newPos;
+	int xPos, visLineNum;
 
 	/* Find the position of the start of the line.  Use the line starts array
 	 if possible */
@@ -1272,7 +2074,7 @@ int fltk3::TextDisplay::move_up()
 	if (mCursorPreferredXPos >= 0)
 		xPos = mCursorPreferredXPos;
 	else
-		xPos = handle_vline(GET_WIDTH, lineStartPos, mCursorPos-lineStartPos,
+		xPos = (int) handle_vline(GET_WIDTH, lineStartPos, (int) (mCursorPos-lineStartPos),
 		                    0, 0, 0, 0, 0, INT_MAX);
 
 	/* count forward from the start of the previous line to reach the column */
@@ -1281,8 +2083,8 @@ int fltk3::TextDisplay::move_up()
 	else
 		prevLineStartPos = rewind_lines( lineStartPos, 1 );
 
-	int lineEnd = line_end(prevLineStartPos, true);
-	newPos = handle_vline(FIND_INDEX_FROM_ZERO, prevLineStartPos, lineEnd-prevLineStartPos,
+	fltk3::TextPosition lineEnd = line_end(prevLineStartPos, true);
+	newPos = handle_vline(FIND_INDEX_FROM_ZERO, prevLineStartPos, (int) (lineEnd-prevLineStartPos),
 	                      0, 0, 0, 0, 0, xPos);
 
 	/* move the cursor */
@@ -1301,7 +2103,8 @@ int fltk3::TextDisplay::move_up()
  */
 int fltk3::TextDisplay::move_down()
 {
-	int lineStartPos, xPos, newPos, visLineNum;
+	fltk3::TextPosition lineStartPos, newPos;
+	int xPos, visLineNum;
 
 	if ( mCursorPos == mBuffer->length() )
 		return 0;
@@ -1315,13 +2118,13 @@ int fltk3::TextDisplay::move_down()
 	if (mCursorPreferredXPos >= 0) {
 		xPos = mCursorPreferredXPos;
 	} else {
-		xPos = handle_vline(GET_WIDTH, lineStartPos, mCursorPos-lineStartPos,
+		xPos = (int) handle_vline(GET_WIDTH, lineStartPos, (int) (mCursorPos-lineStartPos),
 		                    0, 0, 0, 0, 0, INT_MAX);
 	}
 
-	int nextLineStartPos = skip_lines( lineStartPos, 1, true );
-	int lineEnd = line_end(nextLineStartPos, true);
-	newPos = handle_vline(FIND_INDEX_FROM_ZERO, nextLineStartPos, lineEnd-nextLineStartPos,
+	fltk3::TextPosition nextLineStartPos = skip_lines( lineStartPos, 1, true );
+	fltk3::TextPosition lineEnd = line_end(nextLineStartPos, true);
+	newPos = handle_vline(FIND_INDEX_FROM_ZERO, nextLineStartPos, (int) (lineEnd-nextLineStartPos),
 	                      0, 0, 0, 0, 0, xPos);
 
 	insert_position( newPos );
@@ -1344,13 +2147,13 @@ int fltk3::TextDisplay::move_down()
  \param startPosIsLineStart avoid scanning back to the line start
  \return number of lines
  */
-int fltk3::TextDisplay::count_lines(int startPos, int endPos,
+fltk3::TextPosition fltk3::TextDisplay::count_lines(fltk3::TextPosition startPos, fltk3::TextPosition endPos,
                                     bool startPosIsLineStart) const
 {
 	IS_UTF8_ALIGNED2(buffer(), startPos)
 	IS_UTF8_ALIGNED2(buffer(), endPos)
 
-	int retLines, retPos, retLineStart, retLineEnd;
+	fltk3::TextPosition retLines, retPos, retLineStart, retLineEnd;
 
 #ifdef DEBUG
 	printf("fltk3::TextDisplay::count_lines(startPos=%d, endPos=%d, startPosIsLineStart=%d\n",
@@ -1388,12 +2191,12 @@ int fltk3::TextDisplay::count_lines(int startPos, int endPos,
  \param startPosIsLineStart avoid scanning back to the line start
  \return new position as index
  */
-int fltk3::TextDisplay::skip_lines(int startPos, int nLines,
+fltk3::TextPosition fltk3::TextDisplay::skip_lines(fltk3::TextPosition startPos, fltk3::TextPosition nLines,
                                    bool startPosIsLineStart)
 {
 	IS_UTF8_ALIGNED2(buffer(), startPos)
 
-	int retLines, retPos, retLineStart, retLineEnd;
+	fltk3::TextPosition retLines, retPos, retLineStart, retLineEnd;
 
 	/* if we're not wrapping use more efficient BufCountForwardNLines */
 	if (!mContinuousWrap)
@@ -1403,6 +2206,18 @@ int fltk3::TextDisplay::skip_lines(int startPos, int nLines,
 	if (nLines == 0)
 		return startPos;
 
+	/* counting from the start of the text can begin at a checkpoint */
+	fltk3::TextWrapIndex *index = mWrapIndex;
+	if (startPos == 0 && index->counted_for(mWrapMarginPix ? mWrapMarginPix : text_area.w,
+	                                        textfont(), textsize())) {
+		int i = index->find_line(nLines);
+		startPos = index->mPos[i];
+		nLines -= index->mLines[i];
+		startPosIsLineStart = true;
+		if (nLines == 0)
+			return startPos;
+	}
+
 	/* use the common line counting routine to count forward */
 	wrapped_line_counter(buffer(), startPos, buffer()->length(),
 	                     nLines, startPosIsLineStart, 0,
@@ -1435,11 +2250,11 @@ int fltk3::TextDisplay::skip_lines(int startPos, int nLines,
  \param startPosIsLineStart avoid scanning back to the line start
  \return new position as index
  */
-int fltk3::TextDisplay::line_end(int startPos, bool startPosIsLineStart) const
+fltk3::TextPosition fltk3::TextDisplay::line_end(fltk3::TextPosition startPos, bool startPosIsLineStart) const
 {
 	IS_UTF8_ALIGNED2(buffer(), startPos)
 
-	int retLines, retPos, retLineStart, retLineEnd;
+	fltk3::TextPosition retLines, retPos, retLineStart, retLineEnd;
 
 	/* If we're not wrapping use more efficient BufEndOfLine */
 	if (!mContinuousWrap)
@@ -1467,11 +2282,11 @@ int fltk3::TextDisplay::line_end(int startPos, bool startPosIsLineStart) const
  \param pos index to starting character
  \return new position as index
  */
-int fltk3::TextDisplay::line_start(int pos) const
+fltk3::TextPosition fltk3::TextDisplay::line_start(fltk3::TextPosition pos) const
 {
 	IS_UTF8_ALIGNED2(buffer(), pos)
 
-	int retLines, retPos, retLineStart, retLineEnd;
+	fltk3::TextPosition retLines, retPos, retLineStart, retLineEnd;
 
 	/* If we're not wrapping, use the more efficient BufStartOfLine */
 	if (!mContinuousWrap)
@@ -1496,12 +2311,12 @@ int fltk3::TextDisplay::line_start(int pos) const
  \param nLines number of lines to skip back
  \return new position as index
  */
-int fltk3::TextDisplay::rewind_lines(int startPos, int nLines)
+fltk3::TextPosition fltk3::TextDisplay::rewind_lines(fltk3::TextPosition startPos, fltk3::TextPosition nLines)
 {
 	IS_UTF8_ALIGNED2(buffer(), startPos)
 
 	fltk3::TextBuffer *buf = buffer();
-	int pos, lineStart, retLines, retPos, retLineStart, retLineEnd;
+	fltk3::TextPosition pos, lineStart, retLines, retPos, retLineStart, retLineEnd;
 
 	/* If we're not wrapping, use the more efficient BufCountBackwardNLines */
 	if (!mContinuousWrap)
@@ -1537,7 +2352,7 @@ static inline int fl_isseparator(unsigned int c)
  */
 void fltk3::TextDisplay::next_word()
 {
-	int pos = insert_position();
+	fltk3::TextPosition pos = insert_position();
 
 	while (pos < buffer()->length() && !fl_isseparator(buffer()->char_at(pos))) {
 		pos = buffer()->next_char(pos);
@@ -1557,7 +2372,7 @@ void fltk3::TextDisplay::next_word()
  */
 void fltk3::TextDisplay::previous_word()
 {
-	int pos = insert_position();
+	fltk3::TextPosition pos = insert_position();
 	if (pos==0) return;
 	pos = buffer()->prev_char(pos);
 
@@ -1592,7 +2407,7 @@ void fltk3::TextDisplay::previous_word()
  \param nDeleted number of bytes we will delete (must be UTF-8 aligned!)
  \param cbArg "this" pointer for static callback function
  */
-void fltk3::TextDisplay::buffer_predelete_cb(int pos, int nDeleted, void *cbArg)
+void fltk3::TextDisplay::buffer_predelete_cb(fltk3::TextPosition pos, fltk3::TextPosition nDeleted, void *cbArg)
 {
 	fltk3::TextDisplay *textD = (fltk3::TextDisplay *)cbArg;
 	if (textD->mContinuousWrap) {
@@ -1629,28 +2444,41 @@ void fltk3::TextDisplay::buffer_predelete_cb(int pos, int nDeleted, void *cbArg)
  \param deletedText this is what was removed, must not be NULL if nDeleted is set
  \param cbArg "this" pointer for static callback function
  */
-void fltk3::TextDisplay::buffer_modified_cb( int pos, int nInserted, int nDeleted,
-                int nRestyled, const char *deletedText, void *cbArg )
+void fltk3::TextDisplay::buffer_modified_cb( fltk3::TextPosition pos, fltk3::TextPosition nInserted, fltk3::TextPosition nDeleted,
+                fltk3::TextPosition nRestyled, const char *deletedText, void *cbArg )
 {
-	int linesInserted, linesDeleted, startDispPos, endDispPos;
+	fltk3::TextPosition linesInserted, linesDeleted, startDispPos, endDispPos;
 	fltk3::TextDisplay *textD = ( fltk3::TextDisplay * ) cbArg;
 	fltk3::TextBuffer *buf = textD->mBuffer;
-	int oldFirstChar = textD->mFirstChar;
-	int scrolled, origCursorPos = textD->mCursorPos;
-	int wrapModStart = 0, wrapModEnd = 0;
+	fltk3::TextPosition oldFirstChar = textD->mFirstChar;
+	int scrolled;
+	fltk3::TextPosition origCursorPos = textD->mCursorPos;
+	fltk3::TextPosition wrapModStart = 0, wrapModEnd = 0;
+
+	/* In tail mode, a display scrolled to the bottom follows the end of the text */
+	int followEnd = buf->tail_mode() && nInserted != 0
+	                && textD->mTopLineNum >= textD->mNBufferLines + 3 - textD->mNVisibleLines;
 
 	IS_UTF8_ALIGNED2(buf, pos)
 	IS_UTF8_ALIGNED2(buf, oldFirstChar)
 
-	/* buffer modification cancels vertical cursor motion column */
-	if ( nInserted != 0 || nDeleted != 0 )
+	/* buffer modification cancels vertical cursor motion column, and moves
+	 the cached line layouts; a change of selection only restyles a range */
+	if ( nInserted != 0 || nDeleted != 0 ) {
 		textD->mCursorPreferredXPos = -1;
+		textD->mLayoutCache->clear();
+		if ( textD->mStyleRuns )
+			textD->mStyleRuns->modified( buf->line_start(pos), buf->length() );
+	} else if ( nRestyled != 0 )
+		textD->mLayoutCache->invalidate(pos, pos + nRestyled);
 
 	/* Count the number of lines inserted and deleted, and in the case
 	 of continuous wrap mode, how much has changed */
 	if (textD->mContinuousWrap) {
 		textD->find_wrap_range(deletedText, pos, nInserted, nDeleted,
 		                       &wrapModStart, &wrapModEnd, &linesInserted, &linesDeleted);
+		textD->mWrapIndex->modified(wrapModStart, wrapModEnd, nInserted - nDeleted,
+		                            linesInserted - linesDeleted);
 	} else {
 		linesInserted = nInserted == 0 ? 0 : buf->count_lines( pos, pos + nInserted );
 		linesDeleted = nDeleted == 0 ? 0 : countlines( deletedText );
@@ -1683,6 +2511,13 @@ void fltk3::TextDisplay::buffer_modified_cb( int pos, int nInserted, int nDelete
 	/* Update the line count for the whole buffer */
 	textD->mNBufferLines += linesInserted - linesDeleted;
 
+	/* resize() below scrolls to the new bottom line */
+	if (followEnd) {
+		textD->mTopLineNumHint = max(1, textD->mNBufferLines + 3 - textD->mNVisibleLines);
+		if (textD->mTopLineNumHint != textD->mTopLineNum)
+			scrolled = 1;
+	}
+
 	/* Update the cursor position */
 	if ( textD->mCursorToHint != NO_HINT ) {
 		textD->mCursorPos = textD->mCursorToHint;
@@ -1759,6 +2594,11 @@ void fltk3::TextDisplay::buffer_modified_cb( int pos, int nInserted, int nDelete
 	 text).  Extend the redraw range to incorporate style changes */
 	if ( textD->mStyleBuffer )
 		textD->extend_range_for_styles( &startDispPos, &endDispPos );
+
+	/* The rest of the displayed text is unfinished now and may be
+	 highlighted differently */
+	if ( textD->mStyleRuns && textD->mHighlighter && (nInserted != 0 || nDeleted != 0) )
+		endDispPos = max( endDispPos, buf->next_char(textD->mLastChar) );
 	IS_UTF8_ALIGNED2(buf, startDispPos)
 	IS_UTF8_ALIGNED2(buf, endDispPos)
 
@@ -1795,7 +2635,7 @@ void fltk3::TextDisplay::maintain_absolute_top_line_number(int state)
  Returns the absolute (non-wrapped) line number of the first line displayed.
  Returns 0 if the absolute top line number is not being maintained.
  */
-int fltk3::TextDisplay::get_absolute_top_line_number() const
+fltk3::TextPosition fltk3::TextDisplay::get_absolute_top_line_number() const
 {
 	if (!mContinuousWrap)
 		return mTopLineNum;
@@ -1811,7 +2651,7 @@ int fltk3::TextDisplay::get_absolute_top_line_number() const
 
  Re-calculate absolute top line number for a change in scroll position.
  */
-void fltk3::TextDisplay::absolute_top_line_number(int oldFirstChar)
+void fltk3::TextDisplay::absolute_top_line_number(fltk3::TextPosition oldFirstChar)
 {
 	if (maintaining_absolute_top_line_number()) {
 		if (mFirstChar < oldFirstChar)
@@ -1863,7 +2703,7 @@ void fltk3::TextDisplay::reset_absolute_top_line_number()
  \return ??
  \todo What does this do?
  */
-int fltk3::TextDisplay::position_to_line( int pos, int *lineNum ) const
+int fltk3::TextDisplay::position_to_line( fltk3::TextPosition pos, int *lineNum ) const
 {
 	IS_UTF8_ALIGNED2(buffer(), pos)
 
@@ -1920,9 +2760,9 @@ int fltk3::TextDisplay::position_to_line( int pos, int *lineNum ) const
  \todo we handle all styles and selections
  \todo we must provide code to get pixel positions of the middle of a character as well
  */
-int fltk3::TextDisplay::handle_vline(
+fltk3::TextPosition fltk3::TextDisplay::handle_vline(
         int mode,
-        int lineStartPos, int lineLen, int leftChar, int rightChar,
+        fltk3::TextPosition lineStartPos, int lineLen, int leftChar, int rightChar,
         int Y, int bottomClip,
         int leftClip, int rightClip) const
 {
@@ -1930,14 +2770,7 @@ int fltk3::TextDisplay::handle_vline(
 
 	// FIXME: we need to allow two modes for FIND_INDEX: one on the edge of the
 	// FIXME: character for selection, and one on the character center for cursors.
-	int i, X, startX, startIndex, style, charStyle;
-	char *lineStr;
-
-	if ( lineStartPos == -1 ) {
-		lineStr = NULL;
-	} else {
-		lineStr = mBuffer->text_range( lineStartPos, lineStartPos + lineLen );
-	}
+	int X, style;
 
 	if (mode==GET_WIDTH) {
 		X = 0;
@@ -1948,13 +2781,11 @@ int fltk3::TextDisplay::handle_vline(
 		X = text_area.x - mHorizOffset;
 	}
 
-	startX = X;
-	startIndex = 0;
-	if (!lineStr) {
+	if ( lineStartPos == -1 ) {
 		// just clear the background
 		if (mode==DRAW_LINE) {
 			style = position_style(lineStartPos, lineLen, -1);
-			draw_string( style|BG_ONLY_MASK, text_area.x, Y, text_area.x+text_area.w, lineStr, lineLen );
+			draw_string( style|BG_ONLY_MASK, text_area.x, Y, text_area.x+text_area.w, 0, lineLen );
 		}
 		if (mode==FIND_INDEX) {
 			IS_UTF8_ALIGNED2(buffer(), lineStartPos)
@@ -1963,8 +2794,105 @@ int fltk3::TextDisplay::handle_vline(
 		return 0;
 	}
 
+	const char *lineStr = contiguous_text( lineStartPos, lineLen );
+	const fltk3::TextLineLayout *layout = line_layout(lineStartPos, lineLen, lineStr, mode==GET_WIDTH);
+	const TextLayoutRun *runs = layout->runs;
+	int nRuns = layout->nRuns, lo, hi;
+
+	if (mode==GET_WIDTH) {
+		// the layout may be that of a longer line, find the run with the end
+		for (lo = 0, hi = nRuns - 1; lo < hi; ) {
+			int mid = (lo + hi) / 2;
+			if (runs[mid].end < lineLen) lo = mid + 1;
+			else hi = mid;
+		}
+		const TextLayoutRun *r = &runs[lo];
+		if (lineLen >= r->end)
+			return r->x + r->w;
+		if (r->tab)
+			return r->x;
+		return r->x + int( string_width( lineStr+r->start, lineLen-r->start, r->style ) );
+	}
+
+	if (mode==FIND_INDEX) {
+		// find the first run that ends right of the position; the last run
+		// takes all positions beyond the end of the line
+		int x = rightClip - X;
+		for (lo = 0, hi = nRuns - 1; lo < hi; ) {
+			int mid = (lo + hi) / 2;
+			if (runs[mid].x + runs[mid].w > x) hi = mid;
+			else lo = mid + 1;
+		}
+		const TextLayoutRun *r = &runs[lo];
+		if (r->tab)
+			return lineStartPos + r->start + ( lo==nRuns-1 && x-r->x>r->w ? 1 : 0 );
+		int di = find_x(lineStr+r->start, r->end-r->start, r->style, x-r->x);
+		IS_UTF8_ALIGNED2(buffer(), (lineStartPos+r->start+di))
+		return lineStartPos + r->start + di;
+	}
+
+	// draw the line, skipping runs that are well outside of the clipping area
+	for (int i = 0; i < nRuns; i++) {
+		const TextLayoutRun *r = &runs[i];
+		int startX = X + r->x;
+		if (startX + r->w < leftClip - mMaxsize)
+			continue;
+		if (startX > rightClip + mMaxsize)
+			break;
+		if (r->tab)
+			draw_string( r->style|BG_ONLY_MASK, startX, Y, startX+r->w, 0, 0 );
+		else
+			draw_string( r->style, startX, Y, startX+r->w, lineStr+r->start, r->end-r->start );
+	}
+
+	// clear the rest of the line
+	const TextLayoutRun *last = &runs[nRuns - 1];
+	draw_string( layout->endStyle|BG_ONLY_MASK, X+last->x+last->w, Y, text_area.x+text_area.w, lineStr, lineLen );
+
+	IS_UTF8_ALIGNED2(buffer(), (lineStartPos+lineLen))
+	return lineStartPos + lineLen;
+}
+
+
+/**
+ \brief Return the layout of a line: its runs of text in one style and its
+ tabs, with their pixel offsets.
+
+ The layout is taken from the cache if the line was laid out before and
+ neither its text nor its styles have changed since. Otherwise it is
+ measured and kept in the cache.
+
+ \param lineStartPos index of first character
+ \param lineLen size of the line in bytes
+ \param lineStr text of the line, see contiguous_text()
+ \param prefix if set, the layout of a longer line at \p lineStartPos may
+   be returned; only its runs up to \p lineLen may be used
+ \return layout, valid until the next call
+ */
+const fltk3::TextLineLayout *fltk3::TextDisplay::line_layout(fltk3::TextPosition lineStartPos, int lineLen,
+                const char *lineStr, int prefix) const
+{
+	fltk3::TextLayoutCache *cache = mLayoutCache;
+	fltk3::TextLineLayout *layout;
+	cache->check(textfont(), textsize(), mBuffer->tab_distance());
+
+	// widths on a printer differ from those on the screen
+	int printing = fltk3::SurfaceDevice::surface() != fltk3::DisplayDevice::display_device();
+	if (printing) {
+		layout = &cache->mScratch;
+	} else {
+		layout = cache->find(lineStartPos, lineLen, prefix);
+		// a style buffer may have been changed without telling the display
+		if (layout && (!mStyleBuffer || same_layout_styles(layout, mStyleBuffer, lineStartPos, lineLen)))
+			return layout;
+		layout = cache->slot(lineStartPos, mNVisibleLines);
+		layout->start = -1;
+	}
+
+	// a new run starts whenever the style changes or a Tab is found
+	int i, style, charStyle, startIndex = 0, x = 0;
 	char currChar = 0, prevChar = 0;
-	// draw the line
+	layout->nRuns = 0;
 	style = position_style(lineStartPos, lineLen, 0);
 	for (i=0; i<lineLen; ) {
 		currChar = lineStr[i]; // one byte is enough to handele tabs and other cases
@@ -1972,79 +2900,90 @@ int fltk3::TextDisplay::handle_vline(
 		if (len<=0) len = 1; // OUCH!
 		charStyle = position_style(lineStartPos, lineLen, i);
 		if (charStyle!=style || currChar=='\t' || prevChar=='\t') {
-			// draw a segment whenever the style changes or a Tab is found
-			int w = 0;
-			if (prevChar=='\t') {
-				// draw a single Tab space
-				int tab = (int)col_to_x(mBuffer->tab_distance());
-				int xAbs = (mode==GET_WIDTH) ? startX : startX+mHorizOffset-text_area.x;
-				w = (((xAbs/tab)+1)*tab) - xAbs;
-				if (mode==DRAW_LINE)
-					draw_string( style|BG_ONLY_MASK, startX, Y, startX+w, 0, 0 );
-				if (mode==FIND_INDEX && startX+w>rightClip) {
-					// find x pos inside block
-					free(lineStr);
-					return lineStartPos + startIndex;
-				}
-			} else {
-				// draw a text segment
-				w = int( string_width( lineStr+startIndex, i-startIndex, style ) );
-				if (mode==DRAW_LINE)
-					draw_string( style, startX, Y, startX+w, lineStr+startIndex, i-startIndex );
-				if (mode==FIND_INDEX && startX+w>rightClip) {
-					// find x pos inside block
-					int di = find_x(lineStr+startIndex, i-startIndex, style, rightClip-startX);
-					free(lineStr);
-					IS_UTF8_ALIGNED2(buffer(), (lineStartPos+startIndex+di))
-					return lineStartPos + startIndex + di;
-				}
-			}
+			if (i > startIndex)
+				x = add_layout_run(layout, lineStr, startIndex, i, style, prevChar=='\t', x);
 			style = charStyle;
-			startX += w;
 			startIndex = i;
 		}
-		i += len;
+		i = min(i + len, lineLen);
 		prevChar = currChar;
 	}
-	int w = 0;
-	if (currChar=='\t') {
-		// draw a single Tab space
-		int tab = (int)col_to_x(mBuffer->tab_distance());
-		int xAbs = (mode==GET_WIDTH) ? startX : startX+mHorizOffset-text_area.x;
-		w = (((xAbs/tab)+1)*tab) - xAbs;
-		if (mode==DRAW_LINE)
-			draw_string( style|BG_ONLY_MASK, startX, Y, startX+w, 0, 0 );
-		if (mode==FIND_INDEX) {
-			// find x pos inside block
-			free(lineStr);
-			return lineStartPos + startIndex + ( rightClip-startX>w ? 1 : 0 );
-		}
-	} else {
-		w = int( string_width( lineStr+startIndex, i-startIndex, style ) );
-		if (mode==DRAW_LINE)
-			draw_string( style, startX, Y, startX+w, lineStr+startIndex, i-startIndex );
-		if (mode==FIND_INDEX) {
-			// find x pos inside block
-			int di = find_x(lineStr+startIndex, i-startIndex, style, rightClip-startX);
-			free(lineStr);
-			IS_UTF8_ALIGNED2(buffer(), (lineStartPos+startIndex+di))
-			return lineStartPos + startIndex + di;
-		}
+	// the last run is kept even if it is empty
+	add_layout_run(layout, lineStr, startIndex, i, style, currChar=='\t', x);
+	layout->endStyle = position_style(lineStartPos, lineLen, i);
+
+	if (!printing) {
+		layout->start = lineStartPos;
+		layout->len = lineLen;
+		layout->generation = cache->mGeneration;
+		if (mStyleBuffer)
+			save_layout_styles(layout, mStyleBuffer, lineStartPos, lineLen);
 	}
-	if (mode==GET_WIDTH) {
-		free(lineStr);
-		return startX+w;
+	return layout;
+}
+
+
+/**
+ \brief Measure a run of a line and append it to the layout.
+ \param layout the layout of the line
+ \param lineStr text of the line
+ \param start, end byte offsets of the run in the line
+ \param style style of the run
+ \param tab if set, the run is a single tab
+ \param x offset of the run from the start of the line in pixels
+ \return offset of the end of the run
+ */
+int fltk3::TextDisplay::add_layout_run(fltk3::TextLineLayout *layout, const char *lineStr,
+                                       int start, int end, int style, int tab, int x) const
+{
+	if (layout->nRuns == layout->nAllocated) {
+		layout->nAllocated = layout->nAllocated ? 2 * layout->nAllocated : 8;
+		layout->runs = (TextLayoutRun *) realloc(layout->runs, layout->nAllocated * sizeof(TextLayoutRun));
+	}
+	TextLayoutRun *r = &layout->runs[layout->nRuns++];
+	r->start = start;
+	r->end = end;
+	r->style = style;
+	r->x = x;
+	r->tab = (char) tab;
+	if (tab) {
+		// a Tab reaches to the next tab stop
+		int tabW = (int)col_to_x(mBuffer->tab_distance());
+		r->w = (((x/tabW)+1)*tabW) - x;
+	} else {
+		r->w = int( string_width( lineStr+start, end-start, style ) );
 	}
+	return x + r->w;
+}
 
-	// clear the rest of the line
-	startX += w;
-	style = position_style(lineStartPos, lineLen, i);
-	if (mode==DRAW_LINE)
-		draw_string( style|BG_ONLY_MASK, startX, Y, text_area.x+text_area.w, lineStr, lineLen );
 
-	free(lineStr);
-	IS_UTF8_ALIGNED2(buffer(), (lineStartPos+lineLen))
-	return lineStartPos + lineLen;
+/**
+ \brief Return the text of a line as one contiguous string.
+
+ Most lines lie in one piece in the buffer, and are returned in place. A
+ line that is split by the gap or across pieces is copied into a buffer
+ owned by the display. The result is not nul terminated, and is valid until
+ the next call or until the buffer is modified.
+
+ \param pos position of the first character
+ \param len length of the text in bytes
+ \return pointer to \p len bytes of text
+ */
+const char *fltk3::TextDisplay::contiguous_text(fltk3::TextPosition pos, int len) const
+{
+	fltk3::TextSpanIterator span(mBuffer, pos, pos + len);
+	if (span.length() >= len)
+		return len ? span.text() : "";
+	if (len > mLineTextSize) {
+		mLineTextSize = len + 256;
+		free(mLineText);
+		mLineText = (char *) malloc(mLineTextSize);
+	}
+	for (char *p = mLineText; !span.done(); span.next()) {
+		memcpy(p, span.text(), span.length());
+		p += span.length();
+	}
+	return mLineText;
 }
 
 
@@ -2060,16 +2999,22 @@ int fltk3::TextDisplay::find_x(const char *s, int len, int style, int x) const
 {
 	IS_UTF8_ALIGNED(s)
 
-	// TODO: use binary search which may be quicker.
-	int i = 0;
-	while (i<len) {
-		int cl = fltk3::utf8len1(s[i]);
-		int w = int( string_width(s, i+cl, style) );
-		if (w>x)
-			return i;
-		i += cl;
+	// binary search for the first character that ends right of x; the
+	// width of a prefix grows with its length
+	int lo = 0, hi = len;
+	while (lo<hi) {
+		int mid = (lo+hi) / 2;
+		while (mid>lo && (s[mid]&0xc0)==0x80)
+			mid--;
+		int cl = fltk3::utf8len1(s[mid]);
+		if (cl<=0) cl = 1;
+		int end = min(mid+cl, len);
+		if (int( string_width(s, end, style) ) > x)
+			hi = mid;
+		else
+			lo = end;
 	}
-	return len;
+	return lo;
 }
 
 
@@ -2090,7 +3035,8 @@ int fltk3::TextDisplay::find_x(const char *s, int len, int style, int x) const
 void fltk3::TextDisplay::draw_vline(int visLineNum, int leftClip, int rightClip,
                                     int leftCharIndex, int rightCharIndex)
 {
-	int Y, lineStartPos, lineLen, fontHeight;
+	int Y, lineLen, fontHeight;
+	fltk3::TextPosition lineStartPos;
 
 	//  printf("draw_vline(visLineNum=%d, leftClip=%d, rightClip=%d, leftCharIndex=%d, rightCharIndex=%d)\n",
 	//         visLineNum, leftClip, rightClip, leftCharIndex, rightCharIndex);
@@ -2445,13 +3391,13 @@ void fltk3::TextDisplay::draw_cursor( int X, int Y )
  \param lineIndex position of character within line
  \return style for the given character
  */
-int fltk3::TextDisplay::position_style( int lineStartPos, int lineLen, int lineIndex) const
+int fltk3::TextDisplay::position_style( fltk3::TextPosition lineStartPos, int lineLen, int lineIndex) const
 {
 	IS_UTF8_ALIGNED2(buffer(), lineStartPos)
 
 	fltk3::TextBuffer * buf = mBuffer;
-	fltk3::TextBuffer *styleBuf = mStyleBuffer;
-	int pos, style = 0;
+	fltk3::TextPosition pos;
+	int style = 0;
 
 	if ( lineStartPos == -1 || buf == NULL )
 		return FILL_MASK;
@@ -2460,12 +3406,13 @@ int fltk3::TextDisplay::position_style( int lineStartPos, int lineLen, int lineI
 
 	if ( lineIndex >= lineLen )
 		style = FILL_MASK;
-	else if ( styleBuf != NULL ) {
-		style = ( unsigned char ) styleBuf->byte_at( pos );
+	else if ( mStyleBuffer || mStyleRuns ) {
+		style = style_byte( pos );
 		if (style == mUnfinishedStyle && mUnfinishedHighlightCB) {
 			/* encountered "unfinished" style, trigger parsing */
 			(mUnfinishedHighlightCB)( pos, mHighlightCBArg);
-			style = (unsigned char) styleBuf->byte_at( pos);
+			mLayoutCache->clear();
+			style = style_byte( pos );
 		}
 	}
 	if (buf->primary_selection()->includes(pos))
@@ -2523,10 +3470,10 @@ double fltk3::TextDisplay::string_width( const char *string, int length, int sty
  \param posType CURSOR_POS or CHARACTER_POS
  \return index into text buffer
  */
-int fltk3::TextDisplay::xy_to_position( int X, int Y, int posType ) const
+fltk3::TextPosition fltk3::TextDisplay::xy_to_position( int X, int Y, int posType ) const
 {
-	int lineStart, lineLen, fontHeight;
-	int visLineNum;
+	fltk3::TextPosition lineStart;
+	int lineLen, fontHeight, visLineNum;
 
 	/* Find the visible line number corresponding to the Y coordinate */
 	fontHeight = mMaxsize;
@@ -2597,14 +3544,15 @@ void fltk3::TextDisplay::xy_to_rowcol( int X, int Y, int *row,
 
  \param newTopLineNum index into buffer
  */
-void fltk3::TextDisplay::offset_line_starts( int newTopLineNum )
+void fltk3::TextDisplay::offset_line_starts( fltk3::TextPosition newTopLineNum )
 {
-	int oldTopLineNum = mTopLineNum;
-	int oldFirstChar = mFirstChar;
-	int lineDelta = newTopLineNum - oldTopLineNum;
+	fltk3::TextPosition oldTopLineNum = mTopLineNum;
+	fltk3::TextPosition oldFirstChar = mFirstChar;
+	fltk3::TextPosition lineDelta = newTopLineNum - oldTopLineNum;
 	int nVisLines = mNVisibleLines;
-	int *lineStarts = mLineStarts;
-	int i, lastLineNum;
+	fltk3::TextPosition *lineStarts = mLineStarts;
+	int i;
+	fltk3::TextPosition lastLineNum;
 	fltk3::TextBuffer *buf = mBuffer;
 
 	/* If there was no offset, nothing needs to be changed */
@@ -2615,7 +3563,12 @@ void fltk3::TextDisplay::offset_line_starts( int newTopLineNum )
 	 known line start (start or end of buffer, or the closest value in the
 	 lineStarts array) */
 	lastLineNum = oldTopLineNum + nVisLines - 1;
-	if ( newTopLineNum < oldTopLineNum && newTopLineNum < -lineDelta ) {
+	if ( mContinuousWrap && (lineDelta >= nVisLines || -lineDelta >= nVisLines)
+	     && mWrapIndex->counted_for(mWrapMarginPix ? mWrapMarginPix : text_area.w, textfont(), textsize())
+	     && mWrapIndex->mLines[mWrapIndex->mN - 1] >= newTopLineNum - 1 ) {
+		/* the wrap index has a checkpoint near the new top line */
+		mFirstChar = skip_lines( 0, newTopLineNum - 1, true );
+	} else if ( newTopLineNum < oldTopLineNum && newTopLineNum < -lineDelta ) {
 		mFirstChar = skip_lines( 0, newTopLineNum - 1, true );
 	} else if ( newTopLineNum < oldTopLineNum ) {
 		mFirstChar = rewind_lines( mFirstChar, -lineDelta );
@@ -2666,16 +3619,16 @@ void fltk3::TextDisplay::offset_line_starts( int newTopLineNum )
  \param linesDeleted number of lines
  \param[out] scrolled set to 1 if the text display needs to be scrolled
  */
-void fltk3::TextDisplay::update_line_starts(int pos, int charsInserted,
-                int charsDeleted, int linesInserted,
-                int linesDeleted, int *scrolled )
+void fltk3::TextDisplay::update_line_starts(fltk3::TextPosition pos, fltk3::TextPosition charsInserted,
+                fltk3::TextPosition charsDeleted, fltk3::TextPosition linesInserted,
+                fltk3::TextPosition linesDeleted, int *scrolled )
 {
 	IS_UTF8_ALIGNED2(buffer(), pos)
 
-	int *lineStarts = mLineStarts;
+	fltk3::TextPosition *lineStarts = mLineStarts;
 	int i, lineOfPos, lineOfEnd, nVisLines = mNVisibleLines;
-	int charDelta = charsInserted - charsDeleted;
-	int lineDelta = linesInserted - linesDeleted;
+	fltk3::TextPosition charDelta = charsInserted - charsDeleted;
+	fltk3::TextPosition lineDelta = linesInserted - linesDeleted;
 
 	/* If all of the changes were before the displayed text, the display
 	 doesn't change, just update the top line num and offset the line
@@ -2773,11 +3726,11 @@ void fltk3::TextDisplay::update_line_starts(int pos, int charsInserted,
 
  \param startLine, endLine range of lines to scan as line numbers
  */
-void fltk3::TextDisplay::calc_line_starts( int startLine, int endLine )
+void fltk3::TextDisplay::calc_line_starts( fltk3::TextPosition startLine, fltk3::TextPosition endLine )
 {
-	int startPos, bufLen = mBuffer->length();
-	int line, lineEnd, nextLineStart, nVis = mNVisibleLines;
-	int *lineStarts = mLineStarts;
+	fltk3::TextPosition startPos, bufLen = mBuffer->length(), lineEnd, nextLineStart;
+	int line, nVis = mNVisibleLines;
+	fltk3::TextPosition *lineStarts = mLineStarts;
 
 	/* Clean up (possibly) messy input parameters */
 	if ( endLine < 0 ) endLine = 0;
@@ -2797,14 +3750,14 @@ void fltk3::TextDisplay::calc_line_starts( int startLine, int endLine )
 	/* If the starting position is already past the end of the text,
 	 fill in -1's (means no text on line) and return */
 	if ( startPos == -1 ) {
-		for ( line = startLine; line <= endLine; line++ )
+		for ( line = (int) startLine; line <= endLine; line++ )
 			lineStarts[ line ] = -1;
 		return;
 	}
 
 	/* Loop searching for ends of lines and storing the positions of the
 	 start of the next line in lineStarts */
-	for ( line = startLine; line <= endLine; line++ ) {
+	for ( line = (int) startLine; line <= endLine; line++ ) {
 		find_line_end(startPos, true, &lineEnd, &nextLineStart);
 		startPos = nextLineStart;
 		if ( startPos >= bufLen ) {
@@ -2850,11 +3803,21 @@ void fltk3::TextDisplay::calc_last_char()
  \param horizOffset column number
  \todo Column numbers make little sense here.
  */
-void fltk3::TextDisplay::scroll(int topLineNum, int horizOffset)
+void fltk3::TextDisplay::scroll(fltk3::TextPosition topLineNum, int horizOffset)
 {
 	mTopLineNumHint = topLineNum;
 	mHorizOffsetHint = horizOffset;
-	resize(x(), y(), w(), h());
+	if (!mBuffer || !mNVisibleLines || display_insert_position_hint) {
+		resize(x(), y(), w(), h());
+		return;
+	}
+	// The size did not change, so there is no need for resize() to lay out
+	// all lines again and redraw everything in wrap mode.
+	scroll_(topLineNum, horizOffset);
+	mTopLineNumHint = mTopLineNum;
+	mHorizOffsetHint = mHorizOffset;
+	update_v_scrollbar();
+	update_h_scrollbar();
 }
 
 
@@ -2865,7 +3828,7 @@ void fltk3::TextDisplay::scroll(int topLineNum, int horizOffset)
  \param horizOffset in pixels
  \return 0 if nothing changed, 1 if we scrolled
  */
-int fltk3::TextDisplay::scroll_(int topLineNum, int horizOffset)
+int fltk3::TextDisplay::scroll_(fltk3::TextPosition topLineNum, int horizOffset)
 {
 	/* Limit the requested scroll position to allowable values */
 	if (topLineNum > mNBufferLines + 3 - mNVisibleLines)
@@ -2881,6 +3844,12 @@ int fltk3::TextDisplay::scroll_(int topLineNum, int horizOffset)
 	if (mHorizOffset == horizOffset && mTopLineNum == topLineNum)
 		return 0;
 
+	/* Remember how far the text moved, so that draw() can copy the pixels
+	 that are still visible and only draw the strips that scrolled in */
+	mScrollDX += mHorizOffset - horizOffset;
+	fltk3::TextPosition scrollDY = mScrollDY + (mTopLineNum - topLineNum) * mMaxsize;
+	mScrollDY = (int) max(-INT_MAX, min(scrollDY, INT_MAX));
+
 	/* If the vertical scroll position has changed, update the line
 	 starts array and related counters in the text display */
 	offset_line_starts(topLineNum);
@@ -2888,8 +3857,7 @@ int fltk3::TextDisplay::scroll_(int topLineNum, int horizOffset)
 	/* Just setting mHorizOffset is enough information for redisplay */
 	mHorizOffset = horizOffset;
 
-	// redraw all text
-	damage(fltk3::DAMAGE_EXPOSE);
+	damage(fltk3::DAMAGE_SCROLL);
 	return 1;
 }
 
@@ -2913,7 +3881,8 @@ void fltk3::TextDisplay::update_v_scrollbar()
 	       mTopLineNum, mNVisibleLines, mNBufferLines);
 #endif // DEBUG
 
-	mVScrollBar->value(mTopLineNum, mNVisibleLines, 1, mNBufferLines+2);
+	mVScrollBar->value((int) min(mTopLineNum, INT_MAX - 2), mNVisibleLines, 1,
+	                   (int) min(mNBufferLines+2, INT_MAX));
 	mVScrollBar->linesize(3);
 }
 
@@ -2968,7 +3937,8 @@ void fltk3::TextDisplay::h_scrollbar_cb(fltk3::Scrollbar* b, fltk3::TextDisplay*
 //
 void fltk3::TextDisplay::draw_line_numbers(bool /*clearAll*/)
 {
-	int Y, line, visLine, lineStart;
+	int Y, line, visLine;
+	fltk3::TextPosition lineStart;
 	char lineNumString[16];
 	int lineHeight = mMaxsize;
 
@@ -3000,7 +3970,7 @@ void fltk3::TextDisplay::draw_line_numbers(bool /*clearAll*/)
 
 		//Y = y();
 		Y = 0;
-		line = get_absolute_top_line_number();
+		line = (int) get_absolute_top_line_number();
 
 		//int last_y = y();
 		//int last_y = 0;
@@ -3028,12 +3998,12 @@ void fltk3::TextDisplay::draw_line_numbers(bool /*clearAll*/)
 	fltk3::pop_clip();
 }
 
-static int max( int i1, int i2 )
+static fltk3::TextPosition max( fltk3::TextPosition i1, fltk3::TextPosition i2 )
 {
 	return i1 >= i2 ? i1 : i2;
 }
 
-static int min( int i1, int i2 )
+static fltk3::TextPosition min( fltk3::TextPosition i1, fltk3::TextPosition i2 )
 {
 	return i1 <= i2 ? i1 : i2;
 }
@@ -3068,9 +4038,9 @@ static int countlines( const char *string )
 int fltk3::TextDisplay::measure_vline( int visLineNum ) const
 {
 	int lineLen = vline_length( visLineNum );
-	int lineStartPos = mLineStarts[ visLineNum ];
+	fltk3::TextPosition lineStartPos = mLineStarts[ visLineNum ];
 	if (lineStartPos < 0 || lineLen == 0) return 0;
-	return handle_vline(GET_WIDTH, lineStartPos, lineLen, 0, 0, 0, 0, 0, 0);
+	return (int) handle_vline(GET_WIDTH, lineStartPos, lineLen, 0, 0, 0, 0, 0, 0);
 }
 
 
@@ -3097,7 +4067,7 @@ int fltk3::TextDisplay::empty_vlines() const
  */
 int fltk3::TextDisplay::vline_length( int visLineNum ) const
 {
-	int nextLineStart, lineStartPos;
+	fltk3::TextPosition nextLineStart, lineStartPos;
 
 	if (visLineNum < 0 || visLineNum >= mNVisibleLines)
 		return (0);
@@ -3108,17 +4078,17 @@ int fltk3::TextDisplay::vline_length( int visLineNum ) const
 		return 0;
 
 	if ( visLineNum + 1 >= mNVisibleLines )
-		return mLastChar - lineStartPos;
+		return (int) (mLastChar - lineStartPos);
 
 	nextLineStart = mLineStarts[ visLineNum + 1 ];
 	if ( nextLineStart == -1 )
-		return mLastChar - lineStartPos;
+		return (int) (mLastChar - lineStartPos);
 
-	int nextLineStartMinus1 = buffer()->prev_char(nextLineStart);
+	fltk3::TextPosition nextLineStartMinus1 = buffer()->prev_char(nextLineStart);
 	if (wrap_uses_character(nextLineStartMinus1))
-		return nextLineStartMinus1 - lineStartPos;
+		return (int) (nextLineStartMinus1 - lineStartPos);
 
-	return nextLineStart - lineStartPos;
+	return (int) (nextLineStart - lineStartPos);
 }
 
 
@@ -3143,20 +4113,20 @@ int fltk3::TextDisplay::vline_length( int visLineNum ) const
  \param linesInserted
  \param linesDeleted
  */
-void fltk3::TextDisplay::find_wrap_range(const char *deletedText, int pos,
-                int nInserted, int nDeleted,
-                int *modRangeStart, int *modRangeEnd,
-                int *linesInserted, int *linesDeleted)
+void fltk3::TextDisplay::find_wrap_range(const char *deletedText, fltk3::TextPosition pos,
+                fltk3::TextPosition nInserted, fltk3::TextPosition nDeleted,
+                fltk3::TextPosition *modRangeStart, fltk3::TextPosition *modRangeEnd,
+                fltk3::TextPosition *linesInserted, fltk3::TextPosition *linesDeleted)
 {
 	IS_UTF8_ALIGNED(deletedText)
 	IS_UTF8_ALIGNED2(buffer(), pos)
 
-	int length, retPos, retLines, retLineStart, retLineEnd;
+	fltk3::TextPosition length, retPos, retLines, retLineStart, retLineEnd;
 	fltk3::TextBuffer *deletedTextBuf, *buf = buffer();
 	int nVisLines = mNVisibleLines;
-	int *lineStarts = mLineStarts;
-	int countFrom, countTo, lineStart, adjLineStart, i;
-	int visLineNum = 0, nLines = 0;
+	fltk3::TextPosition *lineStarts = mLineStarts;
+	fltk3::TextPosition countFrom, countTo, lineStart, adjLineStart, nLines = 0;
+	int i, visLineNum = 0;
 
 	/*
 	 ** Determine where to begin searching: either the previous newline, or
@@ -3312,16 +4282,16 @@ void fltk3::TextDisplay::find_wrap_range(const char *deletedText, int pos,
  \param pos
  \param nDeleted
  */
-void fltk3::TextDisplay::measure_deleted_lines(int pos, int nDeleted)
+void fltk3::TextDisplay::measure_deleted_lines(fltk3::TextPosition pos, fltk3::TextPosition nDeleted)
 {
 	IS_UTF8_ALIGNED2(buffer(), pos)
 
-	int retPos, retLines, retLineStart, retLineEnd;
+	fltk3::TextPosition retPos, retLines, retLineStart, retLineEnd;
 	fltk3::TextBuffer *buf = buffer();
 	int nVisLines = mNVisibleLines;
-	int *lineStarts = mLineStarts;
-	int countFrom, lineStart;
-	int nLines = 0, i;
+	fltk3::TextPosition *lineStarts = mLineStarts;
+	fltk3::TextPosition countFrom, lineStart;
+	fltk3::TextPosition nLines = 0, i;
 	/*
 	 ** Determine where to begin searching: either the previous newline, or
 	 ** if possible, limit to the start of the (original) previous displayed
@@ -3404,18 +4374,18 @@ void fltk3::TextDisplay::measure_deleted_lines(int pos, int nDeleted)
  \param[out] retLineEnd End position of the last line traversed
  \param[out] countLastLineMissingNewLine
  */
-void fltk3::TextDisplay::wrapped_line_counter(fltk3::TextBuffer *buf, int startPos,
-                int maxPos, int maxLines, bool startPosIsLineStart, int styleBufOffset,
-                int *retPos, int *retLines, int *retLineStart, int *retLineEnd,
+void fltk3::TextDisplay::wrapped_line_counter(fltk3::TextBuffer *buf, fltk3::TextPosition startPos,
+                fltk3::TextPosition maxPos, fltk3::TextPosition maxLines, bool startPosIsLineStart, fltk3::TextPosition styleBufOffset,
+                fltk3::TextPosition *retPos, fltk3::TextPosition *retLines, fltk3::TextPosition *retLineStart, fltk3::TextPosition *retLineEnd,
                 bool countLastLineMissingNewLine) const
 {
 	IS_UTF8_ALIGNED2(buf, startPos)
 	IS_UTF8_ALIGNED2(buf, maxPos)
 
-	int lineStart, newLineStart = 0, b, p, colNum, wrapMarginPix;
-	int i, foundBreak;
+	fltk3::TextPosition lineStart, newLineStart = 0, b, p, i, colNum;
+	int wrapMarginPix, foundBreak;
 	double width;
-	int nLines = 0;
+	fltk3::TextPosition nLines = 0;
 	unsigned int c;
 
 	/* Set the wrap margin to the wrap column or the view width */
@@ -3453,7 +4423,7 @@ void fltk3::TextDisplay::wrapped_line_counter(fltk3::TextBuffer *buf, int startP
 				return;
 			}
 			nLines++;
-			int p1 = buf->next_char(p);
+			fltk3::TextPosition p1 = buf->next_char(p);
 			if (nLines >= maxLines) {
 				*retPos = p1;
 				*retLines = nLines;
@@ -3482,7 +4452,7 @@ void fltk3::TextDisplay::wrapped_line_counter(fltk3::TextBuffer *buf, int startP
 					newLineStart = buf->next_char(b);
 					colNum = 0;
 					width = 0;
-					int iMax = buf->next_char(p);
+					fltk3::TextPosition iMax = buf->next_char(p);
 					for (i=buf->next_char(b); i<iMax; i = buf->next_char(i)) {
 						width += measure_proportional_character(buf->address(i), (int)width,
 						                                        i+styleBufOffset);
@@ -3522,7 +4492,7 @@ void fltk3::TextDisplay::wrapped_line_counter(fltk3::TextBuffer *buf, int startP
 	*retPos = buf->length();
 	*retLines = nLines;
 	if (countLastLineMissingNewLine && colNum > 0)
-		*retLines = buf->next_char(*retLines);
+		(*retLines)++;
 	*retLineStart = lineStart;
 	*retLineEnd = buf->length();
 }
@@ -3550,7 +4520,7 @@ void fltk3::TextDisplay::wrapped_line_counter(fltk3::TextBuffer *buf, int startP
  \param pos offset within string
  \return width of character in pixels
  */
-double fltk3::TextDisplay::measure_proportional_character(const char *s, int xPix, int pos) const
+double fltk3::TextDisplay::measure_proportional_character(const char *s, int xPix, fltk3::TextPosition pos) const
 {
 	IS_UTF8_ALIGNED(s)
 
@@ -3559,11 +4529,8 @@ double fltk3::TextDisplay::measure_proportional_character(const char *s, int xPi
 		return (((xPix/tab)+1)*tab) - xPix;
 	}
 
-	int charLen = fltk3::utf8len1(*s), style = 0;
-	if (mStyleBuffer) {
-		style = mStyleBuffer->byte_at(pos);
-	}
-	return string_width(s, charLen, style);
+	int charLen = fltk3::utf8len1(*s);
+	return string_width(s, charLen, style_byte(pos));
 }
 
 
@@ -3585,17 +4552,17 @@ double fltk3::TextDisplay::measure_proportional_character(const char *s, int xPi
  \param[out] lineEnd
  \param[out] nextLineStart
  */
-void fltk3::TextDisplay::find_line_end(int startPos, bool startPosIsLineStart,
-                                       int *lineEnd, int *nextLineStart) const
+void fltk3::TextDisplay::find_line_end(fltk3::TextPosition startPos, bool startPosIsLineStart,
+                                       fltk3::TextPosition *lineEnd, fltk3::TextPosition *nextLineStart) const
 {
 	IS_UTF8_ALIGNED2(buffer(), startPos)
 
-	int retLines, retLineStart;
+	fltk3::TextPosition retLines, retLineStart;
 
 	/* if we're not wrapping use more efficient BufEndOfLine */
 	if (!mContinuousWrap) {
-		int le = buffer()->line_end(startPos);
-		int ls = buffer()->next_char(le);
+		fltk3::TextPosition le = buffer()->line_end(startPos);
+		fltk3::TextPosition ls = buffer()->next_char(le);
 		*lineEnd = le;
 		*nextLineStart = min(buffer()->length(), ls);
 		return;
@@ -3630,7 +4597,7 @@ void fltk3::TextDisplay::find_line_end(int startPos, bool startPosIsLineStart,
  \param lineEndPos index of character where the line wraps
  \return 1 if a \\n character causes the line wrap
  */
-int fltk3::TextDisplay::wrap_uses_character(int lineEndPos) const
+int fltk3::TextDisplay::wrap_uses_character(fltk3::TextPosition lineEndPos) const
 {
 	IS_UTF8_ALIGNED2(buffer(), lineEndPos)
 
@@ -3658,7 +4625,7 @@ int fltk3::TextDisplay::wrap_uses_character(int lineEndPos) const
 
  \todo Unicode?
  */
-void fltk3::TextDisplay::extend_range_for_styles( int *startpos, int *endpos )
+void fltk3::TextDisplay::extend_range_for_styles( fltk3::TextPosition *startpos, fltk3::TextPosition *endpos )
 {
 	IS_UTF8_ALIGNED2(buffer(), (*startpos))
 	IS_UTF8_ALIGNED2(buffer(), (*endpos))
@@ -3777,6 +4744,15 @@ void fltk3::TextDisplay::draw(void)
 			draw_text(text_area.x, text_area.y, text_area.w, text_area.h);
 		}
 	} else if (damage() & fltk3::DAMAGE_SCROLL) {
+		if (mScrollDX || mScrollDY) {
+			// move the text that stays visible and draw what scrolled in
+			fltk3::push_clip(text_area.x, text_area.y, text_area.w, text_area.h);
+			fltk3::scroll(text_area.x, text_area.y, text_area.w, text_area.h,
+			              mScrollDX, mScrollDY, draw_text_cb, this);
+			// the old cursor was moved along with the text
+			draw_text(text_area.x, mCursorOldY + mScrollDY, text_area.w, mMaxsize);
+			fltk3::pop_clip();
+		}
 		// draw some lines of text
 		fltk3::push_clip(text_area.x, text_area.y, text_area.w, text_area.h);
 		//printf("drawing text from %d to %d\n", damage_range1_start, damage_range1_end);
@@ -3791,7 +4767,7 @@ void fltk3::TextDisplay::draw(void)
 	}
 
 	// draw the text cursor
-	int start, end;
+	fltk3::TextPosition start, end;
 	int has_selection = buffer()->selection_position(&start, &end);
 	if (damage() & (fltk3::DAMAGE_ALL | fltk3::DAMAGE_SCROLL | fltk3::DAMAGE_EXPOSE)
 	    && (
@@ -3819,6 +4795,10 @@ void fltk3::TextDisplay::draw(void)
 	// will not scroll with the text edit area
 	draw_line_numbers(true);
 
+	// a printer has its own copy of the text, the screen is still to scroll
+	if (fltk3::SurfaceDevice::surface() == fltk3::DisplayDevice::display_device())
+		mScrollDX = mScrollDY = 0;
+
 	fltk3::pop_clip();
 }
 
@@ -3829,7 +4809,7 @@ namespace fltk3
 // this processes drag events due to mouse for fltk3::TextDisplay and
 // also drags due to cursor movement with shift held down for
 // fltk3::TextEditor
-void text_drag_me(int pos, fltk3::TextDisplay* d)
+void text_drag_me(fltk3::TextPosition pos, fltk3::TextDisplay* d)
 {
 	if (d->dragType == fltk3::TextDisplay::DRAG_CHAR) {
 		if (pos >= d->dragPos) {
@@ -3872,7 +4852,7 @@ void text_drag_me(int pos, fltk3::TextDisplay* d)
 void fltk3::TextDisplay::scroll_timer_cb(void *user_data)
 {
 	fltk3::TextDisplay *w = (fltk3::TextDisplay*)user_data;
-	int pos;
+	fltk3::TextPosition pos;
 	switch (scroll_direction) {
 	case 1: // mouse is to the right, scroll left
 		w->scroll(w->mTopLineNum, w->mHorizOffset + scroll_amount);
@@ -3911,8 +4891,8 @@ void fltk3::TextDisplay::handle_menu_event()
 {
 	fltk3::TextBuffer *buf = mBuffer;
 	if (!buf) return;
-	int m = buf->primary_selection()->end(), p = buf->primary_selection()->start();
-	int pc = xy_to_position(fltk3::event_x(), fltk3::event_y(), CHARACTER_POS);
+	fltk3::TextPosition m = buf->primary_selection()->end(), p = buf->primary_selection()->start();
+	fltk3::TextPosition pc = xy_to_position(fltk3::event_x(), fltk3::event_y(), CHARACTER_POS);
 	if (!buf->primary_selection()->selected()) {
 		p = m = insert_position();
 	}
@@ -4012,7 +4992,7 @@ int fltk3::TextDisplay::handle(int event)
 		if (Group::handle(event)) return 1;
 		if (fltk3::event_state()&fltk3::SHIFT) return handle(fltk3::DRAG);
 		dragging = 1;
-		int pos = xy_to_position(fltk3::event_x(), fltk3::event_y(), CURSOR_POS);
+		fltk3::TextPosition pos = xy_to_position(fltk3::event_x(), fltk3::event_y(), CURSOR_POS);
 		dragPos = pos;
 		if (buffer()->primary_selection()->includes(pos)) {
 			dragType = DRAG_START_DND;
@@ -4046,7 +5026,8 @@ int fltk3::TextDisplay::handle(int event)
 			}
 			return 1;
 		}
-		int X = fltk3::event_x(), Y = fltk3::event_y(), pos = insert_position();
+		int X = fltk3::event_x(), Y = fltk3::event_y();
+		fltk3::TextPosition pos = insert_position();
 		// if we leave the text_area, we start a timer event
 		// that will take care of scrolling and selecting
 		if (Y < text_area.y) {
@@ -4128,17 +5109,17 @@ int fltk3::TextDisplay::handle(int event)
 		if (active_r() && window()) window()->cursor(fltk3::CURSOR_DEFAULT);
 	case fltk3::FOCUS:
 		if (buffer()->selected()) {
-			int start, end;
+			fltk3::TextPosition start, end;
 			if (buffer()->selection_position(&start, &end))
 				redisplay_range(start, end);
 		}
 		if (buffer()->secondary_selected()) {
-			int start, end;
+			fltk3::TextPosition start, end;
 			if (buffer()->secondary_selection_position(&start, &end))
 				redisplay_range(start, end);
 		}
 		if (buffer()->highlight()) {
-			int start, end;
+			fltk3::TextPosition start, end;
 			if (buffer()->highlight_position(&start, &end))
 				redisplay_range(start, end);
 		}
@@ -133,6 +133,8 @@ static struct {
 	//{ FL_Clear,	  0,                        fltk3::TextEditor::delete_to_eol },
 	{ 'z',          fltk3::CTRL,                  fltk3::TextEditor::kf_undo	  },
 	{ '/',          fltk3::CTRL,                  fltk3::TextEditor::kf_undo	  },
+	{ 'z',          fltk3::CTRL|fltk3::SHIFT,         fltk3::TextEditor::kf_redo	  },
+	{ 'y',          fltk3::CTRL,                  fltk3::TextEditor::kf_redo	  },
 	{ 'x',          fltk3::CTRL,                  fltk3::TextEditor::kf_cut        },
 	{ fltk3::DeleteKey,    fltk3::SHIFT,                 fltk3::TextEditor::kf_cut        },
 	{ 'c',          fltk3::CTRL,                  fltk3::TextEditor::kf_copy       },
@@ -144,6 +146,7 @@ static struct {
 #ifdef __APPLE__
 	// Define CMD+key accelerators...
 	{ 'z',          fltk3::COMMAND,               fltk3::TextEditor::kf_undo       },
+	{ 'z',          fltk3::COMMAND|fltk3::SHIFT,      fltk3::TextEditor::kf_redo       },
 	{ 'x',          fltk3::COMMAND,               fltk3::TextEditor::kf_cut        },
 	{ 'c',          fltk3::COMMAND,               fltk3::TextEditor::kf_copy       },
 	{ 'v',          fltk3::COMMAND,               fltk3::TextEditor::kf_paste      },
@@ -252,8 +255,8 @@ int fltk3::TextEditor::kf_ignore(int, fltk3::TextEditor*)
 int fltk3::TextEditor::kf_backspace(int, fltk3::TextEditor* e)
 {
 	if (!e->buffer()->selected() && e->move_left()) {
-		int p1 = e->insert_position();
-		int p2 = e->buffer()->next_char(p1);
+		fltk3::TextPosition p1 = e->insert_position();
+		fltk3::TextPosition p2 = e->buffer()->next_char(p1);
 		e->buffer()->select(p1, p2);
 	}
 	kill_selection(e);
@@ -277,7 +280,7 @@ int fltk3::TextEditor::kf_enter(int, fltk3::TextEditor* e)
 //extern void fltk3::text_drag_me(int pos, fltk3::Text_Display* d);
 namespace fltk3
 {
-	extern void text_drag_me(int pos, fltk3::TextDisplay* d);
+	extern void text_drag_me(fltk3::TextPosition pos, fltk3::TextDisplay* d);
 }
 
 /**  Moves the text cursor in the direction indicated by key c.*/
@@ -474,8 +477,8 @@ int fltk3::TextEditor::kf_insert(int, fltk3::TextEditor* e)
 int fltk3::TextEditor::kf_delete(int, fltk3::TextEditor* e)
 {
 	if (!e->buffer()->selected()) {
-		int p1 = e->insert_position();
-		int p2 = e->buffer()->next_char(p1);
+		fltk3::TextPosition p1 = e->insert_position();
+		fltk3::TextPosition p2 = e->buffer()->next_char(p1);
 		e->buffer()->select(p1, p2);
 	}
 
@@ -532,8 +535,24 @@ int fltk3::TextEditor::kf_undo(int , fltk3::TextEditor* e)
 {
 	e->buffer()->unselect();
 	fltk3::copy("", 0, 0);
-	int crsr;
+	fltk3::TextPosition crsr;
 	int ret = e->buffer()->undo(&crsr);
+	if (!ret) return 0;
+	e->insert_position(crsr);
+	e->show_insert_position();
+	e->set_changed();
+	if (e->when()&fltk3::WHEN_CHANGED) e->do_callback();
+	return ret;
+}
+
+/**  Redoes the last undone change. Bound to Ctrl-Shift-Z and Ctrl-Y.*/
+int fltk3::TextEditor::kf_redo(int , fltk3::TextEditor* e)
+{
+	e->buffer()->unselect();
+	fltk3::copy("", 0, 0);
+	fltk3::TextPosition crsr;
+	int ret = e->buffer()->redo(&crsr);
+	if (!ret) return 0;
 	e->insert_position(crsr);
 	e->show_insert_position();
 	e->set_changed();
@@ -552,7 +571,7 @@ int fltk3::TextEditor::handle_key()
 	if (fltk3::compose(del)) {
 		if (del) {
 			// del is a number of bytes
-			int dp = insert_position() - del;
+			fltk3::TextPosition dp = insert_position() - del;
 			if ( dp < 0 ) dp = 0;
 			buffer()->select(dp, insert_position());
 		}
@@ -563,7 +582,7 @@ int fltk3::TextEditor::handle_key()
 		}
 #ifdef __APPLE__
 		if (fltk3::compose_state) {
-			int pos = this->insert_position();
+			fltk3::TextPosition pos = this->insert_position();
 			this->buffer()->select(pos - fltk3::compose_state, pos);
 		}
 #endif
@@ -593,7 +612,7 @@ void fltk3::TextEditor::maybe_do_callback()
 
 int fltk3::TextEditor::handle(int event)
 {
-	static int dndCursorPos;
+	static fltk3::TextPosition dndCursorPos;
 
 	if (!buffer()) return 0;
 
@@ -608,7 +627,7 @@ int fltk3::TextEditor::handle(int event)
 		show_cursor(mCursorOn); // redraws the cursor
 #ifdef __APPLE__
 		if (buffer()->selected() && fltk3::compose_state) {
-			int pos = insert_position();
+			fltk3::TextPosition pos = insert_position();
 			buffer()->select(pos, pos);
 			fltk3::reset_marked_text();
 		}
@@ -650,7 +669,7 @@ int fltk3::TextEditor::handle(int event)
 			if(buffer()->selected()) {
 				buffer()->unselect();
 			}
-			int pos = xy_to_position(fltk3::event_x(), fltk3::event_y(), CURSOR_POS);
+			fltk3::TextPosition pos = xy_to_position(fltk3::event_x(), fltk3::event_y(), CURSOR_POS);
 			insert_position(pos);
 			fltk3::paste(*this, 0);
 			fltk3::focus(this);
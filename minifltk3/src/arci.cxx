@@ -88,6 +88,7 @@ void fltk3::GDIGraphicsDriver::arc(int x,int y,int w,int h,double a1,double a2)
 #else
 void fltk3::XlibGraphicsDriver::arc(int x,int y,int w,int h,double a1,double a2)
 {
+	fl_flush_text();
 	if (w <= 0 || h <= 0) return;
 	x += origin_x();
 	y += origin_y();
@@ -146,6 +147,7 @@ void fltk3::GDIGraphicsDriver::pie(int x,int y,int w,int h,double a1,double a2)
 #else
 void fltk3::XlibGraphicsDriver::pie(int x,int y,int w,int h,double a1,double a2)
 {
+	fl_flush_text();
 	if (w <= 0 || h <= 0) return;
 	x += origin_x();
 	y += origin_y();
@@ -413,6 +413,97 @@ mono32_converter(const uchar *from,uchar *to,int w, int delta)
 	        (*from << fl_redshift)+(*from << fl_greenshift)+(*from << fl_blueshift));
 }
 
+////////////////////////////////////////////////////////////////
+// SIMD versions of the 24 and 32-bit TrueColor converters, for RGB and
+// RGBA data. A byte shuffle puts 4 (SSSE3) or 8 (AVX2) pixels at a time in
+// the order of the visual, the end of the line is left to the scalar
+// converter. They are compiled with target attributes and only used if
+// the CPU reports SSSE3 or AVX2 at run time.
+
+#  if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+      (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#    define DRAW_SIMD 1
+#    include <immintrin.h>
+#    define SSSE3_TARGET __attribute__((target("ssse3")))
+#    define AVX2_TARGET __attribute__((target("avx2")))
+
+// The source byte of each byte of a pixel, -1 for a zero byte. The
+// 32-bit layouts are the bytes in memory, x86 is little-endian.
+static const struct {
+	void (*converter)(const uchar *from, uchar *to, int w, int delta);
+	int size;
+	signed char order[4];
+} simd_layouts[] = {
+	{rgb_converter, 3, {0, 1, 2}},
+	{bgr_converter, 3, {2, 1, 0}},
+	{xbgr_converter, 4, {0, 1, 2, -1}},
+	{xrgb_converter, 4, {2, 1, 0, -1}},
+	{rgbx_converter, 4, {-1, 2, 1, 0}},
+	{bgrx_converter, 4, {-1, 0, 1, 2}}
+};
+
+static void (*simd_scalar)(const uchar *from, uchar *to, int w, int delta);
+static int simd_size;			// bytes per pixel of the visual
+static uchar simd_shuffle[2][16];	// for 4 pixels of 3 and of 4 bytes
+
+SSSE3_TARGET static void ssse3_converter(const uchar *from, uchar *to, int w, int delta)
+{
+	if (delta == 3 || delta == 4) {
+		const __m128i shuffle = _mm_loadu_si128((const __m128i*)simd_shuffle[delta-3]);
+		// 16 bytes are read and written for 4 pixels of 3 bytes, so the
+		// last 2 pixels are always left to the scalar converter
+		for (; w >= 6; w -= 4, from += 4*delta, to += 4*simd_size)
+			_mm_storeu_si128((__m128i*)to,
+			                 _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)from), shuffle));
+	}
+	simd_scalar(from, to, w, delta);
+}
+
+AVX2_TARGET static void avx2_converter(const uchar *from, uchar *to, int w, int delta)
+{
+	if (delta == 3 || delta == 4) {
+		// the shuffle works on each half, pixels of 3 bytes are spread so
+		// that the upper half starts with the fifth pixel
+		const __m256i shuffle =
+		        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)simd_shuffle[delta-3]));
+		const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+		for (; w >= 11; w -= 8, from += 8*delta, to += 8*simd_size) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)from);
+			if (delta == 3) v = _mm256_permutevar8x32_epi32(v, spread);
+			v = _mm256_shuffle_epi8(v, shuffle);
+			if (simd_size == 4) {
+				_mm256_storeu_si256((__m256i*)to, v);
+			} else {
+				_mm_storeu_si128((__m128i*)to, _mm256_castsi256_si128(v));
+				_mm_storeu_si128((__m128i*)(to+12), _mm256_extracti128_si256(v, 1));
+			}
+		}
+	}
+	ssse3_converter(from, to, w, delta);
+}
+
+// replaces the converter of the visual by a SIMD version, if there is one
+// and the CPU can run it
+static void simd_converter()
+{
+	for (unsigned i = 0; i < sizeof(simd_layouts)/sizeof(*simd_layouts); i++) {
+		if (converter != simd_layouts[i].converter) continue;
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("ssse3")) return;
+		simd_scalar = converter;
+		simd_size = simd_layouts[i].size;
+		for (int d = 3; d <= 4; d++) {
+			for (int j = 0; j < 16; j++) {
+				int p = j / simd_size, k = simd_layouts[i].order[j % simd_size];
+				simd_shuffle[d-3][j] = (p < 4 && k >= 0) ? uchar(p*d + k) : 0x80;
+			}
+		}
+		converter = __builtin_cpu_supports("avx2") ? avx2_converter : ssse3_converter;
+		return;
+	}
+}
+#  endif // DRAW_SIMD
+
 ////////////////////////////////////////////////////////////////
 
 static void figure_out_visual()
@@ -526,6 +617,243 @@ xi.byte_order = 1;
 		fltk3::fatal("Can't do %d bits_per_pixel",xi.bits_per_pixel);
 	}
 
+#  if DRAW_SIMD
+	simd_converter();
+#  endif
+
+}
+
+#  if HAVE_XSHM
+////////////////////////////////////////////////////////////////
+// MIT-SHM: large images are converted straight into memory shared with
+// a local X server, which reads them from there instead of the socket.
+// A few segments are used in turn, so that converting an image rarely
+// waits for the server to finish reading the one before. The segments
+// grow to the largest image drawn or read recently, and shrink again when
+// the images get smaller.
+
+#    include <X11/extensions/XShm.h>
+#    include <stddef.h>
+#    include <sys/ipc.h>
+#    include <sys/shm.h>
+
+#    define SHM_MINIMUM 0x10000	// smaller images are sent through the socket
+#    define SHM_SEGMENTS 3
+
+struct Fl_Shm_Segment {
+	XShmSegmentInfo info;	// info.shmaddr is NULL if not allocated
+	size_t size;
+	unsigned long serial;	// last request that used the segment
+};
+
+static Fl_Shm_Segment shm_pool[SHM_SEGMENTS];
+static int shm_next;
+static int shm_state = -1;	// -1 = not checked, 0 = not usable, 1 = usable
+static size_t shm_largest, shm_recent; // largest sizes of all and of the recent images
+static int shm_count;
+static int shm_error;
+
+static int shm_error_handler(Display *, XErrorEvent *)
+{
+	shm_error = 1;
+	return 0;
+}
+
+static void shm_free(Fl_Shm_Segment *s)
+{
+	if (!s->info.shmaddr) return;
+	XShmDetach(fl_display, &s->info);
+	shmdt(s->info.shmaddr);
+	s->info.shmaddr = NULL;
+	s->size = 0;
+}
+
+// attaches a new segment of size bytes, the server fails to attach it if
+// it is not on this machine
+static int shm_alloc(Fl_Shm_Segment *s, size_t size)
+{
+	s->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (s->info.shmid < 0) return 0;
+	s->info.shmaddr = (char*)shmat(s->info.shmid, NULL, 0);
+	if (s->info.shmaddr == (char*)-1) {
+		shmctl(s->info.shmid, IPC_RMID, NULL);
+		s->info.shmaddr = NULL;
+		return 0;
+	}
+	s->info.readOnly = False;
+	shm_error = 0;
+	XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+	XShmAttach(fl_display, &s->info);
+	XSync(fl_display, False);
+	XSetErrorHandler(old_handler);
+	// the segment goes away when both sides detach it
+	shmctl(s->info.shmid, IPC_RMID, NULL);
+	if (shm_error) {
+		shmdt(s->info.shmaddr);
+		s->info.shmaddr = NULL;
+		shm_state = 0; // remote display
+		return 0;
+	}
+	s->size = size;
+	s->serial = 0;
+	return 1;
+}
+
+/* Returns an image of the visual in the next shared segment, or NULL if
+ MIT-SHM is not available or the image is small. Destroy it with
+ fl_shm_destroy_image(), the segment stays in the pool. Setting FLTK_NO_SHM
+ in the environment turns MIT-SHM off, to compare both ways.
+ */
+XImage *fl_shm_create_image(int w, int h)
+{
+	if (shm_state < 0) {
+		shm_state = !getenv("FLTK_NO_SHM") && XShmQueryExtension(fl_display) ? 1 : 0;
+		if (shm_state && !bytes_per_pixel) figure_out_visual();
+		// the converters write in the byte order of the client
+		if (xi.byte_order != ImageByteOrder(fl_display)) shm_state = 0;
+	}
+	if (!shm_state) return NULL;
+	XImage *image = XShmCreateImage(fl_display, fl_visual->visual, fl_visual->depth,
+	                                ZPixmap, NULL, NULL, w, h);
+	if (!image) return NULL;
+	size_t size = (size_t)image->bytes_per_line * h;
+	if (size < SHM_MINIMUM) {
+		XDestroyImage(image);
+		return NULL;
+	}
+	if (size > shm_largest) shm_largest = size;
+	if (size > shm_recent) shm_recent = size;
+	if (++shm_count == 64) { // forget about images older than that
+		shm_largest = shm_recent;
+		shm_recent = 0;
+		shm_count = 0;
+	}
+	Fl_Shm_Segment *s = shm_pool + shm_next;
+	shm_next = (shm_next + 1) % SHM_SEGMENTS;
+	// wait until the server has read what the last request put there
+	if (s->info.shmaddr && s->serial &&
+	    (long)(LastKnownRequestProcessed(fl_display) - s->serial) < 0)
+		XSync(fl_display, False);
+	if (s->info.shmaddr && (s->size < size || s->size > 4 * shm_largest)) shm_free(s);
+	if (!s->info.shmaddr && !shm_alloc(s, shm_largest)) {
+		XDestroyImage(image);
+		return NULL;
+	}
+	image->data = s->info.shmaddr;
+	image->obdata = (char*)&s->info;
+	return image;
+}
+
+void fl_shm_destroy_image(XImage *image)
+{
+	XShmSegmentInfo *info = (XShmSegmentInfo*)image->obdata;
+	Fl_Shm_Segment *s = (Fl_Shm_Segment*)((char*)info - offsetof(Fl_Shm_Segment, info));
+	s->serial = NextRequest(fl_display) - 1;
+	image->data = NULL; // not ours to free
+	XDestroyImage(image);
+}
+#  endif // HAVE_XSHM
+
+////////////////////////////////////////////////////////////////
+// Large images are converted by a few threads, each doing a band of
+// lines. The 24 and 32-bit converters keep no state between lines, the
+// error diffusion of the smaller visuals does, so those use one thread.
+
+struct Fl_Convert_Band {
+	void (*conv)(const uchar *from, uchar *to, int w, int delta);
+	const uchar *from;
+	uchar *to;
+	int w, h, delta, linedelta, bytes_per_line;
+};
+
+static void convert_band(const Fl_Convert_Band &b)
+{
+	const uchar *from = b.from;
+	uchar *to = b.to;
+	for (int j = 0; j < b.h; j++, from += b.linedelta, to += b.bytes_per_line)
+		b.conv(from, to, b.w, b.delta);
+}
+
+#  if HAVE_PTHREAD
+#    include <pthread.h>
+#    include <unistd.h>
+
+#    define BAND_THREADS 4		// at most, including the calling thread
+#    define BAND_MINIMUM 0x20000	// pixels, smaller images use one thread
+
+static Fl_Convert_Band bands[BAND_THREADS];
+static int band_threads = -1;		// started, besides the calling thread
+static unsigned band_generation;	// counts the images given to the threads
+static int band_pending;		// bands not done yet
+static pthread_mutex_t band_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t band_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t band_done = PTHREAD_COND_INITIALIZER;
+
+static void *band_worker(void *arg)
+{
+	const Fl_Convert_Band &band = bands[(long)arg];
+	unsigned generation = 0;
+	pthread_mutex_lock(&band_mutex);
+	for (;;) {
+		while (generation == band_generation) pthread_cond_wait(&band_start, &band_mutex);
+		generation = band_generation;
+		pthread_mutex_unlock(&band_mutex);
+		convert_band(band);
+		pthread_mutex_lock(&band_mutex);
+		if (!--band_pending) pthread_cond_signal(&band_done);
+	}
+	return NULL;
+}
+
+static int start_band_threads()
+{
+	if (band_threads < 0) {
+		band_threads = 0;
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n > BAND_THREADS) n = BAND_THREADS;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		for (long i = 1; i < n; i++) {
+			pthread_t thread;
+			if (pthread_create(&thread, &attr, band_worker, (void*)i)) break;
+			band_threads++;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	return band_threads;
+}
+#  endif // HAVE_PTHREAD
+
+static void convert_lines(void (*conv)(const uchar *from, uchar *to, int w, int delta),
+                          const uchar *from, int linedelta, uchar *to, int bytes_per_line,
+                          int w, int h, int delta)
+{
+	Fl_Convert_Band b = {conv, from, to, w, h, delta, linedelta, bytes_per_line};
+#  if HAVE_PTHREAD
+	if (bytes_per_pixel >= 3 && w*h >= BAND_MINIMUM && start_band_threads()) {
+		int n = band_threads + 1;
+		int lines = (h + n - 1) / n;
+		for (int i = 0; i < n; i++) {
+			bands[i] = b;
+			bands[i].from = from + (long)i*lines*linedelta;
+			bands[i].to = to + (long)i*lines*bytes_per_line;
+			bands[i].h = h - i*lines < lines ? h - i*lines : lines;
+			if (bands[i].h < 0) bands[i].h = 0;
+		}
+		pthread_mutex_lock(&band_mutex);
+		band_pending = band_threads;
+		band_generation++;
+		pthread_cond_broadcast(&band_start);
+		pthread_mutex_unlock(&band_mutex);
+		convert_band(bands[0]);
+		pthread_mutex_lock(&band_mutex);
+		while (band_pending) pthread_cond_wait(&band_done, &band_mutex);
+		pthread_mutex_unlock(&band_mutex);
+		return;
+	}
+#  endif // HAVE_PTHREAD
+	convert_band(b);
 }
 
 #  define MAXBUFFER 0x40000 // 256k
@@ -536,6 +864,7 @@ static void innards(const uchar *buf, int X, int Y, int W, int H,
 {
 	// here, X,Y are window-relative coordinates
 	if (!linedelta) linedelta = W*delta;
+	fl_flush_text();
 
 	int dx, dy, w, h;
 	fltk3::push_origin();
@@ -569,12 +898,36 @@ conv == xbgr_converter
 #    endif
 	            ||
 #  endif
-	            conv == rgb_converter && delta==3
+	            (conv == rgb_converter && delta==3)
+#  if DRAW_SIMD
+	            || (conv == converter && simd_scalar == rgb_converter && delta==3)
+#  endif
 	    ) && !(linedelta&scanline_add)) {
 		xi.data = (char *)(buf+delta*dx+linedelta*dy);
 		xi.bytes_per_line = linedelta;
 
 	} else {
+#  if HAVE_XSHM
+		// with 64-bit stores the 32-bit converters write an even number of pixels
+		XImage *shm = fl_shm_create_image(bytes_per_pixel == 4 ? (w+1)&~1 : w, h);
+		if (shm) {
+			uchar *to = (uchar*)shm->data;
+			if (buf) {
+				buf += delta*dx+linedelta*dy;
+				convert_lines(conv, buf, linedelta, to, shm->bytes_per_line, w, h, delta);
+			} else {
+				STORETYPE* linebuf = new STORETYPE[(W*delta+(sizeof(STORETYPE)-1))/sizeof(STORETYPE)];
+				for (int j=0; j<h; j++, to += shm->bytes_per_line) {
+					cb(userdata, dx, dy+j, w, (uchar*)linebuf);
+					conv((uchar*)linebuf, to, w, delta);
+				}
+				delete[] linebuf;
+			}
+			XShmPutImage(fl_display, fl_window, fl_gc, shm, 0, 0, X+dx, Y+dy, w, h, False);
+			fl_shm_destroy_image(shm);
+			return;
+		}
+#  endif // HAVE_XSHM
 		int linesize = ((w*bytes_per_pixel+scanline_add)&scanline_mask)/sizeof(STORETYPE);
 		int blocking = h;
 		static STORETYPE *buffer;	// our storage, always word aligned
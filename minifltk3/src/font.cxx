@@ -117,6 +117,12 @@ void draw(const char* str, int l, float x, float y)
 #endif
 }
 
+#if defined(WIN32) || defined(__APPLE__) || !USE_XFT
+void preload_fonts(fltk3::Font, const fltk3::Fontsize*, int)
+{
+}
+#endif
+
 }
 
 //
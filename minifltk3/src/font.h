@@ -37,6 +37,8 @@
 
 #  if USE_XFT
 typedef struct _XftFont XftFont;
+typedef struct _FcFontSet FcFontSet;
+typedef struct _FcCharSet FcCharSet;
 #  elif !defined(WIN32) && !defined(__APPLE__)
 #    include "Xutf8.h"
 #  endif // USE_XFT
@@ -75,6 +77,21 @@ public:
 	XftFont* font;
 	//const char* encoding;
 	int angle;
+	// advances of U+0000..U+00FF, and of the rest of the BMP in blocks of
+	// 256 characters allocated on first use (width[0] is not used)
+	short latin[256];
+	short *width[256];
+	// UCS-4 copy of the last non-ASCII string drawn or measured
+	unsigned *ucs;
+	int ucs_size;
+	// the fltk3::fonts entry this is a size of, the fonts of its fallback
+	// chain opened at this size on first use, and the font drawing each
+	// character of the BMP in blocks of 256 (0 = font, n = fallback[n-1])
+	fltk3::Font fnum;
+	XftFont **fallback;
+	unsigned char *face[256];
+	// next descriptor in the same slot of the (font, size, angle) lookup table
+	Fl_Font_Descriptor *hash_next;
 	FLTK3_EXPORT Fl_Font_Descriptor(const char* xfontname, fltk3::Fontsize size, int angle);
 #  else
 	XUtf8FontStruct* font;	// X UTF-8 font information
@@ -102,6 +119,10 @@ struct Fl_Fontdesc {
 	char **xlist;		// matched X font names
 	int n;		// size of xlist, negative = don't free xlist!
 #  endif
+#  if USE_XFT
+	FcFontSet *fallback;	// fonts covering what the first size opened lacks
+	FcCharSet **coverage;	// characters of each fallback font, 0 = not sorted yet
+#  endif
 };
 
 namespace fltk3
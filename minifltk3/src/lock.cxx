@@ -261,6 +261,13 @@ void fltk3::awake(void* msg)
 	PostThreadMessage( main_thread, fl_wake_msg, (WPARAM)msg, 0);
 }
 
+// Returns non-zero in the thread that runs fltk3::wait(), or if
+// fltk3::lock() was never called.
+int fl_thread_is_main()
+{
+	return !main_thread || GetCurrentThreadId() == main_thread;
+}
+
 ////////////////////////////////////////////////////////////////
 // POSIX threading...
 #elif HAVE_PTHREAD
@@ -276,6 +283,9 @@ static pthread_mutex_t fltk_mutex;
 static pthread_t owner;
 static int counter;
 
+// The thread that first called fltk3::lock()
+static pthread_t main_thread;
+
 static void lock_function_init_std()
 {
 	pthread_mutex_init(&fltk_mutex, NULL);
@@ -364,6 +374,7 @@ int fltk3::lock()
 		// conditions (STR #1537)
 		fcntl(thread_filedes[1], F_SETFL,
 		      fcntl(thread_filedes[1], F_GETFL) | O_NONBLOCK);
+		main_thread = pthread_self();
 
 		// Monitor the read side of the pipe so that messages sent via
 		// fltk3::awake() from a thread will "wake up" the main thread in
@@ -395,6 +406,13 @@ void fltk3::unlock()
 	fl_unlock_function();
 }
 
+// Returns non-zero in the thread that runs fltk3::wait(), or if
+// fltk3::lock() was never called.
+int fl_thread_is_main()
+{
+	return !thread_filedes[1] || pthread_equal(pthread_self(), main_thread);
+}
+
 // Mutex code for the awake ring buffer
 static pthread_mutex_t *ring_mutex;
 
@@ -440,6 +458,11 @@ void* fltk3::thread_message()
 	return NULL;
 }
 
+int fl_thread_is_main()
+{
+	return 1;
+}
+
 #endif // WIN32
 
 //
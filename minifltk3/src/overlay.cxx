@@ -50,6 +50,7 @@ static void draw_current_rect()
 {
 #ifdef USE_XOR
 # if defined(USE_X11)
+	fl_flush_text();
 	XSetFunction(fl_display, fl_gc, GXxor);
 	XSetForeground(fl_display, fl_gc, 0xffffffff);
 	XDrawRectangle(fl_display, fl_window, fl_gc, px, py, pw, ph);
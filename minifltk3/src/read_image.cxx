@@ -90,6 +90,13 @@ fl_subimage_offsets(int a, int aw, int b, int bw, int &obw)
 	return off;
 }
 
+#  if HAVE_XSHM
+#    include <X11/extensions/XShm.h>
+// Defined in draw_image.cxx
+extern XImage *fl_shm_create_image(int w, int h);
+extern void fl_shm_destroy_image(XImage *image);
+#  endif // HAVE_XSHM
+
 // this handler will catch and ignore exceptions during XGetImage
 // to avoid an application crash
 static int xgetimageerrhandler(Display *display, XErrorEvent *error)
@@ -136,6 +143,8 @@ fltk3::read_image(uchar *p,		// I - Pixel buffer or NULL to allocate
 	//
 	int allow_outside = w < 0;    // negative w allows negative X or Y, that is, window frame
 	if (w < 0) w = - w;
+	XImage *shm = 0;		// Image read through shared memory
+	fl_flush_text();
 
 #  ifdef __sgi
 	if (XReadDisplayQueryExtension(fl_display, &i, &i)) {
@@ -164,6 +173,17 @@ image = 0;
 				// however, if the window is obscured etc. the function will still fail. Make sure we
 				// catch the error and continue, otherwise an exception will be thrown.
 				XErrorHandler old_handler = XSetErrorHandler(xgetimageerrhandler);
+#  if HAVE_XSHM
+				// large images are read through shared memory on a local display
+				shm = fl_shm_create_image(w, h);
+				if (shm && XShmGetImage(fl_display, fl_window, shm, X, Y, AllPlanes)) {
+					image = shm;
+				} else if (shm) {
+					fl_shm_destroy_image(shm);
+					shm = 0;
+				}
+				if (!image)
+#  endif // HAVE_XSHM
 				image = XGetImage(fl_display, fl_window, X, Y, w, h, AllPlanes, ZPixmap);
 				XSetErrorHandler(old_handler);
 			} else {
@@ -512,6 +532,10 @@ image = 0;
 	}
 
 	// Destroy the X image we've read and return the RGB(A) image...
+#  if HAVE_XSHM
+	if (shm) fl_shm_destroy_image(shm);
+	else
+#  endif // HAVE_XSHM
 	XDestroyImage(image);
 
 	return p;
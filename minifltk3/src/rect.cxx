@@ -230,6 +230,7 @@ void fltk3::GDIGraphicsDriver::rect(int x, int y, int w, int h)
 #else
 void fltk3::XlibGraphicsDriver::rect(int x, int y, int w, int h)
 {
+	fl_flush_text();
 	if (w<=0 || h<=0) return;
 	x += origin_x();
 	y += origin_y();
@@ -264,6 +265,7 @@ void fltk3::GDIGraphicsDriver::rectf(int x, int y, int w, int h)
 #else
 void fltk3::XlibGraphicsDriver::rectf(int x, int y, int w, int h)
 {
+	fl_flush_text();
 	if (w<=0 || h<=0) return;
 	x += origin_x();
 	y += origin_y();
@@ -301,6 +303,7 @@ void fltk3::GDIGraphicsDriver::xyline(int x, int y, int x1)
 #else
 void fltk3::XlibGraphicsDriver::xyline(int x, int y, int x1)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	x1 += origin_x();
@@ -343,6 +346,7 @@ void fltk3::GDIGraphicsDriver::xyline(int x, int y, int x1, int y2)
 #else
 void fltk3::XlibGraphicsDriver::xyline(int x, int y, int x1, int y2)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	x1 += origin_x();
@@ -395,6 +399,7 @@ void fltk3::GDIGraphicsDriver::xyline(int x, int y, int x1, int y2, int x3)
 #else
 void fltk3::XlibGraphicsDriver::xyline(int x, int y, int x1, int y2, int x3)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	x1 += origin_x();
@@ -441,6 +446,7 @@ void fltk3::GDIGraphicsDriver::yxline(int x, int y, int y1)
 #else
 void fltk3::XlibGraphicsDriver::yxline(int x, int y, int y1)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	y1 += origin_y();
@@ -483,6 +489,7 @@ void fltk3::GDIGraphicsDriver::yxline(int x, int y, int y1, int x2)
 #else
 void fltk3::XlibGraphicsDriver::yxline(int x, int y, int y1, int x2)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	y1 += origin_y();
@@ -535,6 +542,7 @@ void fltk3::GDIGraphicsDriver::yxline(int x, int y, int y1, int x2, int y3)
 #else
 void fltk3::XlibGraphicsDriver::yxline(int x, int y, int y1, int x2, int y3)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	y1 += origin_y();
@@ -580,6 +588,7 @@ void fltk3::GDIGraphicsDriver::line(int x, int y, int x1, int y1)
 #else
 void fltk3::XlibGraphicsDriver::line(int x, int y, int x1, int y1)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	x1 += origin_x();
@@ -624,6 +633,7 @@ void fltk3::GDIGraphicsDriver::line(int x, int y, int x1, int y1, int x2, int y2
 #else
 void fltk3::XlibGraphicsDriver::line(int x, int y, int x1, int y1, int x2, int y2)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	x1 += origin_x();
@@ -676,6 +686,7 @@ void fltk3::GDIGraphicsDriver::loop(int x, int y, int x1, int y1, int x2, int y2
 #else
 void fltk3::XlibGraphicsDriver::loop(int x, int y, int x1, int y1, int x2, int y2)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	x1 += origin_x();
@@ -736,6 +747,7 @@ void fltk3::GDIGraphicsDriver::loop(int x, int y, int x1, int y1, int x2, int y2
 #else
 void fltk3::XlibGraphicsDriver::loop(int x, int y, int x1, int y1, int x2, int y2, int x3, int y3)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	x1 += origin_x();
@@ -799,6 +811,7 @@ void fltk3::GDIGraphicsDriver::polygon(int x, int y, int x1, int y1, int x2, int
 #else
 void fltk3::XlibGraphicsDriver::polygon(int x, int y, int x1, int y1, int x2, int y2)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	x1 += origin_x();
@@ -866,6 +879,7 @@ void fltk3::GDIGraphicsDriver::polygon(int x, int y, int x1, int y1, int x2, int
 #else
 void fltk3::XlibGraphicsDriver::polygon(int x, int y, int x1, int y1, int x2, int y2, int x3, int y3)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	x1 += origin_x();
@@ -908,6 +922,7 @@ void fltk3::GDIGraphicsDriver::point(int x, int y)
 #else
 void fltk3::XlibGraphicsDriver::point(int x, int y)
 {
+	fl_flush_text();
 	x += origin_x();
 	y += origin_y();
 	XDrawPoint(fl_display, fl_window, fl_gc, clip_x(x), clip_x(y));
@@ -959,6 +974,7 @@ void fltk3::GDIGraphicsDriver::restore_clip()
 #else
 void fltk3::XlibGraphicsDriver::restore_clip()
 {
+	fl_flush_text();
 	fl_clip_state_number++;
 	fltk3::Region r = clip_region();
 	if (r) XSetRegion(fl_display, fl_gc, r);
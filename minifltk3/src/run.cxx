@@ -817,6 +817,7 @@ void fltk3::flush()
 		}
 	}
 #if defined(USE_X11)
+	fl_flush_text();
 	if (fl_display) XFlush(fl_display);
 #elif defined(WIN32)
 	GdiFlush();
@@ -85,15 +85,17 @@ void fltk3::scroll(int X, int Y, int W, int H, int dx, int dy,
 	}
 
 #if defined(USE_X11)
+	fl_flush_text();
 	XCopyArea(fl_display, fl_window, fl_window, fl_gc,
-	          src_x+origin_x(), src_y+origin_y(), src_w, src_h, dest_x, dest_y);
+	          src_x+origin_x(), src_y+origin_y(), src_w, src_h,
+	          dest_x+origin_x(), dest_y+origin_y());
 	// we have to sync the display and get the GraphicsExpose events! (sigh)
 	for (;;) {
 		XEvent e;
 		XWindowEvent(fl_display, fl_window, ExposureMask, &e);
 		if (e.type == NoExpose) break;
 		// otherwise assume it is a GraphicsExpose event:
-		draw_area(data, e.xexpose.x, e.xexpose.y,
+		draw_area(data, e.xexpose.x-origin_x(), e.xexpose.y-origin_y(),
 		          e.xexpose.width, e.xexpose.height);
 		if (!e.xgraphicsexpose.count) break;
 	}
@@ -36,6 +36,9 @@
 #include <stdlib.h>
 
 static int table_size;
+#if USE_XFT
+extern void fl_xft_forget_fallback(Fl_Fontdesc *s);
+#endif
 /**
   Changes a face.  The string pointer is simply stored,
   the string is not copied, so the string must be in static memory.
@@ -61,6 +64,10 @@ void fltk3::set_font(fltk3::Font fnum, const char* name)
 			fltk3::fonts[i].xlist = 0;
 			fltk3::fonts[i].n = 0;
 #endif // !WIN32 && !__APPLE__
+#if USE_XFT
+			fltk3::fonts[i].fallback = 0;
+			fltk3::fonts[i].coverage = 0;
+#endif
 		}
 	}
 	Fl_Fontdesc* s = fltk3::fonts+fnum;
@@ -78,6 +85,9 @@ void fltk3::set_font(fltk3::Font fnum, const char* name)
 			f = n;
 		}
 		s->first = 0;
+#if USE_XFT
+		fl_xft_forget_fallback(s);
+#endif
 	}
 	s->name = name;
 	s->fontname[0] = 0;
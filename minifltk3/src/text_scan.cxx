@@ -0,0 +1,632 @@
+//
+// "$Id$"
+//
+// Byte scanning kernels for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2010 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+#include <stddef.h>
+#include <stdlib.h>
+#include "text_scan.h"
+#include "utf8.h"
+
+// SSE2 is part of every x86-64 CPU. The AVX2 versions are compiled with a
+// target attribute and only called if the CPU reports AVX2 at run time.
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#  define SCAN_SSE2 1
+#  if (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) || defined(__clang__)
+#    define SCAN_AVX2 1
+#  endif
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#  define SCAN_SSE2 1
+#endif
+
+#if SCAN_AVX2
+#  include <immintrin.h>
+#  define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+#elif SCAN_SSE2
+#  include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#  define first_bit(x) __builtin_ctz(x)
+#  define last_bit(x) (31 - __builtin_clz(x))
+#  define bit_count(x) __builtin_popcount(x)
+#elif SCAN_SSE2
+#  include <intrin.h>
+static inline int first_bit(unsigned x)
+{
+	unsigned long i;
+	_BitScanForward(&i, x);
+	return (int) i;
+}
+static inline int last_bit(unsigned x)
+{
+	unsigned long i;
+	_BitScanReverse(&i, x);
+	return (int) i;
+}
+static inline int bit_count(unsigned x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	return (int) ((((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24);
+}
+#endif
+
+
+//
+// Plain C versions. The vector versions use them for the bytes at the ends.
+//
+
+static int count_byte_c(const char *s, int n, char c)
+{
+	int count = 0;
+	for (int i = 0; i < n; i++)
+		if (s[i] == c)
+			count++;
+	return count;
+}
+
+static const char *find_nth_byte_c(const char *s, int n, char c, int *count)
+{
+	for (int i = 0; i < n; i++)
+		if (s[i] == c && --*count == 0)
+			return s + i;
+	return NULL;
+}
+
+static const char *find_nth_byte_back_c(const char *s, int n, char c, int *count)
+{
+	for (int i = n - 1; i >= 0; i--)
+		if (s[i] == c && --*count == 0)
+			return s + i;
+	return NULL;
+}
+
+static const char *find_byte_pair_c(const char *s, int n, char a1, char a2,
+                                    char b1, char b2, int dist)
+{
+	for (int i = 0; i < n - dist; i++)
+		if ((s[i] == a1 || s[i] == a2) && (s[i + dist] == b1 || s[i + dist] == b2))
+			return s + i;
+	return NULL;
+}
+
+static const char *find_byte_pair_back_c(const char *s, int n, char a1, char a2,
+                                         char b1, char b2, int dist)
+{
+	for (int i = n - dist - 1; i >= 0; i--)
+		if ((s[i] == a1 || s[i] == a2) && (s[i + dist] == b1 || s[i + dist] == b2))
+			return s + i;
+	return NULL;
+}
+
+// Return the length of the UTF-8 character at s, or 0 if it is invalid,
+// incomplete, or a nul byte.
+static inline int utf8_char_length(const unsigned char *s, const unsigned char *end)
+{
+	unsigned c = s[0];
+	if (c < 0x80)
+		return c ? 1 : 0;
+	if (c < 0xc2 || c > 0xf4)
+		return 0;
+	if (c < 0xe0)
+		return (end - s >= 2 && (s[1] & 0xc0) == 0x80) ? 2 : 0;
+	if (c < 0xf0) {
+		if (end - s < 3 || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80)
+			return 0;
+		return (c == 0xe0 && s[1] < 0xa0) ? 0 : 3;
+	}
+	if (end - s < 4 || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80
+	    || (s[3] & 0xc0) != 0x80)
+		return 0;
+	if ((c == 0xf0 && s[1] < 0x90) || (c == 0xf4 && s[1] > 0x8f))
+		return 0;
+	return 4;
+}
+
+// Check the characters that start in [i, stop) of the n bytes at s. Returns
+// the offset of the first invalid one, or the end of the last character,
+// which is at least stop.
+static int utf8_check_c(const char *s, int n, int i, int stop)
+{
+	const unsigned char *u = (const unsigned char *) s;
+	while (i < stop) {
+		int len = utf8_char_length(u + i, u + n);
+		if (!len)
+			return i;
+		i += len;
+	}
+	return i;
+}
+
+static int ascii_prefix_c(const char *s, int n, int i)
+{
+	while (i < n && !(s[i] & 0x80))
+		i++;
+	return i;
+}
+
+// Decode the characters that start in [i, stop) of the n bytes at s into
+// dst + *k, and add their number to *k. Returns the end of the last one.
+static int utf8_to_ucs4_c(const char *s, int n, int i, int stop, unsigned *dst, int *k)
+{
+	const unsigned char *u = (const unsigned char *) s;
+	int j = *k; // a local count, as dst may alias *k
+	while (i < stop) {
+		unsigned c = u[i];
+		if (c < 0x80) {
+			dst[j++] = c;
+			i++;
+			continue;
+		}
+		int len = utf8_char_length(u + i, u + n);
+		if (len == 2)
+			c = ((c & 0x1f) << 6) | (u[i + 1] & 0x3f);
+		else if (len == 3)
+			c = ((c & 0x0f) << 12) | ((u[i + 1] & 0x3f) << 6) | (u[i + 2] & 0x3f);
+		else if (len == 4)
+			c = ((c & 0x07) << 18) | ((u[i + 1] & 0x3f) << 12) | ((u[i + 2] & 0x3f) << 6) | (u[i + 3] & 0x3f);
+		else // let fltk3::utf8decode() handle the errors
+			c = fltk3::utf8decode(s + i, s + n, &len);
+		dst[j++] = c;
+		i += len;
+	}
+	*k = j;
+	return i;
+}
+
+
+#if SCAN_SSE2
+
+//
+// SSE2 versions, 16 bytes at a time.
+//
+
+static int count_byte_sse2(const char *s, int n, char c)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+	const __m128i zero = _mm_setzero_si128();
+	int count = 0;
+	while (n >= 16) {
+		// every byte of acc counts the matches in its lane; it must not
+		// overflow, so it is added up every 255 vectors
+		int nVectors = n / 16;
+		if (nVectors > 255)
+			nVectors = 255;
+		__m128i acc = zero;
+		for (int i = 0; i < nVectors; i++, s += 16)
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) s), needle));
+		__m128i sum = _mm_sad_epu8(acc, zero);
+		count += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+		n -= nVectors * 16;
+	}
+	return count + count_byte_c(s, n, c);
+}
+
+static const char *find_nth_byte_sse2(const char *s, int n, char c, int *count)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (s + i)), needle));
+		if (!mask)
+			continue;
+		int k = bit_count(mask);
+		if (k < *count) {
+			*count -= k;
+			continue;
+		}
+		while (--*count)
+			mask &= mask - 1;
+		return s + i + first_bit(mask);
+	}
+	return find_nth_byte_c(s + i, n - i, c, count);
+}
+
+static const char *find_nth_byte_back_sse2(const char *s, int n, char c, int *count)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+	int i = n - 16;
+	for (; i >= 0; i -= 16) {
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (s + i)), needle));
+		if (!mask)
+			continue;
+		int k = bit_count(mask);
+		if (k < *count) {
+			*count -= k;
+			continue;
+		}
+		while (--*count)
+			mask &= ~(1u << last_bit(mask));
+		return s + i + last_bit(mask);
+	}
+	return find_nth_byte_back_c(s, i + 16, c, count);
+}
+
+static const char *find_byte_pair_sse2(const char *s, int n, char a1, char a2,
+                                       char b1, char b2, int dist)
+{
+	const __m128i va1 = _mm_set1_epi8(a1), va2 = _mm_set1_epi8(a2);
+	const __m128i vb1 = _mm_set1_epi8(b1), vb2 = _mm_set1_epi8(b2);
+	int i = 0;
+	for (; i + dist + 16 <= n; i += 16) {
+		__m128i first = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i last = _mm_loadu_si128((const __m128i *) (s + i + dist));
+		__m128i m = _mm_and_si128(
+		              _mm_or_si128(_mm_cmpeq_epi8(first, va1), _mm_cmpeq_epi8(first, va2)),
+		              _mm_or_si128(_mm_cmpeq_epi8(last, vb1), _mm_cmpeq_epi8(last, vb2)));
+		unsigned mask = _mm_movemask_epi8(m);
+		if (mask)
+			return s + i + first_bit(mask);
+	}
+	return find_byte_pair_c(s + i, n - i, a1, a2, b1, b2, dist);
+}
+
+static const char *find_byte_pair_back_sse2(const char *s, int n, char a1, char a2,
+                                            char b1, char b2, int dist)
+{
+	const __m128i va1 = _mm_set1_epi8(a1), va2 = _mm_set1_epi8(a2);
+	const __m128i vb1 = _mm_set1_epi8(b1), vb2 = _mm_set1_epi8(b2);
+	int i = n - dist - 16;
+	for (; i >= 0; i -= 16) {
+		__m128i first = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i last = _mm_loadu_si128((const __m128i *) (s + i + dist));
+		__m128i m = _mm_and_si128(
+		              _mm_or_si128(_mm_cmpeq_epi8(first, va1), _mm_cmpeq_epi8(first, va2)),
+		              _mm_or_si128(_mm_cmpeq_epi8(last, vb1), _mm_cmpeq_epi8(last, vb2)));
+		unsigned mask = _mm_movemask_epi8(m);
+		if (mask)
+			return s + i + last_bit(mask);
+	}
+	return find_byte_pair_back_c(s, i + 16 + dist, a1, a2, b1, b2, dist);
+}
+
+// Skip blocks of ASCII without nul bytes, and check the others one character
+// at a time.
+static int utf8_valid_prefix_sse2(const char *s, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	while (i + 16 <= n) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		if (_mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) {
+			int j = utf8_check_c(s, n, i, i + 16);
+			if (j < i + 16)
+				return j;
+			i = j;
+		} else {
+			i += 16;
+		}
+	}
+	return utf8_check_c(s, n, i, n);
+}
+
+static int ascii_prefix_sse2(const char *s, int n)
+{
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		unsigned mask = (unsigned) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (s + i)));
+		if (mask)
+			return i + first_bit(mask);
+	}
+	return ascii_prefix_c(s, n, i);
+}
+
+// Widen blocks of ASCII to four 32-bit vectors, and decode the others one
+// character at a time.
+static int utf8_to_ucs4_sse2(const char *s, int n, unsigned *dst)
+{
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0, k = 0;
+	while (i + 16 <= n) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		if (_mm_movemask_epi8(v)) {
+			i = utf8_to_ucs4_c(s, n, i, i + 16, dst, &k);
+			continue;
+		}
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i *) (dst + k), _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *) (dst + k + 4), _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *) (dst + k + 8), _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i *) (dst + k + 12), _mm_unpackhi_epi16(hi, zero));
+		i += 16;
+		k += 16;
+	}
+	utf8_to_ucs4_c(s, n, i, n, dst, &k);
+	return k;
+}
+
+#endif // SCAN_SSE2
+
+
+
+#if SCAN_AVX2
+
+//
+// AVX2 versions, 32 bytes at a time.
+//
+
+AVX2_TARGET static int count_byte_avx2(const char *s, int n, char c)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+	const __m256i zero = _mm256_setzero_si256();
+	int count = 0;
+	while (n >= 32) {
+		int nVectors = n / 32;
+		if (nVectors > 255)
+			nVectors = 255;
+		__m256i acc = zero;
+		for (int i = 0; i < nVectors; i++, s += 32)
+			acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) s), needle));
+		__m256i sum = _mm256_sad_epu8(acc, zero);
+		__m128i sum2 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		count += _mm_cvtsi128_si32(sum2) + _mm_cvtsi128_si32(_mm_srli_si128(sum2, 8));
+		n -= nVectors * 32;
+	}
+	return count + count_byte_c(s, n, c);
+}
+
+AVX2_TARGET static const char *find_nth_byte_avx2(const char *s, int n, char c, int *count)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (s + i)), needle));
+		if (!mask)
+			continue;
+		int k = bit_count(mask);
+		if (k < *count) {
+			*count -= k;
+			continue;
+		}
+		while (--*count)
+			mask &= mask - 1;
+		return s + i + first_bit(mask);
+	}
+	return find_nth_byte_c(s + i, n - i, c, count);
+}
+
+AVX2_TARGET static const char *find_nth_byte_back_avx2(const char *s, int n, char c, int *count)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+	int i = n - 32;
+	for (; i >= 0; i -= 32) {
+		unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (s + i)), needle));
+		if (!mask)
+			continue;
+		int k = bit_count(mask);
+		if (k < *count) {
+			*count -= k;
+			continue;
+		}
+		while (--*count)
+			mask &= ~(1u << last_bit(mask));
+		return s + i + last_bit(mask);
+	}
+	return find_nth_byte_back_c(s, i + 32, c, count);
+}
+
+AVX2_TARGET static const char *find_byte_pair_avx2(const char *s, int n, char a1, char a2,
+                                                   char b1, char b2, int dist)
+{
+	const __m256i va1 = _mm256_set1_epi8(a1), va2 = _mm256_set1_epi8(a2);
+	const __m256i vb1 = _mm256_set1_epi8(b1), vb2 = _mm256_set1_epi8(b2);
+	int i = 0;
+	for (; i + dist + 32 <= n; i += 32) {
+		__m256i first = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i last = _mm256_loadu_si256((const __m256i *) (s + i + dist));
+		__m256i m = _mm256_and_si256(
+		              _mm256_or_si256(_mm256_cmpeq_epi8(first, va1), _mm256_cmpeq_epi8(first, va2)),
+		              _mm256_or_si256(_mm256_cmpeq_epi8(last, vb1), _mm256_cmpeq_epi8(last, vb2)));
+		unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+		if (mask)
+			return s + i + first_bit(mask);
+	}
+	return find_byte_pair_c(s + i, n - i, a1, a2, b1, b2, dist);
+}
+
+AVX2_TARGET static const char *find_byte_pair_back_avx2(const char *s, int n, char a1, char a2,
+                                                        char b1, char b2, int dist)
+{
+	const __m256i va1 = _mm256_set1_epi8(a1), va2 = _mm256_set1_epi8(a2);
+	const __m256i vb1 = _mm256_set1_epi8(b1), vb2 = _mm256_set1_epi8(b2);
+	int i = n - dist - 32;
+	for (; i >= 0; i -= 32) {
+		__m256i first = _mm256_loadu_si256((const __m256i *) (s + i));
+		__m256i last = _mm256_loadu_si256((const __m256i *) (s + i + dist));
+		__m256i m = _mm256_and_si256(
+		              _mm256_or_si256(_mm256_cmpeq_epi8(first, va1), _mm256_cmpeq_epi8(first, va2)),
+		              _mm256_or_si256(_mm256_cmpeq_epi8(last, vb1), _mm256_cmpeq_epi8(last, vb2)));
+		unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+		if (mask)
+			return s + i + last_bit(mask);
+	}
+	return find_byte_pair_back_c(s, i + 32 + dist, a1, a2, b1, b2, dist);
+}
+
+AVX2_TARGET static int utf8_valid_prefix_avx2(const char *s, int n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	int i = 0;
+	while (i + 32 <= n) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (s + i));
+		if (_mm256_movemask_epi8(v) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero))) {
+			int j = utf8_check_c(s, n, i, i + 32);
+			if (j < i + 32)
+				return j;
+			i = j;
+		} else {
+			i += 32;
+		}
+	}
+	return utf8_check_c(s, n, i, n);
+}
+
+AVX2_TARGET static int ascii_prefix_avx2(const char *s, int n)
+{
+	int i = 0;
+	for (; i + 32 <= n; i += 32) {
+		unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) (s + i)));
+		if (mask)
+			return i + first_bit(mask);
+	}
+	return ascii_prefix_c(s, n, i);
+}
+
+// Check once if the CPU and the OS support AVX2.
+static int have_avx2()
+{
+	static int avx2 = -1;
+	if (avx2 < 0) {
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+	}
+	return avx2;
+}
+
+#endif // SCAN_AVX2
+
+// Return 2 to use the AVX2 versions, 1 for SSE2 and 0 for plain C. Setting
+// FLTK_SCAN_SCALAR in the environment forces the C versions, to compare.
+static int scan_level()
+{
+	static int level = -1;
+	if (level < 0) {
+		level = 0;
+		if (!getenv("FLTK_SCAN_SCALAR")) {
+#if SCAN_SSE2
+			level = 1;
+#endif
+#if SCAN_AVX2
+			if (have_avx2()) level = 2;
+#endif
+		}
+	}
+	return level;
+}
+
+
+//
+// Public entry points, dispatching to the best version.
+//
+
+int fl_count_byte(const char *s, int n, char c)
+{
+#if SCAN_AVX2
+	if (scan_level() == 2)
+		return count_byte_avx2(s, n, c);
+#endif
+#if SCAN_SSE2
+	if (scan_level())
+		return count_byte_sse2(s, n, c);
+#endif
+	return count_byte_c(s, n, c);
+}
+
+const char *fl_find_nth_byte(const char *s, int n, char c, int *count)
+{
+#if SCAN_AVX2
+	if (scan_level() == 2)
+		return find_nth_byte_avx2(s, n, c, count);
+#endif
+#if SCAN_SSE2
+	if (scan_level())
+		return find_nth_byte_sse2(s, n, c, count);
+#endif
+	return find_nth_byte_c(s, n, c, count);
+}
+
+const char *fl_find_nth_byte_back(const char *s, int n, char c, int *count)
+{
+#if SCAN_AVX2
+	if (scan_level() == 2)
+		return find_nth_byte_back_avx2(s, n, c, count);
+#endif
+#if SCAN_SSE2
+	if (scan_level())
+		return find_nth_byte_back_sse2(s, n, c, count);
+#endif
+	return find_nth_byte_back_c(s, n, c, count);
+}
+
+const char *fl_find_byte_pair(const char *s, int n, char a1, char a2,
+                              char b1, char b2, int dist)
+{
+#if SCAN_AVX2
+	if (scan_level() == 2)
+		return find_byte_pair_avx2(s, n, a1, a2, b1, b2, dist);
+#endif
+#if SCAN_SSE2
+	if (scan_level())
+		return find_byte_pair_sse2(s, n, a1, a2, b1, b2, dist);
+#endif
+	return find_byte_pair_c(s, n, a1, a2, b1, b2, dist);
+}
+
+const char *fl_find_byte_pair_back(const char *s, int n, char a1, char a2,
+                                   char b1, char b2, int dist)
+{
+#if SCAN_AVX2
+	if (scan_level() == 2)
+		return find_byte_pair_back_avx2(s, n, a1, a2, b1, b2, dist);
+#endif
+#if SCAN_SSE2
+	if (scan_level())
+		return find_byte_pair_back_sse2(s, n, a1, a2, b1, b2, dist);
+#endif
+	return find_byte_pair_back_c(s, n, a1, a2, b1, b2, dist);
+}
+
+int fl_utf8_valid_prefix(const char *s, int n)
+{
+#if SCAN_AVX2
+	if (scan_level() == 2)
+		return utf8_valid_prefix_avx2(s, n);
+#endif
+#if SCAN_SSE2
+	if (scan_level())
+		return utf8_valid_prefix_sse2(s, n);
+#endif
+	return utf8_check_c(s, n, 0, n);
+}
+
+int fl_ascii_prefix(const char *s, int n)
+{
+#if SCAN_AVX2
+	if (scan_level() == 2)
+		return ascii_prefix_avx2(s, n);
+#endif
+#if SCAN_SSE2
+	if (scan_level())
+		return ascii_prefix_sse2(s, n);
+#endif
+	return ascii_prefix_c(s, n, 0);
+}
+
+int fl_utf8_to_ucs4(const char *s, int n, unsigned *dst)
+{
+#if SCAN_SSE2
+	if (scan_level())
+		return utf8_to_ucs4_sse2(s, n, dst);
+#endif
+	int k = 0;
+	utf8_to_ucs4_c(s, n, 0, n, dst, &k);
+	return k;
+}
+
+//
+// End of "$Id$".
+//
@@ -0,0 +1,69 @@
+//
+// "$Id$"
+//
+// Byte scanning kernels for the Fast Light Tool Kit (FLTK).
+//
+// Copyright 1998-2010 by Bill Spitzak and others.
+//
+// This library is free software. Distribution and use rights are outlined in
+// the file "COPYING" which should have been included with this file.  If this
+// file is missing or damaged, see the license at:
+//
+//     http://www.fltk.org/COPYING.php
+//
+// Please report all bugs and problems on the following page:
+//
+//     http://www.fltk.org/str.php
+//
+
+// Internal helpers that search a contiguous run of bytes. fltk3::TextBuffer
+// calls them once for each contiguous segment of its text, the Xft text code
+// for each string it draws. Most functions have an SSE2 and an AVX2 version
+// on x86 and a plain C version everywhere else; the best version for the CPU
+// is picked the first time it is called.
+
+#ifndef FL_TEXT_SCAN_H
+#define FL_TEXT_SCAN_H
+
+// Return the number of bytes equal to c in the n bytes at s.
+int fl_count_byte(const char *s, int n, char c);
+
+// Return the address of the *count'th byte equal to c in the n bytes at s,
+// or NULL if there are fewer. In that case *count is decremented by the
+// number of bytes that were found, so the search can continue in the next
+// segment. *count must be at least 1.
+const char *fl_find_nth_byte(const char *s, int n, char c, int *count);
+
+// Same as fl_find_nth_byte(), but counts backwards from s + n.
+const char *fl_find_nth_byte_back(const char *s, int n, char c, int *count);
+
+// Return the first address p in [s, s + n - dist) where p[0] is a1 or a2 and
+// p[dist] is b1 or b2, or NULL if there is none. This quickly filters the
+// candidate positions of a string with known first and last bytes.
+const char *fl_find_byte_pair(const char *s, int n, char a1, char a2,
+                              char b1, char b2, int dist);
+
+// Same as fl_find_byte_pair(), but returns the last matching address.
+const char *fl_find_byte_pair_back(const char *s, int n, char a1, char a2,
+                                   char b1, char b2, int dist);
+
+// Return the length of the longest prefix of the n bytes at s that holds
+// only complete, valid UTF-8 characters and no nul bytes. Like
+// fltk3::utf8decode(), overlong forms and codes above U+10FFFF are invalid
+// and surrogates are accepted.
+int fl_utf8_valid_prefix(const char *s, int n);
+
+// Return the length of the longest prefix of the n bytes at s that holds
+// only 7-bit ASCII bytes.
+int fl_ascii_prefix(const char *s, int n);
+
+// Decode the n bytes of UTF-8 at s into dst, which must have room for n
+// characters, and return the number of characters. Errors are decoded the
+// same way as by fltk3::utf8decode().
+int fl_utf8_to_ucs4(const char *s, int n, unsigned *dst);
+
+#endif
+
+//
+// End of "$Id$".
+//
@@ -200,6 +200,7 @@ void fltk3::QuartzGraphicsDriver::end_points()
 #else
 void fltk3::XlibGraphicsDriver::end_points()
 {
+	fl_flush_text();
 	int n = vertex_no();
 	if (n > 1) XDrawPoints(fl_display, fl_window, fl_gc, vertices(), n, 0);
 }
@@ -237,6 +238,7 @@ void fltk3::GDIGraphicsDriver::end_line()
 #else
 void fltk3::XlibGraphicsDriver::end_line()
 {
+	fl_flush_text();
 	int n = vertex_no();
 	XPOINT *p = vertices();
 	if (n < 2) {
@@ -296,6 +298,7 @@ void fltk3::GDIGraphicsDriver::end_polygon()
 #else
 void fltk3::XlibGraphicsDriver::end_polygon()
 {
+	fl_flush_text();
 	fixloop();
 	int n = vertex_no();
 	XPOINT *p = vertices();
@@ -382,6 +385,7 @@ void fltk3::GDIGraphicsDriver::end_complex_polygon()
 #else
 void fltk3::XlibGraphicsDriver::end_complex_polygon()
 {
+	fl_flush_text();
 	gap();
 	int n = vertex_no();
 	XPOINT *p = vertices();
@@ -437,6 +441,7 @@ void fltk3::GDIGraphicsDriver::circle(double x, double y, double r)
 #else
 void fltk3::XlibGraphicsDriver::circle(double x, double y, double r)
 {
+	fl_flush_text();
 	int llx, lly, w, h;
 	double xt, yt;
 	prepare_circle(x, y, r, llx, lly, w, h, xt, yt);
@@ -131,7 +131,7 @@ typedef ulong Offscreen;
 #    define fl_end_offscreen() \
   fltk3::pop_clip(); fl_window = _sw; _ss->set_current()
 
-#    define fl_delete_offscreen(pixmap) XFreePixmap(fl_display, pixmap)
+extern FLTK3_EXPORT void fl_delete_offscreen(fltk3::Offscreen pixmap);
 
 // Bitmap masks
 namespace fltk3
@@ -149,6 +149,13 @@ namespace fltk3
 extern FLTK3_EXPORT ::Window message_window;
 }
 extern FLTK3_EXPORT void *fl_xftfont;
+// Xft text is drawn in batches, Xlib drawing calls fl_flush_text() first
+extern FLTK3_EXPORT int fl_text_batch;
+FLTK3_EXPORT void fl_draw_text_batch();
+inline void fl_flush_text()
+{
+	if (fl_text_batch) fl_draw_text_batch();
+}
 FLTK3_EXPORT fltk3::Region XRectangleRegion(int x, int y, int w, int h); // in fltk3::rect.cxx
 
 // access to core fonts: